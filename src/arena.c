@@ -0,0 +1,49 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "arena.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+void *alloc_arena(size_t size) {
+	void *arena;
+
+	size = ARENA_SIZE(size);
+	if (size == 0) return NULL;
+
+#ifdef _WIN32
+	arena = _aligned_malloc(size, CACHE_LINE);
+#else
+	arena = aligned_alloc(CACHE_LINE, size);
+#endif
+	if (arena == NULL) return NULL;
+
+	memset(arena, 0, size);
+	return arena;
+}
+
+void free_arena(void *arena) {
+#ifdef _WIN32
+	_aligned_free(arena);
+#else
+	free(arena);
+#endif
+}
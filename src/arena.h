@@ -0,0 +1,31 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Arenas
+ *
+ * State and tables that are read on every sample are kept in one
+ * allocation, cut into parts that each start on a cache line. The
+ * caller adds up the part sizes with ARENA_SIZE to get the offsets.
+ */
+#define ARENA_SIZE(n)	(((size_t)(n) + CACHE_LINE - 1) & \
+	~((size_t)CACHE_LINE - 1))
+
+/* zeroed, size is rounded up to whole cache lines */
+extern void *alloc_arena(size_t size);
+extern void free_arena(void *arena);
@@ -19,213 +19,525 @@
 #include "common.h"
 #include "rds.h"
 #include "fm_mpx.h"
+#include "station.h"
 #include "lib.h"
 #include "ascii_cmd.h"
-
-#define CMD_MATCHES(a) (ustrcmp(cmd, (unsigned char *)a) == 0)
+#include "metrics.h"
 
 /*
- * If a command is received, process it and update the RDS data.
- *
+ * Command names packed into an integer, so they can be looked up with
+ * a switch instead of trying every name in turn
  */
+#define CMD2(a, b)		((uint64_t)(a) << 8 | (b))
+#define CMD3(a, b, c)		(CMD2(a, b) << 8 | (c))
+#define CMD4(a, b, c, d)	(CMD3(a, b, c) << 8 | (d))
+#define CMD5(a, b, c, d, e)	(CMD4(a, b, c, d) << 8 | (e))
 
-void process_ascii_cmd(unsigned char *str) {
-	unsigned char *cmd, *arg;
-	uint16_t cmd_len = 0;
+#define MAX_CMD_NAME	5
 
-	while (str[cmd_len] != 0 && cmd_len < CTL_BUFFER_SIZE)
-		cmd_len++;
+/*
+ * Cut the argument short
+ *
+ * The command is parsed where it was received, so never write past
+ * its end (that may be the next command).
+ */
+#define ARG_LIMIT(n) do { if ((n) < arg_len) arg[n] = 0; } while (0)
 
-	if (cmd_len > 3 && str[2] == ' ') {
-		cmd = str;
-		cmd[2] = 0;
-		arg = str + 3;
+typedef struct ascii_cmd_t {
+	/* longer arguments are cut short, 0 = no limit */
+	uint16_t arg_max;
+	void (*handler)(struct station_t *st, unsigned char *arg,
+		uint16_t arg_len);
+} ascii_cmd_t;
 
-		if (CMD_MATCHES("PI")) {
-			arg[4] = 0;
+/*
+ * Command handlers
+ *
+ */
+static void cmd_pi(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
 #ifdef RBDS
-			if (arg[0] == 'K' || arg[0] == 'W' ||
-				arg[0] == 'k' || arg[0] == 'w') {
-				set_rds_pi(callsign2pi(arg));
-			} else
+	if (arg[0] == 'K' || arg[0] == 'W' ||
+		arg[0] == 'k' || arg[0] == 'w') {
+		set_rds_pi(st->rds, callsign2pi(arg));
+		return;
+	}
 #endif
-			set_rds_pi(strtoul((char *)arg, NULL, 16));
-			return;
-		}
-		if (CMD_MATCHES("PS")) {
-			arg[PS_LENGTH * 2] = 0;
-			set_rds_ps(xlat(arg));
-			return;
-		}
-		if (CMD_MATCHES("RT")) {
-			arg[RT_LENGTH * 2] = 0;
-			set_rds_rt(xlat(arg));
-			return;
-		}
-		if (CMD_MATCHES("TA")) {
-			set_rds_ta(arg[0]);
-			return;
-		}
-		if (CMD_MATCHES("TP")) {
-			set_rds_tp(arg[0]);
-			return;
-		}
-		if (CMD_MATCHES("MS")) {
-			set_rds_ms(arg[0]);
-			return;
-		}
-		if (CMD_MATCHES("DI")) {
-			arg[2] = 0;
-			set_rds_di(strtoul((char *)arg, NULL, 10));
-			return;
-		}
-		if (CMD_MATCHES("AF")) {
-			/* TODO: work on existing AF list */
-			uint8_t arg_count;
-			rds_af_t new_af;
-			char af_cmd;
-			float af[MAX_AFS], *af_iter;
-
-			arg_count = sscanf((char *)arg,
-				"%c " /* AF command */
-				"%f %f %f %f %f " /* AF list */
-				"%f %f %f %f %f "
-				"%f %f %f %f %f "
-				"%f %f %f %f %f "
-				"%f %f %f %f %f",
-			&af_cmd,
-			&af[0],  &af[1],  &af[2],  &af[3],  &af[4],
-			&af[5],  &af[6],  &af[7],  &af[8],  &af[9],
-			&af[10], &af[11], &af[12], &af[13], &af[14],
-			&af[15], &af[16], &af[17], &af[18], &af[19],
-			&af[20], &af[21], &af[22], &af[23], &af[24]);
-			switch (af_cmd) {
-			case 's': /* set */
-				af_iter = af;
-				memset(&new_af, 0, sizeof(struct rds_af_t));
-				while ((arg_count-- - 1) != 0) {
-					add_rds_af(&new_af, *af_iter++);
-				}
-				set_rds_af(new_af);
-				break;
-			case 'c': /* clear */
-				clear_rds_af();
-				break;
-			default: /* other */
-				return;
-			}
+	set_rds_pi(st->rds, strtoul((char *)arg, NULL, 16));
+}
+
+static void cmd_ps(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	xlat(arg, arg, arg_len + 1);
+	set_rds_ps(st->rds, arg);
+}
+
+static void cmd_rt(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	xlat(arg, arg, arg_len + 1);
+	set_rds_rt(st->rds, arg);
+}
+
+static void cmd_ta(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_rds_ta(st->rds, arg[0]);
+}
+
+static void cmd_tp(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_rds_tp(st->rds, arg[0]);
+}
+
+static void cmd_ms(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_rds_ms(st->rds, arg[0]);
+}
+
+static void cmd_di(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_rds_di(st->rds, strtoul((char *)arg, NULL, 10));
+}
+
+static void cmd_af(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	/* TODO: work on existing AF list */
+	uint8_t arg_count;
+	rds_af_t new_af;
+	char af_cmd;
+	float af[MAX_AFS], *af_iter;
+
+	(void)arg_len;
+
+	arg_count = sscanf((char *)arg,
+		"%c " /* AF command */
+		"%f %f %f %f %f " /* AF list */
+		"%f %f %f %f %f "
+		"%f %f %f %f %f "
+		"%f %f %f %f %f "
+		"%f %f %f %f %f",
+	&af_cmd,
+	&af[0],  &af[1],  &af[2],  &af[3],  &af[4],
+	&af[5],  &af[6],  &af[7],  &af[8],  &af[9],
+	&af[10], &af[11], &af[12], &af[13], &af[14],
+	&af[15], &af[16], &af[17], &af[18], &af[19],
+	&af[20], &af[21], &af[22], &af[23], &af[24]);
+	switch (af_cmd) {
+	case 's': /* set */
+		af_iter = af;
+		memset(&new_af, 0, sizeof(struct rds_af_t));
+		while ((arg_count-- - 1) != 0) {
+			add_rds_af(&new_af, *af_iter++);
 		}
+		set_rds_af(st->rds, new_af);
+		break;
+	case 'c': /* clear */
+		clear_rds_af(st->rds);
+		break;
+	default: /* other */
+		break;
 	}
+}
 
-	if (cmd_len > 4 && str[3] == ' ') {
-		cmd = str;
-		cmd[3] = 0;
-		arg = str + 4;
+static void cmd_pty(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	if (arg[0] >= 'A') { /* PTY ID was passed */
+		set_rds_pty(st->rds, get_pty_code((char *)arg));
+	} else {
+		ARG_LIMIT(2);
+		set_rds_pty(st->rds, strtoul((char *)arg, NULL, 10));
+	}
+}
 
-		if (CMD_MATCHES("PTY")) {
-			if (arg[0] >= 'A') { /* PTY ID was passed */
-				set_rds_pty(get_pty_code((char *)arg));
-			} else {
-				arg[2] = 0;
-				set_rds_pty(strtoul((char *)arg, NULL, 10));
-			}
-			return;
-		}
-		if (CMD_MATCHES("ECC")) {
-			set_rds_ecc(strtoul((char *)arg, NULL, 16));
-			return;
-		}
-		if (CMD_MATCHES("RTP")) {
-			char tag_names[2][32];
-			uint8_t tags[6];
-			if (sscanf((char *)arg, "%hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
-				&tags[0], &tags[1], &tags[2], &tags[3],
-				&tags[4], &tags[5]) == 6) {
-				set_rds_rtplus_tags(tags);
-			} else if (sscanf((char *)arg, "%31[^,],%hhu,%hhu,%31[^,],%hhu,%hhu",
-				tag_names[0], &tags[1], &tags[2],
-				tag_names[1], &tags[4], &tags[5]) == 6) {
-				tags[0] = get_rtp_tag_id(tag_names[0]);
-				tags[3] = get_rtp_tag_id(tag_names[1]);
-				set_rds_rtplus_tags(tags);
-			}
-			return;
-		}
-		if (CMD_MATCHES("MPX")) {
-			float gains[5];
-			if (sscanf((char *)arg, "%f,%f,%f,%f,%f",
-				&gains[0], &gains[1], &gains[2], &gains[3],
-				&gains[4]) == 5) {
-				set_carrier_volume(0, gains[0]);
-				set_carrier_volume(1, gains[1]);
-				set_carrier_volume(2, gains[2]);
-				set_carrier_volume(3, gains[3]);
-				set_carrier_volume(4, gains[4]);
-			}
-			return;
-		}
-		if (CMD_MATCHES("VOL")) {
-			arg[4] = 0;
-			set_output_volume(strtof((char *)arg, NULL));
-			return;
-		}
-		if (CMD_MATCHES("LPS")) {
-			arg[LPS_LENGTH] = 0;
-			if (arg[0] == '-') arg[0] = 0;
-			set_rds_lps(arg);
-			return;
-		}
-		if (CMD_MATCHES("ERT")) {
-			arg[ERT_LENGTH] = 0;
-			if (arg[0] == '-') arg[0] = 0;
-			set_rds_ert(arg);
-			return;
-		}
+static void cmd_ecc(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_rds_ecc(st->rds, strtoul((char *)arg, NULL, 16));
+}
+
+/* parse RT+ or eRT+ tags, by number or by name */
+static bool parse_rtp_tags(unsigned char *arg, uint8_t *tags) {
+	char tag_names[2][32];
+
+	if (sscanf((char *)arg, "%hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
+		&tags[0], &tags[1], &tags[2], &tags[3],
+		&tags[4], &tags[5]) == 6)
+		return true;
+
+	if (sscanf((char *)arg, "%31[^,],%hhu,%hhu,%31[^,],%hhu,%hhu",
+		tag_names[0], &tags[1], &tags[2],
+		tag_names[1], &tags[4], &tags[5]) == 6) {
+		tags[0] = get_rtp_tag_id(tag_names[0]);
+		tags[3] = get_rtp_tag_id(tag_names[1]);
+		return true;
 	}
 
-	if (cmd_len > 5 && str[4] == ' ') {
-		cmd = str;
-		cmd[4] = 0;
-		arg = str + 5;
+	return false;
+}
 
-		if (CMD_MATCHES("RTPF")) {
-			arg[1] = 0;
-			set_rds_rtplus_flags(strtoul((char *)arg, NULL, 10));
-			return;
-		}
-		if (CMD_MATCHES("PTYN")) {
-			arg[PTYN_LENGTH] = 0;
-			if (arg[0] == '-') arg[0] = 0;
-			set_rds_ptyn(arg);
-			return;
-		}
-		if (CMD_MATCHES("ERTP")) {
-			char tag_names[2][32];
-			uint8_t tags[6];
-			if (sscanf((char *)arg, "%hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
-				&tags[0], &tags[1], &tags[2], &tags[3],
-				&tags[4], &tags[5]) == 6) {
-				set_rds_ertplus_tags(tags);
-			} else if (sscanf((char *)arg, "%31[^,],%hhu,%hhu,%31[^,],%hhu,%hhu",
-				tag_names[0], &tags[1], &tags[2],
-				tag_names[1], &tags[4], &tags[5]) == 6) {
-				tags[0] = get_rtp_tag_id(tag_names[0]);
-				tags[3] = get_rtp_tag_id(tag_names[1]);
-				set_rds_ertplus_tags(tags);
-			}
-			return;
+static void cmd_rtp(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	uint8_t tags[6];
+
+	(void)arg_len;
+	if (parse_rtp_tags(arg, tags)) set_rds_rtplus_tags(st->rds, tags);
+}
+
+static void cmd_mpx(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	float gains[5];
+
+	(void)arg_len;
+	if (sscanf((char *)arg, "%f,%f,%f,%f,%f",
+		&gains[0], &gains[1], &gains[2], &gains[3],
+		&gains[4]) == 5) {
+		set_carrier_volume(st->mpx, 0, gains[0]);
+		set_carrier_volume(st->mpx, 1, gains[1]);
+		set_carrier_volume(st->mpx, 2, gains[2]);
+		set_carrier_volume(st->mpx, 3, gains[3]);
+		set_carrier_volume(st->mpx, 4, gains[4]);
+	}
+}
+
+static void cmd_vol(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_output_volume(st->mpx, strtof((char *)arg, NULL));
+}
+
+static void cmd_lps(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	if (arg[0] == '-') arg[0] = 0;
+	set_rds_lps(st->rds, arg);
+}
+
+static void cmd_ert(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	if (arg[0] == '-') arg[0] = 0;
+	xlat_ert(arg, arg, arg_len + 1);
+	set_rds_ert(st->rds, arg);
+}
+
+static void cmd_rtpf(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_rds_rtplus_flags(st->rds, strtoul((char *)arg, NULL, 10));
+}
+
+static void cmd_ptyn(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	if (arg[0] == '-') arg[0] = 0;
+	set_rds_ptyn(st->rds, arg);
+}
+
+static void cmd_ertp(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	uint8_t tags[6];
+
+	(void)arg_len;
+	if (parse_rtp_tags(arg, tags)) set_rds_ertplus_tags(st->rds, tags);
+}
+
+static void cmd_ertpf(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	(void)arg_len;
+	set_rds_ertplus_flags(st->rds, strtoul((char *)arg, NULL, 10));
+}
+
+/*
+ * Group intervals as group:interval pairs ("3A:20,10A:10")
+ *
+ * They are applied together, and each one only if the groups can
+ * still all be sent that often.
+ */
+static void cmd_grp(struct station_t *st, unsigned char *arg,
+	uint16_t arg_len) {
+	char *p = (char *)arg, *end;
+	unsigned long type, interval;
+	uint8_t ver;
+
+	(void)arg_len;
+	begin_rds_batch(st->rds);
+	while (*p) {
+		type = strtoul(p, &end, 10);
+		if (end == p || type > 15) break;
+
+		if (*end == 'A' || *end == 'a') {
+			ver = GROUP_VER_A;
+		} else if (*end == 'B' || *end == 'b') {
+			ver = GROUP_VER_B;
+		} else {
+			break;
 		}
+		if (end[1] != ':') break;
+
+		p = end + 2;
+		interval = strtoul(p, &end, 10);
+		if (end == p || interval > UINT8_MAX) break;
+
+		set_rds_group_interval(st->rds, (uint8_t)(type << 4 | ver),
+			(uint8_t)interval);
+
+		if (*end != ',') break;
+		p = end + 1;
 	}
+	end_rds_batch(st->rds);
+}
 
-	if (cmd_len > 6 && str[5] == ' ') {
-		cmd = str;
-		cmd[5] = 0;
-		arg = str + 6;
+/*
+ * Dispatch table
+ *
+ */
+static const struct ascii_cmd_t *find_cmd(uint64_t name) {
+	static const struct ascii_cmd_t
+		pi	= { 4,			cmd_pi },
+		ps	= { PS_LENGTH * 2,	cmd_ps },
+		rt	= { RT_LENGTH * 2,	cmd_rt },
+		ta	= { 0,			cmd_ta },
+		tp	= { 0,			cmd_tp },
+		ms	= { 0,			cmd_ms },
+		di	= { 2,			cmd_di },
+		af	= { 0,			cmd_af },
+		pty	= { 0,			cmd_pty },
+		ecc	= { 0,			cmd_ecc },
+		rtp	= { 0,			cmd_rtp },
+		mpx	= { 0,			cmd_mpx },
+		vol	= { 4,			cmd_vol },
+		lps	= { LPS_LENGTH,		cmd_lps },
+		ert	= { ERT_LENGTH,		cmd_ert },
+		rtpf	= { 1,			cmd_rtpf },
+		ptyn	= { PTYN_LENGTH,	cmd_ptyn },
+		ertp	= { 0,			cmd_ertp },
+		ertpf	= { 1,			cmd_ertpf },
+		grp	= { 0,			cmd_grp };
+
+	switch (name) {
+	case CMD2('P', 'I'):			return &pi;
+	case CMD2('P', 'S'):			return &ps;
+	case CMD2('R', 'T'):			return &rt;
+	case CMD2('T', 'A'):			return &ta;
+	case CMD2('T', 'P'):			return &tp;
+	case CMD2('M', 'S'):			return &ms;
+	case CMD2('D', 'I'):			return &di;
+	case CMD2('A', 'F'):			return &af;
+	case CMD3('P', 'T', 'Y'):		return &pty;
+	case CMD3('E', 'C', 'C'):		return &ecc;
+	case CMD3('R', 'T', 'P'):		return &rtp;
+	case CMD3('M', 'P', 'X'):		return &mpx;
+	case CMD3('V', 'O', 'L'):		return &vol;
+	case CMD3('L', 'P', 'S'):		return &lps;
+	case CMD3('E', 'R', 'T'):		return &ert;
+	case CMD3('G', 'R', 'P'):		return &grp;
+	case CMD4('R', 'T', 'P', 'F'):		return &rtpf;
+	case CMD4('P', 'T', 'Y', 'N'):		return &ptyn;
+	case CMD4('E', 'R', 'T', 'P'):		return &ertp;
+	case CMD5('E', 'R', 'T', 'P', 'F'):	return &ertpf;
+	default:				return NULL;
+	}
+}
+
+/*
+ * If a command is received, process it and update the station.
+ *
+ * str must be NUL terminated at cmd_len. It is modified.
+ */
+void process_ascii_cmd(struct station_t *st, unsigned char *str,
+	uint16_t cmd_len) {
+	const struct ascii_cmd_t *cmd;
+	unsigned char *arg;
+	uint16_t arg_len;
+	uint64_t name = 0;
+	uint8_t i;
+
+	/* the name ends at the first space */
+	for (i = 0; i < cmd_len && str[i] != ' '; i++) {
+		if (i == MAX_CMD_NAME) return;
+		name = name << 8 | str[i];
+	}
 
-		if (CMD_MATCHES("ERTPF")) {
-			arg[1] = 0;
-			set_rds_ertplus_flags(strtoul((char *)arg, NULL, 10));
-			return;
+	/* every command takes an argument */
+	if (i < 2 || cmd_len <= i + 1) return;
+
+	cmd = find_cmd(name);
+	if (cmd == NULL) return;
+
+	arg = str + i + 1;
+	arg_len = cmd_len - (i + 1);
+	if (cmd->arg_max) ARG_LIMIT(cmd->arg_max);
+
+	cmd->handler(st, arg, arg_len);
+}
+
+/*
+ * Batched updates
+ *
+ * Commands between "BATCH" and "END" lines are kept in the framer
+ * and run together when END comes, so the encoder sees them at the
+ * same time. Until then they don't hold up anyone else. A batch
+ * ends with the stream if END never comes. A batch too big for the
+ * stage goes out in parts. "STATS" is answered on the stream it
+ * came in on.
+ */
+static bool is_keyword(unsigned char *line, uint16_t len, const char *word) {
+	return len == strlen(word) && memcmp(line, word, len) == 0;
+}
+
+static void reset_cmd_framer(struct cmd_framer_t *framer) {
+	framer->start = framer->scan = framer->end = 0;
+	framer->skip = false;
+}
+
+void init_cmd_framer(struct cmd_framer_t *framer,
+	struct station_t *station) {
+	reset_cmd_framer(framer);
+	framer->station = station;
+	framer->batch = false;
+	framer->stage_len = 0;
+	framer->reply = NULL;
+}
+
+void set_cmd_framer_reply(struct cmd_framer_t *framer, cmd_reply_t reply,
+	void *ctx) {
+	framer->reply = reply;
+	framer->reply_ctx = ctx;
+}
+
+/* Telemetry of the station, see metrics.c */
+static void reply_stats(struct cmd_framer_t *framer) {
+	char text[2048];
+	size_t len;
+
+	if (framer->reply == NULL) return;
+	len = format_station_stats(framer->station->metrics, text,
+		sizeof(text));
+	if (len) framer->reply(framer->reply_ctx, (uint8_t *)text, len);
+}
+
+/*
+ * Where to put the next read and how much room is left
+ *
+ * The unfinished line (if any) is moved to the front first.
+ */
+unsigned char *get_cmd_framer_buf(struct cmd_framer_t *framer,
+	size_t *size) {
+	if (framer->start) {
+		memmove(framer->buf, framer->buf + framer->start,
+			framer->end - framer->start);
+		framer->scan -= framer->start;
+		framer->end -= framer->start;
+		framer->start = 0;
+	}
+
+	*size = CTL_BUFFER_SIZE - framer->end;
+	return framer->buf + framer->end;
+}
+
+/* Run the staged commands as one update */
+static void apply_batch(struct cmd_framer_t *framer) {
+	unsigned char *line = framer->stage;
+	unsigned char *end = framer->stage + framer->stage_len;
+
+	if (framer->stage_len == 0) return;
+
+	begin_rds_batch(framer->station->rds);
+	while (line < end) {
+		process_ascii_cmd(framer->station, line + 1, line[0]);
+		line += line[0] + 2;
+	}
+	end_rds_batch(framer->station->rds);
+	framer->stage_len = 0;
+}
+
+static void stage_line(struct cmd_framer_t *framer, unsigned char *line,
+	uint16_t len) {
+	if (framer->stage_len + len + 2 > BATCH_BUFFER_SIZE)
+		apply_batch(framer);
+
+	framer->stage[framer->stage_len] = (unsigned char)len;
+	memcpy(framer->stage + framer->stage_len + 1, line, len + 1);
+	framer->stage_len += len + 2;
+}
+
+static void process_line(struct cmd_framer_t *framer, uint16_t line_end) {
+	unsigned char *line = framer->buf + framer->start;
+	uint16_t len = line_end - framer->start;
+
+	/* telnet and Windows clients send CRLF */
+	if (len && line[len - 1] == '\r') len--;
+
+	/* commands were always limited to this */
+	if (len > CMD_BUFFER_SIZE - 1) len = CMD_BUFFER_SIZE - 1;
+
+	line[len] = 0;
+
+	if (is_keyword(line, len, "BATCH")) {
+		framer->batch = true;
+		return;
+	}
+	if (is_keyword(line, len, "END")) {
+		apply_batch(framer);
+		framer->batch = false;
+		return;
+	}
+	if (is_keyword(line, len, "STATS")) {
+		reply_stats(framer);
+		return;
+	}
+
+	if (len == 0) return;
+
+	if (framer->batch) {
+		stage_line(framer, line, len);
+	} else {
+		process_ascii_cmd(framer->station, line, len);
+	}
+}
+
+/* Process the commands completed by the last bytes read */
+void feed_cmd_framer(struct cmd_framer_t *framer, size_t bytes) {
+	unsigned char *nl;
+
+	framer->end += bytes;
+
+	while ((nl = memchr(framer->buf + framer->scan, '\n',
+		framer->end - framer->scan)) != NULL) {
+		if (framer->skip) {
+			framer->skip = false;
+		} else {
+			process_line(framer, nl - framer->buf);
 		}
+		framer->start = framer->scan = nl - framer->buf + 1;
+	}
+	framer->scan = framer->end;
+
+	if (framer->skip) {
+		framer->start = framer->scan = framer->end = 0;
+	} else if (framer->start == 0 && framer->end == CTL_BUFFER_SIZE) {
+		/* no newline in sight, use what we have */
+		process_line(framer, framer->end);
+		framer->start = framer->scan = framer->end = 0;
+		framer->skip = true;
+	} else if (framer->start == framer->end) {
+		framer->start = framer->scan = framer->end = 0;
 	}
 }
+
+/* Process a trailing command without a newline (end of stream) */
+void flush_cmd_framer(struct cmd_framer_t *framer) {
+	if (!framer->skip && framer->end > framer->start)
+		process_line(framer, framer->end);
+	reset_cmd_framer(framer);
+}
+
+/* The stream is gone, close its batch if it left one open */
+void close_cmd_framer(struct cmd_framer_t *framer) {
+	flush_cmd_framer(framer);
+	apply_batch(framer);
+	framer->batch = false;
+}
@@ -18,6 +18,43 @@
 
 #define CMD_BUFFER_SIZE	255
 #define CTL_BUFFER_SIZE	(CMD_BUFFER_SIZE * 2)
-#define READ_TIMEOUT_MS	100
+/* lines of an open batch held back until its END */
+#define BATCH_BUFFER_SIZE	(CMD_BUFFER_SIZE * 8)
 
-extern void process_ascii_cmd(unsigned char *cmd);
+/* where the answers to queries (STATS) go */
+typedef void (*cmd_reply_t)(void *ctx, uint8_t *data, size_t len);
+
+/*
+ * Splits a byte stream into commands
+ *
+ * Data is read straight into the buffer. Complete lines are handed
+ * to process_ascii_cmd in place and a partial line is kept until the
+ * rest of it arrives, so commands can be split over reads or several
+ * of them can come in at once.
+ */
+typedef struct cmd_framer_t {
+	unsigned char buf[CTL_BUFFER_SIZE + 1];
+	uint16_t start;	/* start of the current line */
+	uint16_t scan;	/* where to continue looking for the newline */
+	uint16_t end;	/* end of the data */
+	bool skip;	/* dropping the rest of an overlong line */
+	bool batch;	/* between BATCH and END */
+	/* the batch so far: length byte, the line and a 0 for each line */
+	unsigned char stage[BATCH_BUFFER_SIZE];
+	uint16_t stage_len;
+	struct station_t *station; /* where the commands go */
+	cmd_reply_t reply; /* NULL if the stream is one way */
+	void *reply_ctx;
+} cmd_framer_t;
+
+extern void process_ascii_cmd(struct station_t *st, unsigned char *cmd,
+	uint16_t cmd_len);
+extern void init_cmd_framer(struct cmd_framer_t *framer,
+	struct station_t *station);
+extern void set_cmd_framer_reply(struct cmd_framer_t *framer,
+	cmd_reply_t reply, void *ctx);
+extern unsigned char *get_cmd_framer_buf(struct cmd_framer_t *framer,
+	size_t *size);
+extern void feed_cmd_framer(struct cmd_framer_t *framer, size_t bytes);
+extern void flush_cmd_framer(struct cmd_framer_t *framer);
+extern void close_cmd_framer(struct cmd_framer_t *framer);
@@ -0,0 +1,401 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <stdatomic.h>
+
+#ifdef _WIN32
+  #include <fcntl.h>
+#else
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <pthread.h>
+#endif
+
+#include "rds.h"
+#include "lib.h"
+#include "audio_ring.h"
+#include "audio_input.h"
+
+/* frames read from the source at a time */
+#define INPUT_READ_FRAMES	1024
+
+/*
+ * Queue
+ *
+ * Half a second of audio. Reading starts once a tenth of a second
+ * is queued, and again after every underrun, which rides out the
+ * jitter of a live source.
+ */
+#define INPUT_QUEUE_DIV		2
+#define INPUT_PRIME_DIV		10
+
+/* how often a blocked read checks whether it should stop (ms) */
+#define INPUT_POLL_MS		100
+
+#define WAVE_FORMAT_PCM		1
+#define WAVE_FORMAT_EXTENSIBLE	0xfffe
+
+struct audio_input_t {
+	int fd;
+	bool is_stdin;
+#ifdef _WIN32
+	bool is_pipe;
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+	bool thread_running;
+
+	uint32_t rate;
+	uint8_t channels;
+	/* bytes of audio left in the file (WAV data chunk) */
+	uint64_t data_left;
+
+	struct audio_ring_t *ring;
+	size_t prime_frames;
+	bool primed;
+	bool blocking;
+	unsigned long underruns;
+
+	atomic_bool eof;
+	atomic_bool quit;
+};
+
+/*
+ * Wait until the source has something to read
+ *
+ * Returns 1 if it does (or is at the end), 0 after INPUT_POLL_MS
+ * without data and -1 on error
+ */
+static int wait_readable(struct audio_input_t *in) {
+#ifdef _WIN32
+	DWORD avail;
+
+	/* a read on a pipe can't be interrupted, only start one with data */
+	if (!in->is_pipe) return 1;
+	if (!PeekNamedPipe((HANDLE)_get_osfhandle(in->fd), NULL, 0, NULL,
+		&avail, NULL))
+		return 1; /* broken pipe, the read will see the end */
+	if (avail) return 1;
+	Sleep(INPUT_POLL_MS / 10);
+	return 0;
+#else
+	struct pollfd pfd = { .fd = in->fd, .events = POLLIN };
+	int r = poll(&pfd, 1, INPUT_POLL_MS);
+
+	if (r < 0) return errno == EINTR ? 0 : -1;
+	return r > 0;
+#endif
+}
+
+/*
+ * Read len bytes unless the source ends or the input is closed
+ *
+ * Returns the number of bytes read
+ */
+static size_t read_bytes(struct audio_input_t *in, void *buf, size_t len) {
+	uint8_t *p = buf;
+	size_t got = 0;
+	int r;
+
+	if (len > in->data_left) len = (size_t)in->data_left;
+
+	while (got < len && !atomic_load(&in->quit)) {
+		r = wait_readable(in);
+		if (r < 0) break;
+		if (r == 0) continue;
+
+#ifdef _WIN32
+		r = _read(in->fd, p + got, (unsigned int)(len - got));
+#else
+		r = (int)read(in->fd, p + got, len - got);
+		if (r < 0 && errno == EINTR) continue;
+#endif
+		if (r <= 0) break;
+		got += r;
+	}
+
+	in->data_left -= got;
+	return got;
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Find the format and the audio of a WAV file
+ *
+ * Only 16-bit PCM with one or two channels is taken
+ */
+static int read_wav_header(struct audio_input_t *in) {
+	uint8_t hdr[16];
+	uint32_t size;
+	bool have_fmt = false;
+
+	if (read_bytes(in, hdr, 12) != 12 ||
+		memcmp(hdr, "RIFF", 4) != 0 ||
+		memcmp(hdr + 8, "WAVE", 4) != 0) {
+		fprintf(stderr, "Audio input is not a WAV file.\n");
+		return -1;
+	}
+
+	for (;;) {
+		if (read_bytes(in, hdr, 8) != 8) {
+			fprintf(stderr, "WAV file has no audio.\n");
+			return -1;
+		}
+		size = get_le32(hdr + 4);
+
+		if (memcmp(hdr, "data", 4) == 0) break;
+
+		if (memcmp(hdr, "fmt ", 4) == 0 && size >= 16) {
+			if (read_bytes(in, hdr, 16) != 16) return -1;
+			size -= 16;
+			if ((get_le16(hdr) != WAVE_FORMAT_PCM &&
+				get_le16(hdr) != WAVE_FORMAT_EXTENSIBLE) ||
+				get_le16(hdr + 14) != 16 ||
+				get_le16(hdr + 2) < 1 ||
+				get_le16(hdr + 2) > 2) {
+				fprintf(stderr, "Only 16-bit mono or stereo "
+					"PCM WAV files can be used.\n");
+				return -1;
+			}
+			in->channels = (uint8_t)get_le16(hdr + 2);
+			in->rate = get_le32(hdr + 4);
+			have_fmt = true;
+		}
+
+		/* skip the rest of the chunk and its padding */
+		size += size & 1;
+		while (size) {
+			uint32_t n = size > sizeof(hdr) ? sizeof(hdr) : size;
+			if (read_bytes(in, hdr, n) != n) return -1;
+			size -= n;
+		}
+	}
+
+	if (!have_fmt) {
+		fprintf(stderr, "WAV file has no format chunk.\n");
+		return -1;
+	}
+
+	/* streamed WAV files leave the size open */
+	if (size != 0 && size != UINT32_MAX) in->data_left = size;
+	return 0;
+}
+
+/* Source -> queue, until the source ends or the input is closed */
+static void read_loop(struct audio_input_t *in) {
+	uint8_t raw[INPUT_READ_FRAMES * 2 * sizeof(int16_t)];
+	int16_t frames[INPUT_READ_FRAMES * 2];
+	size_t frame_bytes = in->channels * sizeof(int16_t);
+	size_t want = INPUT_READ_FRAMES * frame_bytes;
+	size_t got, n, done;
+
+	do {
+		got = read_bytes(in, raw, want);
+		n = got / frame_bytes;
+
+		for (size_t i = 0; i < n; i++) {
+			const uint8_t *p = raw + i * frame_bytes;
+			frames[i * 2 + 0] = (int16_t)get_le16(p);
+			frames[i * 2 + 1] = in->channels == 2 ?
+				(int16_t)get_le16(p + 2) : frames[i * 2];
+		}
+
+		/* wait for room, the source is paced by the generator */
+		done = 0;
+		while (done < n && !atomic_load(&in->quit)) {
+			done += audio_ring_write(in->ring, frames + done * 2,
+				n - done);
+			if (done < n) msleep(2);
+		}
+	} while (got == want && !atomic_load(&in->quit));
+
+	atomic_store(&in->eof, true);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI input_worker(LPVOID param) {
+	read_loop(param);
+	return 0;
+}
+#else
+static void *input_worker(void *param) {
+	read_loop(param);
+	pthread_exit(NULL);
+}
+#endif
+
+static void free_input(struct audio_input_t *in) {
+	if (in->fd != -1 && !in->is_stdin) {
+#ifdef _WIN32
+		_close(in->fd);
+#else
+		close(in->fd);
+#endif
+	}
+	audio_ring_free(in->ring);
+	free(in);
+}
+
+/*
+ * Open an audio source and start reading it
+ *
+ * Names ending in ".wav" are read as WAV files and take their rate
+ * from the file. Returns NULL on failure
+ */
+struct audio_input_t *open_audio_input(const char *path,
+	uint32_t raw_rate) {
+	struct audio_input_t *in;
+	size_t len = strlen(path);
+	int r;
+
+	in = calloc(1, sizeof(struct audio_input_t));
+	if (in == NULL) return NULL;
+
+	in->rate = raw_rate;
+	in->channels = 2;
+	in->data_left = UINT64_MAX;
+	atomic_init(&in->eof, false);
+	atomic_init(&in->quit, false);
+
+	if (strcmp(path, "-") == 0) {
+		in->is_stdin = true;
+#ifdef _WIN32
+		in->fd = _fileno(stdin);
+		_setmode(in->fd, _O_BINARY);
+#else
+		in->fd = STDIN_FILENO;
+#endif
+	} else {
+#ifdef _WIN32
+		in->fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+		in->fd = open(path, O_RDONLY);
+#endif
+	}
+	if (in->fd == -1) {
+		fprintf(stderr, "Error: cannot open audio input %s.\n", path);
+		goto fail;
+	}
+#ifdef _WIN32
+	in->is_pipe = GetFileType((HANDLE)_get_osfhandle(in->fd)) ==
+		FILE_TYPE_PIPE;
+#endif
+
+	if (len > 4 && strcasecmp(path + len - 4, ".wav") == 0 &&
+		read_wav_header(in) < 0)
+		goto fail;
+
+	if (in->rate == 0) goto fail;
+
+	in->ring = audio_ring_new(in->rate / INPUT_QUEUE_DIV);
+	if (in->ring == NULL) goto fail;
+	in->prime_frames = in->rate / INPUT_PRIME_DIV;
+
+#ifdef _WIN32
+	in->thread = CreateThread(NULL, 0, input_worker, in, 0, NULL);
+	r = in->thread == NULL;
+#else
+	r = pthread_create(&in->thread, NULL, input_worker, in);
+#endif
+	if (r != 0) goto fail;
+	in->thread_running = true;
+
+	return in;
+
+fail:
+	free_input(in);
+	return NULL;
+}
+
+uint32_t get_audio_input_rate(struct audio_input_t *in) {
+	return in->rate;
+}
+
+/*
+ * Make reads wait for the source instead of filling in silence
+ *
+ * For offline rendering, where the generator runs faster than real
+ * time and mustn't outrun a file
+ */
+void set_audio_input_blocking(struct audio_input_t *in, bool blocking) {
+	in->blocking = blocking;
+}
+
+/*
+ * Take the next frames from the queue
+ *
+ * Whatever the source can't deliver in time is filled with silence.
+ * Returns the number of frames that came from the source.
+ */
+size_t read_audio_input(struct audio_input_t *in, int16_t *out,
+	size_t frames) {
+	size_t got = 0;
+	bool eof = atomic_load(&in->eof);
+
+	if (in->blocking) {
+		while (!eof && audio_ring_fill(in->ring) < frames) {
+			msleep(1);
+			eof = atomic_load(&in->eof);
+		}
+	} else if (!in->primed) {
+		in->primed = eof ||
+			audio_ring_fill(in->ring) >= in->prime_frames;
+	}
+
+	if (in->blocking || in->primed)
+		got = audio_ring_read(in->ring, out, frames);
+
+	if (got < frames) {
+		memset(out + got * 2, 0, (frames - got) * 2 * sizeof(int16_t));
+		if (in->primed && !eof) {
+			in->underruns++;
+			in->primed = false;
+		}
+	}
+
+	return got;
+}
+
+unsigned long get_audio_input_underruns(struct audio_input_t *in) {
+	return in->underruns;
+}
+
+void close_audio_input(struct audio_input_t *in) {
+	if (in == NULL) return;
+
+	if (in->thread_running) {
+		atomic_store(&in->quit, true);
+#ifdef _WIN32
+		WaitForSingleObject(in->thread, INFINITE);
+		CloseHandle(in->thread);
+#else
+		pthread_join(in->thread, NULL);
+#endif
+	}
+	free_input(in);
+}
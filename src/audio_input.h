@@ -0,0 +1,37 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Audio input
+ *
+ * Reads 16-bit PCM from a WAV file, a raw file or stdin ("-") on a
+ * thread of its own and queues it as stereo frames, so the MPX
+ * generator never waits on the source. Raw input is interleaved
+ * stereo, little endian, at the rate given to open_audio_input.
+ */
+typedef struct audio_input_t audio_input_t;
+
+extern struct audio_input_t *open_audio_input(const char *path,
+	uint32_t raw_rate);
+extern uint32_t get_audio_input_rate(struct audio_input_t *in);
+extern void set_audio_input_blocking(struct audio_input_t *in,
+	bool blocking);
+extern size_t read_audio_input(struct audio_input_t *in, int16_t *out,
+	size_t frames);
+extern unsigned long get_audio_input_underruns(struct audio_input_t *in);
+extern void close_audio_input(struct audio_input_t *in);
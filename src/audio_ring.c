@@ -0,0 +1,265 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <stdatomic.h>
+#include "audio_ring.h"
+
+#define CHANNELS	2
+#define FRAME_SIZE	(CHANNELS * sizeof(int16_t))
+
+struct audio_ring_t {
+	uint8_t *buf;
+
+	/* size in frames (power of 2) */
+	size_t size;
+	size_t mask;
+	size_t frame_size;
+
+	/* total frames written/read, only ever incremented (own lines) */
+	char pad0[CACHE_LINE];
+	atomic_size_t write_pos;
+	char pad1[CACHE_LINE];
+	atomic_size_t read_pos;
+	char pad2[CACHE_LINE];
+
+	atomic_ulong underruns;
+	atomic_ulong overruns;
+};
+
+/*
+ * Create a ring holding at least the given number of frames
+ * of frame_size bytes
+ *
+ * Returns NULL on failure
+ */
+struct audio_ring_t *audio_ring_new_sized(size_t frames,
+	size_t frame_size) {
+	struct audio_ring_t *ring;
+	size_t size = 1;
+
+	while (size < frames) size <<= 1;
+
+	ring = malloc(sizeof(struct audio_ring_t));
+	if (ring == NULL) return NULL;
+
+	ring->buf = malloc(size * frame_size);
+	if (ring->buf == NULL) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->size = size;
+	ring->mask = size - 1;
+	ring->frame_size = frame_size;
+
+	atomic_init(&ring->write_pos, 0);
+	atomic_init(&ring->read_pos, 0);
+	atomic_init(&ring->underruns, 0);
+	atomic_init(&ring->overruns, 0);
+
+	return ring;
+}
+
+/* a ring of 16-bit stereo frames */
+struct audio_ring_t *audio_ring_new(size_t frames) {
+	return audio_ring_new_sized(frames, FRAME_SIZE);
+}
+
+void audio_ring_free(struct audio_ring_t *ring) {
+	if (ring == NULL) return;
+	free(ring->buf);
+	free(ring);
+}
+
+/* where frames from pos on sit in the buffer */
+static void get_span(struct audio_ring_t *ring, size_t pos,
+	size_t frames, struct audio_ring_span_t *span) {
+	size_t start = pos & ring->mask;
+	size_t first = ring->size - start;
+
+	if (first > frames) first = frames;
+
+	span->data[0] = ring->buf + start * ring->frame_size;
+	span->frames[0] = first;
+	span->data[1] = ring->buf;
+	span->frames[1] = frames - first;
+}
+
+/* copy frames in or out of the buffer, wrapping around the end */
+static void copy_in(struct audio_ring_t *ring, size_t pos,
+	const uint8_t *in, size_t frames) {
+	struct audio_ring_span_t span;
+	size_t first;
+
+	get_span(ring, pos, frames, &span);
+	first = span.frames[0] * ring->frame_size;
+
+	memcpy(span.data[0], in, first);
+	memcpy(span.data[1], in + first, span.frames[1] * ring->frame_size);
+}
+
+static void copy_out(struct audio_ring_t *ring, size_t pos,
+	uint8_t *out, size_t frames) {
+	struct audio_ring_span_t span;
+	size_t first;
+
+	get_span(ring, pos, frames, &span);
+	first = span.frames[0] * ring->frame_size;
+
+	memcpy(out, span.data[0], first);
+	memcpy(out + first, span.data[1], span.frames[1] * ring->frame_size);
+}
+
+/*
+ * Producer side
+ *
+ * Writes as many frames as there is room for and returns that number
+ */
+size_t audio_ring_write(struct audio_ring_t *ring,
+	const void *in, size_t frames) {
+	size_t wpos, rpos, space;
+
+	wpos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+	rpos = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+
+	space = ring->size - (wpos - rpos);
+	if (frames > space) frames = space;
+
+	copy_in(ring, wpos, in, frames);
+
+	/* make the samples visible before the new position */
+	atomic_store_explicit(&ring->write_pos, wpos + frames,
+		memory_order_release);
+
+	return frames;
+}
+
+/*
+ * Consumer side
+ *
+ * Reads up to the requested number of frames and returns how many
+ * were available
+ */
+size_t audio_ring_read(struct audio_ring_t *ring,
+	void *out, size_t frames) {
+	size_t wpos, rpos, fill;
+
+	rpos = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+	wpos = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+
+	fill = wpos - rpos;
+	if (frames > fill) frames = fill;
+
+	copy_out(ring, rpos, out, frames);
+
+	/* give the space back only after the samples were copied */
+	atomic_store_explicit(&ring->read_pos, rpos + frames,
+		memory_order_release);
+
+	return frames;
+}
+
+/*
+ * Producer side, in place
+ *
+ * Gets the free space for up to the requested number of frames and
+ * returns how many fit. They are queued by audio_ring_commit_write().
+ */
+size_t audio_ring_write_span(struct audio_ring_t *ring, size_t frames,
+	struct audio_ring_span_t *span) {
+	size_t wpos, rpos, space;
+
+	wpos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+	rpos = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+
+	space = ring->size - (wpos - rpos);
+	if (frames > space) frames = space;
+
+	get_span(ring, wpos, frames, span);
+	return frames;
+}
+
+void audio_ring_commit_write(struct audio_ring_t *ring, size_t frames) {
+	size_t wpos;
+
+	wpos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+	atomic_store_explicit(&ring->write_pos, wpos + frames,
+		memory_order_release);
+}
+
+/*
+ * Consumer side, in place
+ *
+ * Gets up to the requested number of frames, starting offset frames
+ * past the oldest one, and returns how many there are. They stay
+ * queued until audio_ring_commit_read().
+ */
+size_t audio_ring_read_span(struct audio_ring_t *ring, size_t offset,
+	size_t frames, struct audio_ring_span_t *span) {
+	size_t wpos, rpos, fill;
+
+	rpos = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+	wpos = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+
+	fill = wpos - rpos;
+	fill = fill > offset ? fill - offset : 0;
+	if (frames > fill) frames = fill;
+
+	get_span(ring, rpos + offset, frames, span);
+	return frames;
+}
+
+void audio_ring_commit_read(struct audio_ring_t *ring, size_t frames) {
+	size_t rpos;
+
+	rpos = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+	atomic_store_explicit(&ring->read_pos, rpos + frames,
+		memory_order_release);
+}
+
+/* frames waiting to be read */
+size_t audio_ring_fill(struct audio_ring_t *ring) {
+	size_t wpos, rpos;
+
+	rpos = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+	wpos = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+
+	return wpos - rpos;
+}
+
+/* frames that can be written */
+size_t audio_ring_space(struct audio_ring_t *ring) {
+	return ring->size - audio_ring_fill(ring);
+}
+
+void audio_ring_add_underrun(struct audio_ring_t *ring) {
+	atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+}
+
+void audio_ring_add_overrun(struct audio_ring_t *ring) {
+	atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+}
+
+unsigned long audio_ring_underruns(struct audio_ring_t *ring) {
+	return atomic_load_explicit(&ring->underruns, memory_order_relaxed);
+}
+
+unsigned long audio_ring_overruns(struct audio_ring_t *ring) {
+	return atomic_load_explicit(&ring->overruns, memory_order_relaxed);
+}
@@ -0,0 +1,68 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Single-producer/single-consumer ring of interleaved
+ * 16-bit stereo frames (or frames of any other size)
+ *
+ * One thread writes, one thread reads. Neither side ever blocks
+ * or takes a lock; they only see each other through the read and
+ * write positions.
+ */
+typedef struct audio_ring_t audio_ring_t;
+
+extern struct audio_ring_t *audio_ring_new(size_t frames);
+extern struct audio_ring_t *audio_ring_new_sized(size_t frames,
+	size_t frame_size);
+extern void audio_ring_free(struct audio_ring_t *ring);
+
+extern size_t audio_ring_write(struct audio_ring_t *ring,
+	const void *in, size_t frames);
+extern size_t audio_ring_read(struct audio_ring_t *ring,
+	void *out, size_t frames);
+
+/*
+ * Frames in place
+ *
+ * A span is where a run of frames sits in the buffer, in two pieces
+ * when it wraps around the end. The writer can fill the free space in
+ * place and commit it, and the reader can use queued frames in place
+ * (say as send buffers) and commit them once done, saving a copy.
+ */
+typedef struct audio_ring_span_t {
+	uint8_t *data[2];
+	size_t frames[2];
+} audio_ring_span_t;
+
+extern size_t audio_ring_write_span(struct audio_ring_t *ring,
+	size_t frames, struct audio_ring_span_t *span);
+extern void audio_ring_commit_write(struct audio_ring_t *ring,
+	size_t frames);
+extern size_t audio_ring_read_span(struct audio_ring_t *ring,
+	size_t offset, size_t frames, struct audio_ring_span_t *span);
+extern void audio_ring_commit_read(struct audio_ring_t *ring,
+	size_t frames);
+
+extern size_t audio_ring_fill(struct audio_ring_t *ring);
+extern size_t audio_ring_space(struct audio_ring_t *ring);
+
+/* counters, updated by the threads using the ring */
+extern void audio_ring_add_underrun(struct audio_ring_t *ring);
+extern void audio_ring_add_overrun(struct audio_ring_t *ring);
+extern unsigned long audio_ring_underruns(struct audio_ring_t *ring);
+extern unsigned long audio_ring_overruns(struct audio_ring_t *ring);
@@ -0,0 +1,46 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Built-in tables
+ *
+ * builtin_tables.c is written by gen_tables when the encoder is built
+ * (BUILTIN_TABLES) and holds the oscillator tables of the carriers and
+ * the RDS envelopes for the usual MPX rates. Tables not in it are
+ * still made at run time.
+ *
+ * The waves have the guard sample after the end that osc.c expects.
+ */
+typedef struct builtin_wave_t {
+	uint32_t len;
+	uint32_t cycles;
+	const float *sin_wave;
+	const float *cos_wave;
+} builtin_wave_t;
+
+typedef struct builtin_envelope_t {
+	uint32_t sample_rate;
+	const uint16_t *bit_len;
+	const float *slices;
+	const float *polyphase; /* NULL unless spb_den is 1 */
+} builtin_envelope_t;
+
+extern const struct builtin_wave_t builtin_waves[];
+extern const size_t num_builtin_waves;
+extern const struct builtin_envelope_t builtin_envelopes[];
+extern const size_t num_builtin_envelopes;
@@ -36,6 +36,7 @@
   #define strncasecmp _strnicmp
 #else
   #include <unistd.h>
+  #include <strings.h>
 #endif
 
 /* workaround for missing pi definition */
@@ -44,3 +45,6 @@
 #endif
 
 #define M_2PI	(M_PI * 2.0)
+
+/* for keeping data on separate cache lines */
+#define CACHE_LINE	64
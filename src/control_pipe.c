@@ -18,26 +18,128 @@
 
 #include "common.h"
 #include "ascii_cmd.h"
+#include "event_loop.h"
 #include "control_pipe.h"
 
 #ifdef _WIN32
 
 /* Windows named pipe implementation */
-static HANDLE hPipe = INVALID_HANDLE_VALUE;
-static OVERLAPPED olap;
-static HANDLE hEvent = NULL;
+typedef struct ctl_pipe_t {
+	HANDLE hPipe;
+	OVERLAPPED olap;
+	HANDLE hEvent;
+
+	/* what the pending overlapped operation is */
+	bool connecting;
+
+	struct cmd_framer_t framer;
+} ctl_pipe_t;
+
+static struct ctl_pipe_t pipes[MAX_CTL_PIPES];
+static uint8_t num_pipes;
+
+static void start_read(struct ctl_pipe_t *p);
+
+/* (Re)start waiting for a client, without blocking */
+static void start_connect(struct ctl_pipe_t *p) {
+	p->connecting = true;
+	ResetEvent(p->hEvent);
+
+	if (!ConnectNamedPipe(p->hPipe, &p->olap)) {
+		switch (GetLastError()) {
+		case ERROR_IO_PENDING:
+			break;
+		case ERROR_PIPE_CONNECTED:
+			/* client connected before we started waiting */
+			p->connecting = false;
+			start_read(p);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Queue the next read, its completion signals hEvent */
+static void start_read(struct ctl_pipe_t *p) {
+	unsigned char *buf;
+	size_t size;
+	DWORD bytes_read;
+
+	p->connecting = false;
+	buf = get_cmd_framer_buf(&p->framer, &size);
+
+	if (!ReadFile(p->hPipe, buf, (DWORD)size, &bytes_read, &p->olap) &&
+		GetLastError() != ERROR_IO_PENDING) {
+		/* Client disconnected - reconnect */
+		DisconnectNamedPipe(p->hPipe);
+		start_connect(p);
+	}
+}
 
-int open_control_pipe(char *filename) {
+static void pipe_event(void *arg) {
+	struct ctl_pipe_t *p = arg;
+	DWORD bytes_read = 0;
+
+	if (!GetOverlappedResult(p->hPipe, &p->olap, &bytes_read, FALSE)) {
+		if (GetLastError() == ERROR_IO_INCOMPLETE) return;
+
+		/* Client disconnected - reconnect */
+		close_cmd_framer(&p->framer);
+		DisconnectNamedPipe(p->hPipe);
+		start_connect(p);
+		return;
+	}
+
+	if (p->connecting) {
+		start_read(p);
+		return;
+	}
+
+	if (bytes_read == 0) {
+		/* Client disconnected */
+		close_cmd_framer(&p->framer);
+		DisconnectNamedPipe(p->hPipe);
+		start_connect(p);
+		return;
+	}
+
+	feed_cmd_framer(&p->framer, bytes_read);
+
+	start_read(p);
+}
+
+static void close_pipe(struct ctl_pipe_t *p) {
+	if (p->hEvent != NULL) remove_event_source(p->hEvent);
+	if (p->hPipe != INVALID_HANDLE_VALUE) {
+		CancelIo(p->hPipe);
+		DisconnectNamedPipe(p->hPipe);
+		CloseHandle(p->hPipe);
+		p->hPipe = INVALID_HANDLE_VALUE;
+	}
+	if (p->hEvent != NULL) {
+		CloseHandle(p->hEvent);
+		p->hEvent = NULL;
+	}
+}
+
+int open_control_pipe(char *filename, struct station_t *station) {
+	struct ctl_pipe_t *p;
 	char pipe_name[256];
 
+	if (num_pipes == MAX_CTL_PIPES) return -1;
+	p = &pipes[num_pipes];
+
 	/* Convert a simple name into a Windows named pipe path */
 	if (filename[0] != '\\') {
-		snprintf(pipe_name, sizeof(pipe_name), "\\\\.\\pipe\\%s", filename);
+		snprintf(pipe_name, sizeof(pipe_name), "\\\\.\\pipe\\%s",
+			filename);
 	} else {
 		snprintf(pipe_name, sizeof(pipe_name), "%s", filename);
 	}
 
-	hPipe = CreateNamedPipeA(
+	p->hEvent = NULL;
+	p->hPipe = CreateNamedPipeA(
 		pipe_name,
 		PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
 		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
@@ -48,143 +150,107 @@ int open_control_pipe(char *filename) {
 		NULL		/* security attributes */
 	);
 
-	if (hPipe == INVALID_HANDLE_VALUE) return -1;
+	if (p->hPipe == INVALID_HANDLE_VALUE) return -1;
+
+	init_cmd_framer(&p->framer, station);
+	memset(&p->olap, 0, sizeof(p->olap));
+	p->hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	p->olap.hEvent = p->hEvent;
 
-	memset(&olap, 0, sizeof(olap));
-	hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	olap.hEvent = hEvent;
+	if (add_event_source(p->hEvent, pipe_event, p) < 0) {
+		close_pipe(p);
+		return -1;
+	}
+	num_pipes++;
 
 	/* Start waiting for a client connection (non-blocking) */
-	ConnectNamedPipe(hPipe, &olap);
+	start_connect(p);
 
 	return 0;
 }
 
-void poll_control_pipe() {
-	static unsigned char pipe_buf[CTL_BUFFER_SIZE];
-	static unsigned char cmd_buf[CMD_BUFFER_SIZE];
-	DWORD bytes_read = 0;
-	DWORD result;
-	char *token;
-
-	/* Check if there's data available (with timeout) */
-	result = WaitForSingleObject(hEvent, READ_TIMEOUT_MS);
-	if (result != WAIT_OBJECT_0) return;
-
-	ResetEvent(hEvent);
-
-	memset(pipe_buf, 0, CTL_BUFFER_SIZE);
-
-	if (!ReadFile(hPipe, pipe_buf, CTL_BUFFER_SIZE - 1, &bytes_read, &olap)) {
-		DWORD err = GetLastError();
-		if (err == ERROR_IO_PENDING) {
-			GetOverlappedResult(hPipe, &olap, &bytes_read, TRUE);
-		} else if (err == ERROR_BROKEN_PIPE) {
-			/* Client disconnected - reconnect */
-			DisconnectNamedPipe(hPipe);
-			ResetEvent(hEvent);
-			ConnectNamedPipe(hPipe, &olap);
-			return;
-		} else {
-			return;
-		}
-	}
+#else /* POSIX */
 
-	if (bytes_read == 0) {
-		/* Client disconnected */
-		DisconnectNamedPipe(hPipe);
-		ResetEvent(hEvent);
-		ConnectNamedPipe(hPipe, &olap);
-		return;
-	}
+typedef struct ctl_pipe_t {
+	int fd;
+	char path[256];
+	struct cmd_framer_t framer;
+} ctl_pipe_t;
 
-	/* handle commands per line */
-	token = strtok((char *)pipe_buf, "\n");
-	while (token != NULL) {
-		memset(cmd_buf, 0, CMD_BUFFER_SIZE);
-		memcpy(cmd_buf, token, CMD_BUFFER_SIZE - 1);
-		token = strtok(NULL, "\n");
+static struct ctl_pipe_t pipes[MAX_CTL_PIPES];
+static uint8_t num_pipes;
 
-		process_ascii_cmd(cmd_buf);
-	}
-}
+static void pipe_event(void *arg);
 
-void close_control_pipe() {
-	if (hPipe != INVALID_HANDLE_VALUE) {
-		DisconnectNamedPipe(hPipe);
-		CloseHandle(hPipe);
-		hPipe = INVALID_HANDLE_VALUE;
-	}
-	if (hEvent != NULL) {
-		CloseHandle(hEvent);
-		hEvent = NULL;
+static int open_fifo(struct ctl_pipe_t *p) {
+	p->fd = open(p->path, O_RDONLY | O_NONBLOCK);
+	if (p->fd == -1) return -1;
+
+	if (add_event_source(p->fd, pipe_event, p) < 0) {
+		close(p->fd);
+		p->fd = -1;
+		return -1;
 	}
-}
 
-#else /* POSIX */
+	return 0;
+}
 
-static int fd;
-static struct pollfd poller;
+static void close_pipe(struct ctl_pipe_t *p) {
+	if (p->fd == -1) return;
+	remove_event_source(p->fd);
+	close(p->fd);
+	p->fd = -1;
+}
 
 /*
- * Opens a file (pipe) to be used to control the RDS coder.
+ * Opens a file (pipe) to be used to control a station.
  */
-int open_control_pipe(char *filename) {
-	fd = open(filename, O_RDONLY | O_NONBLOCK);
-	if (fd == -1) return -1;
+int open_control_pipe(char *filename, struct station_t *station) {
+	struct ctl_pipe_t *p;
 
-	/* setup the poller */
-	poller.fd = fd;
-	poller.events = POLLIN;
+	if (num_pipes == MAX_CTL_PIPES) return -1;
+	p = &pipes[num_pipes];
 
+	snprintf(p->path, sizeof(p->path), "%s", filename);
+	init_cmd_framer(&p->framer, station);
+	if (open_fifo(p) < 0) return -1;
+	num_pipes++;
 	return 0;
 }
 
 /*
- * Polls the control file (pipe), and if a command is received,
- * calls process_ascii_cmd.
+ * Reads the control file (pipe) when the event loop says there's
+ * something to read and calls process_ascii_cmd.
  */
-void poll_control_pipe() {
-	static unsigned char pipe_buf[CTL_BUFFER_SIZE];
-	static unsigned char cmd_buf[CMD_BUFFER_SIZE];
-	struct timeval timeout;
-	int ret;
-	fd_set set;
-	char *token;
-
-	FD_ZERO(&set);
-	FD_SET(fd, &set);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = READ_TIMEOUT_MS * 1000;
-
-	/* check for new commands */
-	if (poll(&poller, 1, READ_TIMEOUT_MS) <= 0) return;
-
-	/* return early if there are no new commands */
-	if (poller.revents == 0) return;
-
-	memset(pipe_buf, 0, CTL_BUFFER_SIZE);
-
-	ret = select(fd + 1, &set, NULL, NULL, &timeout);
-	if (ret == -1 || ret == 0) {
+static void pipe_event(void *arg) {
+	struct ctl_pipe_t *p = arg;
+	unsigned char *buf;
+	size_t size;
+	ssize_t bytes;
+
+	buf = get_cmd_framer_buf(&p->framer, &size);
+
+	bytes = read(p->fd, buf, size);
+	if (bytes == 0) {
+		/*
+		 * The last writer went away. Reopen the FIFO, otherwise
+		 * it would keep reporting end of file.
+		 */
+		close_cmd_framer(&p->framer);
+		close_pipe(p);
+		if (open_fifo(p) < 0)
+			fprintf(stderr, "Could not reopen %s.\n", p->path);
 		return;
-	} else {
-		read(fd, pipe_buf, CTL_BUFFER_SIZE - 1);
 	}
+	if (bytes < 0) return;
 
-	/* handle commands per line */
-	token = strtok((char *)pipe_buf, "\n");
-	while (token != NULL) {
-		memset(cmd_buf, 0, CMD_BUFFER_SIZE);
-		memcpy(cmd_buf, token, CMD_BUFFER_SIZE - 1);
-		token = strtok(NULL, "\n");
-
-		process_ascii_cmd(cmd_buf);
-	}
+	feed_cmd_framer(&p->framer, bytes);
 }
 
+#endif /* _WIN32 */
+
 void close_control_pipe() {
-	if (fd > 0) close(fd);
+	for (uint8_t i = 0; i < num_pipes; i++)
+		close_pipe(&pipes[i]);
+	num_pipes = 0;
 }
-
-#endif /* _WIN32 */
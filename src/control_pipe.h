@@ -18,10 +18,10 @@
 
 #ifndef _WIN32
   #include <fcntl.h>
-  #include <poll.h>
-  #include <sys/select.h>
 #endif
 
-extern int open_control_pipe(char *filename);
+/* one per station */
+#define MAX_CTL_PIPES	16
+
+extern int open_control_pipe(char *filename, struct station_t *station);
 extern void close_control_pipe();
-extern void poll_control_pipe();
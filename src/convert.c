@@ -0,0 +1,284 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "mpx_simd.h"
+#include "audio_ring.h"
+#include "convert.h"
+
+/* frames converted at a time, sized to stay in L1 */
+#define CONVERT_BLOCK	1024
+
+struct converter_t {
+	const struct mpx_kernels_t *kernels;
+	struct sink_format_t fmt;
+	uint8_t sample_size;
+	size_t frame_size;
+	float scale;
+
+	/* the kernels write our byte order straight to the sink */
+	bool native;
+
+	uint32_t rng;
+	float dither[CONVERT_BLOCK];
+	int32_t samples[CONVERT_BLOCK];
+};
+
+static const struct {
+	char *name;
+	uint8_t sample_fmt;
+	uint8_t size;
+	float scale;
+} sample_formats[] = {
+	{"s16", SAMPLE_FMT_S16, 2, 32767.0f},
+	{"s24", SAMPLE_FMT_S24, 3, 8388607.0f},
+	{"s32", SAMPLE_FMT_S32, 4, 2147483647.0f},
+	{"f32", SAMPLE_FMT_F32, 4, 1.0f}
+};
+
+#define NUM_SAMPLE_FORMATS \
+	(sizeof(sample_formats) / sizeof(sample_formats[0]))
+
+/*
+ * Look up a sample format by name
+ *
+ * Returns -1 if unknown
+ */
+int8_t get_sample_format(const char *name) {
+	for (uint8_t i = 0; i < NUM_SAMPLE_FORMATS; i++) {
+		if (strcasecmp(name, sample_formats[i].name) == 0)
+			return (int8_t)sample_formats[i].sample_fmt;
+	}
+	return -1;
+}
+
+/* bytes per sample */
+uint8_t get_sample_size(uint8_t sample_fmt) {
+	return sample_formats[sample_fmt].size;
+}
+
+/*
+ * Channels of a sink as "count[:list]"
+ *
+ * The list has the channels that carry the MPX, numbered from 1 and
+ * separated by commas ("4:3" is the third of four channels). Without
+ * one all channels do. Returns -1 if it doesn't parse.
+ */
+int parse_sink_channels(const char *arg, struct sink_format_t *fmt) {
+	unsigned long count, ch;
+	char *end;
+
+	count = strtoul(arg, &end, 10);
+	if (end == arg || count < 1 || count > MAX_SINK_CHANNELS) return -1;
+
+	fmt->channels = (uint8_t)count;
+	fmt->mask = (uint8_t)((1u << count) - 1);
+	if (*end == 0) return 0;
+	if (*end != ':') return -1;
+
+	fmt->mask = 0;
+	do {
+		arg = end + 1;
+		ch = strtoul(arg, &end, 10);
+		if (end == arg || ch < 1 || ch > count) return -1;
+		fmt->mask |= (uint8_t)(1u << (ch - 1));
+	} while (*end == ',');
+
+	return *end == 0 ? 0 : -1;
+}
+
+/*
+ * Create a converter for a sink
+ *
+ * Returns NULL on failure
+ */
+struct converter_t *init_converter(const struct sink_format_t *fmt) {
+	struct converter_t *conv;
+	const uint16_t one = 1;
+	bool little_endian;
+
+	conv = malloc(sizeof(struct converter_t));
+	if (conv == NULL) return NULL;
+
+	little_endian = *(const uint8_t *)&one == 1;
+
+	conv->kernels = mpx_select_kernels();
+	conv->fmt = *fmt;
+	conv->sample_size = get_sample_size(fmt->sample_fmt);
+	conv->frame_size = (size_t)conv->sample_size * fmt->channels;
+	conv->scale = sample_formats[fmt->sample_fmt].scale;
+	conv->native = little_endian != fmt->big_endian;
+	conv->rng = 0x2545f491u;
+
+	/* floats are not dithered */
+	if (fmt->sample_fmt == SAMPLE_FMT_F32) conv->fmt.dither = false;
+
+	return conv;
+}
+
+void exit_converter(struct converter_t *conv) {
+	free(conv);
+}
+
+/* bytes per frame of the sink */
+size_t get_sink_frame_size(struct converter_t *conv) {
+	return conv->frame_size;
+}
+
+/*
+ * TPDF dither of one LSB
+ *
+ * The difference of two uniform values in [0, 1) has a triangular
+ * distribution over (-1, 1), which removes the dependence of the
+ * error on the signal
+ */
+static void make_dither(struct converter_t *conv, size_t n) {
+	const float unit = 1.0f / 16777216.0f;
+	uint32_t x = conv->rng;
+	float u1, u2;
+
+	for (size_t i = 0; i < n; i++) {
+		/* xorshift32 */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		u1 = (float)(x >> 8) * unit;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		u2 = (float)(x >> 8) * unit;
+		conv->dither[i] = u1 - u2;
+	}
+	conv->rng = x;
+}
+
+/* lay out the converted samples in the channels of the sink */
+static void spread_samples(struct converter_t *conv, uint8_t *out,
+	size_t n) {
+	const uint8_t size = conv->sample_size;
+	const int16_t *s16 = (const int16_t *)conv->samples;
+	uint32_t v;
+
+	for (size_t i = 0; i < n; i++) {
+		switch (conv->fmt.sample_fmt) {
+		case SAMPLE_FMT_S16:
+			v = (uint16_t)s16[i];
+			break;
+		default:
+			/* 32-bit values, or the bits of floats */
+			v = (uint32_t)conv->samples[i];
+			break;
+		}
+
+		for (uint8_t ch = 0; ch < conv->fmt.channels; ch++) {
+			if ((conv->fmt.mask >> ch & 1) == 0) {
+				memset(out, 0, size);
+			} else if (conv->fmt.big_endian) {
+				for (uint8_t b = 0; b < size; b++)
+					out[size - 1 - b] = (uint8_t)(v >> 8 * b);
+			} else {
+				for (uint8_t b = 0; b < size; b++)
+					out[b] = (uint8_t)(v >> 8 * b);
+			}
+			out += size;
+		}
+	}
+}
+
+static void convert_block(struct converter_t *conv, const float *in,
+	uint8_t *out, size_t n) {
+	const struct mpx_kernels_t *k = conv->kernels;
+	const struct sink_format_t *fmt = &conv->fmt;
+	const bool mono = fmt->channels == 1;
+	const float *dither = NULL;
+
+	if (fmt->dither) {
+		make_dither(conv, n);
+		dither = conv->dither;
+	}
+
+	switch (fmt->sample_fmt) {
+	case SAMPLE_FMT_S16:
+		/* the usual sinks go straight out */
+		if (conv->native && mono) {
+			k->to_s16((int16_t *)out, in, dither, conv->scale, n);
+			return;
+		}
+		if (conv->native && fmt->channels == 2 && fmt->mask == 3) {
+			k->to_s16_2ch((int16_t *)out, in, dither,
+				conv->scale, n);
+			return;
+		}
+		k->to_s16((int16_t *)conv->samples, in, dither,
+			conv->scale, n);
+		break;
+	case SAMPLE_FMT_S24:
+		k->to_s32(conv->samples, in, dither, conv->scale, n);
+		break;
+	case SAMPLE_FMT_S32:
+		if (conv->native && mono) {
+			k->to_s32((int32_t *)out, in, dither, conv->scale, n);
+			return;
+		}
+		k->to_s32(conv->samples, in, dither, conv->scale, n);
+		break;
+	case SAMPLE_FMT_F32:
+		if (conv->native && mono) {
+			memcpy(out, in, n * sizeof(float));
+			return;
+		}
+		memcpy(conv->samples, in, n * sizeof(float));
+		break;
+	}
+
+	spread_samples(conv, out, n);
+}
+
+/* n frames of MPX into the sink's format */
+void convert_frames(struct converter_t *conv, const float *in, void *out,
+	size_t frames) {
+	uint8_t *dst = out;
+	size_t n;
+
+	while (frames) {
+		n = frames > CONVERT_BLOCK ? CONVERT_BLOCK : frames;
+		convert_block(conv, in, dst, n);
+		in += n;
+		dst += n * conv->frame_size;
+		frames -= n;
+	}
+}
+
+/*
+ * Convert straight into the free space of a ring
+ *
+ * The ring has to be made with the sink's frame size. Returns the
+ * frames that fit.
+ */
+size_t convert_into_ring(struct converter_t *conv,
+	struct audio_ring_t *ring, const float *in, size_t frames) {
+	struct audio_ring_span_t span;
+
+	frames = audio_ring_write_span(ring, frames, &span);
+	convert_frames(conv, in, span.data[0], span.frames[0]);
+	convert_frames(conv, in + span.frames[0], span.data[1],
+		span.frames[1]);
+	audio_ring_commit_write(ring, frames);
+
+	return frames;
+}
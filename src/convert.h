@@ -0,0 +1,62 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Output conversion
+ *
+ * The MPX is one channel of floats all the way to the sink. A
+ * converter makes the samples of the sink from it: 16, 24 or 32-bit
+ * integers or floats, little or big-endian, on any of the channels of
+ * a sink with up to MAX_SINK_CHANNELS (the others are silent). The
+ * integer formats can have TPDF dither added.
+ */
+#define SAMPLE_FMT_S16		0
+#define SAMPLE_FMT_S24		1
+#define SAMPLE_FMT_S32		2
+#define SAMPLE_FMT_F32		3
+
+#define MAX_SINK_CHANNELS	8
+
+typedef struct sink_format_t {
+	uint8_t sample_fmt;
+	uint8_t channels;
+
+	/* channels that carry the MPX, bit 0 is the first */
+	uint8_t mask;
+
+	bool big_endian;
+	bool dither;
+} sink_format_t;
+
+typedef struct converter_t converter_t;
+
+/* see audio_ring.h */
+struct audio_ring_t;
+
+extern int8_t get_sample_format(const char *name);
+extern uint8_t get_sample_size(uint8_t sample_fmt);
+extern int parse_sink_channels(const char *arg, struct sink_format_t *fmt);
+
+extern struct converter_t *init_converter(const struct sink_format_t *fmt);
+extern void exit_converter(struct converter_t *conv);
+
+extern size_t get_sink_frame_size(struct converter_t *conv);
+extern void convert_frames(struct converter_t *conv, const float *in,
+	void *out, size_t frames);
+extern size_t convert_into_ring(struct converter_t *conv,
+	struct audio_ring_t *ring, const float *in, size_t frames);
@@ -0,0 +1,389 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* for clock_gettime() */
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+#include "event_loop.h"
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #if defined(__linux__)
+    #define EVENT_EPOLL
+    #include <sys/epoll.h>
+  #elif defined(__APPLE__) || defined(__FreeBSD__) || \
+	defined(__OpenBSD__) || defined(__NetBSD__)
+    #define EVENT_KQUEUE
+    #include <sys/types.h>
+    #include <sys/event.h>
+  #else
+    #define EVENT_POLL
+    #include <poll.h>
+  #endif
+#endif
+
+/* events handled per wait */
+#define MAX_READY	16
+
+typedef struct event_source_t {
+	bool used;
+	event_handle_t handle;
+	event_cb_t cb;
+	void *arg;
+	/* also ready when it can be written to */
+	bool output;
+} event_source_t;
+
+typedef struct event_timer_t {
+	bool used;
+	uint32_t interval_ms;
+	uint64_t deadline;
+	event_cb_t cb;
+	void *arg;
+} event_timer_t;
+
+static struct event_source_t sources[MAX_EVENT_SOURCES];
+static struct event_timer_t timers[MAX_EVENT_TIMERS];
+static volatile bool running;
+
+#ifdef _WIN32
+static HANDLE wake_event;
+#else
+static int wake_pipe[2] = {-1, -1};
+#endif
+
+#if defined(EVENT_EPOLL) || defined(EVENT_KQUEUE)
+static int poll_fd = -1;
+#endif
+
+/* timers run on a clock that isn't set, so they go on when it is */
+static uint64_t get_time_ms() {
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000 +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000 /
+		(uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static struct event_source_t *find_source(event_handle_t handle) {
+	for (uint8_t i = 0; i < MAX_EVENT_SOURCES; i++) {
+		if (sources[i].used && sources[i].handle == handle)
+			return &sources[i];
+	}
+	return NULL;
+}
+
+#ifndef _WIN32
+/* drain the wakeup pipe and leave the loop */
+static void wake_cb(void *arg) {
+	char buf[16];
+
+	(void)arg;
+	while (read(wake_pipe[0], buf, sizeof(buf)) > 0);
+	running = false;
+}
+#endif
+
+int init_event_loop() {
+	memset(sources, 0, sizeof(sources));
+	memset(timers, 0, sizeof(timers));
+
+#ifdef _WIN32
+	wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (wake_event == NULL) return -1;
+#else
+#if defined(EVENT_EPOLL)
+	poll_fd = epoll_create1(0);
+	if (poll_fd == -1) return -1;
+#elif defined(EVENT_KQUEUE)
+	poll_fd = kqueue();
+	if (poll_fd == -1) return -1;
+#endif
+
+	if (pipe(wake_pipe) == -1) return -1;
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	if (add_event_source(wake_pipe[0], wake_cb, NULL) < 0) return -1;
+#endif
+
+	return 0;
+}
+
+/*
+ * Watch a handle for input
+ *
+ * cb is called from the event loop thread whenever it's ready
+ */
+int add_event_source(event_handle_t handle, event_cb_t cb, void *arg) {
+	struct event_source_t *src = NULL;
+
+	for (uint8_t i = 0; i < MAX_EVENT_SOURCES; i++) {
+		if (!sources[i].used) {
+			src = &sources[i];
+			break;
+		}
+	}
+	if (src == NULL) return -1;
+
+#if defined(EVENT_EPOLL)
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, handle, &ev) == -1) return -1;
+#elif defined(EVENT_KQUEUE)
+	struct kevent ev;
+
+	EV_SET(&ev, handle, EVFILT_READ, EV_ADD, 0, 0, src);
+	if (kevent(poll_fd, &ev, 1, NULL, 0, NULL) == -1) return -1;
+#endif
+
+	src->handle = handle;
+	src->cb = cb;
+	src->arg = arg;
+	src->output = false;
+	src->used = true;
+
+	return 0;
+}
+
+/* must be called before the handle is closed */
+void remove_event_source(event_handle_t handle) {
+	struct event_source_t *src = find_source(handle);
+
+	if (src == NULL) return;
+
+#if defined(EVENT_EPOLL)
+	epoll_ctl(poll_fd, EPOLL_CTL_DEL, handle, NULL);
+#elif defined(EVENT_KQUEUE)
+	struct kevent ev;
+
+	EV_SET(&ev, handle, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	kevent(poll_fd, &ev, 1, NULL, 0, NULL);
+	if (src->output) {
+		EV_SET(&ev, handle, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(poll_fd, &ev, 1, NULL, 0, NULL);
+	}
+#endif
+
+	src->used = false;
+}
+
+#ifndef _WIN32
+/*
+ * Call the handler when the handle can be written to as well
+ *
+ * For sockets with output the peer hasn't taken yet, turn it off
+ * again once everything has been sent.
+ */
+int set_event_output(event_handle_t handle, bool on) {
+	struct event_source_t *src = find_source(handle);
+
+	if (src == NULL) return -1;
+	if (src->output == on) return 0;
+
+#if defined(EVENT_EPOLL)
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(poll_fd, EPOLL_CTL_MOD, handle, &ev) == -1) return -1;
+#elif defined(EVENT_KQUEUE)
+	struct kevent ev;
+
+	EV_SET(&ev, handle, EVFILT_WRITE, on ? EV_ADD : EV_DELETE, 0, 0,
+		src);
+	if (kevent(poll_fd, &ev, 1, NULL, 0, NULL) == -1) return -1;
+#endif
+
+	src->output = on;
+	return 0;
+}
+#endif
+
+/* Call cb every interval_ms milliseconds */
+int add_event_timer(uint32_t interval_ms, event_cb_t cb, void *arg) {
+	for (uint8_t i = 0; i < MAX_EVENT_TIMERS; i++) {
+		if (timers[i].used) continue;
+
+		timers[i].interval_ms = interval_ms;
+		timers[i].deadline = get_time_ms() + interval_ms;
+		timers[i].cb = cb;
+		timers[i].arg = arg;
+		timers[i].used = true;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Run the expired timers
+ *
+ * Returns the time until the next one in ms, -1 if there are none
+ */
+static int run_timers() {
+	uint64_t now = get_time_ms();
+	uint64_t next = UINT64_MAX;
+
+	for (uint8_t i = 0; i < MAX_EVENT_TIMERS; i++) {
+		if (!timers[i].used) continue;
+
+		if (timers[i].deadline <= now) {
+			timers[i].cb(timers[i].arg);
+			timers[i].deadline += timers[i].interval_ms;
+			/* don't try to catch up after a stall */
+			if (timers[i].deadline <= now)
+				timers[i].deadline = now + timers[i].interval_ms;
+		}
+
+		if (timers[i].deadline < next) next = timers[i].deadline;
+	}
+
+	if (next == UINT64_MAX) return -1;
+	return (int)(next - now);
+}
+
+static inline void dispatch(struct event_source_t *src) {
+	/* it may have been removed by an earlier callback */
+	if (src->used) src->cb(src->arg);
+}
+
+#if defined(EVENT_EPOLL)
+static void wait_events(int timeout) {
+	struct epoll_event ready[MAX_READY];
+	int n;
+
+	n = epoll_wait(poll_fd, ready, MAX_READY, timeout);
+	for (int i = 0; i < n; i++)
+		dispatch(ready[i].data.ptr);
+}
+#elif defined(EVENT_KQUEUE)
+static void wait_events(int timeout) {
+	struct kevent ready[MAX_READY];
+	struct timespec ts, *tsp = NULL;
+	int n;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000l;
+		tsp = &ts;
+	}
+
+	n = kevent(poll_fd, NULL, 0, ready, MAX_READY, tsp);
+	for (int i = 0; i < n; i++)
+		dispatch(ready[i].udata);
+}
+#elif defined(EVENT_POLL)
+static void wait_events(int timeout) {
+	struct pollfd fds[MAX_EVENT_SOURCES];
+	struct event_source_t *src[MAX_EVENT_SOURCES];
+	nfds_t n = 0;
+
+	for (uint8_t i = 0; i < MAX_EVENT_SOURCES; i++) {
+		if (!sources[i].used) continue;
+		fds[n].fd = sources[i].handle;
+		fds[n].events = POLLIN;
+		if (sources[i].output) fds[n].events |= POLLOUT;
+		fds[n].revents = 0;
+		src[n++] = &sources[i];
+	}
+
+	if (poll(fds, n, timeout) <= 0) return;
+
+	for (nfds_t i = 0; i < n; i++) {
+		if (fds[i].revents) dispatch(src[i]);
+	}
+}
+#else /* _WIN32 */
+static void wait_events(int timeout) {
+	HANDLE handles[MAX_EVENT_SOURCES + 1];
+	struct event_source_t *src[MAX_EVENT_SOURCES + 1];
+	DWORD n = 0, ret;
+
+	handles[n] = wake_event;
+	src[n++] = NULL;
+
+	for (uint8_t i = 0; i < MAX_EVENT_SOURCES; i++) {
+		if (!sources[i].used) continue;
+		handles[n] = sources[i].handle;
+		src[n++] = &sources[i];
+	}
+
+	ret = WaitForMultipleObjects(n, handles, FALSE,
+		timeout < 0 ? INFINITE : (DWORD)timeout);
+	if (ret >= WAIT_OBJECT_0 + n) return;
+
+	ret -= WAIT_OBJECT_0;
+	if (ret == 0) {
+		running = false;
+		return;
+	}
+
+	dispatch(src[ret]);
+}
+#endif
+
+/* Handle events until stop_event_loop is called */
+void run_event_loop() {
+	running = true;
+
+	while (running)
+		wait_events(run_timers());
+}
+
+/* Can be called from any thread */
+void stop_event_loop() {
+#ifdef _WIN32
+	if (wake_event) SetEvent(wake_event);
+#else
+	if (wake_pipe[1] != -1) {
+		if (write(wake_pipe[1], "x", 1) < 0) {
+			/* pipe is full so a wakeup is already pending */
+		}
+	}
+#endif
+}
+
+void exit_event_loop() {
+#ifdef _WIN32
+	if (wake_event) CloseHandle(wake_event);
+	wake_event = NULL;
+#else
+	for (uint8_t i = 0; i < 2; i++) {
+		if (wake_pipe[i] != -1) close(wake_pipe[i]);
+		wake_pipe[i] = -1;
+	}
+#endif
+#if defined(EVENT_EPOLL) || defined(EVENT_KQUEUE)
+	if (poll_fd != -1) close(poll_fd);
+	poll_fd = -1;
+#endif
+}
@@ -0,0 +1,58 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Control I/O event loop
+ *
+ * One thread waits on every control input (FIFO, sockets and
+ * timers) at once and calls the handler of whichever is ready, so
+ * commands are acted on as soon as they arrive and nothing wakes
+ * up while idle.
+ *
+ * On Windows a source is an event handle (named pipe overlapped
+ * event or WSAEventSelect event), elsewhere it's a file descriptor.
+ * A socket that is waiting to send more is watched for room in its
+ * buffer with set_event_output, or FD_WRITE on Windows.
+ */
+#ifdef _WIN32
+typedef HANDLE event_handle_t;
+#else
+typedef int event_handle_t;
+#endif
+
+/* every station has its own pipe and listeners */
+#ifdef _WIN32
+/* one handle is kept for waking the loop up */
+#define MAX_EVENT_SOURCES	(MAXIMUM_WAIT_OBJECTS - 1)
+#else
+#define MAX_EVENT_SOURCES	128
+#endif
+#define MAX_EVENT_TIMERS	8
+
+typedef void (*event_cb_t)(void *arg);
+
+extern int init_event_loop();
+extern int add_event_source(event_handle_t handle, event_cb_t cb, void *arg);
+extern void remove_event_source(event_handle_t handle);
+#ifndef _WIN32
+extern int set_event_output(event_handle_t handle, bool on);
+#endif
+extern int add_event_timer(uint32_t interval_ms, event_cb_t cb, void *arg);
+extern void run_event_loop();
+extern void stop_event_loop();
+extern void exit_event_loop();
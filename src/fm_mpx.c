@@ -24,29 +24,53 @@
 #endif
 #include "fm_mpx.h"
 #include "osc.h"
+#include "mpx_simd.h"
+#include "modulator.h"
+#include "work_pool.h"
+#include "stereo.h"
+#include "arena.h"
 
 /*
- * Local oscillator objects
- * this is where the MPX waveforms are stored
+ * All carriers are whole multiples of 4750 Hz, so they can be
+ * generated from one shared phase
  *
  */
-static struct osc_t osc_19k;
-static struct osc_t osc_57k;
+#define CARRIER_BASE_FREQ	4750.0f
+#define HARMONIC_19K		4
+#define HARMONIC_38K		8
+#define HARMONIC_57K		12
+#define HARMONIC_67K		14
+#define HARMONIC_71K		15
+#define HARMONIC_76K		16
+
+/*
+ * Carrier of each RDS stream
+ *
+ * With RDS2_QUADRATURE_CARRIER the RDS2 streams are 90, 180 and 270
+ * degrees out of phase with RDS. The sine is 90 degrees ahead of the
+ * cosine and a flipped carrier adds another 180 degrees.
+ */
+static const struct {
+	uint8_t harmonic;
+	bool sine;
+	bool invert;
+} stream_carriers[NUM_STREAMS] = {
+	{ HARMONIC_57K, false, false },
 #ifdef RDS2
-static struct osc_t osc_67k;
-static struct osc_t osc_71k;
-static struct osc_t osc_76k;
+#ifdef RDS2_QUADRATURE_CARRIER
+	{ HARMONIC_67K, true, false },
+	{ HARMONIC_71K, false, true },
+	{ HARMONIC_76K, true, true }
+#else
+	{ HARMONIC_67K, false, false },
+	{ HARMONIC_71K, false, false },
+	{ HARMONIC_76K, false, false }
 #endif
-
-static float mpx_vol;
-
-void set_output_volume(float vol) {
-	if (vol > 100.0f) vol = 100.0f;
-	mpx_vol = vol / 100.0f;
-}
+#endif
+};
 
 /* subcarrier volumes */
-static float volumes[MPX_SUBCARRIER_END] = {
+static const float default_volumes[MPX_SUBCARRIER_END] = {
 	0.09f, /* pilot tone: 9% */
 	0.09f, /* RDS: 4.5% modulation */
 #ifdef RDS2
@@ -57,100 +81,404 @@ static float volumes[MPX_SUBCARRIER_END] = {
 #endif
 };
 
-void set_carrier_volume(uint8_t carrier, float new_volume) {
+/* L+R and L-R, leaving room for the pilot and RDS */
+#define DEFAULT_AUDIO_VOLUME	0.8f
+
+/*
+ * MPX generator context
+ *
+ * The oscillator and envelope tables are shared by all generators,
+ * only the positions, levels and buffers are per station.
+ */
+struct mpx_generator_t {
+	/*
+	 * Local oscillator objects
+	 * this is where the MPX waveforms are stored
+	 *
+	 */
+	struct osc_t osc_19k;
+	struct osc_t osc_38k;
+	struct osc_t osc_57k;
+#ifdef RDS2
+	struct osc_t osc_67k;
+	struct osc_t osc_71k;
+	struct osc_t osc_76k;
+#endif
+
+	/* oscillators of the RDS streams, in stream order */
+	struct osc_t *stream_osc[NUM_STREAMS];
+
+#ifdef PHASE_LOCKED_CARRIERS
+	struct osc_bank_t carrier_bank;
+	bool use_carrier_bank;
+#endif
+
+	struct rds_modulator_t *rds;
+
+	/* stereo audio, NULL for RDS only */
+	uint32_t sample_rate;
+	struct stereo_encoder_t *stereo;
+	float audio_vol;
+
+	float mpx_vol;
+	float volumes[MPX_SUBCARRIER_END];
+
+	/*
+	 * Block buffers
+	 *
+	 * Each subcarrier is generated as a run of contiguous samples
+	 * and mixed into the accumulator by the vector kernels
+	 */
+	const struct mpx_kernels_t *kernels;
+	_Alignas(CACHE_LINE) float mpx_buf[NUM_MPX_FRAMES_IN];
+	float carrier_buf[NUM_MPX_FRAMES_IN];
+	float envelope_buf[NUM_MPX_FRAMES_IN];
+	float mono_buf[NUM_MPX_FRAMES_IN];
+	float diff_buf[NUM_MPX_FRAMES_IN];
+
+	/*
+	 * Parallel rendering
+	 *
+	 * Each RDS stream is generated into its own buffers by a job on
+	 * the pool. The results are mixed in stream order once all jobs
+	 * are done, which gives the same output as the serial path.
+	 */
+	struct work_pool_t *pool;
+	size_t block_len;
+	/*
+	 * carrier and envelope of each stream (NUM_MPX_FRAMES_IN each),
+	 * all in stream_bufs
+	 */
+	void *stream_bufs;
+	float *stream_carrier_buf[NUM_STREAMS];
+	float *stream_envelope_buf[NUM_STREAMS];
+};
+
+void set_output_volume(struct mpx_generator_t *mpx, float vol) {
+	if (vol > 100.0f) vol = 100.0f;
+	mpx->mpx_vol = vol / 100.0f;
+}
+
+void set_audio_volume(struct mpx_generator_t *mpx, float vol) {
+	if (vol > 100.0f) vol = 100.0f;
+	mpx->audio_vol = vol / 100.0f;
+}
+
+void set_carrier_volume(struct mpx_generator_t *mpx, uint8_t carrier,
+	float new_volume) {
 	/* check for valid index */
 	if (carrier >= MPX_SUBCARRIER_END) return;
 
 	/* don't allow levels over 15% */
 	if (new_volume >= 15.0f) new_volume = 15.0f;
 
-	volumes[carrier] = new_volume / 100.0f;
+	mpx->volumes[carrier] = new_volume / 100.0f;
 }
 
-void fm_mpx_init(uint32_t sample_rate) {
+/*
+ * Create a generator for an encoder
+ *
+ */
+struct mpx_generator_t *fm_mpx_init(uint32_t sample_rate,
+	struct rds_encoder_t *enc) {
+	struct mpx_generator_t *mpx;
+
+	mpx = alloc_arena(sizeof(struct mpx_generator_t));
+	if (mpx == NULL) return NULL;
+
 	/* initialize the subcarrier oscillators */
-	osc_init(&osc_19k, sample_rate, 19000.0f);
-	osc_init(&osc_57k, sample_rate, 57000.0f);
+	if (osc_init(&mpx->osc_19k, sample_rate, 19000.0f) < 0 ||
+		osc_init(&mpx->osc_38k, sample_rate, 38000.0f) < 0 ||
+		osc_init(&mpx->osc_57k, sample_rate, 57000.0f) < 0)
+		goto fail;
 #ifdef RDS2
-	osc_init(&osc_67k, sample_rate, 66500.0f);
-	osc_init(&osc_71k, sample_rate, 71250.0f);
-	osc_init(&osc_76k, sample_rate, 76000.0f);
+	if (osc_init(&mpx->osc_67k, sample_rate, 66500.0f) < 0 ||
+		osc_init(&mpx->osc_71k, sample_rate, 71250.0f) < 0 ||
+		osc_init(&mpx->osc_76k, sample_rate, 76000.0f) < 0)
+		goto fail;
+#endif
+
+#ifdef PHASE_LOCKED_CARRIERS
+	/* fall back to separate oscillators if there's no exact period */
+	mpx->use_carrier_bank = osc_bank_init(&mpx->carrier_bank,
+		sample_rate, CARRIER_BASE_FREQ) == 0;
 #endif
+
+	mpx->stream_osc[0] = &mpx->osc_57k;
+#ifdef RDS2
+	mpx->stream_osc[1] = &mpx->osc_67k;
+	mpx->stream_osc[2] = &mpx->osc_71k;
+	mpx->stream_osc[3] = &mpx->osc_76k;
+#endif
+
+	/* RDS envelope at the same rate */
+	mpx->rds = init_rds_modulator(enc, sample_rate);
+	if (mpx->rds == NULL) goto fail;
+
+	memcpy(mpx->volumes, default_volumes, sizeof(default_volumes));
+	mpx->sample_rate = sample_rate;
+	mpx->audio_vol = DEFAULT_AUDIO_VOLUME;
+	mpx->kernels = mpx_select_kernels();
+
+	return mpx;
+
+fail:
+	fm_mpx_exit(mpx);
+	return NULL;
 }
 
-void fm_rds_get_frames(float *outbuf, size_t num_frames) {
-	size_t j = 0;
-	float out;
+const char *get_mpx_kernel_name(struct mpx_generator_t *mpx) {
+	return mpx->kernels ? mpx->kernels->name : "none";
+}
 
-	for (size_t i = 0; i < num_frames; i++) {
-		out = 0.0f;
+/*
+ * Generate stereo audio from an input
+ *
+ * Set before the first block, so the 38 kHz subcarrier starts in
+ * phase with the pilot. The input stays with the caller. preemphasis
+ * is in us (0 for none).
+ */
+int set_mpx_audio_input(struct mpx_generator_t *mpx,
+	struct audio_input_t *in, uint8_t preemphasis) {
+	struct stereo_encoder_t *stereo = NULL;
 
-		/* Pilot tone for calibration */
-		out += osc_get_cos(&osc_19k)
-			* volumes[MPX_SUBCARRIER_ST_PILOT];
+	if (in) {
+		stereo = init_stereo_encoder(in, mpx->sample_rate,
+			preemphasis);
+		if (stereo == NULL) return -1;
+	}
 
-		out += osc_get_cos(&osc_57k)
-			* get_rds_sample(0)
-			* volumes[MPX_SUBCARRIER_RDS_STREAM_0];
-#ifdef RDS2
-#ifdef RDS2_QUADRATURE_CARRIER
-		/* RDS2 is quadrature phase */
-
-		/* 90 degree shift */
-		out += osc_get_sin(&osc_67k)
-			* get_rds_sample(1)
-			* volumes[MPX_SUBCARRIER_RDS2_STREAM_1];
-
-		/* 180 degree shift */
-		out += -osc_get_cos(&osc_71k)
-			* get_rds_sample(2)
-			* volumes[MPX_SUBCARRIER_RDS2_STREAM_2];
-
-		/* 270 degree shift */
-		out += -osc_get_sin(&osc_76k)
-			* get_rds_sample(3)
-			* volumes[MPX_SUBCARRIER_RDS2_STREAM_3];
-#else
-		out += osc_get_cos(&osc_67k)
-			* get_rds_sample(1)
-			* volumes[MPX_SUBCARRIER_RDS2_STREAM_1];
+	exit_stereo_encoder(mpx->stereo);
+	mpx->stereo = stereo;
+	return 0;
+}
 
-		out += osc_get_cos(&osc_71k)
-			* get_rds_sample(2)
-			* volumes[MPX_SUBCARRIER_RDS2_STREAM_2];
+/*
+ * Use a work pool to generate the RDS streams in parallel
+ *
+ * The pool can be shared with other generators as long as they are
+ * not rendered at the same time. NULL goes back to serial rendering.
+ */
+int set_mpx_work_pool(struct mpx_generator_t *mpx,
+	struct work_pool_t *pool) {
+	const size_t buf_size = ARENA_SIZE(NUM_MPX_FRAMES_IN * sizeof(float));
+	uint8_t *arena;
+
+	if (pool && mpx->stream_bufs == NULL) {
+		arena = alloc_arena(2 * NUM_STREAMS * buf_size);
+		if (arena == NULL) return -1;
+
+		mpx->stream_bufs = arena;
+		for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+			mpx->stream_carrier_buf[i] = (float *)arena;
+			arena += buf_size;
+			mpx->stream_envelope_buf[i] = (float *)arena;
+			arena += buf_size;
+		}
+	}
+
+	mpx->pool = pool;
+	return 0;
+}
 
-		out += osc_get_cos(&osc_76k)
-			* get_rds_sample(3)
-			* volumes[MPX_SUBCARRIER_RDS2_STREAM_3];
+/*
+ * Fill a carrier buffer from an oscillator or from the harmonic bank
+ *
+ * Reading the bank doesn't change it, only the oscillator moves on.
+ */
+static inline void get_carrier(struct mpx_generator_t *mpx,
+	struct osc_t *osc, uint8_t harmonic, bool sine, float *out,
+	size_t n) {
+#ifdef PHASE_LOCKED_CARRIERS
+	if (mpx->use_carrier_bank) {
+		if (sine) {
+			osc_bank_get_sin_block(&mpx->carrier_bank, harmonic,
+				out, n);
+		} else {
+			osc_bank_get_cos_block(&mpx->carrier_bank, harmonic,
+				out, n);
+		}
+		return;
+	}
+#else
+	(void)mpx;
+	(void)harmonic;
 #endif
+	if (sine) {
+		osc_get_sin_block(osc, out, n);
+	} else {
+		osc_get_cos_block(osc, out, n);
+	}
+}
+
+static inline void get_stream_carrier(struct mpx_generator_t *mpx,
+	uint8_t stream_num, float *out, size_t n) {
+	get_carrier(mpx, mpx->stream_osc[stream_num],
+		stream_carriers[stream_num].harmonic,
+		stream_carriers[stream_num].sine, out, n);
+}
+
+/* a negative gain flips the carrier phase by 180 degrees */
+static inline float get_stream_gain(struct mpx_generator_t *mpx,
+	uint8_t stream_num) {
+	float gain = mpx->volumes[MPX_SUBCARRIER_RDS_STREAM_0 + stream_num];
+
+	return stream_carriers[stream_num].invert ? -gain : gain;
+}
+
+/*
+ * Mix one RDS subcarrier into the accumulator
+ *
+ */
+static inline void add_rds_stream(struct mpx_generator_t *mpx,
+	uint8_t stream_num, size_t n) {
+	get_stream_carrier(mpx, stream_num, mpx->carrier_buf, n);
+	get_rds_samples(mpx->rds, stream_num, mpx->envelope_buf, n);
+	mpx->kernels->mul_acc(mpx->mpx_buf, mpx->carrier_buf,
+		mpx->envelope_buf, get_stream_gain(mpx, stream_num), n);
+}
+
+/*
+ * Job for one RDS subcarrier
+ *
+ * Leaves the modulated subcarrier in the stream's envelope buffer
+ */
+static void render_rds_stream(void *ctx, uint8_t stream_num) {
+	struct mpx_generator_t *mpx = ctx;
+	float *carrier = mpx->stream_carrier_buf[stream_num];
+	float *envelope = mpx->stream_envelope_buf[stream_num];
+	size_t n = mpx->block_len;
+
+	get_stream_carrier(mpx, stream_num, carrier, n);
+	get_rds_samples(mpx->rds, stream_num, envelope, n);
+	mpx->kernels->mul(envelope, carrier, envelope,
+		get_stream_gain(mpx, stream_num), n);
+}
+
+static void add_rds_streams_parallel(struct mpx_generator_t *mpx,
+	size_t n) {
+	/* keep the encoders out of the jobs */
+	for (uint8_t i = 0; i < NUM_STREAMS; i++)
+		prefetch_rds_groups(mpx->rds, i, n);
+
+	mpx->block_len = n;
+	run_work(mpx->pool, render_rds_stream, mpx, NUM_STREAMS);
+
+	for (uint8_t i = 0; i < NUM_STREAMS; i++)
+		mpx->kernels->add(mpx->mpx_buf,
+			mpx->stream_envelope_buf[i], n);
+}
+
+void fm_rds_get_frames(struct mpx_generator_t *mpx, float *outbuf,
+	size_t num_frames) {
+	const float *vol = mpx->volumes;
+	size_t n;
+
+	while (num_frames) {
+		n = num_frames;
+		if (n > NUM_MPX_FRAMES_IN) n = NUM_MPX_FRAMES_IN;
+
+		/* Pilot tone for calibration */
+		get_carrier(mpx, &mpx->osc_19k, HARMONIC_19K, false,
+			mpx->carrier_buf, n);
+		mpx->kernels->scale(mpx->mpx_buf, mpx->carrier_buf,
+			vol[MPX_SUBCARRIER_ST_PILOT], n);
+
+		/*
+		 * L+R and L-R on 38 kHz
+		 *
+		 * The pilot is a cosine, so the subcarrier that crosses zero
+		 * with it is the flipped sine of the second harmonic
+		 */
+		if (mpx->stereo) {
+			get_stereo_samples(mpx->stereo, mpx->mono_buf,
+				mpx->diff_buf, mpx->audio_vol, n);
+			mpx->kernels->add(mpx->mpx_buf, mpx->mono_buf, n);
+			get_carrier(mpx, &mpx->osc_38k, HARMONIC_38K, true,
+				mpx->carrier_buf, n);
+			mpx->kernels->mul_acc(mpx->mpx_buf, mpx->carrier_buf,
+				mpx->diff_buf, -1.0f, n);
+		}
+
+		if (mpx->pool) {
+			add_rds_streams_parallel(mpx, n);
+		} else {
+			for (uint8_t i = 0; i < NUM_STREAMS; i++)
+				add_rds_stream(mpx, i, n);
+		}
+
+#ifdef PHASE_LOCKED_CARRIERS
+		if (mpx->use_carrier_bank)
+			osc_bank_update_pos(&mpx->carrier_bank, n);
 #endif
 
-		/* update oscillator */
-		osc_update_pos(&osc_19k);
-		osc_update_pos(&osc_57k);
-#ifdef RDS2
-		osc_update_pos(&osc_67k);
-		osc_update_pos(&osc_71k);
-		osc_update_pos(&osc_76k);
+		/* clipper and volume */
+		mpx->kernels->clip(outbuf, mpx->mpx_buf, mpx->mpx_vol, n);
+
+		outbuf += n;
+		num_frames -= n;
+	}
+}
+
+/*
+ * Sample-by-sample MPX generation
+ *
+ * This is the scalar reference for fm_rds_get_frames, it takes its
+ * carriers from the same source one sample at a time.
+ */
+void fm_rds_get_frames_ref(struct mpx_generator_t *mpx, float *outbuf,
+	size_t num_frames) {
+	float out, mono, diff, carrier;
+
+	for (size_t i = 0; i < num_frames; i++) {
+		/* Pilot tone for calibration */
+		get_carrier(mpx, &mpx->osc_19k, HARMONIC_19K, false,
+			&carrier, 1);
+		out = carrier * mpx->volumes[MPX_SUBCARRIER_ST_PILOT];
+
+		if (mpx->stereo) {
+			get_stereo_samples(mpx->stereo, &mono, &diff,
+				mpx->audio_vol, 1);
+			out += mono;
+			get_carrier(mpx, &mpx->osc_38k, HARMONIC_38K, true,
+				&carrier, 1);
+			out += -carrier * diff;
+		}
+
+		for (uint8_t j = 0; j < NUM_STREAMS; j++) {
+			get_stream_carrier(mpx, j, &carrier, 1);
+			out += carrier * get_rds_sample(mpx->rds, j)
+				* get_stream_gain(mpx, j);
+		}
+
+#ifdef PHASE_LOCKED_CARRIERS
+		if (mpx->use_carrier_bank)
+			osc_bank_update_pos(&mpx->carrier_bank, 1);
 #endif
 
 		/* clipper */
 		out = fminf(+1.0f, out);
 		out = fmaxf(-1.0f, out);
 
-		/* adjust volume and put into both channels */
-		outbuf[j+0] = outbuf[j+1] = out * mpx_vol;
-		j += 2;
-
+		/* adjust volume */
+		outbuf[i] = out * mpx->mpx_vol;
 	}
 }
 
-void fm_mpx_exit() {
-	osc_exit(&osc_19k);
-	osc_exit(&osc_57k);
+void fm_mpx_exit(struct mpx_generator_t *mpx) {
+	free_arena(mpx->stream_bufs);
+	if (mpx->rds) exit_rds_modulator(mpx->rds);
+	exit_stereo_encoder(mpx->stereo);
+#ifdef PHASE_LOCKED_CARRIERS
+	osc_bank_exit(&mpx->carrier_bank);
+#endif
+	osc_exit(&mpx->osc_19k);
+	osc_exit(&mpx->osc_38k);
+	osc_exit(&mpx->osc_57k);
 #ifdef RDS2
-	osc_exit(&osc_67k);
-	osc_exit(&osc_71k);
-	osc_exit(&osc_76k);
+	osc_exit(&mpx->osc_67k);
+	osc_exit(&mpx->osc_71k);
+	osc_exit(&mpx->osc_76k);
 #endif
+	free_arena(mpx);
 }
@@ -16,7 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-/* MPX */
+/* MPX, one float per frame (the sinks duplicate it if they need to) */
 #define NUM_MPX_FRAMES_IN	4096
 #define NUM_MPX_FRAMES_OUT	(NUM_MPX_FRAMES_IN * 2)
 
@@ -27,6 +27,19 @@
 
 #define OUTPUT_SAMPLE_RATE	192000
 
+/*
+ * Range of output rates
+ *
+ * The top RDS subcarrier must stay below Nyquist, and resampled
+ * output has to fit in NUM_MPX_FRAMES_OUT
+ */
+#ifdef RDS2
+#define MIN_OUTPUT_SAMPLE_RATE	160000
+#else
+#define MIN_OUTPUT_SAMPLE_RATE	128000
+#endif
+#define MAX_OUTPUT_SAMPLE_RATE	(MPX_SAMPLE_RATE * 2)
+
 enum mpx_subcarriers {
 	MPX_SUBCARRIER_ST_PILOT,
 	MPX_SUBCARRIER_RDS_STREAM_0,
@@ -38,8 +51,26 @@ enum mpx_subcarriers {
 	MPX_SUBCARRIER_END
 };
 
-extern void fm_mpx_init(uint32_t sample_rate);
-extern void fm_rds_get_frames(float *outbuf, size_t num_frames);
-extern void fm_mpx_exit();
-extern void set_output_volume(float vol);
-extern void set_carrier_volume(uint8_t carrier, float new_volume);
+/* one station's MPX generator, see fm_mpx.c */
+typedef struct mpx_generator_t mpx_generator_t;
+
+/* see work_pool.h and audio_input.h */
+struct work_pool_t;
+struct audio_input_t;
+
+extern struct mpx_generator_t *fm_mpx_init(uint32_t sample_rate,
+	struct rds_encoder_t *enc);
+extern void fm_rds_get_frames(struct mpx_generator_t *mpx, float *outbuf,
+	size_t num_frames);
+extern void fm_rds_get_frames_ref(struct mpx_generator_t *mpx, float *outbuf,
+	size_t num_frames);
+extern int set_mpx_audio_input(struct mpx_generator_t *mpx,
+	struct audio_input_t *in, uint8_t preemphasis);
+extern int set_mpx_work_pool(struct mpx_generator_t *mpx,
+	struct work_pool_t *pool);
+extern const char *get_mpx_kernel_name(struct mpx_generator_t *mpx);
+extern void fm_mpx_exit(struct mpx_generator_t *mpx);
+extern void set_output_volume(struct mpx_generator_t *mpx, float vol);
+extern void set_audio_volume(struct mpx_generator_t *mpx, float vol);
+extern void set_carrier_volume(struct mpx_generator_t *mpx, uint8_t carrier,
+	float new_volume);
@@ -0,0 +1,249 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Table generator
+ *
+ * Run at build time to write builtin_tables.c with the tables for
+ * the given MPX rates, so the encoder doesn't have to make them when
+ * it starts. The tables come from the same code as at run time
+ * (tables.c) and are written as hex floats, so they are exact.
+ *
+ * usage: gen_tables <output.c> <rate>...
+ */
+
+#include "common.h"
+#include "rds.h"
+#include "osc.h"
+#include "modulator.h"
+#include "tables.h"
+
+/* everything fm_mpx.c and rds_decoder.c ask osc.c for */
+static const float carrier_freqs[] = {
+	4750.0f,	/* CARRIER_BASE_FREQ */
+	19000.0f, 38000.0f, 57000.0f,
+	66500.0f, 71250.0f, 76000.0f
+};
+
+#define NUM_CARRIERS	(sizeof(carrier_freqs) / sizeof(carrier_freqs[0]))
+#define MAX_RATES	16
+#define MAX_WAVES	(MAX_RATES * NUM_CARRIERS + 1)
+
+static struct {
+	uint32_t len;
+	uint32_t cycles;
+} waves[MAX_WAVES];
+static size_t num_waves;
+
+static void put_floats(FILE *f, const char *name, const float *data,
+	size_t n) {
+	fprintf(f, "static _Alignas(CACHE_LINE) const float %s[%zu] = {",
+		name, n);
+	for (size_t i = 0; i < n; i++) {
+		fprintf(f, "%s%af,", i % 4 ? " " : "\n\t", (double)data[i]);
+	}
+	fprintf(f, "\n};\n\n");
+}
+
+static void add_wave(uint32_t len, uint32_t cycles) {
+	for (size_t i = 0; i < num_waves; i++) {
+		if (waves[i].len == len && waves[i].cycles == cycles) return;
+	}
+	waves[num_waves].len = len;
+	waves[num_waves].cycles = cycles;
+	num_waves++;
+}
+
+static int put_wave(FILE *f, uint32_t len, uint32_t cycles) {
+	float *sin_wave, *cos_wave;
+	char name[64];
+
+	sin_wave = malloc((len + 1) * sizeof(float));
+	cos_wave = malloc((len + 1) * sizeof(float));
+	if (sin_wave == NULL || cos_wave == NULL) {
+		free(sin_wave);
+		free(cos_wave);
+		return -1;
+	}
+
+	/* with the guard sample */
+	create_wave(len, cycles, sin_wave, cos_wave);
+	sin_wave[len] = sin_wave[0];
+	cos_wave[len] = cos_wave[0];
+
+	snprintf(name, sizeof(name), "sin_%u_%u", len, cycles);
+	put_floats(f, name, sin_wave, len + 1);
+	snprintf(name, sizeof(name), "cos_%u_%u", len, cycles);
+	put_floats(f, name, cos_wave, len + 1);
+
+	free(sin_wave);
+	free(cos_wave);
+	return 0;
+}
+
+static int put_envelope(FILE *f, uint32_t rate) {
+	uint32_t spb_num, spb_den;
+	uint16_t max_bit_len;
+	uint16_t *bit_len;
+	float *slices, *polyphase = NULL;
+	size_t slices_len;
+	char name[64];
+
+	get_envelope_size(rate, &spb_num, &spb_den, &max_bit_len);
+	slices_len = (size_t)spb_den * POLYPHASE_TAPS * max_bit_len;
+
+	bit_len = malloc(spb_den * sizeof(uint16_t));
+	slices = malloc(slices_len * sizeof(float));
+	if (spb_den == 1)
+		polyphase = malloc(POLYPHASE_ROWS * max_bit_len *
+			sizeof(float));
+	if (bit_len == NULL || slices == NULL ||
+		(spb_den == 1 && polyphase == NULL)) {
+		free(bit_len);
+		free(slices);
+		free(polyphase);
+		return -1;
+	}
+
+	create_slices(spb_num, spb_den, max_bit_len, bit_len, slices);
+
+	fprintf(f, "static const uint16_t bit_len_%u[%u] = {", rate, spb_den);
+	for (uint32_t p = 0; p < spb_den; p++) {
+		fprintf(f, "%s%u,", p % 8 ? " " : "\n\t", bit_len[p]);
+	}
+	fprintf(f, "\n};\n\n");
+
+	snprintf(name, sizeof(name), "slices_%u", rate);
+	put_floats(f, name, slices, slices_len);
+
+	if (polyphase) {
+		create_polyphase(max_bit_len, slices, polyphase);
+		snprintf(name, sizeof(name), "polyphase_%u", rate);
+		put_floats(f, name, polyphase,
+			POLYPHASE_ROWS * max_bit_len);
+	}
+
+	free(bit_len);
+	free(slices);
+	free(polyphase);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	FILE *f;
+	uint32_t rates[MAX_RATES];
+	size_t num_rates = 0;
+	uint32_t len, cycles;
+	uint32_t spb_num, spb_den;
+	uint16_t max_bit_len;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <output.c> <rate>...\n", argv[0]);
+		return 1;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		uint32_t rate = (uint32_t)strtoul(argv[i], NULL, 10);
+		bool seen = false;
+
+		if (rate == 0) {
+			fprintf(stderr, "Invalid rate '%s'.\n", argv[i]);
+			return 1;
+		}
+		for (size_t r = 0; r < num_rates; r++) {
+			if (rates[r] == rate) seen = true;
+		}
+		if (seen) continue;
+
+		if (num_rates == MAX_RATES) {
+			fprintf(stderr, "Too many rates (max %u).\n",
+				MAX_RATES);
+			return 1;
+		}
+		rates[num_rates++] = rate;
+	}
+
+	/* the interpolation table doesn't depend on the rate */
+	add_wave(OSC_INTERP_SIZE, 1);
+	for (size_t r = 0; r < num_rates; r++) {
+		for (size_t c = 0; c < NUM_CARRIERS; c++) {
+			cycles = 1;
+			len = get_exact_period(rates[r], carrier_freqs[c],
+				&cycles);
+			if (len) add_wave(len, cycles);
+		}
+	}
+
+	f = fopen(argv[1], "w");
+	if (f == NULL) {
+		fprintf(stderr, "Could not open '%s'.\n", argv[1]);
+		return 1;
+	}
+
+	fprintf(f, "/* This file was automatically generated by "
+		"gen_tables. Do not edit. */\n\n");
+	fprintf(f, "#include \"common.h\"\n");
+	fprintf(f, "#include \"builtin_tables.h\"\n\n");
+
+	for (size_t i = 0; i < num_waves; i++) {
+		if (put_wave(f, waves[i].len, waves[i].cycles) < 0)
+			goto fail;
+	}
+	for (size_t r = 0; r < num_rates; r++) {
+		if (put_envelope(f, rates[r]) < 0) goto fail;
+	}
+
+	fprintf(f, "const struct builtin_wave_t builtin_waves[] = {\n");
+	for (size_t i = 0; i < num_waves; i++) {
+		fprintf(f, "\t{ %u, %u, sin_%u_%u, cos_%u_%u },\n",
+			waves[i].len, waves[i].cycles,
+			waves[i].len, waves[i].cycles,
+			waves[i].len, waves[i].cycles);
+	}
+	fprintf(f, "};\n\nconst size_t num_builtin_waves = %zu;\n\n",
+		num_waves);
+
+	/* an empty initializer isn't allowed, so there's always one */
+	fprintf(f, "const struct builtin_envelope_t builtin_envelopes[] = {\n");
+	if (num_rates == 0) fprintf(f, "\t{ 0, NULL, NULL, NULL },\n");
+	for (size_t r = 0; r < num_rates; r++) {
+		get_envelope_size(rates[r], &spb_num, &spb_den,
+			&max_bit_len);
+		fprintf(f, "\t{ %u, bit_len_%u, slices_%u, ", rates[r],
+			rates[r], rates[r]);
+		if (spb_den == 1) {
+			fprintf(f, "polyphase_%u },\n", rates[r]);
+		} else {
+			fprintf(f, "NULL },\n");
+		}
+	}
+	fprintf(f, "};\n\nconst size_t num_builtin_envelopes = %zu;\n",
+		num_rates);
+
+	if (fclose(f) != 0) {
+		remove(argv[1]);
+		return 1;
+	}
+	return 0;
+
+fail:
+	fprintf(stderr, "Out of memory.\n");
+	fclose(f);
+	remove(argv[1]);
+	return 1;
+}
@@ -37,7 +37,7 @@ extern int nanosleep(const struct timespec *req, struct timespec *rem);
 void msleep(unsigned long ms) {
 	struct timespec ts;
 	ts.tv_sec = ms / 1000ul;		/* whole seconds */
-	ts.tv_nsec = (ms % 1000ul) * 1000;	/* remainder, in nanoseconds */
+	ts.tv_nsec = (ms % 1000ul) * 1000000ul;	/* remainder, in nanoseconds */
 	nanosleep(&ts, NULL);
 }
 #endif
@@ -197,31 +197,113 @@ static uint16_t offset_words[] = {
 	0x350  /*  C' */
 };
 
+/*
+ * CRC lookup tables
+ *
+ * The RDS syndrome is linear, so the checkword of a block is the
+ * XOR of the checkwords of its upper and lower bytes. CRC-16 uses
+ * a slice-by-8 table set for RFT files.
+ */
+static uint16_t checkword_hi[256];
+static uint16_t checkword_lo[256];
+static uint16_t crc16_table[8][256];
+
+/* Classical bit-serial computation, used to fill the tables */
+static uint16_t calc_syndrome(uint16_t block) {
+	uint16_t block_crc = 0;
+	uint8_t bit, msb;
+
+	for (uint8_t j = 0; j < BLOCK_SIZE; j++) {
+		bit = (block & (INT16_15 >> j)) != 0;
+		msb = (block_crc >> (POLY_DEG - 1)) & 1;
+		block_crc <<= 1;
+		if (msb ^ bit) block_crc ^= POLY;
+	}
+
+	return block_crc & INT16_L10;
+}
+
+/*
+ * Fill the lookup tables
+ *
+ * Must be called before the first checkword or CRC is computed.
+ * It is safe to call this more than once.
+ */
+void init_crc_tables() {
+	static bool done;
+	uint16_t crc;
+
+	if (done) return;
+
+	for (uint16_t i = 0; i < 256; i++) {
+		checkword_hi[i] = calc_syndrome(i << 8);
+		checkword_lo[i] = calc_syndrome(i);
+
+		/* CRC-16 ITU-T/CCITT (x^16 + x^12 + x^5 + 1) */
+		crc = i << 8;
+		for (uint8_t j = 0; j < 8; j++)
+			crc = (crc & INT16_15) ? (crc << 1) ^ 0x1021 : crc << 1;
+		crc16_table[0][i] = crc;
+	}
+
+	/* table k advances a byte followed by k zero bytes */
+	for (uint16_t i = 0; i < 256; i++) {
+		crc = crc16_table[0][i];
+		for (uint8_t k = 1; k < 8; k++) {
+			crc = (crc << 8) ^ crc16_table[0][crc >> 8];
+			crc16_table[k][i] = crc;
+		}
+	}
+
+	done = true;
+}
+
 /* CRC-16 ITU-T/CCITT checkword calculation */
 uint16_t crc16(uint8_t *data, size_t len) {
 	uint16_t crc = 0xffff;
 
-	for (size_t i = 0; i < len; i++) {
-		crc = (crc >> 8) | (crc << 8);
-		crc ^= data[i];
-		crc ^= (crc & 0xff) >> 4;
-		crc ^= (crc << 8) << 4;
-		crc ^= ((crc & 0xff) << 4) << 1;
+	/* 8 bytes at a time */
+	for (; len >= 8; len -= 8, data += 8) {
+		crc = crc16_table[7][(crc >> 8) ^ data[0]] ^
+		      crc16_table[6][(crc & 0xff) ^ data[1]] ^
+		      crc16_table[5][data[2]] ^
+		      crc16_table[4][data[3]] ^
+		      crc16_table[3][data[4]] ^
+		      crc16_table[2][data[5]] ^
+		      crc16_table[1][data[6]] ^
+		      crc16_table[0][data[7]];
 	}
 
+	while (len--)
+		crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *data++];
+
 	return crc ^ 0xffff;
 }
 
-/* Calculate the checkword for each block and emit the bits */
+/* Pack one block and its checkword */
+static inline uint32_t encode_block(uint16_t block, uint16_t offset_word) {
+	uint16_t check;
+
+	check = checkword_hi[block >> 8] ^ checkword_lo[block & 0xff];
+	check ^= offset_word;
+
+	return (uint32_t)block << POLY_DEG | check;
+}
+
+/*
+ * Calculate the checkword for each block
+ *
+ * Each block is packed into one word with its 16 data bits followed
+ * by the 10 checkword bits. The first bit to send is bit 25.
+ */
 #ifdef RDS2
-void add_checkwords(uint16_t *blocks, uint8_t *bits, bool rds2)
+void add_checkwords(uint16_t *blocks, uint32_t *bits, bool rds2)
 #else
-void add_checkwords(uint16_t *blocks, uint8_t *bits)
+void add_checkwords(uint16_t *blocks, uint32_t *bits)
 #endif
 {
-	size_t i, j;
-	uint8_t bit, msb;
-	uint16_t block, block_crc, check, offset_word;
+	size_t i;
+	uint16_t offset_word;
 	bool group_type_b = false;
 #ifdef RDS2
 	bool tunneling_type_b = false;
@@ -258,24 +340,29 @@ void add_checkwords(uint16_t *blocks, uint8_t *bits)
 			offset_word = offset_words[i];
 		}
 
-		block = blocks[i];
-
-		/* Classical CRC computation */
-		block_crc = 0;
-		for (j = 0; j < BLOCK_SIZE; j++) {
-			bit = (block & (INT16_15 >> j)) != 0;
-			msb = (block_crc >> (POLY_DEG - 1)) & 1;
-			block_crc <<= 1;
-			if (msb ^ bit) block_crc ^= POLY;
-			*bits++ = bit;
-		}
-		check = block_crc ^ offset_word;
-		for (j = 0; j < POLY_DEG; j++) {
-			*bits++ = (check & ((1 << (POLY_DEG - 1)) >> j)) != 0;
-		}
+		bits[i] = encode_block(blocks[i], offset_word);
 	}
 }
 
+/*
+ * Find the offset word of a received block
+ *
+ * Returns the index into offset_words (0-3 for A-D, 4 for C') or -1
+ * if the checkword matches none of them. Errors are not corrected.
+ */
+int8_t get_block_offset(uint32_t block) {
+	uint16_t data = block >> POLY_DEG;
+	uint16_t check;
+
+	check = checkword_hi[data >> 8] ^ checkword_lo[data & 0xff];
+	check ^= block & INT16_L10;
+
+	for (int8_t i = 0; i < 5; i++)
+		if (check == offset_words[i]) return i;
+
+	return -1;
+}
+
 #ifdef RBDS
 /*
  * PI code calculator
@@ -417,203 +504,270 @@ char *show_af_list(struct rds_af_t af_list) {
 
 	return outstr;
 }
-
 /*
  * UTF-8 to RDS char set converter
  *
  * Translates certain chars into their RDS equivalents
  * NOTE!! Only applies to PS and RT. ERT uses UTF-8 (SCB = 1)
  *
+ * Every char of the RDS set beyond ASCII is a two byte UTF-8 sequence,
+ * so the table is looked up by the lead byte and then by the low six
+ * bits of the continuation byte. 0 means there is no RDS equivalent.
  */
-#define XLATSTRLEN	255
-unsigned char *xlat(unsigned char *str) {
-	static unsigned char new_str[XLATSTRLEN];
-	uint8_t i = 0;
-
-	while (*str != 0 && i < XLATSTRLEN) {
-		switch (*str) {
-		case 0xc2:
-			str++;
-			switch (*str) {
-			case 0xa1: new_str[i] = 0x8e; break; /* INVERTED EXCLAMATION MARK */
-			case 0xa3: new_str[i] = 0xaa; break; /* POUND SIGN */
-			case 0xa7: new_str[i] = 0xbf; break; /* SECTION SIGN */
-			case 0xa9: new_str[i] = 0xa2; break; /* COPYRIGHT SIGN */
-			case 0xaa: new_str[i] = 0xa0; break; /* FEMININE ORDINAL INDICATOR */
-			case 0xb0: new_str[i] = 0xbb; break; /* DEGREE SIGN */
-			case 0xb1: new_str[i] = 0xb4; break; /* PLUS-MINUS SIGN */
-			case 0xb2: new_str[i] = 0xb2; break; /* SUPERSCRIPT TWO */
-			case 0xb3: new_str[i] = 0xb3; break; /* SUPERSCRIPT THREE */
-			case 0xb5: new_str[i] = 0xb8; break; /* MIKRO SIGN */
-			case 0xb9: new_str[i] = 0xb1; break; /* SUPERSCRIPT ONE */
-			case 0xba: new_str[i] = 0xb0; break; /* MASCULINE ORDINAL INDICATOR */
-			case 0xbc: new_str[i] = 0xbc; break; /* VULGAR FRACTION ONE QUARTER */
-			case 0xbd: new_str[i] = 0xbd; break; /* VULGAR FRACTION ONE HALF */
-			case 0xbe: new_str[i] = 0xbe; break; /* VULGAR FRACTION THREE QUARTERS */
-			case 0xbf: new_str[i] = 0xb9; break; /* INVERTED QUESTION MARK */
-			default: new_str[i] = ' '; break;
-			}
-			break;
+static const uint8_t xlat_c2[64] = {
+	[0x21] = 0x8e, /* U+00A1 INVERTED EXCLAMATION MARK */
+	[0x23] = 0xaa, /* U+00A3 POUND SIGN */
+	[0x27] = 0xbf, /* U+00A7 SECTION SIGN */
+	[0x29] = 0xa2, /* U+00A9 COPYRIGHT SIGN */
+	[0x2a] = 0xa0, /* U+00AA FEMININE ORDINAL INDICATOR */
+	[0x30] = 0xbb, /* U+00B0 DEGREE SIGN */
+	[0x31] = 0xb4, /* U+00B1 PLUS-MINUS SIGN */
+	[0x32] = 0xb2, /* U+00B2 SUPERSCRIPT TWO */
+	[0x33] = 0xb3, /* U+00B3 SUPERSCRIPT THREE */
+	[0x35] = 0xb8, /* U+00B5 MIKRO SIGN */
+	[0x39] = 0xb1, /* U+00B9 SUPERSCRIPT ONE */
+	[0x3a] = 0xb0, /* U+00BA MASCULINE ORDINAL INDICATOR */
+	[0x3c] = 0xbc, /* U+00BC VULGAR FRACTION ONE QUARTER */
+	[0x3d] = 0xbd, /* U+00BD VULGAR FRACTION ONE HALF */
+	[0x3e] = 0xbe, /* U+00BE VULGAR FRACTION THREE QUARTERS */
+	[0x3f] = 0xb9, /* U+00BF INVERTED QUESTION MARK */
+};
 
-		case 0xc3:
-			str++;
-			switch (*str) {
-			case 0x80: new_str[i] = 0xc1; break; /* LATIN CAPITAL LETTER A WITH GRAVE */
-			case 0x81: new_str[i] = 0xc0; break; /* LATIN CAPITAL LETTER A WITH ACUTE */
-			case 0x82: new_str[i] = 0xd0; break; /* LATIN CAPITAL LETTER A WITH CIRCUMFLEX */
-			case 0x83: new_str[i] = 0xe0; break; /* LATIN CAPITAL LETTER A WITH TILDE */
-			case 0x84: new_str[i] = 0xd1; break; /* LATIN CAPITAL LETTER A WITH DIAERESIS */
-			case 0x85: new_str[i] = 0xe1; break; /* LATIN CAPITAL LETTER A WITH RING ABOVE */
-			case 0x86: new_str[i] = 0xe2; break; /* LATIN CAPITAL LETTER AE */
-			case 0x87: new_str[i] = 0x8b; break; /* LATIN CAPITAL LETTER C WITH CEDILLA */
-			case 0x88: new_str[i] = 0xc3; break; /* LATIN CAPITAL LETTER E WITH GRAVE */
-			case 0x89: new_str[i] = 0xc2; break; /* LATIN CAPITAL LETTER E WITH ACUTE */
-			case 0x8a: new_str[i] = 0xd2; break; /* LATIN CAPITAL LETTER E WITH CIRCUMFLEX */
-			case 0x8b: new_str[i] = 0xd3; break; /* LATIN CAPITAL LETTER E WITH DIAERESIS */
-			case 0x8c: new_str[i] = 0xc5; break; /* LATIN CAPITAL LETTER I WITH GRAVE */
-			case 0x8d: new_str[i] = 0xc4; break; /* LATIN CAPITAL LETTER I WITH ACUTE */
-			case 0x8e: new_str[i] = 0xd4; break; /* LATIN CAPITAL LETTER I WITH CIRCUMFLEX */
-			case 0x8f: new_str[i] = 0xd5; break; /* LATIN CAPITAL LETTER I WITH DIAERESIS */
-			case 0x90: new_str[i] = 0xce; break; /* LATIN CAPITAL LETTER ETH */
-			case 0x91: new_str[i] = 0x8a; break; /* LATIN CAPITAL LETTER N WITH TILDE */
-			case 0x92: new_str[i] = 0xc7; break; /* LATIN CAPITAL LETTER O WITH GRAVE */
-			case 0x93: new_str[i] = 0xc6; break; /* LATIN CAPITAL LETTER O WITH ACUTE */
-			case 0x94: new_str[i] = 0xd6; break; /* LATIN CAPITAL LETTER O WITH CIRCUMFLEX */
-			case 0x95: new_str[i] = 0xe6; break; /* LATIN CAPITAL LETTER O WITH TILDE */
-			case 0x96: new_str[i] = 0xd7; break; /* LATIN CAPITAL LETTER O WITH DIAERESIS */
-			case 0x98: new_str[i] = 0xe7; break; /* LATIN CAPITAL LETTER O WITH STROKE */
-			case 0x99: new_str[i] = 0xc9; break; /* LATIN CAPITAL LETTER U WITH GRAVE */
-			case 0x9a: new_str[i] = 0xc8; break; /* LATIN CAPITAL LETTER U WITH ACUTE */
-			case 0x9b: new_str[i] = 0xd8; break; /* LATIN CAPITAL LETTER U WITH CIRCUMFLEX */
-			case 0x9c: new_str[i] = 0xd9; break; /* LATIN CAPITAL LETTER U WITH DIAERESIS */
-			case 0x9d: new_str[i] = 0xe5; break; /* LATIN CAPITAL LETTER Y WITH ACUTE */
-			case 0x9e: new_str[i] = 0xe8; break; /* LATIN CAPITAL LETTER THORN */
-			case 0xa0: new_str[i] = 0x81; break; /* LATIN SMALL LETTER A WITH GRAVE */
-			case 0xa1: new_str[i] = 0x80; break; /* LATIN SMALL LETTER A WITH ACUTE */
-			case 0xa2: new_str[i] = 0x90; break; /* LATIN SMALL LETTER A WITH CIRCUMFLEX */
-			case 0xa3: new_str[i] = 0xf0; break; /* LATIN SMALL LETTER A WITH TILDE */
-			case 0xa4: new_str[i] = 0x91; break; /* LATIN SMALL LETTER A WITH DIAERESIS */
-			case 0xa5: new_str[i] = 0xf1; break; /* LATIN SMALL LETTER A WITH RING ABOVE */
-			case 0xa6: new_str[i] = 0xf2; break; /* LATIN SMALL LETTER AE */
-			case 0xa7: new_str[i] = 0x9b; break; /* LATIN SMALL LETTER C WITH CEDILLA */
-			case 0xa8: new_str[i] = 0x83; break; /* LATIN SMALL LETTER E WITH GRAVE */
-			case 0xa9: new_str[i] = 0x82; break; /* LATIN SMALL LETTER E WITH ACUTE */
-			case 0xaa: new_str[i] = 0x92; break; /* LATIN SMALL LETTER E WITH CIRCUMFLEX */
-			case 0xab: new_str[i] = 0x93; break; /* LATIN SMALL LETTER E WITH DIAERESIS */
-			case 0xac: new_str[i] = 0x85; break; /* LATIN SMALL LETTER I WITH GRAVE */
-			case 0xad: new_str[i] = 0x84; break; /* LATIN SMALL LETTER I WITH ACUTE */
-			case 0xae: new_str[i] = 0x94; break; /* LATIN SMALL LETTER I WITH CIRCUMFLEX */
-			case 0xaf: new_str[i] = 0x95; break; /* LATIN SMALL LETTER I WITH DIAERESIS */
-			case 0xb0: new_str[i] = 0xef; break; /* LATIN SMALL LETTER ETH */
-			case 0xb1: new_str[i] = 0x9a; break; /* LATIN SMALL LETTER N WITH TILDE */
-			case 0xb2: new_str[i] = 0x87; break; /* LATIN SMALL LETTER O WITH GRAVE */
-			case 0xb3: new_str[i] = 0x86; break; /* LATIN SMALL LETTER O WITH ACUTE */
-			case 0xb4: new_str[i] = 0x96; break; /* LATIN SMALL LETTER O WITH CIRCUMFLEX */
-			case 0xb5: new_str[i] = 0xf6; break; /* LATIN SMALL LETTER O WITH TILDE */
-			case 0xb6: new_str[i] = 0x97; break; /* LATIN SMALL LETTER O WITH DIAERESIS */
-			case 0xb7: new_str[i] = 0xba; break; /* DIVISION SIGN */
-			case 0xb8: new_str[i] = 0xf7; break; /* LATIN SMALL LETTER O WITH STROKE */
-			case 0xb9: new_str[i] = 0x89; break; /* LATIN SMALL LETTER U WITH GRAVE */
-			case 0xba: new_str[i] = 0x88; break; /* LATIN SMALL LETTER U WITH ACUTE */
-			case 0xbb: new_str[i] = 0x98; break; /* LATIN SMALL LETTER U WITH CIRCUMFLEX */
-			case 0xbc: new_str[i] = 0x99; break; /* LATIN SMALL LETTER U WITH DIAERESIS */
-			case 0xbd: new_str[i] = 0xf5; break; /* LATIN SMALL LETTER Y WITH ACUTE */
-			case 0xbe: new_str[i] = 0xf8; break; /* LATIN SMALL LETTER THORN */
-			default: new_str[i] = ' '; break;
-			}
-			break;
+static const uint8_t xlat_c3[64] = {
+	[0x00] = 0xc1, /* U+00C0 LATIN CAPITAL LETTER A WITH GRAVE */
+	[0x01] = 0xc0, /* U+00C1 LATIN CAPITAL LETTER A WITH ACUTE */
+	[0x02] = 0xd0, /* U+00C2 LATIN CAPITAL LETTER A WITH CIRCUMFLEX */
+	[0x03] = 0xe0, /* U+00C3 LATIN CAPITAL LETTER A WITH TILDE */
+	[0x04] = 0xd1, /* U+00C4 LATIN CAPITAL LETTER A WITH DIAERESIS */
+	[0x05] = 0xe1, /* U+00C5 LATIN CAPITAL LETTER A WITH RING ABOVE */
+	[0x06] = 0xe2, /* U+00C6 LATIN CAPITAL LETTER AE */
+	[0x07] = 0x8b, /* U+00C7 LATIN CAPITAL LETTER C WITH CEDILLA */
+	[0x08] = 0xc3, /* U+00C8 LATIN CAPITAL LETTER E WITH GRAVE */
+	[0x09] = 0xc2, /* U+00C9 LATIN CAPITAL LETTER E WITH ACUTE */
+	[0x0a] = 0xd2, /* U+00CA LATIN CAPITAL LETTER E WITH CIRCUMFLEX */
+	[0x0b] = 0xd3, /* U+00CB LATIN CAPITAL LETTER E WITH DIAERESIS */
+	[0x0c] = 0xc5, /* U+00CC LATIN CAPITAL LETTER I WITH GRAVE */
+	[0x0d] = 0xc4, /* U+00CD LATIN CAPITAL LETTER I WITH ACUTE */
+	[0x0e] = 0xd4, /* U+00CE LATIN CAPITAL LETTER I WITH CIRCUMFLEX */
+	[0x0f] = 0xd5, /* U+00CF LATIN CAPITAL LETTER I WITH DIAERESIS */
+	[0x10] = 0xce, /* U+00D0 LATIN CAPITAL LETTER ETH */
+	[0x11] = 0x8a, /* U+00D1 LATIN CAPITAL LETTER N WITH TILDE */
+	[0x12] = 0xc7, /* U+00D2 LATIN CAPITAL LETTER O WITH GRAVE */
+	[0x13] = 0xc6, /* U+00D3 LATIN CAPITAL LETTER O WITH ACUTE */
+	[0x14] = 0xd6, /* U+00D4 LATIN CAPITAL LETTER O WITH CIRCUMFLEX */
+	[0x15] = 0xe6, /* U+00D5 LATIN CAPITAL LETTER O WITH TILDE */
+	[0x16] = 0xd7, /* U+00D6 LATIN CAPITAL LETTER O WITH DIAERESIS */
+	[0x18] = 0xe7, /* U+00D8 LATIN CAPITAL LETTER O WITH STROKE */
+	[0x19] = 0xc9, /* U+00D9 LATIN CAPITAL LETTER U WITH GRAVE */
+	[0x1a] = 0xc8, /* U+00DA LATIN CAPITAL LETTER U WITH ACUTE */
+	[0x1b] = 0xd8, /* U+00DB LATIN CAPITAL LETTER U WITH CIRCUMFLEX */
+	[0x1c] = 0xd9, /* U+00DC LATIN CAPITAL LETTER U WITH DIAERESIS */
+	[0x1d] = 0xe5, /* U+00DD LATIN CAPITAL LETTER Y WITH ACUTE */
+	[0x1e] = 0xe8, /* U+00DE LATIN CAPITAL LETTER THORN */
+	[0x20] = 0x81, /* U+00E0 LATIN SMALL LETTER A WITH GRAVE */
+	[0x21] = 0x80, /* U+00E1 LATIN SMALL LETTER A WITH ACUTE */
+	[0x22] = 0x90, /* U+00E2 LATIN SMALL LETTER A WITH CIRCUMFLEX */
+	[0x23] = 0xf0, /* U+00E3 LATIN SMALL LETTER A WITH TILDE */
+	[0x24] = 0x91, /* U+00E4 LATIN SMALL LETTER A WITH DIAERESIS */
+	[0x25] = 0xf1, /* U+00E5 LATIN SMALL LETTER A WITH RING ABOVE */
+	[0x26] = 0xf2, /* U+00E6 LATIN SMALL LETTER AE */
+	[0x27] = 0x9b, /* U+00E7 LATIN SMALL LETTER C WITH CEDILLA */
+	[0x28] = 0x83, /* U+00E8 LATIN SMALL LETTER E WITH GRAVE */
+	[0x29] = 0x82, /* U+00E9 LATIN SMALL LETTER E WITH ACUTE */
+	[0x2a] = 0x92, /* U+00EA LATIN SMALL LETTER E WITH CIRCUMFLEX */
+	[0x2b] = 0x93, /* U+00EB LATIN SMALL LETTER E WITH DIAERESIS */
+	[0x2c] = 0x85, /* U+00EC LATIN SMALL LETTER I WITH GRAVE */
+	[0x2d] = 0x84, /* U+00ED LATIN SMALL LETTER I WITH ACUTE */
+	[0x2e] = 0x94, /* U+00EE LATIN SMALL LETTER I WITH CIRCUMFLEX */
+	[0x2f] = 0x95, /* U+00EF LATIN SMALL LETTER I WITH DIAERESIS */
+	[0x30] = 0xef, /* U+00F0 LATIN SMALL LETTER ETH */
+	[0x31] = 0x9a, /* U+00F1 LATIN SMALL LETTER N WITH TILDE */
+	[0x32] = 0x87, /* U+00F2 LATIN SMALL LETTER O WITH GRAVE */
+	[0x33] = 0x86, /* U+00F3 LATIN SMALL LETTER O WITH ACUTE */
+	[0x34] = 0x96, /* U+00F4 LATIN SMALL LETTER O WITH CIRCUMFLEX */
+	[0x35] = 0xf6, /* U+00F5 LATIN SMALL LETTER O WITH TILDE */
+	[0x36] = 0x97, /* U+00F6 LATIN SMALL LETTER O WITH DIAERESIS */
+	[0x37] = 0xba, /* U+00F7 DIVISION SIGN */
+	[0x38] = 0xf7, /* U+00F8 LATIN SMALL LETTER O WITH STROKE */
+	[0x39] = 0x89, /* U+00F9 LATIN SMALL LETTER U WITH GRAVE */
+	[0x3a] = 0x88, /* U+00FA LATIN SMALL LETTER U WITH ACUTE */
+	[0x3b] = 0x98, /* U+00FB LATIN SMALL LETTER U WITH CIRCUMFLEX */
+	[0x3c] = 0x99, /* U+00FC LATIN SMALL LETTER U WITH DIAERESIS */
+	[0x3d] = 0xf5, /* U+00FD LATIN SMALL LETTER Y WITH ACUTE */
+	[0x3e] = 0xf8, /* U+00FE LATIN SMALL LETTER THORN */
+};
 
-		case 0xc4:
-			str++;
-			switch (*str) {
-			case 0x87: new_str[i] = 0xfb; break; /* LATIN SMALL LETTER C WITH ACUTE */
-			case 0x8c: new_str[i] = 0xcb; break; /* LATIN CAPITAL LETTER C WITH CARON */
-			case 0x8d: new_str[i] = 0xdb; break; /* LATIN SMALL LETTER C WITH CARON */
-			case 0x91: new_str[i] = 0xde; break; /* LATIN SMALL LETTER D WITH STROKE */
-			case 0x9b: new_str[i] = 0xa5; break; /* LATIN SMALL LETTER E WITH CARON */
-			case 0xb0: new_str[i] = 0xb5; break; /* LATIN CAPITAL LETTER I WITH DOT ABOVE */
-			case 0xb1: new_str[i] = 0x9f; break; /* LATIN SMALL LETTER DOTLESS I */
-			case 0xb2: new_str[i] = 0x8f; break; /* LATIN CAPITAL LIGATURE IJ */
-			case 0xb3: new_str[i] = 0x9f; break; /* LATIN SMALL LIGATURE IJ */
-			case 0xbf: new_str[i] = 0xcf; break; /* LATIN CAPITAL LETTER L WITH MIDDLE DOT */
-			default: new_str[i] = ' '; break;
-			}
-			break;
+static const uint8_t xlat_c4[64] = {
+	[0x07] = 0xfb, /* U+0107 LATIN SMALL LETTER C WITH ACUTE */
+	[0x0c] = 0xcb, /* U+010C LATIN CAPITAL LETTER C WITH CARON */
+	[0x0d] = 0xdb, /* U+010D LATIN SMALL LETTER C WITH CARON */
+	[0x11] = 0xde, /* U+0111 LATIN SMALL LETTER D WITH STROKE */
+	[0x1b] = 0xa5, /* U+011B LATIN SMALL LETTER E WITH CARON */
+	[0x30] = 0xb5, /* U+0130 LATIN CAPITAL LETTER I WITH DOT ABOVE */
+	[0x31] = 0x9f, /* U+0131 LATIN SMALL LETTER DOTLESS I */
+	[0x32] = 0x8f, /* U+0132 LATIN CAPITAL LIGATURE IJ */
+	[0x33] = 0x9f, /* U+0133 LATIN SMALL LIGATURE IJ */
+	[0x3f] = 0xcf, /* U+013F LATIN CAPITAL LETTER L WITH MIDDLE DOT */
+};
 
-		case 0xc5:
-			str++;
-			switch (*str) {
-			case 0x80: new_str[i] = 0xdf; break; /* LATIN SMALL LETTER L WITH MIDDLE DOT */
-			case 0x84: new_str[i] = 0xb6; break; /* LATIN SMALL LETTER N WITH ACUTE */
-			case 0x88: new_str[i] = 0xa6; break; /* LATIN SMALL LETTER N WITH CARON */
-			case 0x8a: new_str[i] = 0xe9; break; /* LATIN CAPITAL LETTER ENG */
-			case 0x8b: new_str[i] = 0xf9; break; /* LATIN SMALL LETTER ENG */
-			case 0x91: new_str[i] = 0xa7; break; /* LATIN SMALL LETTER O WITH DOUBLE ACUTE */
-			case 0x92: new_str[i] = 0xe3; break; /* LATIN CAPITAL LIGATURE OE */
-			case 0x93: new_str[i] = 0xf3; break; /* LATIN SMALL LIGATURE OE */
-			case 0x94: new_str[i] = 0xea; break; /* LATIN CAPITAL LETTER R WITH ACUTE */
-			case 0x95: new_str[i] = 0xfa; break; /* LATIN SMALL LETTER R WITH ACUTE */
-			case 0x98: new_str[i] = 0xca; break; /* LATIN CAPITAL LETTER R WITH CARON */
-			case 0x99: new_str[i] = 0xda; break; /* LATIN SMALL LETTER R WITH CARON */
-			case 0x9a: new_str[i] = 0xec; break; /* LATIN CAPITAL LETTER S WITH ACUTE */
-			case 0x9b: new_str[i] = 0xfc; break; /* LATIN SMALL LETTER S WITH ACUTE */
-			case 0x9e: new_str[i] = 0x8c; break; /* LATIN CAPITAL LETTER S WITH CEDILLA */
-			case 0x9f: new_str[i] = 0x9c; break; /* LATIN SMALL LETTER S WITH CEDILLA */
-			case 0xa0: new_str[i] = 0xcc; break; /* LATIN CAPITAL LETTER S WITH CARON */
-			case 0xa1: new_str[i] = 0xdc; break; /* LATIN SMALL LETTER S WITH CARON */
-			case 0xa6: new_str[i] = 0xee; break; /* LATIN CAPITAL LETTER T WITH STROKE */
-			case 0xa7: new_str[i] = 0xfe; break; /* LATIN SMALL LETTER T WITH STROKE */
-			case 0xb1: new_str[i] = 0xb7; break; /* LATIN SMALL LETTER U WITH DOUBLE ACUTE */
-			case 0xb5: new_str[i] = 0xf4; break; /* LATIN SMALL LETTER W WITH CIRCUMFLEX */
-			case 0xb7: new_str[i] = 0xe4; break; /* LATIN SMALL LETTER Y WITH CIRCUMFLEX */
-			case 0xb9: new_str[i] = 0xed; break; /* LATIN CAPITAL LETTER Z WITH ACUTE */
-			case 0xba: new_str[i] = 0xfd; break; /* LATIN SMALL LETTER Z WITH ACUTE */
-			case 0xbd: new_str[i] = 0xcd; break; /* LATIN CAPITAL LETTER Z WITH CARON */
-			case 0xbe: new_str[i] = 0xdd; break; /* LATIN SMALL LETTER Z WITH CARON */
-			default: new_str[i] = ' '; break;
-			}
-			break;
+static const uint8_t xlat_c5[64] = {
+	[0x00] = 0xdf, /* U+0140 LATIN SMALL LETTER L WITH MIDDLE DOT */
+	[0x04] = 0xb6, /* U+0144 LATIN SMALL LETTER N WITH ACUTE */
+	[0x08] = 0xa6, /* U+0148 LATIN SMALL LETTER N WITH CARON */
+	[0x0a] = 0xe9, /* U+014A LATIN CAPITAL LETTER ENG */
+	[0x0b] = 0xf9, /* U+014B LATIN SMALL LETTER ENG */
+	[0x11] = 0xa7, /* U+0151 LATIN SMALL LETTER O WITH DOUBLE ACUTE */
+	[0x12] = 0xe3, /* U+0152 LATIN CAPITAL LIGATURE OE */
+	[0x13] = 0xf3, /* U+0153 LATIN SMALL LIGATURE OE */
+	[0x14] = 0xea, /* U+0154 LATIN CAPITAL LETTER R WITH ACUTE */
+	[0x15] = 0xfa, /* U+0155 LATIN SMALL LETTER R WITH ACUTE */
+	[0x18] = 0xca, /* U+0158 LATIN CAPITAL LETTER R WITH CARON */
+	[0x19] = 0xda, /* U+0159 LATIN SMALL LETTER R WITH CARON */
+	[0x1a] = 0xec, /* U+015A LATIN CAPITAL LETTER S WITH ACUTE */
+	[0x1b] = 0xfc, /* U+015B LATIN SMALL LETTER S WITH ACUTE */
+	[0x1e] = 0x8c, /* U+015E LATIN CAPITAL LETTER S WITH CEDILLA */
+	[0x1f] = 0x9c, /* U+015F LATIN SMALL LETTER S WITH CEDILLA */
+	[0x20] = 0xcc, /* U+0160 LATIN CAPITAL LETTER S WITH CARON */
+	[0x21] = 0xdc, /* U+0161 LATIN SMALL LETTER S WITH CARON */
+	[0x26] = 0xee, /* U+0166 LATIN CAPITAL LETTER T WITH STROKE */
+	[0x27] = 0xfe, /* U+0167 LATIN SMALL LETTER T WITH STROKE */
+	[0x31] = 0xb7, /* U+0171 LATIN SMALL LETTER U WITH DOUBLE ACUTE */
+	[0x35] = 0xf4, /* U+0175 LATIN SMALL LETTER W WITH CIRCUMFLEX */
+	[0x37] = 0xe4, /* U+0177 LATIN SMALL LETTER Y WITH CIRCUMFLEX */
+	[0x39] = 0xed, /* U+0179 LATIN CAPITAL LETTER Z WITH ACUTE */
+	[0x3a] = 0xfd, /* U+017A LATIN SMALL LETTER Z WITH ACUTE */
+	[0x3d] = 0xcd, /* U+017D LATIN CAPITAL LETTER Z WITH CARON */
+	[0x3e] = 0xdd, /* U+017E LATIN SMALL LETTER Z WITH CARON */
+};
 
-		case 0xc7:
-			str++;
-			switch (*str) {
-			case 0xa6: new_str[i] = 0xa4; break; /* LATIN CAPITAL LETTER G WITH CARON */
-			case 0xa7: new_str[i] = 0x9d; break; /* LATIN SMALL LETTER G WITH CARON */
-			default: new_str[i] = ' '; break;
-			}
-			break;
+static const uint8_t xlat_c7[64] = {
+	[0x26] = 0xa4, /* U+01E6 LATIN CAPITAL LETTER G WITH CARON */
+	[0x27] = 0x9d, /* U+01E7 LATIN SMALL LETTER G WITH CARON */
+};
 
-		case 0xce:
-			str++;
-			switch (*str) {
-			case 0xb1: new_str[i] = 0xa1; break; /* GREEK SMALL LETTER ALPHA */
-			case 0xb2: new_str[i] = 0x8d; break; /* GREEK SMALL LETTER BETA */
-			default: new_str[i] = ' '; break;
-			}
-			break;
+static const uint8_t xlat_ce[64] = {
+	[0x31] = 0xa1, /* U+03B1 GREEK SMALL LETTER ALPHA */
+	[0x32] = 0x8d, /* U+03B2 GREEK SMALL LETTER BETA */
+};
+
+static const uint8_t xlat_cf[64] = {
+	[0x00] = 0xa8, /* U+03C0 GREEK SMALL LETTER PI */
+};
+
+static const uint8_t *const xlat_pages[32] = {
+	[0x02] = xlat_c2, [0x03] = xlat_c3, [0x04] = xlat_c4,
+	[0x05] = xlat_c5, [0x07] = xlat_c7, [0x0e] = xlat_ce,
+	[0x0f] = xlat_cf
+};
+
+/* length of the UTF-8 sequence starting with c, 0 if c can't start one */
+static uint8_t utf8_seq_len(unsigned char c) {
+	if (c < 0x80) return 1;
+	if (c < 0xc2) return 0;
+	if (c < 0xe0) return 2;
+	if (c < 0xf0) return 3;
+	if (c < 0xf5) return 4;
+	return 0;
+}
+
+/* all continuation bytes are there (stops at the NUL) */
+static bool is_utf8_seq(const unsigned char *str, uint8_t len) {
+	uint8_t i;
+
+	for (i = 1; i < len; i++)
+		if ((str[i] & 0xc0) != 0x80) return false;
+	return true;
+}
 
-		case 0xcf:
-			str++;
-			switch (*str) {
-			case 0x80: new_str[i] = 0xa8; break; /* GREEK SMALL LETTER PI */
-			default: new_str[i] = ' '; break;
+/*
+ * ASCII runs are copied a word at a time
+ *
+ * A word can be copied as it is if no byte has the high bit set and,
+ * for the RDS set, no byte is a '$'.
+ */
+#define XLAT_WORD	sizeof(uint64_t)
+static bool is_ascii_word(uint64_t v, bool to_rds) {
+	const uint64_t ones = 0x0101010101010101ULL;
+	uint64_t d = v ^ (ones * '$');
+
+	if (to_rds) v |= (d - ones) & ~d; /* sets the high bit of a '$' */
+	return !(v & (ones * 0x80));
+}
+
+static size_t transcode(const unsigned char *str, unsigned char *out,
+	size_t size, bool to_rds) {
+	size_t len = strlen((const char *)str);
+	size_t i = 0, o = 0;
+	const uint8_t *page;
+	uint64_t word;
+	uint8_t n;
+
+	while (i < len && o < size) {
+		if (i + XLAT_WORD <= len && o + XLAT_WORD <= size) {
+			memcpy(&word, str + i, XLAT_WORD);
+			if (is_ascii_word(word, to_rds)) {
+				memcpy(out + o, &word, XLAT_WORD);
+				i += XLAT_WORD;
+				o += XLAT_WORD;
+				continue;
 			}
-			break;
+		}
+
+		n = utf8_seq_len(str[i]);
+		if (n == 1) {
+			out[o++] = (to_rds && str[i] == '$') ? 0xab : str[i];
+			i++;
+			continue;
+		}
 
-		default: /* 0-127 or unknown */
-			switch (*str) {
-			case '$': new_str[i] = 0xab; break; /* DOLLAR SIGN */
-			default: new_str[i] = *str; break;
+		if (n == 0 || !is_utf8_seq(str + i, n)) {
+			if (to_rds) {
+				/* not UTF-8, pass the byte on */
+				out[o++] = str[i++];
+				continue;
 			}
-			break;
+			/* a sequence cut short by the end is dropped */
+			if (n && i + n > len) break;
+			out[o++] = '?';
+			i++;
+			continue;
+		}
+
+		if (!to_rds) {
+			/* keep chars whole */
+			if (o + n > size) break;
+			memmove(out + o, str + i, n);
+			i += n;
+			o += n;
+			continue;
 		}
 
-		i++;
-		str++;
+		page = n == 2 ? xlat_pages[str[i] & 0x1f] : NULL;
+		out[o] = page ? page[str[i + 1] & 0x3f] : 0;
+		if (!out[o]) out[o] = ' ';
+		i += n;
+		o++;
 	}
 
-	new_str[i] = 0;
-	return new_str;
+	if (o < size) out[o] = 0;
+	return o;
+}
+
+/*
+ * Writes at most size bytes to out, which may be str itself since the
+ * result is never longer. It is NUL terminated if there is room, so a
+ * fixed length field can be filled in full. Returns the number of chars.
+ */
+size_t xlat(const unsigned char *str, unsigned char *out, size_t size) {
+	return transcode(str, out, size, true);
+}
+
+/*
+ * The same for eRT, which is sent as UTF-8: malformed bytes become '?'
+ * and a char is never split at the end.
+ */
+size_t xlat_ert(const unsigned char *str, unsigned char *out, size_t size) {
+	return transcode(str, out, size, false);
 }
 
 /*
@@ -24,16 +24,21 @@ extern uint8_t get_pty_code(char *pty_str);
 extern char *get_pty_str(uint8_t pty_code);
 extern uint8_t get_rtp_tag_id(char *rtp_tag_name);
 extern char *get_rtp_tag_name(uint8_t rtp_tag);
+extern void init_crc_tables();
 #ifdef RDS2
-extern void add_checkwords(uint16_t *blocks, uint8_t *bits, bool rds2);
+extern void add_checkwords(uint16_t *blocks, uint32_t *bits, bool rds2);
 #else
-extern void add_checkwords(uint16_t *blocks, uint8_t *bits);
+extern void add_checkwords(uint16_t *blocks, uint32_t *bits);
 #endif
+extern int8_t get_block_offset(uint32_t block);
 extern uint16_t callsign2pi(unsigned char *callsign);
 extern uint8_t add_rds_af(struct rds_af_t *af_list, float freq);
 extern char *show_af_list(struct rds_af_t af_list);
 extern uint16_t crc16(uint8_t *data, size_t len);
-extern unsigned char *xlat(unsigned char *str);
+extern size_t xlat(const unsigned char *str, unsigned char *out,
+	size_t size);
+extern size_t xlat_ert(const unsigned char *str, unsigned char *out,
+	size_t size);
 
 /* TMC */
 extern uint16_t tmc_encrypt(uint16_t loc, uint16_t key);
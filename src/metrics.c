@@ -0,0 +1,662 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* for clock_gettime() */
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include "rds.h"
+#ifdef RDS2
+#include "rds2.h"
+#endif
+#include "modulator.h"
+#include "rds_decoder.h"
+#include "metrics.h"
+
+static struct station_metrics_t registry[MAX_METRICS_STATIONS];
+
+/* monotonic, so setting the clock doesn't show up in the times */
+uint64_t metrics_now_ns() {
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000u +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000u /
+		(uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t metrics_since_ns(uint64_t start) {
+	return metrics_now_ns() - start;
+}
+
+void metrics_add(atomic_uint_fast64_t *counter, uint64_t n) {
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+void metrics_set(atomic_uint_fast64_t *gauge, uint64_t v) {
+	atomic_store_explicit(gauge, v, memory_order_relaxed);
+}
+
+static uint64_t get(atomic_uint_fast64_t *v) {
+	return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+void metrics_record(struct metrics_hist_t *hist, uint64_t ns) {
+	uint64_t us = ns / 1000;
+	uint64_t max;
+	uint8_t i = 0;
+
+	while (i < METRICS_HIST_BUCKETS - 1 && (1ull << i) < us) i++;
+
+	metrics_add(&hist->buckets[i], 1);
+	metrics_add(&hist->count, 1);
+	metrics_add(&hist->sum_ns, ns);
+
+	max = get(&hist->max_ns);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(
+		&hist->max_ns, &max, ns,
+		memory_order_relaxed, memory_order_relaxed))
+		; /* someone else raised it, check again */
+}
+
+/*
+ * Estimate a quantile from the histogram
+ *
+ * Times are assumed to be spread evenly over their bucket, so the
+ * result is only as good as the bucket widths. It never goes past
+ * the longest time seen.
+ */
+uint64_t metrics_quantile_ns(struct metrics_hist_t *hist, double q) {
+	uint64_t count = get(&hist->count);
+	uint64_t max = get(&hist->max_ns);
+	uint64_t seen = 0, n, lower, upper, ns;
+	double target;
+
+	if (count == 0) return 0;
+	target = q * count;
+
+	for (uint8_t i = 0; i < METRICS_HIST_BUCKETS; i++) {
+		n = get(&hist->buckets[i]);
+		if (n == 0 || seen + n < target) {
+			seen += n;
+			continue;
+		}
+
+		lower = i ? (1000ull << (i - 1)) : 0;
+		upper = i < METRICS_HIST_BUCKETS - 1 ? 1000ull << i : max;
+		if (upper < lower) upper = lower;
+		ns = lower + (uint64_t)((upper - lower) *
+			((target - seen) / n));
+		return ns < max ? ns : max;
+	}
+
+	return max;
+}
+
+static void clear_hist(struct metrics_hist_t *hist) {
+	for (uint8_t i = 0; i < METRICS_HIST_BUCKETS; i++)
+		metrics_set(&hist->buckets[i], 0);
+	metrics_set(&hist->count, 0);
+	metrics_set(&hist->sum_ns, 0);
+	metrics_set(&hist->max_ns, 0);
+}
+
+/*
+ * Take a free slot for a station
+ *
+ * Slots are never freed, only marked unused, so a reader can never
+ * get hold of a dangling one. Returns NULL if they are all taken.
+ */
+struct station_metrics_t *register_station_metrics(uint8_t id,
+	struct rds_encoder_t *rds) {
+	struct station_metrics_t *m;
+	bool expected;
+
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		m = &registry[i];
+		expected = false;
+		if (!atomic_compare_exchange_strong(&m->claimed, &expected,
+			true))
+			continue;
+
+		m->id = id;
+		m->rds = rds;
+		metrics_set(&m->blocks, 0);
+		clear_hist(&m->gen_time);
+		clear_hist(&m->play_time);
+		metrics_set(&m->ring_fill, 0);
+		metrics_set(&m->ring_size, 0);
+		metrics_set(&m->underruns, 0);
+		metrics_set(&m->overruns, 0);
+		metrics_set(&m->packets, 0);
+		metrics_set(&m->late_packets, 0);
+		metrics_set(&m->failed_packets, 0);
+		clear_hist(&m->send_jitter);
+		metrics_set(&m->frames_in, 0);
+		metrics_set(&m->frames_out, 0);
+		atomic_store(&m->mpx_rate, 0);
+		atomic_store(&m->out_rate, 0);
+		atomic_store(&m->decoder, NULL);
+
+		/* readers may look at it from now on */
+		atomic_store_explicit(&m->live, true, memory_order_release);
+		return m;
+	}
+
+	return NULL;
+}
+
+/* before the station's encoder goes away */
+void unregister_station_metrics(struct station_metrics_t *m) {
+	if (m == NULL) return;
+	atomic_store_explicit(&m->live, false, memory_order_release);
+	atomic_store(&m->claimed, false);
+}
+
+/* the resampler converts mpx_rate to out_rate (same rate if bypassed) */
+void set_metrics_rates(struct station_metrics_t *m, uint32_t mpx_rate,
+	uint32_t out_rate) {
+	if (m == NULL) return;
+	atomic_store(&m->mpx_rate, mpx_rate);
+	atomic_store(&m->out_rate, out_rate);
+}
+
+/* before the first block, and again before the decoder goes away */
+void set_metrics_decoder(struct station_metrics_t *m,
+	struct rds_decoder_t *decoder) {
+	if (m == NULL) return;
+	atomic_store_explicit(&m->decoder, decoder, memory_order_release);
+}
+
+static bool is_live(struct station_metrics_t *m) {
+	return atomic_load_explicit(&m->live, memory_order_acquire);
+}
+
+static struct rds_decoder_t *get_decoder(struct station_metrics_t *m) {
+	return atomic_load_explicit(&m->decoder, memory_order_acquire);
+}
+
+/*
+ * Resampler ratio
+ *
+ * nominal is what it was set up for and actual what it really did
+ * over all the blocks so far. drift is how far apart they are (ppm).
+ */
+static void get_ratios(struct station_metrics_t *m, double *nominal,
+	double *actual, double *drift) {
+	uint32_t mpx_rate = atomic_load(&m->mpx_rate);
+	uint32_t out_rate = atomic_load(&m->out_rate);
+	uint64_t in = get(&m->frames_in);
+	uint64_t out = get(&m->frames_out);
+
+	*nominal = mpx_rate ? (double)out_rate / mpx_rate : 0.0;
+	*actual = in ? (double)out / in : 0.0;
+	*drift = *nominal > 0.0 && in ?
+		(*actual / *nominal - 1.0) * 1e6 : 0.0;
+}
+
+/* name of a 5-bit group type code ("0A") */
+static void group_name(char *name, uint8_t code) {
+	sprintf(name, "%u%c", code >> 1, code & 1 ? 'B' : 'A');
+}
+
+/* text that keeps its last byte for the terminator */
+typedef struct metrics_text_t {
+	char *buf;
+	size_t size;
+	size_t len;
+} metrics_text_t;
+
+static void put(struct metrics_text_t *t, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	if (t->len + 1 >= t->size) return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+	va_end(ap);
+
+	if (n < 0) return;
+	t->len += (size_t)n;
+	if (t->len >= t->size) t->len = t->size - 1;
+}
+
+/* the latency line of a histogram for STATS (us) */
+static void put_hist_stats(struct metrics_text_t *t, const char *name,
+	struct metrics_hist_t *hist) {
+	put(t, "%s p50 %.1f p99 %.1f max %.1f us\n", name,
+		metrics_quantile_ns(hist, 0.5) / 1e3,
+		metrics_quantile_ns(hist, 0.99) / 1e3,
+		get(&hist->max_ns) / 1e3);
+}
+
+/* what the loopback decoder got, for STATS */
+static void put_verify_stats(struct metrics_text_t *t,
+	struct rds_decoder_t *dec) {
+	struct decoder_counts_t counts;
+	uint64_t mix[NUM_GROUP_CODES];
+	char ps[PS_LENGTH + 1];
+	char rt[RT_LENGTH + 1];
+	char name[4];
+
+	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+		get_decoder_counts(dec, i, &counts);
+		put(t, "verify stream %u blocks %llu errors %llu (%.3f%%) "
+			"groups %llu sync %s losses %llu\n", i,
+			(unsigned long long)counts.blocks,
+			(unsigned long long)counts.errors,
+			counts.blocks ? 100.0 * counts.errors / counts.blocks
+			: 0.0,
+			(unsigned long long)counts.groups,
+			counts.in_sync ? "yes" : "no",
+			(unsigned long long)counts.sync_losses);
+	}
+
+	get_decoder_group_mix(dec, mix);
+	put(t, "verify groups");
+	for (uint8_t i = 0; i < NUM_GROUP_CODES; i++) {
+		if (mix[i] == 0) continue;
+		group_name(name, i);
+		put(t, " %s %llu", name, (unsigned long long)mix[i]);
+	}
+	put(t, "\n");
+
+	get_decoder_ps(dec, ps);
+	get_decoder_rt(dec, rt);
+	put(t, "verify ps \"%s\"\n", ps);
+	put(t, "verify rt \"%s\"\n", rt);
+
+#ifdef RDS2
+	for (uint8_t i = 0; i < DECODER_RFT_PIPES; i++) {
+		struct decoder_rft_t rft;
+
+		get_decoder_rft(dec, i, &rft);
+		if (!rft.seen) continue;
+		put(t, "verify rft pipe %u file %u version %u "
+			"segments %u/%u\n", i, rft.file_id, rft.version,
+			rft.segs, rft.num_segs);
+	}
+#endif
+}
+
+/*
+ * Reply to the STATS command
+ *
+ * One "name values" line for each figure, meant for people and
+ * simple scripts alike
+ */
+size_t format_station_stats(struct station_metrics_t *m, char *buf,
+	size_t size) {
+	struct metrics_text_t t = { buf, size, 0 };
+	struct rds_decoder_t *dec;
+	uint64_t mix[NUM_GROUP_CODES];
+	double nominal, actual, drift;
+	char name[4];
+
+	if (size == 0) return 0;
+	buf[0] = 0;
+	if (m == NULL || !is_live(m)) return 0;
+
+	put(&t, "station %u\n", m->id);
+	put(&t, "blocks %llu\n", (unsigned long long)get(&m->blocks));
+	put_hist_stats(&t, "generate", &m->gen_time);
+	put_hist_stats(&t, "play", &m->play_time);
+	put(&t, "buffer %llu/%llu frames\n",
+		(unsigned long long)get(&m->ring_fill),
+		(unsigned long long)get(&m->ring_size));
+	put(&t, "underruns %llu\n", (unsigned long long)get(&m->underruns));
+	put(&t, "overruns %llu\n", (unsigned long long)get(&m->overruns));
+	if (get(&m->packets) || get(&m->failed_packets)) {
+		put(&t, "rtp packets %llu late %llu failed %llu\n",
+			(unsigned long long)get(&m->packets),
+			(unsigned long long)get(&m->late_packets),
+			(unsigned long long)get(&m->failed_packets));
+		put_hist_stats(&t, "jitter", &m->send_jitter);
+	}
+
+	get_ratios(m, &nominal, &actual, &drift);
+	put(&t, "resampler nominal %.7f actual %.7f drift %.2f ppm\n",
+		nominal, actual, drift);
+
+	get_rds_group_mix(m->rds, mix);
+	put(&t, "groups");
+	for (uint8_t i = 0; i < NUM_GROUP_CODES; i++) {
+		if (mix[i] == 0) continue;
+		group_name(name, i);
+		put(&t, " %s %llu", name, (unsigned long long)mix[i]);
+	}
+	put(&t, "\n");
+
+#ifdef RDS2
+	{
+		struct rds2_encoder_t *rds2 = get_rds2_encoder(m->rds);
+		struct rft_file_info_t info;
+
+		for (uint8_t i = 0; rds2 && i < get_rds2_num_files(rds2); i++) {
+			get_rft_file_info(rds2, i, &info);
+			put(&t, "rft %u groups %llu\n", info.file_id,
+				(unsigned long long)info.groups);
+		}
+	}
+#endif
+
+	dec = get_decoder(m);
+	if (dec) put_verify_stats(&t, dec);
+
+	return t.len;
+}
+
+static void put_family(struct metrics_text_t *t, const char *name,
+	const char *type, const char *help) {
+	put(t, "# HELP minirds_%s %s\n", name, help);
+	put(t, "# TYPE minirds_%s %s\n", name, type);
+}
+
+/* one value of every station */
+#define PUT_STATIONS(t, name, fmt, value) do { \
+	for (uint8_t i_ = 0; i_ < MAX_METRICS_STATIONS; i_++) { \
+		struct station_metrics_t *m = &registry[i_]; \
+		if (!is_live(m)) continue; \
+		put(t, "minirds_%s{station=\"%u\"} " fmt "\n", name, \
+			m->id, value); \
+	} \
+} while (0)
+
+static void put_hist(struct metrics_text_t *t, const char *name,
+	const char *help, size_t offset) {
+	struct station_metrics_t *m;
+	struct metrics_hist_t *hist;
+	uint64_t cum;
+
+	put_family(t, name, "histogram", help);
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		m = &registry[i];
+		if (!is_live(m)) continue;
+		hist = (struct metrics_hist_t *)((char *)m + offset);
+
+		cum = 0;
+		for (uint8_t b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+			cum += get(&hist->buckets[b]);
+			put(t, "minirds_%s_bucket{station=\"%u\",le=\"%g\"} "
+				"%llu\n", name, m->id, ldexp(1e-6, b),
+				(unsigned long long)cum);
+		}
+		cum += get(&hist->buckets[METRICS_HIST_BUCKETS - 1]);
+		put(t, "minirds_%s_bucket{station=\"%u\",le=\"+Inf\"} %llu\n",
+			name, m->id, (unsigned long long)cum);
+		put(t, "minirds_%s_sum{station=\"%u\"} %.9f\n", name, m->id,
+			get(&hist->sum_ns) / 1e9);
+		put(t, "minirds_%s_count{station=\"%u\"} %llu\n", name,
+			m->id, (unsigned long long)get(&hist->count));
+	}
+
+	put(t, "# HELP minirds_%s_max The longest one so far.\n", name);
+	put(t, "# TYPE minirds_%s_max gauge\n", name);
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		m = &registry[i];
+		if (!is_live(m)) continue;
+		hist = (struct metrics_hist_t *)((char *)m + offset);
+		put(t, "minirds_%s_max{station=\"%u\"} %.9f\n", name, m->id,
+			get(&hist->max_ns) / 1e9);
+	}
+}
+
+/* one count of every stream of the stations that are verified */
+static void put_verify_counts(struct metrics_text_t *t, const char *name,
+	const char *help, size_t offset) {
+	struct station_metrics_t *m;
+	struct rds_decoder_t *dec;
+	struct decoder_counts_t counts;
+
+	put_family(t, name, "counter", help);
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		m = &registry[i];
+		if (!is_live(m) || (dec = get_decoder(m)) == NULL) continue;
+		for (uint8_t s = 0; s < NUM_STREAMS; s++) {
+			get_decoder_counts(dec, s, &counts);
+			put(t, "minirds_%s{station=\"%u\",stream=\"%u\"} "
+				"%llu\n", name, m->id, s, (unsigned long long)
+				*(uint64_t *)((char *)&counts + offset));
+		}
+	}
+}
+
+/* what the loopback decoders got */
+static void put_verify_metrics(struct metrics_text_t *t) {
+	struct station_metrics_t *m;
+	struct rds_decoder_t *dec;
+	struct decoder_counts_t counts;
+	uint64_t mix[NUM_GROUP_CODES];
+	char name[4];
+
+	put_verify_counts(t, "verify_blocks_total",
+		"Blocks decoded back from the MPX while in sync.",
+		offsetof(struct decoder_counts_t, blocks));
+	put_verify_counts(t, "verify_block_errors_total",
+		"Decoded blocks with a bad checkword.",
+		offsetof(struct decoder_counts_t, errors));
+	put_verify_counts(t, "verify_sync_losses_total",
+		"Times the decoder lost block sync.",
+		offsetof(struct decoder_counts_t, sync_losses));
+
+	put_family(t, "verify_in_sync", "gauge",
+		"1 if the decoder has block sync.");
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		m = &registry[i];
+		if (!is_live(m) || (dec = get_decoder(m)) == NULL) continue;
+		for (uint8_t s = 0; s < NUM_STREAMS; s++) {
+			get_decoder_counts(dec, s, &counts);
+			put(t, "minirds_verify_in_sync{station=\"%u\","
+				"stream=\"%u\"} %u\n", m->id, s,
+				counts.in_sync ? 1 : 0);
+		}
+	}
+
+	put_family(t, "verify_groups_total", "counter",
+		"RDS groups decoded back from the MPX by type.");
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		m = &registry[i];
+		if (!is_live(m) || (dec = get_decoder(m)) == NULL) continue;
+		get_decoder_group_mix(dec, mix);
+		for (uint8_t c = 0; c < NUM_GROUP_CODES; c++) {
+			if (mix[c] == 0) continue;
+			group_name(name, c);
+			put(t, "minirds_verify_groups_total{station=\"%u\","
+				"group=\"%s\"} %llu\n", m->id, name,
+				(unsigned long long)mix[c]);
+		}
+	}
+
+#ifdef RDS2
+	put_family(t, "verify_rft_segments", "gauge",
+		"Segments of the RFT file on a pipe decoded so far.");
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		struct decoder_rft_t rft;
+
+		m = &registry[i];
+		if (!is_live(m) || (dec = get_decoder(m)) == NULL) continue;
+		for (uint8_t p = 0; p < DECODER_RFT_PIPES; p++) {
+			get_decoder_rft(dec, p, &rft);
+			if (!rft.seen) continue;
+			put(t, "minirds_verify_rft_segments{station=\"%u\","
+				"pipe=\"%u\",file=\"%u\"} %u\n", m->id, p,
+				rft.file_id, rft.segs);
+		}
+	}
+
+	put_family(t, "verify_rft_file_segments", "gauge",
+		"Segments the RFT file on a pipe has.");
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		struct decoder_rft_t rft;
+
+		m = &registry[i];
+		if (!is_live(m) || (dec = get_decoder(m)) == NULL) continue;
+		for (uint8_t p = 0; p < DECODER_RFT_PIPES; p++) {
+			get_decoder_rft(dec, p, &rft);
+			if (!rft.seen) continue;
+			put(t, "minirds_verify_rft_file_segments{"
+				"station=\"%u\",pipe=\"%u\",file=\"%u\"} "
+				"%u\n", m->id, p, rft.file_id, rft.num_segs);
+		}
+	}
+#endif
+}
+
+static double get_nominal(struct station_metrics_t *m) {
+	double nominal, actual, drift;
+
+	get_ratios(m, &nominal, &actual, &drift);
+	return nominal;
+}
+
+static double get_actual(struct station_metrics_t *m) {
+	double nominal, actual, drift;
+
+	get_ratios(m, &nominal, &actual, &drift);
+	return actual;
+}
+
+static double get_drift(struct station_metrics_t *m) {
+	double nominal, actual, drift;
+
+	get_ratios(m, &nominal, &actual, &drift);
+	return drift;
+}
+
+/*
+ * All stations in the Prometheus text exposition format
+ *
+ * Returns the length of the text, which is cut short (but still
+ * terminated) if it doesn't fit.
+ */
+size_t format_prometheus_metrics(char *buf, size_t size) {
+	struct metrics_text_t t = { buf, size, 0 };
+	uint64_t mix[NUM_GROUP_CODES];
+	struct station_metrics_t *m;
+	char name[4];
+
+	if (size == 0) return 0;
+	buf[0] = 0;
+
+	put_family(&t, "blocks_total", "counter",
+		"MPX blocks generated.");
+	PUT_STATIONS(&t, "blocks_total", "%llu",
+		(unsigned long long)get(&m->blocks));
+
+	put_hist(&t, "block_generation_seconds",
+		"Time taken to generate an MPX block.",
+		offsetof(struct station_metrics_t, gen_time));
+	put_hist(&t, "output_play_seconds",
+		"Time spent blocked in ao_play or sending RTP packets.",
+		offsetof(struct station_metrics_t, play_time));
+
+	put_family(&t, "output_buffer_frames", "gauge",
+		"Frames queued for the sound card or network.");
+	PUT_STATIONS(&t, "output_buffer_frames", "%llu",
+		(unsigned long long)get(&m->ring_fill));
+	put_family(&t, "output_buffer_size_frames", "gauge",
+		"Size of the output buffer.");
+	PUT_STATIONS(&t, "output_buffer_size_frames", "%llu",
+		(unsigned long long)get(&m->ring_size));
+	put_family(&t, "output_underruns_total", "counter",
+		"Periods the sound card got (partly) silence.");
+	PUT_STATIONS(&t, "output_underruns_total", "%llu",
+		(unsigned long long)get(&m->underruns));
+	put_family(&t, "output_overruns_total", "counter",
+		"Blocks dropped because the sound card stopped taking them.");
+	PUT_STATIONS(&t, "output_overruns_total", "%llu",
+		(unsigned long long)get(&m->overruns));
+
+	put_family(&t, "rtp_packets_total", "counter",
+		"RTP packets sent.");
+	PUT_STATIONS(&t, "rtp_packets_total", "%llu",
+		(unsigned long long)get(&m->packets));
+	put_family(&t, "rtp_late_packets_total", "counter",
+		"RTP packets sent more than a packet time late.");
+	PUT_STATIONS(&t, "rtp_late_packets_total", "%llu",
+		(unsigned long long)get(&m->late_packets));
+	put_family(&t, "rtp_failed_packets_total", "counter",
+		"RTP packets the network refused.");
+	PUT_STATIONS(&t, "rtp_failed_packets_total", "%llu",
+		(unsigned long long)get(&m->failed_packets));
+	put_hist(&t, "rtp_send_jitter_seconds",
+		"How late the RTP sender woke up for a batch.",
+		offsetof(struct station_metrics_t, send_jitter));
+
+	put_family(&t, "resampler_nominal_ratio", "gauge",
+		"Output rate over MPX rate.");
+	PUT_STATIONS(&t, "resampler_nominal_ratio", "%.9f", get_nominal(m));
+	put_family(&t, "resampler_ratio", "gauge",
+		"Frames out over frames in so far.");
+	PUT_STATIONS(&t, "resampler_ratio", "%.9f", get_actual(m));
+	put_family(&t, "resampler_drift_ppm", "gauge",
+		"How far the actual ratio is from the nominal one.");
+	PUT_STATIONS(&t, "resampler_drift_ppm", "%.3f", get_drift(m));
+
+	put_family(&t, "groups_total", "counter",
+		"RDS groups transmitted by type.");
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		m = &registry[i];
+		if (!is_live(m)) continue;
+		get_rds_group_mix(m->rds, mix);
+		for (uint8_t c = 0; c < NUM_GROUP_CODES; c++) {
+			if (mix[c] == 0) continue;
+			group_name(name, c);
+			put(&t, "minirds_groups_total{station=\"%u\","
+				"group=\"%s\"} %llu\n", m->id, name,
+				(unsigned long long)mix[c]);
+		}
+	}
+
+#ifdef RDS2
+	put_family(&t, "rft_groups_total", "counter",
+		"RDS2 groups transmitted for each RFT file.");
+	for (uint8_t i = 0; i < MAX_METRICS_STATIONS; i++) {
+		struct rds2_encoder_t *rds2;
+		struct rft_file_info_t info;
+
+		m = &registry[i];
+		if (!is_live(m)) continue;
+		rds2 = get_rds2_encoder(m->rds);
+		for (uint8_t f = 0; rds2 && f < get_rds2_num_files(rds2);
+			f++) {
+			get_rft_file_info(rds2, f, &info);
+			put(&t, "minirds_rft_groups_total{station=\"%u\","
+				"file=\"%u\"} %llu\n", m->id, info.file_id,
+				(unsigned long long)info.groups);
+		}
+	}
+#endif
+
+	put_verify_metrics(&t);
+
+	return t.len;
+}
@@ -0,0 +1,102 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+
+/*
+ * Pipeline telemetry
+ *
+ * Every station registers a set of counters that the generator and
+ * output threads update as they go. Updates are relaxed atomics, so
+ * nothing on the audio path takes a lock or waits. Readers (the STATS
+ * command, the Prometheus endpoint and the GUI) may see the counters
+ * of a block half updated, which at worst puts them one block apart.
+ */
+#define MAX_METRICS_STATIONS	16
+
+/*
+ * Latency histograms
+ *
+ * Bucket i counts the times up to 2^i us, the last one everything
+ * longer. That covers 1 us to 4 s, more than the pipeline ever holds.
+ */
+#define METRICS_HIST_BUCKETS	24
+
+typedef struct metrics_hist_t {
+	atomic_uint_fast64_t buckets[METRICS_HIST_BUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum_ns;
+	atomic_uint_fast64_t max_ns;
+} metrics_hist_t;
+
+typedef struct station_metrics_t {
+	uint8_t id;
+	struct rds_encoder_t *rds;
+
+	/* generator: MPX blocks made and how long each one took */
+	atomic_uint_fast64_t blocks;
+	struct metrics_hist_t gen_time;
+
+	/* output: time blocked in ao_play (or sending) and the ring */
+	struct metrics_hist_t play_time;
+	atomic_uint_fast64_t ring_fill;
+	atomic_uint_fast64_t ring_size;
+	atomic_uint_fast64_t underruns;
+	atomic_uint_fast64_t overruns;
+
+	/* RTP output: packets sent, how late the sender woke up for them */
+	atomic_uint_fast64_t packets;
+	atomic_uint_fast64_t late_packets;
+	atomic_uint_fast64_t failed_packets;
+	struct metrics_hist_t send_jitter;
+
+	/* resampler: frames in and out, and the rates it was set up for */
+	atomic_uint_fast64_t frames_in;
+	atomic_uint_fast64_t frames_out;
+	atomic_uint_fast32_t mpx_rate;
+	atomic_uint_fast32_t out_rate;
+
+	/* loopback decoder, NULL if the station isn't verified */
+	_Atomic(struct rds_decoder_t *) decoder;
+
+	atomic_bool claimed;
+	atomic_bool live;
+} station_metrics_t;
+
+/* Plenty for the Prometheus text of every station */
+#define METRICS_TEXT_SIZE	(MAX_METRICS_STATIONS * 16384)
+
+extern uint64_t metrics_now_ns();
+extern uint64_t metrics_since_ns(uint64_t start);
+extern void metrics_add(atomic_uint_fast64_t *counter, uint64_t n);
+extern void metrics_set(atomic_uint_fast64_t *gauge, uint64_t v);
+extern void metrics_record(struct metrics_hist_t *hist, uint64_t ns);
+extern uint64_t metrics_quantile_ns(struct metrics_hist_t *hist,
+	double q);
+
+extern struct station_metrics_t *register_station_metrics(uint8_t id,
+	struct rds_encoder_t *rds);
+extern void unregister_station_metrics(struct station_metrics_t *m);
+extern void set_metrics_rates(struct station_metrics_t *m,
+	uint32_t mpx_rate, uint32_t out_rate);
+extern void set_metrics_decoder(struct station_metrics_t *m,
+	struct rds_decoder_t *decoder);
+
+extern size_t format_station_stats(struct station_metrics_t *m,
+	char *buf, size_t size);
+extern size_t format_prometheus_metrics(char *buf, size_t size);
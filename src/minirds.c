@@ -18,9 +18,11 @@
 
 #include "common.h"
 #include <signal.h>
+#include <stdatomic.h>
 
 #ifdef _WIN32
   #include "getopt.h"
+  #include <avrt.h>
 #else
   #include <getopt.h>
   #include <pthread.h>
@@ -29,18 +31,149 @@
 #include <ao/ao.h>
 
 #include "rds.h"
+#ifdef RDS2
+#include "rds2.h"
+#endif
 #include "fm_mpx.h"
+#include "station.h"
 #include "control_pipe.h"
 #include "resampler.h"
 #include "net.h"
 #include "lib.h"
 #include "ascii_cmd.h"
+#include "audio_ring.h"
+#include "convert.h"
+#include "render.h"
+#include "event_loop.h"
+#include "work_pool.h"
+#include "metrics.h"
+#include "audio_input.h"
+#include "stereo.h"
+#include "rtp_out.h"
+#include "modulator.h"
+#include "rds_decoder.h"
+
+/* default output buffering */
+#define DEFAULT_LATENCY_MS	100
+#define MIN_LATENCY_MS		20
+#define MAX_LATENCY_MS		2000
+
+/* stereo audio input */
+#define DEFAULT_AUDIO_RATE	48000
+#define DEFAULT_AUDIO_LEVEL	80
+#ifdef RBDS
+#define DEFAULT_PREEMPHASIS	PREEMPHASIS_US_RBDS
+#else
+#define DEFAULT_PREEMPHASIS	PREEMPHASIS_US
+#endif
+
+/* set by the signal handlers, read by every thread */
+static atomic_bool stop_rds;
+
+/*
+ * Station outputs
+ *
+ * Every station has its own resampler and output. The render pool
+ * generates the MPX and queues it in the ring, and the output thread
+ * drains it into the device (or sends it over RTP) at real-time
+ * priority, so neither side waits on the other. When rendering to a
+ * file the pool writes it directly.
+ */
+typedef struct station_out_t {
+	uint8_t id;
+
+	/* SRC (NULL in native mode) */
+	SRC_STATE *src_state;
+	SRC_DATA src_data;
+	float *out_buffer;
+
+	ao_device *device;
+	struct audio_ring_t *ring;
+
+	/* makes the samples of the device, which go in the ring */
+	struct converter_t *conv;
+	size_t frame_size;
+
+	/* sends the ring instead of the device, NULL for the device */
+	struct rtp_output_t *rtp;
+
+	/* frames queued before playback starts */
+	size_t latency_frames;
+
+	/* frames per ao_play call */
+	size_t period;
+	uint8_t *buf;
+
+	/* how long the device may stop taking samples (ms) */
+	unsigned long max_wait;
+	uint64_t full_since;
+	bool full;
+	unsigned long underruns;
+
+	/* of the station, NULL if it has none */
+	struct station_metrics_t *metrics;
+
+	/* stereo audio of the station, NULL for RDS only */
+	struct audio_input_t *input;
+
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+	bool thread_running;
+
+	/* offline rendering */
+	char file[256];
+	struct render_t *render;
+	uint64_t render_left;
+	bool timed;
+
+	unsigned long loop_count;
+	unsigned long total_frames;
+} station_out_t;
+
+/* what every station output is opened with */
+typedef struct output_cfg_t {
+	char *file;
+
+	/* samples of the file, device or RTP stream */
+	struct sink_format_t sink;
+	double duration;
+	int driver;
+	ao_sample_format ao_format;
+	uint32_t mpx_rate;
+	uint32_t out_rate;
+	bool native;
+	uint32_t latency;
+	char *rtp_dest;
+} output_cfg_t;
+
+static struct station_t stations[MAX_STATIONS];
+static struct station_out_t outputs[MAX_STATIONS];
 
-static volatile uint8_t stop_rds;
+/*
+ * Sound card
+ *
+ * Finding the driver and opening the devices can take a while, so
+ * this is done on its own thread while the stations are set up.
+ * Nothing else touches the devices of the outputs until
+ * wait_audio_open() has returned.
+ */
+typedef struct audio_open_t {
+	struct output_cfg_t *cfg;
+	uint8_t num_outputs;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+	bool running;
+} audio_open_t;
 
 static void stop(int sig) {
 	(void)sig;
-	stop_rds = 1;
+	atomic_store(&stop_rds, true);
 }
 
 #ifdef _WIN32
@@ -51,7 +184,7 @@ static BOOL WINAPI console_ctrl_handler(DWORD ctrl_type) {
 	case CTRL_CLOSE_EVENT:
 		fprintf(stderr, "Received console ctrl event %lu, stopping...\n",
 			(unsigned long)ctrl_type);
-		stop_rds = 1;
+		atomic_store(&stop_rds, true);
 		return TRUE;
 	default:
 		return FALSE;
@@ -59,74 +192,528 @@ static BOOL WINAPI console_ctrl_handler(DWORD ctrl_type) {
 }
 #endif
 
-static inline void float2char2channel(
-	float *inbuf, char *outbuf, size_t frames) {
-	uint16_t j = 0, k = 0;
-	int16_t sample;
-	int8_t lower, upper;
+/* threads */
+static void set_realtime_priority() {
+#ifdef _WIN32
+	DWORD task_index = 0;
+
+	/* let MMCSS schedule us like other audio applications */
+	if (AvSetMmThreadCharacteristicsA("Pro Audio", &task_index) == NULL) {
+		fprintf(stderr, "Could not register the output thread "
+			"with MMCSS.\n");
+		SetThreadPriority(GetCurrentThread(),
+			THREAD_PRIORITY_TIME_CRITICAL);
+	}
+#else
+	struct sched_param param;
+	int r;
+
+	memset(&param, 0, sizeof(struct sched_param));
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+
+	r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (r != 0) {
+		fprintf(stderr, "Could not set real-time priority "
+			"for the output thread: %s.\n", strerror(r));
+	}
+#endif
+}
+
+static void output_loop(struct station_out_t *out) {
+	struct station_metrics_t *m = out->metrics;
+	size_t frames, bytes;
+	uint64_t start;
+	bool played;
+
+	set_realtime_priority();
 
-	for (uint16_t i = 0; i < frames; i++) {
-		sample = lroundf((inbuf[j] + inbuf[j+1]) * 16383.5f);
+	/* wait until the ring holds the target latency */
+	while (!atomic_load(&stop_rds) &&
+		audio_ring_fill(out->ring) < out->latency_frames)
+		msleep(1);
 
-		/* convert from short to char */
-		lower = sample & 255;
-		sample >>= 8;
-		upper = sample & 255;
+	bytes = out->period * out->frame_size;
 
-		outbuf[k+0] = lower;
-		outbuf[k+1] = upper;
-		outbuf[k+2] = lower;
-		outbuf[k+3] = upper;
+	while (!atomic_load(&stop_rds)) {
+		frames = audio_ring_read(out->ring, out->buf, out->period);
 
-		j += 2;
-		k += 4;
+		if (frames < out->period) {
+			/* generator fell behind, fill the gap with silence */
+			audio_ring_add_underrun(out->ring);
+			if (m) metrics_add(&m->underruns, 1);
+			memset(out->buf + frames * out->frame_size, 0,
+				(out->period - frames) * out->frame_size);
+		}
+
+		start = metrics_now_ns();
+		played = ao_play(out->device, (char *)out->buf, bytes);
+		if (m) {
+			metrics_record(&m->play_time, metrics_since_ns(start));
+			metrics_set(&m->ring_fill, audio_ring_fill(out->ring));
+		}
+
+		if (!played) {
+			fprintf(stderr, "Error: ao_play failed "
+				"(buffer size: %lu bytes).\n",
+				(unsigned long)bytes);
+			atomic_store(&stop_rds, true);
+			break;
+		}
 	}
 }
 
-/* threads */
+/*
+ * The output thread of an RTP output
+ *
+ * Here the clock is ours: every batch of packets goes out when it is
+ * due, straight from the ring, and how late we woke up for it is the
+ * jitter the receivers have to absorb.
+ */
+static void rtp_loop(struct station_out_t *out) {
+	struct station_metrics_t *m = out->metrics;
+	struct rtp_batch_t batch;
+	uint64_t late, start;
+	bool warned = false;
+
+	set_realtime_priority();
+
+	while (!atomic_load(&stop_rds) &&
+		audio_ring_fill(out->ring) < out->latency_frames)
+		msleep(1);
+
+	start_rtp_clock(out->rtp);
+
+	while (!atomic_load(&stop_rds)) {
+		late = wait_rtp_batch(out->rtp);
+
+		start = metrics_now_ns();
+		send_rtp_batch(out->rtp, out->ring, &batch);
+		if (m) {
+			metrics_record(&m->play_time, metrics_since_ns(start));
+			metrics_record(&m->send_jitter, late);
+			metrics_set(&m->ring_fill, audio_ring_fill(out->ring));
+			metrics_add(&m->packets, batch.packets);
+			metrics_add(&m->late_packets, batch.late);
+			metrics_add(&m->failed_packets, batch.failed);
+		}
+
+		if (batch.silent) {
+			audio_ring_add_underrun(out->ring);
+			if (m) metrics_add(&m->underruns, 1);
+		}
+
+		if (batch.failed && !warned) {
+			fprintf(stderr, "Warning: station %u could not send "
+				"RTP packets.\n", out->id);
+			warned = true;
+		}
+	}
+}
+
+/* control inputs (pipes and sockets) are all handled by one thread */
 #ifdef _WIN32
-static DWORD WINAPI control_pipe_worker(LPVOID param) {
+static DWORD WINAPI ctl_worker(LPVOID param) {
 	(void)param;
-	while (!stop_rds) {
-		poll_control_pipe();
-		msleep(READ_TIMEOUT_MS);
-	}
+	run_event_loop();
+	return 0;
+}
+
+static DWORD WINAPI output_worker(LPVOID param) {
+	struct station_out_t *out = param;
 
-	close_control_pipe();
+	if (out->rtp) rtp_loop(out);
+	else output_loop(out);
 	return 0;
 }
+#else
+static void *ctl_worker() {
+	run_event_loop();
+	pthread_exit(NULL);
+}
 
-static DWORD WINAPI net_ctl_worker(LPVOID param) {
-	(void)param;
-	while (!stop_rds) {
-		poll_ctl_socket();
-		msleep(READ_TIMEOUT_MS);
+static void *output_worker(void *param) {
+	struct station_out_t *out = param;
+
+	if (out->rtp) rtp_loop(out);
+	else output_loop(out);
+	pthread_exit(NULL);
+}
+#endif
+
+static void open_audio(struct audio_open_t *ao) {
+	ao_initialize();
+
+	ao->cfg->driver = ao_default_driver_id();
+	if (ao->cfg->driver < 0) return;
+
+	for (uint8_t i = 0; i < ao->num_outputs; i++) {
+		outputs[i].device = ao_open_live(ao->cfg->driver,
+			&ao->cfg->ao_format, NULL);
 	}
+}
 
-	close_ctl_socket();
+#ifdef _WIN32
+static DWORD WINAPI audio_open_worker(LPVOID param) {
+	open_audio(param);
 	return 0;
 }
 #else
-static void *control_pipe_worker() {
-	while (!stop_rds) {
-		poll_control_pipe();
-		msleep(READ_TIMEOUT_MS);
+static void *audio_open_worker(void *param) {
+	open_audio(param);
+	pthread_exit(NULL);
+}
+#endif
+
+/* opens the devices right away if there's no thread for it */
+static void start_audio_open(struct audio_open_t *ao,
+	struct output_cfg_t *cfg, uint8_t num_outputs) {
+	ao->cfg = cfg;
+	ao->num_outputs = num_outputs;
+
+#ifdef _WIN32
+	ao->thread = CreateThread(NULL, 0, audio_open_worker, ao, 0, NULL);
+	ao->running = ao->thread != NULL;
+#else
+	ao->running = pthread_create(&ao->thread, NULL,
+		audio_open_worker, ao) == 0;
+#endif
+	if (!ao->running) open_audio(ao);
+}
+
+static void wait_audio_open(struct audio_open_t *ao) {
+	if (!ao->running) return;
+
+#ifdef _WIN32
+	WaitForSingleObject(ao->thread, INFINITE);
+	CloseHandle(ao->thread);
+#else
+	pthread_join(ao->thread, NULL);
+#endif
+	ao->running = false;
+}
+
+/*
+ * Does the output have room for another block?
+ *
+ * The ring is topped up whenever it is at or below the latency
+ * target. If the device stops taking samples for much longer than
+ * that should take, the block is made anyway and dropped instead of
+ * stalling.
+ */
+static bool output_ready(void *ctx) {
+	struct station_out_t *out = ctx;
+	uint64_t now;
+
+	/* rendering runs as fast as it can */
+	if (out->render) return true;
+
+	if (audio_ring_fill(out->ring) <= out->latency_frames) {
+		out->full = false;
+		return true;
 	}
 
-	close_control_pipe();
-	pthread_exit(NULL);
+	now = metrics_now_ns();
+	if (!out->full) {
+		out->full = true;
+		out->full_since = now;
+		return false;
+	}
+
+	return now - out->full_since >= (uint64_t)out->max_wait * 1000000u;
 }
 
-static void *net_ctl_worker() {
-	while (!stop_rds) {
-		poll_ctl_socket();
-		msleep(READ_TIMEOUT_MS);
+/*
+ * Resample a block of MPX and queue or write it
+ *
+ * Returns -1 when the station is done
+ */
+static int output_frames(void *ctx, float *mpx, size_t frames) {
+	struct station_out_t *out = ctx;
+	struct station_metrics_t *m = out->metrics;
+	float *play_buffer = mpx;
+	size_t in_frames = frames;
+	/* first iterations of the first station */
+	bool debug = out->id == 1 && out->loop_count < 3;
+	int ret = 0;
+
+	if (out->src_state == NULL) goto convert;
+
+	if (debug)
+		fprintf(stderr, "[iter %lu] Resampling...\n", out->loop_count);
+
+	out->src_data.data_in = mpx;
+	if (resample(out->src_state, out->src_data, &frames) < 0) {
+		fprintf(stderr, "Error: resampler failed at iteration %lu "
+			"(total frames: %lu).\n", out->loop_count,
+			out->total_frames);
+		return -1;
 	}
 
-	close_ctl_socket();
-	pthread_exit(NULL);
+	if (frames == 0) {
+		fprintf(stderr, "Warning: resampler produced 0 frames at "
+			"iteration %lu.\n", out->loop_count);
+		if (m) metrics_add(&m->frames_in, in_frames);
+		return 0;
+	}
+
+	play_buffer = out->out_buffer;
+
+convert:
+	if (m) {
+		metrics_add(&m->frames_in, in_frames);
+		metrics_add(&m->frames_out, frames);
+	}
+
+	if (debug)
+		fprintf(stderr, "[iter %lu] Converting %lu frames...\n",
+			out->loop_count, (unsigned long)frames);
+
+	if (out->render) {
+		/* stop exactly at the requested duration */
+		if (out->timed && frames >= out->render_left) {
+			frames = out->render_left;
+			ret = -1;
+		}
+		out->render_left -= frames;
+
+		if (write_render_frames(out->render, play_buffer,
+			frames) < 0) {
+			fprintf(stderr, "Error: write to %s failed.\n",
+				out->file);
+			ret = -1;
+		}
+		goto next;
+	}
+
+	if (audio_ring_fill(out->ring) > out->latency_frames) {
+		/* waited too long, see output_ready() */
+		audio_ring_add_overrun(out->ring);
+		if (m) metrics_add(&m->overruns, 1);
+		out->full = false;
+		goto next;
+	}
+
+	if (debug)
+		fprintf(stderr, "[iter %lu] Queueing %lu frames...\n",
+			out->loop_count, (unsigned long)frames);
+
+	/* converted in place, ready to play or send */
+	if (out->rtp) {
+		write_rtp_frames(out->rtp, out->ring, play_buffer, frames);
+	} else {
+		convert_into_ring(out->conv, out->ring, play_buffer,
+			frames);
+	}
+	if (m) metrics_set(&m->ring_fill, audio_ring_fill(out->ring));
+
+	if (audio_ring_underruns(out->ring) != out->underruns) {
+		out->underruns = audio_ring_underruns(out->ring);
+		fprintf(stderr, "Warning: station %u output underrun "
+			"(%lu so far).\n", out->id, out->underruns);
+	}
+
+next:
+	out->total_frames += frames;
+	out->loop_count++;
+
+	if (out->loop_count == 1 && out->id == 1)
+		fprintf(stderr, "RDS output started successfully.\n");
+
+	return ret;
 }
+
+/*
+ * Name of a per-station file or pipe
+ *
+ * The first station uses the name as given, the others get their
+ * number added before the extension ("out.wav" -> "out-2.wav").
+ */
+static void station_name(char *dst, size_t size, const char *name,
+	uint8_t id) {
+	const char *ext = strrchr(name, '.');
+	const char *dir = strrchr(name, '/');
+	int len;
+
+	if (id == 1) {
+		snprintf(dst, size, "%s", name);
+		return;
+	}
+
+#ifdef _WIN32
+	if (strrchr(name, '\\') > dir) dir = strrchr(name, '\\');
 #endif
+	if (ext == NULL || ext == name || (dir && ext < dir))
+		ext = name + strlen(name);
+
+	len = (int)(ext - name);
+	snprintf(dst, size, "%.*s-%u%s", len, name, id, ext);
+}
+
+/*
+ * Open the output of a station
+ *
+ * Either the file or the audio device (or RTP sender) and its ring
+ * and thread, and the resampler in front of them
+ */
+static int open_station_output(struct station_out_t *out,
+	struct output_cfg_t *cfg) {
+	char sdp[512];
+	int r;
+
+	out->out_buffer = malloc(NUM_MPX_FRAMES_OUT * sizeof(float));
+	if (out->out_buffer == NULL) {
+		fprintf(stderr, "Could not allocate the output buffers.\n");
+		return -1;
+	}
+
+	/* SRC out (MPX -> output) */
+	memset(&out->src_data, 0, sizeof(SRC_DATA));
+	out->src_data.input_frames = NUM_MPX_FRAMES_IN;
+	out->src_data.output_frames = NUM_MPX_FRAMES_OUT;
+	out->src_data.src_ratio =
+		(double)cfg->out_rate / (double)cfg->mpx_rate;
+	out->src_data.data_out = out->out_buffer;
+	set_metrics_rates(out->metrics, cfg->mpx_rate,
+		cfg->native ? cfg->mpx_rate : cfg->out_rate);
+
+	if (!cfg->native) {
+		if (resampler_init(&out->src_state, 1) < 0) {
+			fprintf(stderr, "Could not create output resampler.\n");
+			return -1;
+		}
+	}
+
+	/* Offline rendering replaces the sound card */
+	if (cfg->file) {
+		station_name(out->file, sizeof(out->file), cfg->file,
+			out->id);
+		out->render = open_render_file(out->file, &cfg->sink,
+			cfg->out_rate);
+		if (out->render == NULL) {
+			fprintf(stderr, "Error: cannot open %s for writing.\n",
+				out->file);
+			return -1;
+		}
+
+		out->timed = cfg->duration > 0.0;
+		out->render_left =
+			(uint64_t)(cfg->duration * cfg->out_rate + 0.5);
+		fprintf(stderr, "Rendering to %s.\n", out->file);
+		return 0;
+	}
+
+	if (cfg->rtp_dest) {
+		out->rtp = open_rtp_output(cfg->rtp_dest, out->id,
+			cfg->out_rate, &cfg->sink);
+		if (out->rtp == NULL) return -1;
+		out->frame_size = get_rtp_frame_size(out->rtp);
+
+		format_rtp_sdp(out->rtp, sdp, sizeof(sdp));
+		fprintf(stderr, "Sending station %u over RTP:\n%s", out->id,
+			sdp);
+		goto open_ring;
+	}
+
+	/* normally opened while the stations were set up */
+	if (out->device == NULL)
+		out->device = ao_open_live(cfg->driver, &cfg->ao_format, NULL);
+	if (out->device == NULL) {
+		fprintf(stderr, "Error: cannot open sound device "
+			"(driver=%d, rate=%d, bits=%d, channels=%d).\n",
+			cfg->driver, cfg->ao_format.rate, cfg->ao_format.bits,
+			cfg->ao_format.channels);
+		fprintf(stderr, "Hint: your audio driver may not support %d Hz. "
+			"Check system audio settings.\n", cfg->ao_format.rate);
+#ifdef _WIN32
+		fprintf(stderr, "Windows: try setting your sound device to "
+			"192000 Hz in Sound Settings > Properties > Advanced.\n");
+#endif
+		return -1;
+	}
+
+	out->conv = init_converter(&cfg->sink);
+	if (out->conv == NULL) {
+		fprintf(stderr, "Could not create the output converter.\n");
+		return -1;
+	}
+	out->frame_size = get_sink_frame_size(out->conv);
+
+open_ring:
+	/*
+	 * Output ring
+	 *
+	 * Holds the latency target plus one block, since the pool
+	 * tops it up whenever it is at or below the target
+	 */
+	out->latency_frames = (size_t)cfg->out_rate * cfg->latency / 1000;
+	out->period = out->latency_frames / 4;
+	if (out->period > NUM_MPX_FRAMES_IN)
+		out->period = NUM_MPX_FRAMES_IN;
+	out->ring = audio_ring_new_sized(out->latency_frames +
+		NUM_MPX_FRAMES_OUT, out->frame_size);
+	out->buf = malloc(out->period * out->frame_size);
+	if (out->ring == NULL || out->buf == NULL) {
+		fprintf(stderr, "Could not allocate the output buffer.\n");
+		return -1;
+	}
+	if (out->metrics) {
+		metrics_set(&out->metrics->ring_size,
+			out->latency_frames + NUM_MPX_FRAMES_OUT);
+	}
+
+	/* time for the device to play one block past the target */
+	out->max_wait = cfg->latency +
+		NUM_MPX_FRAMES_OUT * 1000ul / cfg->out_rate + 1;
+
+#ifdef _WIN32
+	out->thread = CreateThread(NULL, 0, output_worker, out, 0, NULL);
+	r = out->thread == NULL;
+#else
+	r = pthread_create(&out->thread, NULL, output_worker, out);
+#endif
+	if (r != 0) {
+		fprintf(stderr, "Could not create output thread.\n");
+		return -1;
+	}
+	out->thread_running = true;
+
+	return 0;
+}
+
+static void close_station_output(struct station_out_t *out) {
+	if (out->thread_running) {
+		/* let the output thread finish its last period */
+#ifdef _WIN32
+		WaitForSingleObject(out->thread, INFINITE);
+		CloseHandle(out->thread);
+#else
+		pthread_join(out->thread, NULL);
+#endif
+		out->thread_running = false;
+	}
+
+	if (out->ring) {
+		fprintf(stderr, "Output %u: %lu underruns, %lu overruns.\n",
+			out->id, audio_ring_underruns(out->ring),
+			audio_ring_overruns(out->ring));
+	}
+
+	if (out->device) ao_close(out->device);
+	close_rtp_output(out->rtp);
+	close_render_file(out->render);
+	exit_converter(out->conv);
+	if (out->src_state) resampler_exit(out->src_state);
+
+	if (out->input) {
+		fprintf(stderr, "Input %u: %lu underruns.\n", out->id,
+			get_audio_input_underruns(out->input));
+		close_audio_input(out->input);
+	}
+
+	audio_ring_free(out->ring);
+	free(out->buf);
+	free(out->out_buffer);
+}
 
 static void show_help(char *name, struct rds_params_t def_params) {
 	printf(
@@ -159,8 +746,60 @@ static void show_help(char *name, struct rds_params_t def_params) {
 #endif
 		"                        (more than one AF may be passed)\n"
 		"    -P,--ptyn         Program Type Name\n"
+#ifdef RDS2
+		"    -f,--rft          File to send with RFT besides the logo\n"
+		"                      as path[,share] (more than one may be\n"
+		"                      passed, the logo has a share of 1)\n"
+#endif
 		"\n"
 		"    -C,--ctl          FIFO control pipe\n"
+		"    -c,--port         Control socket port\n"
+		"    -e,--uecp         UECP (SPB 490) control socket port\n"
+		"    -U,--udp          Use UDP for the control sockets\n"
+		"                        [default: TCP]\n"
+		"    -M,--metrics      Prometheus metrics (HTTP) port\n"
+		"\n"
+		"    -O,--out-rate     Output sample rate in Hz\n"
+		"                        [default: %u]\n"
+		"    -N,--native       Generate the MPX at the output rate\n"
+		"                      instead of resampling\n"
+		"    -L,--latency      Output buffering in milliseconds\n"
+		"                        [default: %u]\n"
+		"    -K,--ct-latency   Milliseconds from encoding to air, CT\n"
+		"                      is sent that much early\n"
+		"                        [default: the output latency]\n"
+		"\n"
+		"    -o,--output       Render to a file instead of the sound card\n"
+		"                      (.wav for a WAV file, raw samples otherwise,\n"
+		"                      \"-\" for stdout)\n"
+		"    -D,--duration     Seconds to render [default: until stopped]\n"
+		"    -F,--format       Sample format: s16, s24, s32 or f32\n"
+		"                      (f32 for files only) [default: s16]\n"
+		"    -k,--channels     Output channels as count[:list], the\n"
+		"                      list has those with the MPX (\"4:3\" is\n"
+		"                      the third of four) [default: 2, 1 for RTP]\n"
+		"    -d,--dither       Add TPDF dither to integer samples\n"
+		"\n"
+		"    -X,--rtp          Send the MPX over RTP (AES67) to\n"
+		"                      host[:port] instead of the sound card\n"
+		"    -Y,--rtp-format   RTP samples: L16 or L24 [default: L24]\n"
+		"\n"
+		"    -a,--audio        Stereo audio to encode: a WAV file, raw\n"
+		"                      16-bit stereo or \"-\" for stdin\n"
+		"    -b,--audio-rate   Sample rate of raw audio in Hz\n"
+		"                        [default: %u]\n"
+		"    -l,--audio-level  Audio level in percent [default: %u]\n"
+		"    -E,--preemphasis  Pre-emphasis in us: 0, 50 or 75\n"
+		"                        [default: %u]\n"
+		"\n"
+		"    -n,--stations     Number of stations to run [default: 1]\n"
+		"                      (each has its own output, pipe and ports)\n"
+		"    -t,--threads      Render threads [default: one per CPU]\n"
+		"    -j,--stream-threads\n"
+		"                      Threads for the RDS streams of each\n"
+		"                      station [default: 1]\n"
+		"    -V,--verify       Decode the MPX again and report the\n"
+		"                      errors with the other statistics\n"
 		"\n"
 		"    -h,--help         Show this help text and exit\n"
 		"    -v,--version      Show version and exit\n"
@@ -169,7 +808,12 @@ static void show_help(char *name, struct rds_params_t def_params) {
 		name,
 		def_params.pi, def_params.ps,
 		def_params.rt, def_params.pty,
-		def_params.tp
+		def_params.tp,
+		OUTPUT_SAMPLE_RATE,
+		DEFAULT_LATENCY_MS,
+		DEFAULT_AUDIO_RATE,
+		DEFAULT_AUDIO_LEVEL,
+		DEFAULT_PREEMPHASIS
 	);
 }
 
@@ -186,60 +830,218 @@ static uint8_t check_mpx_vol(float volume) {
 	return 0;
 }
 
+/* check audio level */
+static uint8_t check_audio_level(float level) {
+	if (level < 0.0f || level > 100.0f) {
+		fprintf(stderr, "Audio level must be between 0-100.\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* check pre-emphasis time constant */
+static uint8_t check_preemphasis(unsigned long us) {
+	if (us != 0 && us != PREEMPHASIS_US && us != PREEMPHASIS_US_RBDS) {
+		fprintf(stderr, "Pre-emphasis must be 0, %u or %u us.\n",
+			PREEMPHASIS_US, PREEMPHASIS_US_RBDS);
+		return 1;
+	}
+	return 0;
+}
+
+/* check output latency */
+static uint8_t check_latency(uint32_t latency) {
+	if (latency < MIN_LATENCY_MS || latency > MAX_LATENCY_MS) {
+		fprintf(stderr, "Output latency must be between %u-%u ms.\n",
+			MIN_LATENCY_MS, MAX_LATENCY_MS);
+		return 1;
+	}
+	return 0;
+}
+
+/* check output sample rate */
+static uint8_t check_out_rate(uint32_t rate) {
+	if (rate < MIN_OUTPUT_SAMPLE_RATE || rate > MAX_OUTPUT_SAMPLE_RATE) {
+		fprintf(stderr, "Output sample rate must be between %u-%u Hz.\n",
+			MIN_OUTPUT_SAMPLE_RATE, MAX_OUTPUT_SAMPLE_RATE);
+		return 1;
+	}
+	return 0;
+}
+
+/* check number of stations */
+static uint8_t check_stations(unsigned long num) {
+	if (num < 1 || num > MAX_STATIONS) {
+		fprintf(stderr, "Number of stations must be between 1-%u.\n",
+			MAX_STATIONS);
+		return 1;
+	}
+	return 0;
+}
+
+/* check number of render threads */
+static uint8_t check_threads(unsigned long num) {
+	if (num < 1 || num > MAX_STATIONS) {
+		fprintf(stderr, "Number of threads must be between 1-%u.\n",
+			MAX_STATIONS);
+		return 1;
+	}
+	return 0;
+}
+
+#ifdef RDS2
+/* extra RFT files, sent by every station */
+static char *rft_paths[MAX_RFT_FILES - 1];
+static uint8_t rft_shares[MAX_RFT_FILES - 1];
+static uint8_t num_rft_files;
+
+/* parse path[,share] */
+static uint8_t add_rft_file(char *arg) {
+	char *sep = strrchr(arg, ',');
+	unsigned long share = 1;
+
+	if (num_rft_files == MAX_RFT_FILES - 1) {
+		fprintf(stderr, "Too many RFT files (at most %u).\n",
+			MAX_RFT_FILES - 1);
+		return 1;
+	}
+
+	if (sep) {
+		*sep = 0;
+		share = strtoul(sep + 1, NULL, 10);
+		if (share < 1 || share > 100) {
+			fprintf(stderr, "RFT share must be between 1-100.\n");
+			return 1;
+		}
+	}
+
+	rft_paths[num_rft_files] = arg;
+	rft_shares[num_rft_files] = share;
+	num_rft_files++;
+	return 0;
+}
+
+/* share and expected delivery time of each file */
+static void show_rft_files(struct rds2_encoder_t *rds2) {
+	struct rft_file_info_t info;
+
+	wait_rds2_encoder(rds2);
+
+	for (uint8_t i = 0; i < get_rds2_num_files(rds2); i++) {
+		if (get_rft_file_info(rds2, i, &info) < 0) continue;
+		fprintf(stderr, "RFT file %u on pipe %u: %lu bytes, "
+			"%.0f%% of RDS2, %.1f s per transfer.\n",
+			info.file_id, info.channel, (unsigned long)info.len,
+			info.capacity * 100.0f, info.delivery_time);
+	}
+}
+#endif
+
+/* what the loopback decoder of a station got */
+static void show_verify(struct station_t *st) {
+	struct decoder_counts_t counts;
+
+	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+		get_decoder_counts(st->decoder, i, &counts);
+		fprintf(stderr, "Station %u stream %u: %llu blocks decoded, "
+			"%llu bad, %llu sync losses.\n", st->id, i,
+			(unsigned long long)counts.blocks,
+			(unsigned long long)counts.errors,
+			(unsigned long long)counts.sync_losses);
+	}
+}
+
+/* check number of threads per station */
+static uint8_t check_stream_threads(unsigned long num) {
+	if (num < 1 || num > MAX_WORK_THREADS) {
+		fprintf(stderr, "Number of stream threads must be "
+			"between 1-%u.\n", MAX_WORK_THREADS);
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc, char **argv) {
 	int opt;
 	char control_pipe[51];
+	char name[256];
 	struct rds_params_t rds_params = {
 		.ps = "MiniRDS",
 		.rt = "MiniRDS: Software RDS encoder",
 		.pi = 0x1000
 	};
 	float volume = 50.0f;
+	uint32_t out_rate = OUTPUT_SAMPLE_RATE;
+	uint32_t mpx_rate;
+	uint8_t native_rate = 0;
+	uint32_t latency = DEFAULT_LATENCY_MS;
+	int32_t ct_latency = -1;
+
+	/* stations and render threads */
+	uint8_t num_stations = 1;
+	uint8_t num_started = 0;
+	uint8_t threads = 0;
+	uint8_t stream_threads = 1;
+	bool verify = false;
+	struct output_cfg_t cfg;
+
+	/* stereo audio */
+	char *audio_file = NULL;
+	uint32_t audio_rate = DEFAULT_AUDIO_RATE;
+	float audio_level = DEFAULT_AUDIO_LEVEL;
+	uint8_t preemphasis = DEFAULT_PREEMPHASIS;
+
+	/* offline rendering */
+	char *output_file = NULL;
+	int8_t sample_fmt = SAMPLE_FMT_S16;
+	struct sink_format_t sink = {
+		.sample_fmt = SAMPLE_FMT_S16,
+		.channels = 2,
+		.mask = 3
+	};
+	bool have_channels = false;
+	double duration = 0.0;
+	uint64_t render_start;
+
+	/* network output */
+	char *rtp_dest = NULL;
+	uint8_t rtp_bits = 24;
 
 	/* Force unbuffered stderr so crash diagnostics are always visible */
 	setvbuf(stderr, NULL, _IONBF, 0);
 
-	/* buffers */
-	float *mpx_buffer;
-	float *out_buffer;
-	char *dev_out;
-
 	uint16_t port = 0;
+	uint16_t uecp_port = 0;
+	uint16_t metrics_port = 0;
 	uint8_t proto = 1;
-
-	int8_t r;
-	size_t frames;
-
-	/* SRC */
-	SRC_STATE *src_state;
-	SRC_DATA src_data;
-
-	/* AO */
-	ao_device *device;
-	ao_sample_format format;
+	bool have_pipe = false;
+	bool have_socket = false;
+	bool ao_running = false;
+	struct audio_open_t audio_open = { 0 };
 
 #ifdef _WIN32
 	/* Windows threads */
-	HANDLE control_pipe_thread = NULL;
-	HANDLE net_ctl_thread = NULL;
+	HANDLE ctl_thread = NULL;
 #else
+	int r;
+
 	/* pthread */
 	pthread_attr_t attr;
-	pthread_t control_pipe_thread;
-	pthread_mutex_t control_pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
-	pthread_cond_t control_pipe_cond;
 
-	/* network control socket */
-	pthread_t net_ctl_thread;
-	pthread_mutex_t net_ctl_mutex = PTHREAD_MUTEX_INITIALIZER;
-	pthread_cond_t net_ctl_cond;
+	/* control pipes and network sockets */
+	pthread_t ctl_thread;
 #endif
+	bool ctl_running = false;
 
 	const char	*short_opt = "m:R:i:s:r:p:T:A:P:"
 #ifdef RBDS
 	"S:"
 #endif
-	"C:hv";
+	"C:c:e:UM:O:NL:K:o:D:F:k:dX:Y:a:b:l:E:n:t:j:V"
+#ifdef RDS2
+	"f:"
+#endif
+	"hv";
 
 	struct option	long_opt[] =
 	{
@@ -253,7 +1055,33 @@ int main(int argc, char **argv) {
 		{"tp",		required_argument, NULL, 'T'},
 		{"af",		required_argument, NULL, 'A'},
 		{"ptyn",	required_argument, NULL, 'P'},
+#ifdef RDS2
+		{"rft",		required_argument, NULL, 'f'},
+#endif
 		{"ctl",		required_argument, NULL, 'C'},
+		{"port",	required_argument, NULL, 'c'},
+		{"uecp",	required_argument, NULL, 'e'},
+		{"udp",		no_argument, NULL, 'U'},
+		{"metrics",	required_argument, NULL, 'M'},
+		{"out-rate",	required_argument, NULL, 'O'},
+		{"native",	no_argument, NULL, 'N'},
+		{"latency",	required_argument, NULL, 'L'},
+		{"ct-latency",	required_argument, NULL, 'K'},
+		{"output",	required_argument, NULL, 'o'},
+		{"duration",	required_argument, NULL, 'D'},
+		{"format",	required_argument, NULL, 'F'},
+		{"channels",	required_argument, NULL, 'k'},
+		{"dither",	no_argument, NULL, 'd'},
+		{"rtp",		required_argument, NULL, 'X'},
+		{"rtp-format",	required_argument, NULL, 'Y'},
+		{"audio",	required_argument, NULL, 'a'},
+		{"audio-rate",	required_argument, NULL, 'b'},
+		{"audio-level",	required_argument, NULL, 'l'},
+		{"preemphasis",	required_argument, NULL, 'E'},
+		{"stations",	required_argument, NULL, 'n'},
+		{"threads",	required_argument, NULL, 't'},
+		{"stream-threads", required_argument, NULL, 'j'},
+		{"verify",	no_argument, NULL, 'V'},
 
 		{"help",	no_argument, NULL, 'h'},
 		{"version",	no_argument, NULL, 'v'},
@@ -284,11 +1112,13 @@ keep_parsing_opts:
 			break;
 
 		case 's': /* ps */
-			memcpy(rds_params.ps, xlat((unsigned char *)optarg), PS_LENGTH);
+			xlat((unsigned char *)optarg, rds_params.ps,
+				PS_LENGTH);
 			break;
 
 		case 'r': /* rt */
-			memcpy(rds_params.rt, xlat((unsigned char *)optarg), RT_LENGTH);
+			xlat((unsigned char *)optarg, rds_params.rt,
+				RT_LENGTH);
 			break;
 
 		case 'p': /* pty */
@@ -308,13 +1138,166 @@ keep_parsing_opts:
 			break;
 
 		case 'P': /* ptyn */
-			memcpy(rds_params.ptyn, xlat((unsigned char *)optarg), PTYN_LENGTH);
+			xlat((unsigned char *)optarg, rds_params.ptyn,
+				PTYN_LENGTH);
+			break;
+
+#ifdef RDS2
+		case 'f': /* rft */
+			if (add_rft_file(optarg) > 0) return 1;
 			break;
 
+#endif
 		case 'C': /* ctl */
 			memcpy(control_pipe, optarg, 50);
 			break;
 
+		case 'c': /* port */
+			port = strtoul(optarg, NULL, 10);
+			if (port == 0) {
+				fprintf(stderr, "Invalid control port.\n");
+				return 1;
+			}
+			break;
+
+		case 'e': /* uecp */
+			uecp_port = strtoul(optarg, NULL, 10);
+			if (uecp_port == 0) {
+				fprintf(stderr, "Invalid UECP port.\n");
+				return 1;
+			}
+			break;
+
+		case 'U': /* udp */
+			proto = 0;
+			break;
+
+		case 'M': /* metrics */
+			metrics_port = strtoul(optarg, NULL, 10);
+			if (metrics_port == 0) {
+				fprintf(stderr, "Invalid metrics port.\n");
+				return 1;
+			}
+			break;
+
+		case 'O': /* out-rate */
+			out_rate = strtoul(optarg, NULL, 10);
+			if (check_out_rate(out_rate) > 0) return 1;
+			break;
+
+		case 'N': /* native */
+			native_rate = 1;
+			break;
+
+		case 'L': /* latency */
+			latency = strtoul(optarg, NULL, 10);
+			if (check_latency(latency) > 0) return 1;
+			break;
+
+		case 'K': /* ct-latency */
+			ct_latency = strtol(optarg, NULL, 10);
+			if (ct_latency < 0 || ct_latency > UINT16_MAX) {
+				fprintf(stderr, "CT latency must be between "
+					"0-%u ms.\n", UINT16_MAX);
+				return 1;
+			}
+			break;
+
+		case 'o': /* output */
+			output_file = optarg;
+			break;
+
+		case 'D': /* duration */
+			duration = strtod(optarg, NULL);
+			if (duration < 0.0) {
+				fprintf(stderr, "Duration can't be negative.\n");
+				return 1;
+			}
+			break;
+
+		case 'F': /* format */
+			sample_fmt = get_sample_format(optarg);
+			if (sample_fmt < 0) {
+				fprintf(stderr, "Unknown sample format: %s.\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'k': /* channels */
+			if (parse_sink_channels(optarg, &sink) < 0) {
+				fprintf(stderr, "Invalid output channels: %s "
+					"(1 to %u channels).\n", optarg,
+					MAX_SINK_CHANNELS);
+				return 1;
+			}
+			have_channels = true;
+			break;
+
+		case 'd': /* dither */
+			sink.dither = true;
+			break;
+
+		case 'X': /* rtp */
+			rtp_dest = optarg;
+			break;
+
+		case 'Y': /* rtp-format */
+			if (strcasecmp(optarg, "L16") == 0) {
+				rtp_bits = 16;
+			} else if (strcasecmp(optarg, "L24") == 0) {
+				rtp_bits = 24;
+			} else {
+				fprintf(stderr, "Unknown RTP format: %s.\n",
+					optarg);
+				return 1;
+			}
+			break;
+
+		case 'a': /* audio */
+			audio_file = optarg;
+			break;
+
+		case 'b': /* audio-rate */
+			audio_rate = strtoul(optarg, NULL, 10);
+			if (audio_rate == 0) {
+				fprintf(stderr, "Invalid audio rate.\n");
+				return 1;
+			}
+			break;
+
+		case 'l': /* audio-level */
+			audio_level = strtof(optarg, NULL);
+			if (check_audio_level(audio_level) > 0) return 1;
+			break;
+
+		case 'E': /* preemphasis */
+			if (check_preemphasis(strtoul(optarg, NULL, 10)) > 0)
+				return 1;
+			preemphasis = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n': /* stations */
+			if (check_stations(strtoul(optarg, NULL, 10)) > 0)
+				return 1;
+			num_stations = strtoul(optarg, NULL, 10);
+			break;
+
+		case 't': /* threads */
+			if (check_threads(strtoul(optarg, NULL, 10)) > 0)
+				return 1;
+			threads = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'j': /* stream-threads */
+			if (check_stream_threads(strtoul(optarg, NULL, 10)) > 0)
+				return 1;
+			stream_threads = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'V': /* verify */
+			verify = true;
+			break;
+
 		case 'v': /* version */
 			show_version();
 			return 0;
@@ -330,58 +1313,176 @@ keep_parsing_opts:
 
 done_parsing_opts:
 
+	if (output_file && num_stations > 1 &&
+		strcmp(output_file, "-") == 0) {
+		fprintf(stderr, "Only one station can be rendered to stdout.\n");
+		return 1;
+	}
+
+	if (output_file && rtp_dest) {
+		fprintf(stderr, "Either render to a file or send over RTP.\n");
+		return 1;
+	}
+
+	if (rtp_dest) {
+		/* -Y picks the samples, and AES67 streams are mono */
+		sink.sample_fmt = rtp_bits == 16 ?
+			SAMPLE_FMT_S16 : SAMPLE_FMT_S24;
+		if (!have_channels) {
+			sink.channels = 1;
+			sink.mask = 1;
+		}
+	} else {
+		sink.sample_fmt = (uint8_t)sample_fmt;
+	}
+
+	if (!output_file && sink.sample_fmt == SAMPLE_FMT_F32) {
+		fprintf(stderr, "Floating point samples can only be "
+			"rendered to a file.\n");
+		return 1;
+	}
+
+	/* a rendered file is heard as it is made */
+	if (ct_latency < 0) ct_latency = output_file ? 0 : (int32_t)latency;
+
+	if (audio_file && num_stations > 1 && strcmp(audio_file, "-") == 0) {
+		fprintf(stderr, "Only one station can take audio from stdin.\n");
+		return 1;
+	}
+
 #ifdef _WIN32
 	/* No pthread init needed on Windows */
 #else
 	/* Initialize pthread stuff */
-	pthread_mutex_init(&control_pipe_mutex, NULL);
-	pthread_cond_init(&control_pipe_cond, NULL);
-	pthread_mutex_init(&net_ctl_mutex, NULL);
-	pthread_cond_init(&net_ctl_cond, NULL);
 	pthread_attr_init(&attr);
 #endif
 
-	/* Setup buffers */
-	mpx_buffer = malloc(NUM_MPX_FRAMES_IN * 2 * sizeof(float));
-	out_buffer = malloc(NUM_MPX_FRAMES_OUT * 2 * sizeof(float));
-	dev_out = malloc(NUM_MPX_FRAMES_OUT * 2 * sizeof(int16_t) * sizeof(char));
-
 	/* Gracefully stop the encoder on SIGINT or SIGTERM */
 #ifdef _WIN32
 	SetConsoleCtrlHandler(console_ctrl_handler, TRUE);
 #else
 	signal(SIGINT, stop);
 	signal(SIGTERM, stop);
+	/* report a closed stdout pipe as a write error instead */
+	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	/* Initialize the baseband generator */
-	fm_mpx_init(MPX_SAMPLE_RATE);
-	set_output_volume(volume);
+	/*
+	 * Initialize the stations
+	 *
+	 * Each has its own RDS encoder and baseband generator. In
+	 * native mode everything runs at the output rate and the
+	 * resampler is skipped
+	 */
+	mpx_rate = native_rate ? out_rate : MPX_SAMPLE_RATE;
+
+	memset(&cfg, 0, sizeof(struct output_cfg_t));
+	cfg.file = output_file;
+	cfg.sink = sink;
+	cfg.duration = duration;
+	cfg.mpx_rate = mpx_rate;
+	cfg.out_rate = out_rate;
+	cfg.native = native_rate;
+	cfg.latency = latency;
+	cfg.rtp_dest = rtp_dest;
+
+	/* Offline rendering and RTP replace the sound card */
+	if (!output_file && !rtp_dest) {
+		/* AO format */
+		cfg.ao_format.channels = sink.channels;
+		cfg.ao_format.bits = get_sample_size(sink.sample_fmt) * 8;
+		cfg.ao_format.rate = out_rate;
+		cfg.ao_format.byte_format = AO_FMT_LITTLE;
+
+		start_audio_open(&audio_open, &cfg, num_stations);
+		ao_running = true;
+	}
 
-	/* Initialize the RDS modulator */
-	init_rds_encoder(rds_params);
+	for (uint8_t i = 0; i < num_stations; i++) {
+		if (init_station(&stations[i], i + 1, rds_params,
+			mpx_rate) < 0) {
+			fprintf(stderr, "Could not create station %u.\n",
+				i + 1);
+			goto exit;
+		}
+		num_started++;
 
-	/* AO format */
-	memset(&format, 0, sizeof(struct ao_sample_format));
-	format.channels = 2;
-	format.bits = 16;
-	format.rate = OUTPUT_SAMPLE_RATE;
-	format.byte_format = AO_FMT_LITTLE;
+		if (set_station_stream_threads(&stations[i],
+			stream_threads) < 0) {
+			fprintf(stderr, "Could not start the stream threads "
+				"of station %u.\n", i + 1);
+			goto exit;
+		}
 
-	ao_initialize();
+		if (verify && set_station_verify(&stations[i], true) < 0) {
+			fprintf(stderr, "Could not create the decoder of "
+				"station %u.\n", i + 1);
+			goto exit;
+		}
+
+#ifdef RDS2
+		for (uint8_t j = 0; j < num_rft_files; j++) {
+			add_rds2_file(get_rds2_encoder(stations[i].rds),
+				j + 1, j + 1, rft_shares[j], rft_paths[j]);
+		}
+		/* loads the files while the rest is set up */
+		start_rds2_encoder(get_rds2_encoder(stations[i].rds));
+#endif
+
+		/* audio files are named like the outputs */
+		if (audio_file) {
+			station_name(name, sizeof(name), audio_file, i + 1);
+			outputs[i].input = open_audio_input(name, audio_rate);
+			if (outputs[i].input == NULL ||
+				set_mpx_audio_input(stations[i].mpx,
+				outputs[i].input, preemphasis) < 0) {
+				fprintf(stderr, "Could not set up the audio of "
+					"station %u.\n", i + 1);
+				goto exit;
+			}
+			/* a file must not run out while rendering */
+			set_audio_input_blocking(outputs[i].input,
+				output_file != NULL);
+			set_audio_volume(stations[i].mpx, audio_level);
+			if (i == 0) {
+				fprintf(stderr, "Audio input: %s at %u Hz.\n",
+					name,
+					get_audio_input_rate(outputs[i].input));
+			}
+		}
+
+		set_output_volume(stations[i].mpx, volume);
+		set_rds_ct_latency(stations[i].rds, (uint16_t)ct_latency);
+		set_rds_ct_live(stations[i].rds, output_file == NULL);
+		stations[i].ready = output_ready;
+		stations[i].output = output_frames;
+		stations[i].ctx = &outputs[i];
+		outputs[i].id = i + 1;
+		outputs[i].metrics = stations[i].metrics;
+	}
+	fprintf(stderr, "MPX kernels: %s\n",
+		get_mpx_kernel_name(stations[0].mpx));
+
+	if (output_file) goto open_outputs;
+	if (rtp_dest) {
+#ifdef _WIN32
+		net_init();
+#endif
+		goto open_outputs;
+	}
+
+	wait_audio_open(&audio_open);
 
 	{
-		int default_driver = ao_default_driver_id();
 		ao_info *driver_info = NULL;
 
-		if (default_driver < 0) {
+		if (cfg.driver < 0) {
 			fprintf(stderr, "Error: ao_default_driver_id() returned %d "
-				"(no usable audio driver found).\n", default_driver);
-			ao_shutdown();
+				"(no usable audio driver found).\n", cfg.driver);
 			goto exit;
 		}
 
-		driver_info = ao_driver_info(default_driver);
+		driver_info = ao_driver_info(cfg.driver);
 		if (driver_info) {
 			fprintf(stderr, "Audio driver: %s (%s), type: %s\n",
 				driver_info->name,
@@ -389,200 +1490,203 @@ done_parsing_opts:
 				driver_info->type == AO_TYPE_LIVE ? "live" : "file");
 		} else {
 			fprintf(stderr, "Warning: could not query driver info for driver %d.\n",
-				default_driver);
+				cfg.driver);
 		}
 
-		fprintf(stderr, "Opening audio device: %d-bit, %d channels, %d Hz...\n",
-			format.bits, format.channels, format.rate);
+		fprintf(stderr, "Audio device: %d-bit, %d channels, %d Hz\n",
+			cfg.ao_format.bits, cfg.ao_format.channels,
+			cfg.ao_format.rate);
+	}
 
-		device = ao_open_live(default_driver, &format, NULL);
-		if (device == NULL) {
-			fprintf(stderr, "Error: cannot open sound device "
-				"(driver=%d, rate=%d, bits=%d, channels=%d).\n",
-				default_driver, format.rate, format.bits, format.channels);
-			fprintf(stderr, "Hint: your audio driver may not support %d Hz. "
-				"Check system audio settings.\n", format.rate);
-#ifdef _WIN32
-			fprintf(stderr, "Windows: try setting your sound device to "
-				"192000 Hz in Sound Settings > Properties > Advanced.\n");
+open_outputs:
+	if (native_rate) {
+		fprintf(stderr, "Resampler bypassed (native rate).\n");
+	} else {
+		fprintf(stderr, "Resampler: ratio=%.6f, in_frames=%d, out_frames=%d\n",
+			(double)out_rate / (double)mpx_rate,
+			NUM_MPX_FRAMES_IN, NUM_MPX_FRAMES_OUT);
+	}
+
+#ifdef RDS2
+	/*
+	 * The files were loaded while the sound card was opened. They
+	 * are waited for so that every run starts the same.
+	 */
+	for (uint8_t i = 1; i < num_stations; i++)
+		wait_rds2_encoder(get_rds2_encoder(stations[i].rds));
+	show_rft_files(get_rds2_encoder(stations[0].rds));
 #endif
-			ao_shutdown();
-			goto exit;
-		}
 
-		fprintf(stderr, "Audio device opened successfully.\n");
+	for (uint8_t i = 0; i < num_stations; i++) {
+		if (open_station_output(&outputs[i], &cfg) < 0) goto exit;
 	}
 
-	/* SRC out (MPX -> output) */
-	memset(&src_data, 0, sizeof(SRC_DATA));
-	src_data.input_frames = NUM_MPX_FRAMES_IN;
-	src_data.output_frames = NUM_MPX_FRAMES_OUT;
-	src_data.src_ratio =
-		(double)OUTPUT_SAMPLE_RATE / (double)MPX_SAMPLE_RATE;
-	src_data.data_in = mpx_buffer;
-	src_data.data_out = out_buffer;
-
-	fprintf(stderr, "Resampler: ratio=%.6f, in_frames=%d, out_frames=%d\n",
-		src_data.src_ratio, NUM_MPX_FRAMES_IN, NUM_MPX_FRAMES_OUT);
-
-	r = resampler_init(&src_state, 2);
-	if (r < 0) {
-		fprintf(stderr, "Could not create output resampler.\n");
-		goto exit;
+	if (!output_file) {
+		if (!rtp_dest)
+			fprintf(stderr, "Audio device opened successfully.\n");
+		fprintf(stderr, "Output latency: %u ms (%lu frames), "
+			"period: %lu frames\n", latency,
+			(unsigned long)outputs[0].latency_frames,
+			(unsigned long)outputs[0].period);
 	}
 
-	fprintf(stderr, "Resampler initialized.\n");
+	if (init_event_loop() < 0) {
+		fprintf(stderr, "Could not initialize the event loop.\n");
+		goto exit;
+	}
 
-	/* Initialize the control pipe reader */
-	if (control_pipe[0]) {
-		if (open_control_pipe(control_pipe) == 0) {
-			fprintf(stderr, "Reading control commands on %s.\n", control_pipe);
-			/* Create control pipe polling worker */
+	/*
+	 * Control inputs
+	 *
+	 * Every station has its own pipe and ports: station 1 uses the
+	 * given name and ports, station n gets "-n" added to the pipe
+	 * name and n - 1 added to the ports
+	 */
 #ifdef _WIN32
-			control_pipe_thread = CreateThread(NULL, 0, control_pipe_worker, NULL, 0, NULL);
-			if (control_pipe_thread == NULL) {
-#else
-			r = pthread_create(&control_pipe_thread, &attr, control_pipe_worker, NULL);
-			if (r < 0) {
+	if (port || uecp_port || metrics_port) net_init();
 #endif
-				fprintf(stderr, "Could not create control pipe thread.\n");
-				control_pipe[0] = 0;
-				goto exit;
+	for (uint8_t i = 0; i < num_stations; i++) {
+		if (control_pipe[0]) {
+			station_name(name, sizeof(name), control_pipe, i + 1);
+			if (open_control_pipe(name, &stations[i]) == 0) {
+				fprintf(stderr, "Reading control commands on %s.\n",
+					name);
+				have_pipe = true;
 			} else {
-				fprintf(stderr, "Created control pipe thread.\n");
+				fprintf(stderr, "Failed to open control pipe: %s.\n",
+					name);
 			}
-		} else {
-			fprintf(stderr, "Failed to open control pipe: %s.\n", control_pipe);
-			control_pipe[0] = 0;
+		}
+
+		/* ASCII and UECP control over network sockets */
+		if (port && port + i <= UINT16_MAX &&
+			open_ctl_socket(port + i, proto, &stations[i]) == 0) {
+			fprintf(stderr, "Reading control commands on %s port %u.\n",
+				proto ? "TCP" : "UDP", port + i);
+			have_socket = true;
+		} else if (port) {
+			fprintf(stderr, "Failed to open port %u.\n", port + i);
+		}
+
+		if (uecp_port && uecp_port + i <= UINT16_MAX &&
+			open_uecp_socket(uecp_port + i, proto,
+			&stations[i]) == 0) {
+			fprintf(stderr, "Reading UECP frames on %s port %u.\n",
+				proto ? "TCP" : "UDP", uecp_port + i);
+			have_socket = true;
+		} else if (uecp_port) {
+			fprintf(stderr, "Failed to open port %u.\n",
+				uecp_port + i);
 		}
 	}
 
-	/* ASCII control over network socket */
-	if (port) {
+	/* one endpoint for all stations */
+	if (metrics_port && open_metrics_socket(metrics_port) == 0) {
+		fprintf(stderr, "Serving metrics on TCP port %u.\n",
+			metrics_port);
+		have_socket = true;
+	} else if (metrics_port) {
+		fprintf(stderr, "Failed to open port %u.\n", metrics_port);
+	}
 #ifdef _WIN32
-		net_init();
+	if ((port || uecp_port || metrics_port) && !have_socket)
+		net_cleanup();
 #endif
-		if (open_ctl_socket(port, proto) == 0) {
-			fprintf(stderr, "Reading control commands on port %d.\n", port);
+
+	if (have_pipe || have_socket) {
+		/* Create control I/O worker */
 #ifdef _WIN32
-			net_ctl_thread = CreateThread(NULL, 0, net_ctl_worker, NULL, 0, NULL);
-			if (net_ctl_thread == NULL) {
+		ctl_thread = CreateThread(NULL, 0, ctl_worker, NULL, 0, NULL);
+		if (ctl_thread == NULL) {
 #else
-			r = pthread_create(&net_ctl_thread, &attr, net_ctl_worker, NULL);
-			if (r < 0) {
+		r = pthread_create(&ctl_thread, &attr, ctl_worker, NULL);
+		if (r != 0) {
 #endif
-				fprintf(stderr, "Could not create network control thread.\n");
-				goto exit;
-			} else {
-				fprintf(stderr, "Created network control thread.\n");
-			}
+			fprintf(stderr, "Could not create control thread.\n");
+			goto exit;
 		} else {
-			fprintf(stderr, "Failed to open port %d.\n", port);
+			fprintf(stderr, "Created control thread.\n");
+			ctl_running = true;
 		}
 	}
 
-	fprintf(stderr, "Entering main loop (generating RDS at %d Hz, "
-		"output at %d Hz)...\n", MPX_SAMPLE_RATE, OUTPUT_SAMPLE_RATE);
+	if (threads == 0) threads = get_cpu_count();
+	if (threads > num_stations) threads = num_stations;
 
-	{
-		unsigned long loop_count = 0;
-		unsigned long total_frames = 0;
-
-		for (;;) {
-			if (loop_count < 3)
-				fprintf(stderr, "[iter %lu] Generating MPX frames...\n", loop_count);
-
-			fm_rds_get_frames(mpx_buffer, NUM_MPX_FRAMES_IN);
-
-			if (loop_count < 3)
-				fprintf(stderr, "[iter %lu] Resampling...\n", loop_count);
-
-			if (resample(src_state, src_data, &frames) < 0) {
-				fprintf(stderr, "Error: resampler failed at iteration %lu "
-					"(total frames: %lu).\n", loop_count, total_frames);
-				break;
-			}
-
-			if (frames == 0) {
-				fprintf(stderr, "Warning: resampler produced 0 frames at "
-					"iteration %lu.\n", loop_count);
-				continue;
-			}
+	if (num_stations > 1) {
+		fprintf(stderr, "Rendering %u stations (render threads: %u).\n",
+			num_stations, threads);
+	}
+	if (stream_threads > 1) {
+		fprintf(stderr, "Rendering the RDS streams on %u threads "
+			"per station.\n", stream_threads);
+	}
 
-			if (loop_count < 3)
-				fprintf(stderr, "[iter %lu] Converting %lu frames...\n",
-					loop_count, (unsigned long)frames);
+	fprintf(stderr, "Entering main loop (generating RDS at %d Hz, "
+		"output at %u Hz)...\n", mpx_rate, out_rate);
 
-			float2char2channel(out_buffer, dev_out, frames);
+	render_start = metrics_now_ns();
 
-			if (loop_count < 3)
-				fprintf(stderr, "[iter %lu] Playing %lu bytes...\n",
-					loop_count, (unsigned long)(frames * 2 * sizeof(int16_t)));
+	run_stations(stations, num_stations, threads, &stop_rds);
 
-			/* num_bytes = audio frames * channels * bytes per sample */
-			if (!ao_play(device, dev_out, frames * 2 * sizeof(int16_t))) {
-				fprintf(stderr, "Error: ao_play failed at iteration %lu "
-					"(total frames: %lu, buffer size: %lu bytes).\n",
-					loop_count, total_frames,
-					(unsigned long)(frames * 2 * sizeof(int16_t)));
-				break;
-			}
+	for (uint8_t i = 0; i < num_stations; i++) {
+		fprintf(stderr, "Station %u stopped after %lu iterations "
+			"(%lu total frames).\n", outputs[i].id,
+			outputs[i].loop_count, outputs[i].total_frames);
+		if (stations[i].decoder) show_verify(&stations[i]);
+	}
 
-			total_frames += frames;
-			loop_count++;
+	/* also stops the threads if the stations stopped on their own */
+	atomic_store(&stop_rds, true);
 
-			if (loop_count == 1) {
-				fprintf(stderr, "RDS output started successfully.\n");
-			}
-
-			if (stop_rds) {
-				fprintf(stderr, "Stopping after %lu iterations "
-					"(%lu total frames).\n", loop_count, total_frames);
-				break;
-			}
-		}
+	if (output_file) {
+		fprintf(stderr, "Rendered in %.2f s.\n",
+			metrics_since_ns(render_start) / 1e9);
 	}
 
-	resampler_exit(src_state);
-	ao_close(device);
-
 exit:
-	if (control_pipe[0]) {
+	/* stops the output threads if we got here on an error */
+	atomic_store(&stop_rds, true);
+
+	if (ctl_running) {
 		/* shut down threads */
-		fprintf(stderr, "Waiting for pipe thread to shut down.\n");
+		fprintf(stderr, "Waiting for control thread to shut down.\n");
+		stop_event_loop();
 #ifdef _WIN32
-		WaitForSingleObject(control_pipe_thread, INFINITE);
-		CloseHandle(control_pipe_thread);
+		WaitForSingleObject(ctl_thread, INFINITE);
+		CloseHandle(ctl_thread);
 #else
-		pthread_cond_signal(&control_pipe_cond);
-		pthread_join(control_pipe_thread, NULL);
+		pthread_join(ctl_thread, NULL);
 #endif
 	}
 
-	if (port) {
-		fprintf(stderr, "Waiting for net socket thread to shut down.\n");
+	if (have_pipe) close_control_pipe();
+
+	if (have_socket) {
+		close_ctl_socket();
 #ifdef _WIN32
-		WaitForSingleObject(net_ctl_thread, INFINITE);
-		CloseHandle(net_ctl_thread);
 		net_cleanup();
-#else
-		pthread_cond_signal(&net_ctl_cond);
-		pthread_join(net_ctl_thread, NULL);
 #endif
 	}
 
+	exit_event_loop();
+
+	/* in case the stations couldn't be set up */
+	wait_audio_open(&audio_open);
+	for (uint8_t i = 0; i < num_stations; i++)
+		close_station_output(&outputs[i]);
+#ifdef _WIN32
+	if (rtp_dest) net_cleanup();
+#endif
+
 #ifndef _WIN32
 	pthread_attr_destroy(&attr);
 #endif
 
-	ao_shutdown();
-
-	fm_mpx_exit();
-	exit_rds_encoder();
+	if (ao_running) ao_shutdown();
 
-	free(mpx_buffer);
-	free(out_buffer);
-	free(dev_out);
+	for (uint8_t i = 0; i < num_started; i++)
+		exit_station(&stations[i]);
 
 	fprintf(stderr, "Cleanup complete.\n");
 
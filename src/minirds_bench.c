@@ -0,0 +1,567 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * MiniRDS benchmark
+ *
+ * Times each stage of the MPX pipeline on its own and reports
+ * ns per unit, the realtime factor and (on x86) TSC cycles per unit,
+ * either as a table or as JSON for tracking regressions. The output
+ * of a fresh generator is also decoded again, and any bad block makes
+ * the benchmark fail, so a faster stage can't quietly break the MPX.
+ */
+
+#include "common.h"
+
+#ifdef _WIN32
+  #include "getopt.h"
+#else
+  #include <getopt.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_TSC
+#elif defined(_M_X64) || defined(_M_IX86)
+  #include <intrin.h>
+  #define HAVE_TSC
+#endif
+
+#include "rds.h"
+#include "fm_mpx.h"
+#include "modulator.h"
+#include "resampler.h"
+#include "convert.h"
+#include "lib.h"
+#include "work_pool.h"
+#include "rds_decoder.h"
+#ifdef RDS2
+#include "rds2.h"
+#endif
+
+#define DEFAULT_MIN_TIME	0.2
+
+/* seconds of MPX the decoder checks */
+#define VERIFY_TIME		10
+
+/* block sizes to try */
+static const size_t block_sizes[] = {64, 256, 1024, NUM_MPX_FRAMES_IN};
+#define NUM_BLOCK_SIZES	(sizeof(block_sizes) / sizeof(block_sizes[0]))
+
+#define MAX_RESULTS	128
+
+typedef struct bench_result_t {
+	char *stage;
+	int8_t stream;		/* -1 if not applicable */
+	size_t block;
+	char *unit;
+	double ns_per_unit;
+	double realtime;	/* units per second / units needed per second */
+	double cycles_per_unit;	/* 0 if unknown */
+} bench_result_t;
+
+static struct bench_result_t results[MAX_RESULTS];
+static uint16_t num_results;
+
+/* minimum measuring time per result in seconds */
+static double min_time = DEFAULT_MIN_TIME;
+
+/* what is being measured */
+static struct rds_encoder_t *enc;
+static struct mpx_generator_t *mpx;
+static struct rds_modulator_t *mod;
+static struct work_pool_t *pool;
+
+/* buffers */
+static float *mpx_buffer;
+static float *out_buffer;
+static float *envelope;
+static uint8_t *dev_out;
+
+/* resampler */
+static SRC_STATE *src_state;
+static SRC_DATA src_data;
+
+/* output conversions, the first is what the sound card gets */
+static const struct {
+	char *name;
+	struct sink_format_t fmt;
+} sinks[] = {
+	{"convert s16/2", {SAMPLE_FMT_S16, 2, 3, false, false}},
+	{"convert s16/2 dither", {SAMPLE_FMT_S16, 2, 3, false, true}},
+	{"convert s24/2", {SAMPLE_FMT_S24, 2, 3, false, false}},
+	{"convert s24/1 be", {SAMPLE_FMT_S24, 1, 1, true, false}}
+};
+#define NUM_SINKS	(sizeof(sinks) / sizeof(sinks[0]))
+
+static struct converter_t *conv;
+
+static struct rds_decoder_t *dec;
+
+/* blocks the decoder got from a fresh generator, see verify_output */
+static struct decoder_counts_t verify_counts[NUM_STREAMS];
+
+static double get_time_ns() {
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t get_cycles() {
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Stages
+ *
+ * Each processes one block and returns the number of units done
+ */
+typedef size_t (*stage_fn)(int8_t stream, size_t block);
+
+static size_t stage_mpx(int8_t stream, size_t block) {
+	(void)stream;
+	fm_rds_get_frames(mpx, mpx_buffer, block);
+	return block;
+}
+
+static size_t stage_rds_samples(int8_t stream, size_t block) {
+	get_rds_samples(mod, stream, envelope, block);
+	return block;
+}
+
+static size_t stage_rds_sample(int8_t stream, size_t block) {
+	for (size_t i = 0; i < block; i++)
+		envelope[i] = get_rds_sample(mod, stream);
+	return block;
+}
+
+static size_t stage_rds_bits(int8_t stream, size_t block) {
+	uint32_t bits[GROUP_LENGTH];
+
+	(void)block;
+#ifdef RDS2
+	if (stream > 0) {
+		get_rds2_bits(get_rds2_encoder(enc), stream, bits);
+		return 1;
+	}
+#else
+	(void)stream;
+#endif
+	get_rds_bits(enc, bits);
+	return 1;
+}
+
+static size_t stage_resample(int8_t stream, size_t block) {
+	size_t frames;
+
+	(void)stream;
+	src_data.input_frames = block;
+	if (resample(src_state, src_data, &frames) < 0) return 0;
+
+	/* count input frames so the realtime factor is comparable */
+	return block;
+}
+
+static size_t stage_convert(int8_t stream, size_t block) {
+	(void)stream;
+	convert_frames(conv, out_buffer, dev_out, block);
+	return block;
+}
+
+static size_t stage_decode(int8_t stream, size_t block) {
+	(void)stream;
+	decode_rds_mpx(dec, mpx_buffer, block);
+	return block;
+}
+
+/*
+ * Run a stage until min_time has passed and record the result
+ *
+ * units_per_sec is how many units real-time operation needs
+ */
+static void run_stage(char *name, stage_fn fn, int8_t stream,
+	size_t block, char *unit, double units_per_sec) {
+	struct bench_result_t *res;
+	double start, elapsed;
+	uint64_t start_cycles, cycles;
+	uint64_t units = 0;
+	size_t done;
+
+	if (num_results == MAX_RESULTS) return;
+
+	/* warm up */
+	fn(stream, block);
+
+	start = get_time_ns();
+	start_cycles = get_cycles();
+	do {
+		done = fn(stream, block);
+		if (done == 0) {
+			fprintf(stderr, "%s failed, skipping.\n", name);
+			return;
+		}
+		units += done;
+		elapsed = get_time_ns() - start;
+	} while (elapsed < min_time * 1e9);
+	cycles = get_cycles() - start_cycles;
+
+	res = &results[num_results++];
+	res->stage = name;
+	res->stream = stream;
+	res->block = block;
+	res->unit = unit;
+	res->ns_per_unit = elapsed / units;
+	res->realtime = (units / (elapsed / 1e9)) / units_per_sec;
+	res->cycles_per_unit = (double)cycles / units;
+}
+
+static void run_all(uint32_t sample_rate) {
+	/* 1187.5 bits per second */
+	const double groups_per_sec =
+		(double)RDS_BIT_RATE_NUM / RDS_BIT_RATE_DEN / BITS_PER_GROUP;
+	size_t b;
+	int8_t s;
+
+	for (b = 0; b < NUM_BLOCK_SIZES; b++) {
+		run_stage("fm_rds_get_frames", stage_mpx, -1,
+			block_sizes[b], "frame", sample_rate);
+	}
+
+	for (s = 0; s < NUM_STREAMS; s++) {
+		for (b = 0; b < NUM_BLOCK_SIZES; b++) {
+			run_stage("get_rds_samples", stage_rds_samples, s,
+				block_sizes[b], "sample", sample_rate);
+		}
+		run_stage("get_rds_sample", stage_rds_sample, s,
+			1, "sample", sample_rate);
+	}
+
+	for (s = 0; s < NUM_STREAMS; s++) {
+		run_stage(s ? "get_rds2_bits" : "get_rds_bits",
+			stage_rds_bits, s, 1, "group", groups_per_sec);
+	}
+
+	for (b = 0; b < NUM_BLOCK_SIZES; b++) {
+		run_stage("decode_rds_mpx", stage_decode, -1,
+			block_sizes[b], "frame", sample_rate);
+	}
+
+	for (b = 0; b < NUM_BLOCK_SIZES; b++) {
+		run_stage("resample", stage_resample, -1,
+			block_sizes[b], "frame", sample_rate);
+	}
+
+	for (uint8_t k = 0; k < NUM_SINKS; k++) {
+		conv = init_converter(&sinks[k].fmt);
+		if (conv == NULL) continue;
+		for (b = 0; b < NUM_BLOCK_SIZES; b++) {
+			run_stage(sinks[k].name, stage_convert, -1,
+				block_sizes[b], "frame", OUTPUT_SAMPLE_RATE);
+		}
+		exit_converter(conv);
+	}
+}
+
+/*
+ * Decode the output of a fresh generator
+ *
+ * The decoder has to start with the generator, so this can't use the
+ * one that is timed. Returns -1 if a stream had a bad block or none
+ * at all, which means the MPX is broken.
+ */
+static int verify_output(uint32_t sample_rate, struct rds_params_t params) {
+	struct rds_encoder_t *venc;
+	struct mpx_generator_t *vmpx;
+	struct rds_decoder_t *vdec;
+	size_t frames;
+	int ret = 0;
+
+	venc = init_rds_encoder(params);
+	vmpx = fm_mpx_init(sample_rate, venc);
+	vdec = init_rds_decoder(sample_rate);
+	if (venc == NULL || vmpx == NULL || vdec == NULL) {
+		ret = -1;
+		goto exit;
+	}
+	/* rendered faster than real time */
+	set_rds_ct_live(venc, 0);
+	set_output_volume(vmpx, 50.0f);
+#ifdef RDS2
+	wait_rds2_encoder(get_rds2_encoder(venc));
+#endif
+
+	for (frames = 0; frames < (size_t)sample_rate * VERIFY_TIME;
+		frames += NUM_MPX_FRAMES_IN) {
+		fm_rds_get_frames(vmpx, mpx_buffer, NUM_MPX_FRAMES_IN);
+		decode_rds_mpx(vdec, mpx_buffer, NUM_MPX_FRAMES_IN);
+	}
+
+	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+		get_decoder_counts(vdec, i, &verify_counts[i]);
+		if (verify_counts[i].blocks == 0 || verify_counts[i].errors)
+			ret = -1;
+	}
+
+exit:
+	exit_rds_decoder(vdec);
+	if (vmpx) fm_mpx_exit(vmpx);
+	if (venc) exit_rds_encoder(venc);
+	return ret;
+}
+
+static void show_table() {
+	struct bench_result_t *res;
+
+	printf("%-20s %6s %6s %12s %12s %12s\n", "stage", "stream",
+		"block", "ns/unit", "realtime", "cycles/unit");
+
+	for (uint16_t i = 0; i < num_results; i++) {
+		res = &results[i];
+		printf("%-20s ", res->stage);
+		if (res->stream >= 0)
+			printf("%6d ", res->stream);
+		else
+			printf("%6s ", "-");
+		printf("%6lu %12.2f %11.1fx ", (unsigned long)res->block,
+			res->ns_per_unit, res->realtime);
+#ifdef HAVE_TSC
+		printf("%12.2f\n", res->cycles_per_unit);
+#else
+		printf("%12s\n", "-");
+#endif
+	}
+
+	printf("\n");
+	for (int8_t s = 0; s < NUM_STREAMS; s++) {
+		printf("decoded stream %d: %llu blocks, %llu bad\n", s,
+			(unsigned long long)verify_counts[s].blocks,
+			(unsigned long long)verify_counts[s].errors);
+	}
+}
+
+static void show_json(uint32_t sample_rate) {
+	struct bench_result_t *res;
+
+	printf("{\n");
+	printf("  \"version\": \"%s\",\n", VERSION);
+	printf("  \"kernels\": \"%s\",\n", get_mpx_kernel_name(mpx));
+#ifdef RDS2
+	printf("  \"rds2\": true,\n");
+#else
+	printf("  \"rds2\": false,\n");
+#endif
+	printf("  \"streams\": %d,\n", NUM_STREAMS);
+	printf("  \"sample_rate\": %u,\n", sample_rate);
+#ifdef HAVE_TSC
+	printf("  \"cycle_counter\": \"tsc\",\n");
+#else
+	printf("  \"cycle_counter\": null,\n");
+#endif
+	printf("  \"results\": [\n");
+
+	for (uint16_t i = 0; i < num_results; i++) {
+		res = &results[i];
+		printf("    {\"stage\": \"%s\", ", res->stage);
+		if (res->stream >= 0)
+			printf("\"stream\": %d, ", res->stream);
+		else
+			printf("\"stream\": null, ");
+		printf("\"block\": %lu, \"unit\": \"%s\", ",
+			(unsigned long)res->block, res->unit);
+		printf("\"ns_per_unit\": %.3f, \"realtime\": %.3f, ",
+			res->ns_per_unit, res->realtime);
+#ifdef HAVE_TSC
+		printf("\"cycles_per_unit\": %.3f}", res->cycles_per_unit);
+#else
+		printf("\"cycles_per_unit\": null}");
+#endif
+		printf("%s\n", i + 1 < num_results ? "," : "");
+	}
+
+	printf("  ],\n");
+	printf("  \"verify\": [\n");
+	for (int8_t s = 0; s < NUM_STREAMS; s++) {
+		printf("    {\"stream\": %d, \"blocks\": %llu, "
+			"\"errors\": %llu}%s\n", s,
+			(unsigned long long)verify_counts[s].blocks,
+			(unsigned long long)verify_counts[s].errors,
+			s + 1 < NUM_STREAMS ? "," : "");
+	}
+	printf("  ]\n");
+	printf("}\n");
+}
+
+static void show_help(char *name) {
+	printf(
+		"This is the MiniRDS benchmark.\n"
+		"Version %s\n"
+		"\n"
+		"Usage: %s [options]\n"
+		"\n"
+		"    -t,--time         Seconds to spend on each measurement\n"
+		"                        [default: %.1f]\n"
+		"    -n,--native       Generate at the output rate (%u Hz)\n"
+		"    -j,--json         Print the results as JSON\n"
+		"    -s,--stream-threads\n"
+		"                      Render the RDS streams of the MPX stage\n"
+		"                      on this many threads [default: 1]\n"
+		"\n"
+		"    -h,--help         Show this help text and exit\n"
+		"\n",
+		VERSION,
+		name,
+		DEFAULT_MIN_TIME,
+		OUTPUT_SAMPLE_RATE
+	);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	int verified;
+	bool json = false;
+	uint8_t stream_threads = 1;
+	uint32_t sample_rate = MPX_SAMPLE_RATE;
+	struct rds_params_t rds_params = {
+		.ps = "MiniRDS",
+		.rt = "MiniRDS: Software RDS encoder",
+		.pi = 0x1000
+	};
+
+	const char	*short_opt = "t:njs:h";
+	struct option	long_opt[] =
+	{
+		{"time",	required_argument, NULL, 't'},
+		{"native",	no_argument, NULL, 'n'},
+		{"json",	no_argument, NULL, 'j'},
+		{"stream-threads", required_argument, NULL, 's'},
+		{"help",	no_argument, NULL, 'h'},
+		{ 0,		0,		0,	0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, short_opt, long_opt, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			min_time = strtod(optarg, NULL);
+			if (min_time <= 0.0) min_time = DEFAULT_MIN_TIME;
+			break;
+		case 'n':
+			sample_rate = OUTPUT_SAMPLE_RATE;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 's':
+			stream_threads = strtoul(optarg, NULL, 10);
+			if (stream_threads < 1) stream_threads = 1;
+			if (stream_threads > MAX_WORK_THREADS)
+				stream_threads = MAX_WORK_THREADS;
+			break;
+		case 'h':
+		default:
+			show_help(argv[0]);
+			return 1;
+		}
+	}
+
+	mpx_buffer = calloc(NUM_MPX_FRAMES_IN, sizeof(float));
+	out_buffer = calloc(NUM_MPX_FRAMES_OUT, sizeof(float));
+	envelope = calloc(NUM_MPX_FRAMES_IN, sizeof(float));
+	dev_out = calloc(NUM_MPX_FRAMES_OUT * MAX_SINK_CHANNELS,
+		sizeof(int32_t));
+
+	enc = init_rds_encoder(rds_params);
+	mpx = fm_mpx_init(sample_rate, enc);
+	if (enc == NULL || mpx == NULL) {
+		fprintf(stderr, "Could not create the encoder.\n");
+		return 1;
+	}
+	set_rds_ct_live(enc, 0);
+	set_output_volume(mpx, 50.0f);
+#ifdef RDS2
+	/* time the RDS2 streams with their files loaded */
+	wait_rds2_encoder(get_rds2_encoder(enc));
+#endif
+
+	if (stream_threads > 1) {
+		pool = init_work_pool(stream_threads);
+		if (pool == NULL || set_mpx_work_pool(mpx, pool) < 0) {
+			fprintf(stderr, "Could not start the stream threads.\n");
+			return 1;
+		}
+	}
+
+	/* the modulator stages get their own, like another station */
+	mod = init_rds_modulator(enc, sample_rate);
+	if (mod == NULL) {
+		fprintf(stderr, "Could not create the modulator.\n");
+		return 1;
+	}
+
+	/* fill the buffers with a real signal */
+	fm_rds_get_frames(mpx, mpx_buffer, NUM_MPX_FRAMES_IN);
+	memcpy(out_buffer, mpx_buffer, NUM_MPX_FRAMES_IN * sizeof(float));
+
+	memset(&src_data, 0, sizeof(SRC_DATA));
+	src_data.output_frames = NUM_MPX_FRAMES_OUT;
+	src_data.src_ratio = (double)OUTPUT_SAMPLE_RATE / sample_rate;
+	src_data.data_in = mpx_buffer;
+	src_data.data_out = out_buffer;
+
+	if (resampler_init(&src_state, 1) < 0) {
+		fprintf(stderr, "Could not create the resampler.\n");
+		return 1;
+	}
+
+	dec = init_rds_decoder(sample_rate);
+	if (dec == NULL) {
+		fprintf(stderr, "Could not create the decoder.\n");
+		return 1;
+	}
+
+	fprintf(stderr, "Benchmarking (%.1f s per measurement)...\n", min_time);
+	run_all(sample_rate);
+
+	verified = verify_output(sample_rate, rds_params);
+	if (verified < 0)
+		fprintf(stderr, "The decoded MPX has errors.\n");
+
+	if (json) {
+		show_json(sample_rate);
+	} else {
+		show_table();
+	}
+
+	resampler_exit(src_state);
+	exit_rds_decoder(dec);
+	exit_rds_modulator(mod);
+	fm_mpx_exit(mpx);
+	if (pool) exit_work_pool(pool);
+	exit_rds_encoder(enc);
+
+	free(mpx_buffer);
+	free(out_buffer);
+	free(envelope);
+	free(dev_out);
+
+	return verified < 0 ? 1 : 0;
+}
@@ -30,10 +30,13 @@
 
 #include "rds.h"
 #include "fm_mpx.h"
+#include "station.h"
 #include "resampler.h"
 #include "modulator.h"
 #include "lib.h"
 #include "ascii_cmd.h"
+#include "metrics.h"
+#include "convert.h"
 
 #ifdef _MSC_VER
 #pragma comment(lib, "comctl32.lib")
@@ -61,15 +64,21 @@
 #define INI_SECTION         "MiniRDS"
 
 /* Timer IDs */
-#define IDT_LOG_TIMER       1
 #define IDT_MONITOR_TIMER   2
-#define IDT_FILEWATCH_TIMER 3
 #define IDT_AUTOSAVE_TIMER  4
-#define LOG_TIMER_MS        100
 #define MONITOR_TIMER_MS    200
-#define FILEWATCH_TIMER_MS  500
 #define AUTOSAVE_DELAY_MS   1500
 
+/* Watched files in directories that cannot be watched are polled */
+#define FILEWATCH_POLL_MS   500
+#define FILE_TEXT_SIZE      1024
+
+/* Messages posted to the main window from the worker threads */
+#define WM_APP_ENGINE_STOPPED   (WM_APP + 1)
+#define WM_APP_LOG              (WM_APP + 2) /* lParam: malloc'd text */
+#define WM_APP_FILE_CHANGED     (WM_APP + 3) /* wParam: watch mask */
+#define WM_APP_RDS_CHANGED      (WM_APP + 4)
+
 /* =======================================================================
  * Control IDs - Main Window
  * ======================================================================= */
@@ -133,6 +142,7 @@ enum {
     IDC_D_LPS, IDC_D_ERT,
     IDC_D_RTP1, IDC_D_RTP2, IDC_D_RTP_STATUS,
     IDC_D_UPTIME, IDC_D_ITERATIONS, IDC_D_RESTARTS,
+    IDC_D_GEN_TIME, IDC_D_PLAY_TIME, IDC_D_SRC_DRIFT,
     IDC_D_PEAK_BAR,
     IDC_D_PEAK_LABEL,
     IDC_D_LOG_EDIT,
@@ -157,6 +167,8 @@ static HFONT g_font_title;
 
 /* Engine state */
 static volatile LONG g_engine_running;
+/* the encoder and generator while the engine is running */
+static struct station_t g_station;
 static volatile LONG g_stop_engine;
 static HANDLE g_engine_thread;
 static volatile LONG g_total_restarts;
@@ -181,12 +193,24 @@ static HANDLE g_stderr_read;
 static HANDLE g_stderr_write;
 
 /* File watch state */
-static struct {
+static struct file_watch_t {
     char path[MAX_PATH];
     FILETIME last_write;
     BOOL active;
 } g_rt_file, g_ps_file, g_rtp_file, g_pt_file;
 
+/* Bit i of a watch mask stands for g_watches[i] */
+#define NUM_FILE_WATCHES 4
+static struct file_watch_t *const g_watches[NUM_FILE_WATCHES] = {
+    &g_rt_file, &g_ps_file, &g_rtp_file, &g_pt_file
+};
+static HANDLE g_watch_thread;
+static HANDLE g_watch_stop;
+static CRITICAL_SECTION g_watch_lock;
+
+/* Set while a WM_APP_RDS_CHANGED is queued and not yet handled */
+static volatile LONG g_monitor_posted;
+
 /* RT source mode: 0=manual, 1=file */
 static int g_rt_source;
 /* RTP source mode: 0=manual, 1=file */
@@ -195,10 +219,8 @@ static int g_rtp_source;
 /* PS chunking */
 static struct {
     char full_text[512];
-    char chunks[64][PS_LENGTH + 1];
+    char chunks[MAX_PS_LIST][PS_LENGTH + 1];
     int num_chunks;
-    int current_chunk;
-    DWORD last_advance_tick;
 } g_ps_scroll;
 static DWORD g_ps_segment_ms = 4000; /* customizable segment duration */
 
@@ -302,27 +324,29 @@ static int setup_stderr_capture(void) {
     return 0;
 }
 
-static void drain_stderr_to_log(void) {
-    DWORD available = 0;
+/*
+ * Blocks on the stderr pipe and hands each chunk to the main window,
+ * so the log fills as text arrives instead of on a timer
+ */
+static DWORD WINAPI stderr_reader_proc(LPVOID param) {
     char buf[4096];
     DWORD bytes_read;
-    if (!g_stderr_read) return;
-    while (PeekNamedPipe(g_stderr_read, NULL, 0, NULL, &available, NULL)
-           && available > 0) {
-        DWORD to_read = (available < sizeof(buf) - 1) ? available : sizeof(buf) - 1;
-        if (ReadFile(g_stderr_read, buf, to_read, &bytes_read, NULL) && bytes_read > 0) {
-            buf[bytes_read] = '\0';
-            char converted[8192];
-            int j = 0;
-            for (DWORD i = 0; i < bytes_read && j < (int)sizeof(converted) - 2; i++) {
-                if (buf[i] == '\n' && (i == 0 || buf[i-1] != '\r'))
-                    converted[j++] = '\r';
-                converted[j++] = buf[i];
-            }
-            converted[j] = '\0';
-            append_log(converted);
-        } else break;
+    (void)param;
+    while (ReadFile(g_stderr_read, buf, sizeof(buf), &bytes_read, NULL)
+           && bytes_read > 0) {
+        char *converted = (char *)malloc(bytes_read * 2 + 1);
+        DWORD j = 0;
+        if (!converted) continue;
+        for (DWORD i = 0; i < bytes_read; i++) {
+            if (buf[i] == '\n' && (i == 0 || buf[i-1] != '\r'))
+                converted[j++] = '\r';
+            converted[j++] = buf[i];
+        }
+        converted[j] = '\0';
+        if (!PostMessageA(g_main_hwnd, WM_APP_LOG, 0, (LPARAM)converted))
+            free(converted);
     }
+    return 0;
 }
 
 /* =======================================================================
@@ -348,27 +372,6 @@ static void enumerate_audio_devices(HWND combo) {
     SendMessageA(combo, CB_SETCURSEL, 0, 0);
 }
 
-/* =======================================================================
- * SECTION: Sample Conversion
- * ======================================================================= */
-
-static void float2char2channel(float *inbuf, char *outbuf, size_t frames) {
-    size_t j = 0, k = 0;
-    int16_t sample;
-    int8_t lower, upper;
-    for (size_t i = 0; i < frames; i++) {
-        sample = (int16_t)lroundf((inbuf[j] + inbuf[j+1]) * 16383.5f);
-        lower = sample & 0xFF;
-        upper = (sample >> 8) & 0xFF;
-        outbuf[k+0] = lower;
-        outbuf[k+1] = upper;
-        outbuf[k+2] = lower;
-        outbuf[k+3] = upper;
-        j += 2;
-        k += 4;
-    }
-}
-
 /* =======================================================================
  * SECTION: PS Smart-Split Text Chunking
  *
@@ -415,8 +418,6 @@ static void ps_chunk_text(const char *text) {
         memcpy(g_ps_scroll.chunks[0], text, len > PS_LENGTH ? PS_LENGTH : len);
         g_ps_scroll.chunks[0][PS_LENGTH] = '\0';
         g_ps_scroll.num_chunks = 1;
-        g_ps_scroll.current_chunk = 0;
-        g_ps_scroll.last_advance_tick = GetTickCount();
         return;
     }
 
@@ -427,11 +428,11 @@ static void ps_chunk_text(const char *text) {
     memset(seg, ' ', PS_LENGTH);
     seg[PS_LENGTH] = '\0';
 
-    for (int w = 0; w < nwords && ci < 64; w++) {
+    for (int w = 0; w < nwords && ci < MAX_PS_LIST; w++) {
         size_t wlen = strlen(words[w]);
         size_t wpos = 0; /* position within the current word (for long-word continuation) */
 
-        while (wpos < wlen && ci < 64) {
+        while (wpos < wlen && ci < MAX_PS_LIST) {
             size_t rem_word = wlen - wpos; /* remaining chars in this word */
             int space_left = PS_LENGTH - seg_used;
 
@@ -520,26 +521,31 @@ static void ps_chunk_text(const char *text) {
     }
 
     /* Flush last segment if it has content */
-    if (seg_used > 0 && ci < 64) {
+    if (seg_used > 0 && ci < MAX_PS_LIST) {
         memcpy(g_ps_scroll.chunks[ci], seg, PS_LENGTH);
         g_ps_scroll.chunks[ci][PS_LENGTH] = '\0';
         ci++;
     }
 
     g_ps_scroll.num_chunks = ci;
-    g_ps_scroll.current_chunk = 0;
-    g_ps_scroll.last_advance_tick = GetTickCount();
 }
 
-static void ps_scroll_tick(void) {
-    if (g_ps_scroll.num_chunks <= 1) return;
-    if (!g_engine_running) return;
-    DWORD now = GetTickCount();
-    if ((now - g_ps_scroll.last_advance_tick) >= g_ps_segment_ms) {
-        g_ps_scroll.current_chunk = (g_ps_scroll.current_chunk + 1) % g_ps_scroll.num_chunks;
-        set_rds_ps(xlat((unsigned char *)g_ps_scroll.chunks[g_ps_scroll.current_chunk]));
-        g_ps_scroll.last_advance_tick = now;
-    }
+/*
+ * Hand all chunks to the encoder, which steps through them on its own
+ * group clock. Each chunk stays on air for at least g_ps_segment_ms.
+ */
+static void send_ps_chunks(void) {
+    unsigned char list[MAX_PS_LIST][PS_LENGTH];
+    int n = g_ps_scroll.num_chunks;
+
+    if (n <= 0 || !g_engine_running) return;
+    for (int i = 0; i < n; i++) {
+        size_t len = xlat((unsigned char *)g_ps_scroll.chunks[i],
+                          list[i], PS_LENGTH);
+        memset(list[i] + len, ' ', PS_LENGTH - len);
+    }
+    set_rds_ps_list(g_station.rds, &list[0][0], (uint8_t)n,
+        (uint16_t)(g_ps_segment_ms < 65535 ? g_ps_segment_ms : 65535));
 }
 
 /* =======================================================================
@@ -560,58 +566,53 @@ static BOOL file_time_changed(FILETIME *a, FILETIME *b) {
             a->dwLowDateTime != b->dwLowDateTime);
 }
 
-static char *read_file_text(const char *path) {
+/* Reads at most size - 1 bytes, which is more than any RDS field holds */
+static BOOL read_file_text(const char *path, char *buf, size_t size) {
     FILE *fp = fopen(path, "r");
-    if (!fp) return NULL;
-    fseek(fp, 0, SEEK_END);
-    long sz = ftell(fp);
-    if (sz < 0 || sz > 65536) { fclose(fp); return NULL; }
-    rewind(fp);
-    char *buf = (char *)malloc(sz + 1);
-    if (!buf) { fclose(fp); return NULL; }
-    size_t rd = fread(buf, 1, sz, fp);
+    if (!fp) return FALSE;
+    size_t rd = fread(buf, 1, size - 1, fp);
     buf[rd] = '\0';
     fclose(fp);
     while (rd > 0 && (buf[rd-1] == '\n' || buf[rd-1] == '\r' ||
            buf[rd-1] == ' ' || buf[rd-1] == '\t'))
         buf[--rd] = '\0';
-    return buf;
+    return TRUE;
 }
 
 static void process_rt_file(void) {
-    char *text = read_file_text(g_rt_file.path);
-    if (!text) return;
+    char text[FILE_TEXT_SIZE];
+    if (!read_file_text(g_rt_file.path, text, sizeof(text))) return;
     if (text[0]) {
-        set_rds_rt(xlat((unsigned char *)text));
+        unsigned char rt[RT_LENGTH + 1];
+        xlat((unsigned char *)text, rt, sizeof(rt));
+        set_rds_rt(g_station.rds, rt);
         log_msg("[RT File] Updated: \"%s\"\r\n", text);
     }
-    free(text);
 }
 
 static void process_ps_file(void) {
-    char *text = read_file_text(g_ps_file.path);
-    if (!text) return;
+    char text[FILE_TEXT_SIZE];
+    if (!read_file_text(g_ps_file.path, text, sizeof(text))) return;
     if (text[0]) {
         strncpy(g_ps_scroll.full_text, text, sizeof(g_ps_scroll.full_text) - 1);
         g_ps_scroll.full_text[sizeof(g_ps_scroll.full_text) - 1] = '\0';
         ps_chunk_text(text);
         if (g_ps_scroll.num_chunks > 0) {
-            set_rds_ps(xlat((unsigned char *)g_ps_scroll.chunks[0]));
+            send_ps_chunks();
             log_msg("[PS File] Loaded %d chunk(s)\r\n", g_ps_scroll.num_chunks);
         }
     }
-    free(text);
 }
 
 static void process_rtp_file(void) {
-    char *text = read_file_text(g_rtp_file.path);
-    if (!text) return;
-    if (!text[0]) { free(text); return; }
+    char text[FILE_TEXT_SIZE];
+    if (!read_file_text(g_rtp_file.path, text, sizeof(text))) return;
+    if (!text[0]) return;
 
     char *sep = strstr(text, "||");
     if (!sep) {
         log_msg("[RT+ File] No '||' separator found. Format: artist || title\r\n");
-        free(text); return;
+        return;
     }
 
     char artist[RT_LENGTH + 1], title_str[RT_LENGTH + 1];
@@ -628,7 +629,7 @@ static void process_rtp_file(void) {
 
     /* Look up the positions in the current RT */
     struct rds_params_t p;
-    get_rds_params_copy(&p);
+    get_rds_params_copy(g_station.rds, &p);
     char current_rt[RT_LENGTH + 1];
     memcpy(current_rt, p.rt, RT_LENGTH);
     current_rt[RT_LENGTH] = '\0';
@@ -659,7 +660,7 @@ static void process_rtp_file(void) {
 
     if (!artist_pos && !title_pos) {
         log_msg("[RT+ File] Artist/title not found in RT\r\n");
-        free(text); return;
+        return;
     }
 
     uint8_t tags[6] = {
@@ -670,54 +671,202 @@ static void process_rtp_file(void) {
         title_pos ? (uint8_t)(title_pos - current_rt) : 0,
         title_pos ? (uint8_t)(t_len > 0 ? t_len - 1 : 0) : 0
     };
-    set_rds_rtplus_tags(tags);
-    set_rds_rtplus_flags(3); /* running + toggle */
+    set_rds_rtplus_tags(g_station.rds, tags);
+    set_rds_rtplus_flags(g_station.rds, 3); /* running + toggle */
     log_msg("[RT+ File] Artist: \"%s\", Title: \"%s\"\r\n", artist, title_str);
-    free(text);
 }
 
 static void process_pt_file(void) {
-    char *text = read_file_text(g_pt_file.path);
-    if (!text) return;
+    char text[FILE_TEXT_SIZE];
+    if (!read_file_text(g_pt_file.path, text, sizeof(text))) return;
     if (text[0]) {
         uint8_t pty = (text[0] >= 'A') ? get_pty_code(text) : (uint8_t)strtoul(text, NULL, 10);
-        set_rds_pty(pty);
+        set_rds_pty(g_station.rds, pty);
         log_msg("[PT File] PTY set to %u (%s)\r\n", pty, get_pty_str(pty));
     }
-    free(text);
 }
 
-static void check_file_watches(void) {
-    FILETIME ft;
-    if (g_rt_file.active && g_rt_file.path[0]) {
-        if (get_file_write_time(g_rt_file.path, &ft) &&
-            file_time_changed(&ft, &g_rt_file.last_write)) {
-            g_rt_file.last_write = ft;
-            if (g_engine_running) process_rt_file();
+/* A directory with ReadDirectoryChangesW pending on it */
+struct watch_dir_t {
+    HANDLE dir;
+    OVERLAPPED ov;
+    char name[MAX_PATH];
+    DWORD mask;
+    DWORD buf[1024]; /* FILE_NOTIFY_INFORMATION is DWORD aligned */
+};
+
+static BOOL arm_watch_dir(struct watch_dir_t *wd) {
+    ResetEvent(wd->ov.hEvent);
+    return ReadDirectoryChangesW(wd->dir, wd->buf, sizeof(wd->buf), FALSE,
+        FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME |
+        FILE_NOTIFY_CHANGE_SIZE, NULL, &wd->ov, NULL);
+}
+
+/* Which of the directory's watches the notifications name */
+static DWORD match_watch_dir(const struct watch_dir_t *wd,
+                             WCHAR names[][MAX_PATH]) {
+    const FILE_NOTIFY_INFORMATION *fni = (const FILE_NOTIFY_INFORMATION *)wd->buf;
+    DWORD changed = 0;
+    for (;;) {
+        size_t len = fni->FileNameLength / sizeof(WCHAR);
+        for (int i = 0; i < NUM_FILE_WATCHES; i++) {
+            if (!(wd->mask & (1u << i))) continue;
+            if (wcslen(names[i]) == len &&
+                _wcsnicmp(fni->FileName, names[i], len) == 0)
+                changed |= 1u << i;
         }
+        if (!fni->NextEntryOffset) break;
+        fni = (const FILE_NOTIFY_INFORMATION *)
+            ((const char *)fni + fni->NextEntryOffset);
     }
-    if (g_ps_file.active && g_ps_file.path[0]) {
-        if (get_file_write_time(g_ps_file.path, &ft) &&
-            file_time_changed(&ft, &g_ps_file.last_write)) {
-            g_ps_file.last_write = ft;
-            if (g_engine_running) process_ps_file();
+    return changed;
+}
+
+/*
+ * Waits for the directories of the active watches to change and posts
+ * WM_APP_FILE_CHANGED with the watches that were touched. Paths are read
+ * once at start, so the thread is restarted when they change.
+ */
+static DWORD WINAPI file_watch_proc(LPVOID param) {
+    static struct watch_dir_t dirs[NUM_FILE_WATCHES];
+    HANDLE events[NUM_FILE_WATCHES + 1];
+    WCHAR names[NUM_FILE_WATCHES][MAX_PATH];
+    DWORD poll = 0;
+    int n = 0;
+    (void)param;
+
+    for (int i = 0; i < NUM_FILE_WATCHES; i++) {
+        const struct file_watch_t *w = g_watches[i];
+        char dir[MAX_PATH];
+        const char *file = w->path;
+        char *slash;
+        int d;
+
+        if (!w->active || !w->path[0]) continue;
+        snprintf(dir, sizeof(dir), "%s", w->path);
+        slash = strrchr(dir, '\\');
+        if (!slash) slash = strrchr(dir, '/');
+        if (slash) {
+            file = w->path + (slash - dir) + 1;
+            *slash = '\0';
+        } else {
+            strcpy(dir, ".");
+        }
+        MultiByteToWideChar(CP_ACP, 0, file, -1, names[i], MAX_PATH);
+
+        for (d = 0; d < n; d++)
+            if (_stricmp(dirs[d].name, dir) == 0) break;
+        if (d == n) {
+            struct watch_dir_t *wd = &dirs[n];
+            memset(wd, 0, sizeof(*wd));
+            wd->dir = CreateFileA(dir, FILE_LIST_DIRECTORY,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                NULL);
+            if (wd->dir == INVALID_HANDLE_VALUE) {
+                poll |= 1u << i;
+                continue;
+            }
+            wd->ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+            if (!wd->ov.hEvent || !arm_watch_dir(wd)) {
+                if (wd->ov.hEvent) CloseHandle(wd->ov.hEvent);
+                CloseHandle(wd->dir);
+                poll |= 1u << i;
+                continue;
+            }
+            snprintf(wd->name, sizeof(wd->name), "%s", dir);
+            n++;
+        }
+        dirs[d].mask |= 1u << i;
+    }
+
+    events[0] = g_watch_stop;
+    for (int d = 0; d < n; d++) events[d + 1] = dirs[d].ov.hEvent;
+
+    for (;;) {
+        DWORD r = WaitForMultipleObjects(n + 1, events, FALSE,
+                                         poll ? FILEWATCH_POLL_MS : INFINITE);
+        DWORD changed = 0;
+
+        if (r == WAIT_TIMEOUT) {
+            changed = poll;
+        } else if (r > WAIT_OBJECT_0 && r <= WAIT_OBJECT_0 + (DWORD)n) {
+            struct watch_dir_t *wd = &dirs[r - WAIT_OBJECT_0 - 1];
+            DWORD len = 0;
+            if (GetOverlappedResult(wd->dir, &wd->ov, &len, FALSE))
+                /* nothing was returned if the buffer overflowed */
+                changed = len ? match_watch_dir(wd, names) : wd->mask;
+            if (!arm_watch_dir(wd))
+                poll |= wd->mask;
+        } else {
+            break; /* stop event or failure */
         }
+
+        if (changed)
+            PostMessageA(g_main_hwnd, WM_APP_FILE_CHANGED, changed, 0);
     }
-    if (g_rtp_file.active && g_rtp_file.path[0]) {
-        if (get_file_write_time(g_rtp_file.path, &ft) &&
-            file_time_changed(&ft, &g_rtp_file.last_write)) {
-            g_rtp_file.last_write = ft;
-            if (g_engine_running) process_rtp_file();
+
+    for (int d = 0; d < n; d++) {
+        DWORD len;
+        CancelIo(dirs[d].dir);
+        GetOverlappedResult(dirs[d].dir, &dirs[d].ov, &len, TRUE);
+        CloseHandle(dirs[d].ov.hEvent);
+        CloseHandle(dirs[d].dir);
+    }
+    return 0;
+}
+
+static void stop_file_watcher(void) {
+    EnterCriticalSection(&g_watch_lock);
+    if (g_watch_thread) {
+        SetEvent(g_watch_stop);
+        WaitForSingleObject(g_watch_thread, INFINITE);
+        CloseHandle(g_watch_thread);
+        CloseHandle(g_watch_stop);
+        g_watch_thread = NULL;
+        g_watch_stop = NULL;
+    }
+    LeaveCriticalSection(&g_watch_lock);
+}
+
+/* (Re)starts the watcher on the current paths */
+static void start_file_watcher(void) {
+    BOOL any = FALSE;
+    for (int i = 0; i < NUM_FILE_WATCHES; i++)
+        if (g_watches[i]->active && g_watches[i]->path[0]) any = TRUE;
+
+    EnterCriticalSection(&g_watch_lock);
+    stop_file_watcher();
+    if (any) {
+        g_watch_stop = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (g_watch_stop)
+            g_watch_thread = CreateThread(NULL, 0, file_watch_proc, NULL, 0, NULL);
+        if (!g_watch_thread) {
+            if (g_watch_stop) CloseHandle(g_watch_stop);
+            g_watch_stop = NULL;
+            fprintf(stderr, "Error: could not start the file watcher.\n");
         }
     }
-    if (g_pt_file.active && g_pt_file.path[0]) {
-        if (get_file_write_time(g_pt_file.path, &ft) &&
-            file_time_changed(&ft, &g_pt_file.last_write)) {
-            g_pt_file.last_write = ft;
-            if (g_engine_running) process_pt_file();
+    LeaveCriticalSection(&g_watch_lock);
+}
+
+/* Runs on the main thread for the watches in mask that were touched */
+static void check_file_watches(DWORD mask) {
+    static void (*const process[NUM_FILE_WATCHES])(void) = {
+        process_rt_file, process_ps_file, process_rtp_file, process_pt_file
+    };
+    FILETIME ft;
+
+    for (int i = 0; i < NUM_FILE_WATCHES; i++) {
+        struct file_watch_t *w = g_watches[i];
+        if (!(mask & (1u << i)) || !w->active || !w->path[0]) continue;
+        /* editors often write a file more than once per save */
+        if (get_file_write_time(w->path, &ft) &&
+            file_time_changed(&ft, &w->last_write)) {
+            w->last_write = ft;
+            if (g_engine_running) process[i]();
         }
     }
-    ps_scroll_tick();
 }
 
 /* =======================================================================
@@ -942,7 +1091,10 @@ static void load_settings_ini(void) {
         int seg_ms = GetPrivateProfileIntA(INI_SECTION, "PSSegmentMs", 4000, g_ini_path);
         if (seg_ms < 500) seg_ms = 500;
         if (seg_ms > 30000) seg_ms = 30000;
-        g_ps_segment_ms = (DWORD)seg_ms;
+        if ((DWORD)seg_ms != g_ps_segment_ms) {
+            g_ps_segment_ms = (DWORD)seg_ms;
+            if (g_ps_scroll.num_chunks > 1) send_ps_chunks();
+        }
         snprintf(buf, sizeof(buf), "%d", seg_ms);
         SetDlgItemTextA(hw, IDC_S_PS_SEGMENT_EDIT, buf);
     }
@@ -964,34 +1116,107 @@ static void schedule_autosave(void) {
  * SECTION: Engine Thread with Auto-Restart
  * ======================================================================= */
 
+/*
+ * The sound card is opened on its own thread while the encoder is set
+ * up, since finding the driver and opening the device can take longer
+ * than everything else together.
+ */
+typedef struct {
+    ao_sample_format format;
+    int device_id;
+    int driver_id;
+    ao_device *device;
+    HANDLE thread;
+} audio_open_t;
+
+static void open_audio(audio_open_t *ao) {
+    ao_option *opts = NULL;
+
+    ao_initialize();
+    ao->driver_id = ao_default_driver_id();
+    if (ao->driver_id < 0) return;
+
+    if (ao->device_id >= 0) {
+        char dev_id_str[16];
+        snprintf(dev_id_str, sizeof(dev_id_str), "%d", ao->device_id);
+        ao_append_option(&opts, "id", dev_id_str);
+    }
+    ao->device = ao_open_live(ao->driver_id, &ao->format, opts);
+    if (opts) ao_free_options(opts);
+}
+
+static DWORD WINAPI audio_open_proc(LPVOID param) {
+    open_audio((audio_open_t *)param);
+    return 0;
+}
+
+/* opens the device right away if there's no thread for it */
+static void start_audio_open(audio_open_t *ao) {
+    ao->thread = CreateThread(NULL, 0, audio_open_proc, ao, 0, NULL);
+    if (!ao->thread) open_audio(ao);
+}
+
+static void wait_audio_open(audio_open_t *ao) {
+    if (!ao->thread) return;
+    WaitForSingleObject(ao->thread, INFINITE);
+    CloseHandle(ao->thread);
+    ao->thread = NULL;
+}
+
 static DWORD WINAPI engine_thread_proc(LPVOID param) {
     (void)param;
 
     float *mpx_buffer = NULL;
     float *out_buffer = NULL;
     char *dev_out = NULL;
+    struct converter_t *conv = NULL;
+    const struct sink_format_t sink = {
+        .sample_fmt = SAMPLE_FMT_S16,
+        .channels = 2,
+        .mask = 3
+    };
     SRC_STATE *src_state = NULL;
     SRC_DATA src_data;
     ao_device *device = NULL;
     ao_sample_format format;
     ao_option *ao_opts = NULL;
+    audio_open_t audio_open;
     int driver_id = -1;
     size_t frames;
     unsigned long loop_count = 0;
     int local_restart_count = 0;
     int restart_cooldown = RESTART_COOLDOWN_BASE;
-
-    mpx_buffer = (float *)malloc(NUM_MPX_FRAMES_IN * 2 * sizeof(float));
-    out_buffer = (float *)malloc(NUM_MPX_FRAMES_OUT * 2 * sizeof(float));
+    uint32_t last_change = 0;
+    float *play_buffer;
+    uint32_t mpx_rate;
+    BOOL native_rate;
+
+    /* NativeRate=1 in the INI generates directly at the device rate */
+    native_rate = GetPrivateProfileIntA(INI_SECTION, "NativeRate", 0, g_ini_path) != 0;
+    mpx_rate = native_rate ? OUTPUT_SAMPLE_RATE : MPX_SAMPLE_RATE;
+
+    /* the MPX is mono until the converter puts it on both channels */
+    mpx_buffer = (float *)malloc(NUM_MPX_FRAMES_IN * sizeof(float));
+    out_buffer = (float *)malloc(NUM_MPX_FRAMES_OUT * sizeof(float));
     dev_out = (char *)malloc(NUM_MPX_FRAMES_OUT * 2 * sizeof(int16_t));
-    if (!mpx_buffer || !out_buffer || !dev_out) {
+    conv = init_converter(&sink);
+    if (!mpx_buffer || !out_buffer || !dev_out || !conv) {
         fprintf(stderr, "Error: failed to allocate audio buffers.\n");
         goto engine_exit;
     }
 
-    fm_mpx_init(MPX_SAMPLE_RATE);
-    set_output_volume(g_volume);
-    fprintf(stderr, "Baseband generator initialized at %d Hz.\n", MPX_SAMPLE_RATE);
+    /* Start opening the audio output */
+    memset(&format, 0, sizeof(format));
+    format.channels = 2;
+    format.bits = 16;
+    format.rate = OUTPUT_SAMPLE_RATE;
+    format.byte_format = AO_FMT_LITTLE;
+
+    memset(&audio_open, 0, sizeof(audio_open));
+    audio_open.format = format;
+    audio_open.device_id = g_selected_device;
+    audio_open.driver_id = -1;
+    start_audio_open(&audio_open);
 
     /* Init RDS encoder from settings window or defaults */
     {
@@ -1017,14 +1242,16 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
             }
             GetDlgItemTextA(sw, IDC_S_PS_EDIT, buf, sizeof(buf));
             if (buf[0]) {
-                unsigned char *x = xlat((unsigned char *)buf);
+                unsigned char *x = (unsigned char *)buf;
+                xlat(x, x, sizeof(buf));
                 memset(rds_params.ps, ' ', PS_LENGTH);
                 memcpy(rds_params.ps, x, strlen((char *)x) < PS_LENGTH ? strlen((char *)x) : PS_LENGTH);
             }
             if (g_rt_source == 0) {
                 GetDlgItemTextA(sw, IDC_S_RT_EDIT, buf, sizeof(buf));
                 if (buf[0]) {
-                    unsigned char *x = xlat((unsigned char *)buf);
+                    unsigned char *x = (unsigned char *)buf;
+                    xlat(x, x, sizeof(buf));
                     memset(rds_params.rt, ' ', RT_LENGTH);
                     size_t rtlen = strlen((char *)x);
                     if (rtlen > RT_LENGTH) rtlen = RT_LENGTH;
@@ -1039,7 +1266,8 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
 
             GetDlgItemTextA(sw, IDC_S_PTYN_EDIT, buf, sizeof(buf));
             if (buf[0]) {
-                unsigned char *x = xlat((unsigned char *)buf);
+                unsigned char *x = (unsigned char *)buf;
+                xlat(x, x, sizeof(buf));
                 memcpy(rds_params.ptyn, x, strlen((char *)x) < PTYN_LENGTH ? strlen((char *)x) : PTYN_LENGTH);
             }
 
@@ -1053,7 +1281,15 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
             }
         }
 
-        init_rds_encoder(rds_params);
+        if (init_station(&g_station, 1, rds_params, mpx_rate) < 0) {
+            fprintf(stderr, "Error: failed to create the encoder.\n");
+            wait_audio_open(&audio_open);
+            if (audio_open.device) ao_close(audio_open.device);
+            ao_shutdown();
+            goto engine_exit;
+        }
+        set_output_volume(g_station.mpx, g_volume);
+        fprintf(stderr, "Baseband generator initialized at %u Hz.\n", mpx_rate);
         fprintf(stderr, "RDS encoder initialized (PI=%04X, PS=\"%.8s\").\n",
                 rds_params.pi, rds_params.ps);
     }
@@ -1062,18 +1298,21 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
     if (g_settings_hwnd) {
         char buf[256];
         if (IsDlgButtonChecked(g_settings_hwnd, IDC_S_TA_CHK) == BST_CHECKED)
-            set_rds_ta(1);
+            set_rds_ta(g_station.rds, 1);
         if (IsDlgButtonChecked(g_settings_hwnd, IDC_S_MS_CHK) == BST_CHECKED)
-            set_rds_ms(1);
+            set_rds_ms(g_station.rds, 1);
         else
-            set_rds_ms(0);
+            set_rds_ms(g_station.rds, 0);
 
         GetDlgItemTextA(g_settings_hwnd, IDC_S_LPS_EDIT, buf, sizeof(buf));
-        if (buf[0]) set_rds_lps((unsigned char *)buf);
+        if (buf[0]) set_rds_lps(g_station.rds, (unsigned char *)buf);
         GetDlgItemTextA(g_settings_hwnd, IDC_S_ERT_EDIT, buf, sizeof(buf));
-        if (buf[0]) set_rds_ert((unsigned char *)buf);
+        if (buf[0]) {
+            xlat_ert((unsigned char *)buf, (unsigned char *)buf, sizeof(buf));
+            set_rds_ert(g_station.rds, (unsigned char *)buf);
+        }
         GetDlgItemTextA(g_settings_hwnd, IDC_S_ECC_EDIT, buf, sizeof(buf));
-        if (buf[0]) set_rds_ecc((uint8_t)strtoul(buf, NULL, 16));
+        if (buf[0]) set_rds_ecc(g_station.rds, (uint8_t)strtoul(buf, NULL, 16));
 
         /* RT+ manual config */
         if (g_rtp_source == 0) {
@@ -1090,11 +1329,11 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
                 (uint8_t)t1, (uint8_t)strtoul(s1, NULL, 10), (uint8_t)strtoul(l1, NULL, 10),
                 (uint8_t)t2, (uint8_t)strtoul(s2, NULL, 10), (uint8_t)strtoul(l2, NULL, 10)
             };
-            set_rds_rtplus_tags(tags);
+            set_rds_rtplus_tags(g_station.rds, tags);
             uint8_t flags = 0;
             if (IsDlgButtonChecked(g_settings_hwnd, IDC_S_RTP_RUNNING_CHK) == BST_CHECKED) flags |= 2;
             if (IsDlgButtonChecked(g_settings_hwnd, IDC_S_RTP_TOGGLE_CHK) == BST_CHECKED) flags |= 1;
-            set_rds_rtplus_flags(flags);
+            set_rds_rtplus_flags(g_station.rds, flags);
         }
     }
 
@@ -1116,7 +1355,6 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
 
     /* Reset PS scroll state before initial file reads */
     g_ps_scroll.num_chunks = 0;
-    g_ps_scroll.current_chunk = 0;
 
     /* Trigger initial file read if watches are active */
     if (g_rt_file.active && g_rt_file.path[0]) {
@@ -1135,29 +1373,17 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
         get_file_write_time(g_pt_file.path, &g_pt_file.last_write);
         process_pt_file();
     }
+    start_file_watcher();
 
-    /* Setup audio output */
-    memset(&format, 0, sizeof(format));
-    format.channels = 2;
-    format.bits = 16;
-    format.rate = OUTPUT_SAMPLE_RATE;
-    format.byte_format = AO_FMT_LITTLE;
-
-    ao_initialize();
-    driver_id = ao_default_driver_id();
+    /* Setup audio output (opened while the encoder was set up) */
+    wait_audio_open(&audio_open);
+    driver_id = audio_open.driver_id;
+    device = audio_open.device;
     if (driver_id < 0) {
         fprintf(stderr, "Error: no usable audio driver found.\n");
         goto engine_cleanup;
     }
 
-    if (g_selected_device >= 0) {
-        char dev_id_str[16];
-        snprintf(dev_id_str, sizeof(dev_id_str), "%d", g_selected_device);
-        ao_append_option(&ao_opts, "id", dev_id_str);
-    }
-
-    device = ao_open_live(driver_id, &format, ao_opts);
-    if (ao_opts) { ao_free_options(ao_opts); ao_opts = NULL; }
     if (!device) {
         fprintf(stderr, "Error: cannot open audio device.\n");
         goto engine_cleanup;
@@ -1168,13 +1394,20 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
     memset(&src_data, 0, sizeof(SRC_DATA));
     src_data.input_frames = NUM_MPX_FRAMES_IN;
     src_data.output_frames = NUM_MPX_FRAMES_OUT;
-    src_data.src_ratio = (double)OUTPUT_SAMPLE_RATE / (double)MPX_SAMPLE_RATE;
+    src_data.src_ratio = (double)OUTPUT_SAMPLE_RATE / (double)mpx_rate;
     src_data.data_in = mpx_buffer;
     src_data.data_out = out_buffer;
-
-    if (resampler_init(&src_state, 2) < 0) {
-        fprintf(stderr, "Error: could not create resampler.\n");
-        goto engine_cleanup;
+    set_metrics_rates(g_station.metrics, mpx_rate, OUTPUT_SAMPLE_RATE);
+
+    if (native_rate) {
+        fprintf(stderr, "Resampler bypassed (native rate).\n");
+        play_buffer = mpx_buffer;
+    } else {
+        if (resampler_init(&src_state, 1) < 0) {
+            fprintf(stderr, "Error: could not create resampler.\n");
+            goto engine_cleanup;
+        }
+        play_buffer = out_buffer;
     }
     fprintf(stderr, "RDS output started successfully.\n");
 
@@ -1182,27 +1415,45 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
 
     /* ===== Main generation loop with auto-restart ===== */
     while (!g_stop_engine) {
-        fm_rds_get_frames(mpx_buffer, NUM_MPX_FRAMES_IN);
+        struct station_metrics_t *m = g_station.metrics;
+        uint64_t start = metrics_now_ns();
+        BOOL played;
+
+        fm_rds_get_frames(g_station.mpx, mpx_buffer, NUM_MPX_FRAMES_IN);
+        if (m) {
+            metrics_record(&m->gen_time, metrics_since_ns(start));
+            metrics_add(&m->blocks, 1);
+            metrics_add(&m->frames_in, NUM_MPX_FRAMES_IN);
+        }
 
-        if (resample(src_state, src_data, &frames) < 0) {
-            fprintf(stderr, "Error: resampler failed at iteration %lu.\n", loop_count);
-            break; /* Resampler failure is fatal */
+        if (native_rate) {
+            frames = NUM_MPX_FRAMES_IN;
+        } else {
+            if (resample(src_state, src_data, &frames) < 0) {
+                fprintf(stderr, "Error: resampler failed at iteration %lu.\n", loop_count);
+                break; /* Resampler failure is fatal */
+            }
+            if (frames == 0) continue;
         }
-        if (frames == 0) continue;
+        if (m) metrics_add(&m->frames_out, frames);
 
         /* Track peak level for diagnostics meter */
         {
             float peak = 0.0f;
-            for (size_t i = 0; i < frames * 2; i++) {
-                float v = fabsf(out_buffer[i]);
+            for (size_t i = 0; i < frames; i++) {
+                float v = fabsf(play_buffer[i]);
                 if (v > peak) peak = v;
             }
             InterlockedExchange(&g_peak_level, (LONG)(peak * 1000.0f));
         }
 
-        float2char2channel(out_buffer, dev_out, frames);
+        convert_frames(conv, play_buffer, dev_out, frames);
+
+        start = metrics_now_ns();
+        played = ao_play(device, dev_out, (uint_32)(frames * 2 * sizeof(int16_t))) != 0;
+        if (m) metrics_record(&m->play_time, metrics_since_ns(start));
 
-        if (!ao_play(device, dev_out, (uint_32)(frames * 2 * sizeof(int16_t)))) {
+        if (!played) {
             fprintf(stderr, "Error: ao_play failed at iteration %lu.\n", loop_count);
 
             /* ===== AUTO-RESTART LOGIC ===== */
@@ -1246,6 +1497,16 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
         loop_count++;
         g_loop_count = loop_count;
 
+        /* The monitor only repaints when the encoder's data changed */
+        {
+            uint32_t changes = get_rds_change_count(g_station.rds);
+            if (changes != last_change &&
+                !InterlockedExchange(&g_monitor_posted, 1)) {
+                PostMessageA(g_main_hwnd, WM_APP_RDS_CHANGED, 0, 0);
+                last_change = changes;
+            }
+        }
+
         /* Reset restart counter after sustained success */
         if (loop_count % 1000 == 0 && local_restart_count > 0) {
             local_restart_count = 0;
@@ -1260,19 +1521,20 @@ static DWORD WINAPI engine_thread_proc(LPVOID param) {
     if (device) ao_close(device);
 
 engine_cleanup:
+    stop_file_watcher();
     ao_shutdown();
-    fm_mpx_exit();
-    exit_rds_encoder();
+    exit_station(&g_station);
     fprintf(stderr, "Engine cleanup complete.\n");
 
 engine_exit:
     free(mpx_buffer);
     free(out_buffer);
     free(dev_out);
+    exit_converter(conv);
 
     InterlockedExchange(&g_peak_level, 0);
     InterlockedExchange(&g_engine_running, 0);
-    PostMessageA(g_main_hwnd, WM_APP + 1, 0, 0);
+    PostMessageA(g_main_hwnd, WM_APP_ENGINE_STOPPED, 0, 0);
     return 0;
 }
 
@@ -1288,6 +1550,7 @@ static void start_engine(void) {
     InterlockedExchange((volatile LONG *)&g_stop_engine, 0);
     g_loop_count = 0;
     InterlockedExchange(&g_total_restarts, 0);
+    InterlockedExchange(&g_monitor_posted, 0);
 
     /* Get device selection from settings */
     if (g_settings_hwnd) {
@@ -1345,7 +1608,7 @@ static void apply_settings_from_gui(void) {
         else
 #endif
             pi = (uint16_t)strtoul(buf, NULL, 16);
-        if (g_engine_running) set_rds_pi(pi);
+        if (g_engine_running) set_rds_pi(g_station.rds, pi);
     }
 
     GetDlgItemTextA(hw, IDC_S_PS_EDIT, buf, sizeof(buf));
@@ -1355,61 +1618,66 @@ static void apply_settings_from_gui(void) {
         if (IsDlgButtonChecked(hw, IDC_S_PS_FILE_CHK) == BST_CHECKED &&
             g_ps_scroll.full_text[0]) {
             ps_chunk_text(g_ps_scroll.full_text);
-            if (g_ps_scroll.num_chunks > 0)
-                set_rds_ps(xlat((unsigned char *)g_ps_scroll.chunks[0]));
+            send_ps_chunks();
         } else {
-            set_rds_ps(xlat((unsigned char *)buf));
+            xlat((unsigned char *)buf, (unsigned char *)buf, sizeof(buf));
+            set_rds_ps(g_station.rds, (unsigned char *)buf);
         }
     }
 
     if (g_rt_source == 0) {
         GetDlgItemTextA(hw, IDC_S_RT_EDIT, buf, sizeof(buf));
-        if (buf[0] && g_engine_running)
-            set_rds_rt(xlat((unsigned char *)buf));
+        if (buf[0] && g_engine_running) {
+            xlat((unsigned char *)buf, (unsigned char *)buf, sizeof(buf));
+            set_rds_rt(g_station.rds, (unsigned char *)buf);
+        }
     }
 
     {
         int pty_sel = (int)SendDlgItemMessageA(hw, IDC_S_PTY_COMBO, CB_GETCURSEL, 0, 0);
         if (pty_sel >= 0 && g_engine_running)
-            set_rds_pty((uint8_t)pty_sel);
+            set_rds_pty(g_station.rds, (uint8_t)pty_sel);
     }
 
     GetDlgItemTextA(hw, IDC_S_PTYN_EDIT, buf, sizeof(buf));
     if (g_engine_running) {
-        if (buf[0] && buf[0] != '-')
-            set_rds_ptyn(xlat((unsigned char *)buf));
+        if (buf[0] && buf[0] != '-') {
+            xlat((unsigned char *)buf, (unsigned char *)buf, sizeof(buf));
+            set_rds_ptyn(g_station.rds, (unsigned char *)buf);
+        }
         else if (buf[0] == '-') {
             unsigned char e = 0;
-            set_rds_ptyn(&e);
+            set_rds_ptyn(g_station.rds, &e);
         }
     }
 
     if (g_engine_running) {
-        set_rds_tp((IsDlgButtonChecked(hw, IDC_S_TP_CHK) == BST_CHECKED) ? 1 : 0);
-        set_rds_ta((IsDlgButtonChecked(hw, IDC_S_TA_CHK) == BST_CHECKED) ? 1 : 0);
-        set_rds_ms((IsDlgButtonChecked(hw, IDC_S_MS_CHK) == BST_CHECKED) ? 1 : 0);
+        set_rds_tp(g_station.rds, (IsDlgButtonChecked(hw, IDC_S_TP_CHK) == BST_CHECKED) ? 1 : 0);
+        set_rds_ta(g_station.rds, (IsDlgButtonChecked(hw, IDC_S_TA_CHK) == BST_CHECKED) ? 1 : 0);
+        set_rds_ms(g_station.rds, (IsDlgButtonChecked(hw, IDC_S_MS_CHK) == BST_CHECKED) ? 1 : 0);
     }
 
     GetDlgItemTextA(hw, IDC_S_LPS_EDIT, buf, sizeof(buf));
     if (buf[0] && g_engine_running) {
         if (buf[0] == '-') buf[0] = 0;
-        set_rds_lps((unsigned char *)buf);
+        set_rds_lps(g_station.rds, (unsigned char *)buf);
     }
 
     GetDlgItemTextA(hw, IDC_S_ERT_EDIT, buf, sizeof(buf));
     if (buf[0] && g_engine_running) {
         if (buf[0] == '-') buf[0] = 0;
-        set_rds_ert((unsigned char *)buf);
+        xlat_ert((unsigned char *)buf, (unsigned char *)buf, sizeof(buf));
+        set_rds_ert(g_station.rds, (unsigned char *)buf);
     }
 
     GetDlgItemTextA(hw, IDC_S_ECC_EDIT, buf, sizeof(buf));
     if (buf[0] && g_engine_running)
-        set_rds_ecc((uint8_t)strtoul(buf, NULL, 16));
+        set_rds_ecc(g_station.rds, (uint8_t)strtoul(buf, NULL, 16));
 
     /* Volume */
     {
         float vol = (float)SendDlgItemMessageA(hw, IDC_S_VOL_SLIDER, TBM_GETPOS, 0, 0);
-        if (g_engine_running) set_output_volume(vol);
+        if (g_engine_running) set_output_volume(g_station.mpx, vol);
         SendDlgItemMessageA(g_main_hwnd, IDC_M_VOL_SLIDER, TBM_SETPOS, TRUE, (int)vol);
         char lbl[16];
         snprintf(lbl, sizeof(lbl), "%d%%", (int)vol);
@@ -1431,11 +1699,11 @@ static void apply_settings_from_gui(void) {
             (uint8_t)t1, (uint8_t)strtoul(s1, NULL, 10), (uint8_t)strtoul(l1, NULL, 10),
             (uint8_t)t2, (uint8_t)strtoul(s2, NULL, 10), (uint8_t)strtoul(l2, NULL, 10)
         };
-        set_rds_rtplus_tags(tags);
+        set_rds_rtplus_tags(g_station.rds, tags);
         uint8_t flags = 0;
         if (IsDlgButtonChecked(hw, IDC_S_RTP_RUNNING_CHK) == BST_CHECKED) flags |= 2;
         if (IsDlgButtonChecked(hw, IDC_S_RTP_TOGGLE_CHK) == BST_CHECKED) flags |= 1;
-        set_rds_rtplus_flags(flags);
+        set_rds_rtplus_flags(g_station.rds, flags);
     }
 
     /* Update file watches */
@@ -1447,6 +1715,7 @@ static void apply_settings_from_gui(void) {
     GetDlgItemTextA(hw, IDC_S_PS_FILE_EDIT, g_ps_file.path, MAX_PATH);
     g_pt_file.active = (IsDlgButtonChecked(hw, IDC_S_PT_FILE_CHK) == BST_CHECKED);
     GetDlgItemTextA(hw, IDC_S_PT_FILE_EDIT, g_pt_file.path, MAX_PATH);
+    if (g_engine_running) start_file_watcher();
 
     /* Sync main window toggles */
     CheckDlgButton(g_main_hwnd, IDC_M_TA_BTN,
@@ -1463,7 +1732,10 @@ static void apply_settings_from_gui(void) {
         int ms = atoi(seg_buf);
         if (ms < 500) ms = 500;
         if (ms > 30000) ms = 30000;
-        g_ps_segment_ms = (DWORD)ms;
+        if ((DWORD)ms != g_ps_segment_ms) {
+            g_ps_segment_ms = (DWORD)ms;
+            if (g_ps_scroll.num_chunks > 1) send_ps_chunks();
+        }
     }
 
     log_msg("Settings applied.\r\n");
@@ -1473,6 +1745,15 @@ static void apply_settings_from_gui(void) {
  * SECTION: Monitor Updates
  * ======================================================================= */
 
+/* Only touch labels whose text changed, so the rest are not repainted */
+static void set_dlg_text(HWND hwnd, int id, const char *text) {
+    char cur[512];
+    if (GetDlgItemTextA(hwnd, id, cur, sizeof(cur)) < sizeof(cur) - 1 &&
+        strcmp(cur, text) == 0)
+        return;
+    SetDlgItemTextA(hwnd, id, text);
+}
+
 static void update_main_monitor(void) {
     if (!g_engine_running) return;
 
@@ -1480,14 +1761,15 @@ static void update_main_monitor(void) {
     struct rds_rtplus_info_t rtp;
     char buf[256];
 
-    get_rds_params_copy(&p);
-    get_rds_rtplus_info(&rtp);
+    get_rds_params_copy(g_station.rds, &p);
+    get_rds_rtplus_info(g_station.rds, &rtp);
 
-    /* PS */
+    /* PS as it is on air, which differs from p.ps while a list scrolls */
     {
         char d[PS_LENGTH + 1];
-        memcpy(d, p.ps, PS_LENGTH); d[PS_LENGTH] = '\0';
-        SetDlgItemTextA(g_main_hwnd, IDC_M_PS_VAL, d);
+        get_rds_ps_on_air(g_station.rds, (unsigned char *)d);
+        d[PS_LENGTH] = '\0';
+        set_dlg_text(g_main_hwnd, IDC_M_PS_VAL, d);
     }
 
     /* RT */
@@ -1496,12 +1778,12 @@ static void update_main_monitor(void) {
         memcpy(d, p.rt, RT_LENGTH); d[RT_LENGTH] = '\0';
         for (int i = RT_LENGTH - 1; i >= 0 && (d[i] == ' ' || d[i] == '\r'); i--)
             d[i] = '\0';
-        SetDlgItemTextA(g_main_hwnd, IDC_M_RT_VAL, d);
+        set_dlg_text(g_main_hwnd, IDC_M_RT_VAL, d);
     }
 
     /* PTY with name */
     snprintf(buf, sizeof(buf), "%s (%u)", get_pty_str(p.pty), p.pty);
-    SetDlgItemTextA(g_main_hwnd, IDC_M_PTY_VAL, buf);
+    set_dlg_text(g_main_hwnd, IDC_M_PTY_VAL, buf);
 
     /* RT+ computed Artist and Title */
     {
@@ -1546,8 +1828,8 @@ static void update_main_monitor(void) {
                 }
             }
         }
-        SetDlgItemTextA(g_main_hwnd, IDC_M_ARTIST_VAL, artist_buf);
-        SetDlgItemTextA(g_main_hwnd, IDC_M_TITLE_VAL, title_buf);
+        set_dlg_text(g_main_hwnd, IDC_M_ARTIST_VAL, artist_buf);
+        set_dlg_text(g_main_hwnd, IDC_M_TITLE_VAL, title_buf);
     }
 
     /* Sync toggle states */
@@ -1556,23 +1838,25 @@ static void update_main_monitor(void) {
     CheckDlgButton(g_main_hwnd, IDC_M_TP_BTN, p.tp ? BST_CHECKED : BST_UNCHECKED);
 }
 
-static void update_diag_monitor(void) {
+/* Station data: refreshed when the encoder reports a change */
+static void update_diag_params(void) {
     if (!g_diag_hwnd || !g_engine_running) return;
 
     struct rds_params_t p;
     struct rds_rtplus_info_t rtp;
     char buf[512];
 
-    get_rds_params_copy(&p);
-    get_rds_rtplus_info(&rtp);
+    get_rds_params_copy(g_station.rds, &p);
+    get_rds_rtplus_info(g_station.rds, &rtp);
 
     snprintf(buf, sizeof(buf), "%04X", p.pi);
-    SetDlgItemTextA(g_diag_hwnd, IDC_D_PI, buf);
+    set_dlg_text(g_diag_hwnd, IDC_D_PI, buf);
 
     {
         char d[PS_LENGTH + 1];
-        memcpy(d, p.ps, PS_LENGTH); d[PS_LENGTH] = '\0';
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_PS, d);
+        get_rds_ps_on_air(g_station.rds, (unsigned char *)d);
+        d[PS_LENGTH] = '\0';
+        set_dlg_text(g_diag_hwnd, IDC_D_PS, d);
     }
 
     {
@@ -1580,27 +1864,27 @@ static void update_diag_monitor(void) {
         memcpy(d, p.rt, RT_LENGTH); d[RT_LENGTH] = '\0';
         for (int i = RT_LENGTH - 1; i >= 0 && (d[i] == ' ' || d[i] == '\r'); i--)
             d[i] = '\0';
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_RT, d);
+        set_dlg_text(g_diag_hwnd, IDC_D_RT, d);
     }
 
     snprintf(buf, sizeof(buf), "%u (%s)", p.pty, get_pty_str(p.pty));
-    SetDlgItemTextA(g_diag_hwnd, IDC_D_PTY, buf);
+    set_dlg_text(g_diag_hwnd, IDC_D_PTY, buf);
 
     {
         char d[PTYN_LENGTH + 1];
         memcpy(d, p.ptyn, PTYN_LENGTH); d[PTYN_LENGTH] = '\0';
         for (int i = PTYN_LENGTH - 1; i >= 0 && d[i] == ' '; i--) d[i] = '\0';
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_PTYN, d[0] ? d : "(none)");
+        set_dlg_text(g_diag_hwnd, IDC_D_PTYN, d[0] ? d : "(none)");
     }
 
-    SetDlgItemTextA(g_diag_hwnd, IDC_D_TP, p.tp ? "ON" : "OFF");
-    SetDlgItemTextA(g_diag_hwnd, IDC_D_TA, p.ta ? "ON" : "OFF");
-    SetDlgItemTextA(g_diag_hwnd, IDC_D_MS, p.ms ? "Music" : "Speech");
+    set_dlg_text(g_diag_hwnd, IDC_D_TP, p.tp ? "ON" : "OFF");
+    set_dlg_text(g_diag_hwnd, IDC_D_TA, p.ta ? "ON" : "OFF");
+    set_dlg_text(g_diag_hwnd, IDC_D_MS, p.ms ? "Music" : "Speech");
 
     {
         char d[LPS_LENGTH + 1];
         memcpy(d, p.lps, LPS_LENGTH); d[LPS_LENGTH] = '\0';
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_LPS, d[0] ? d : "(none)");
+        set_dlg_text(g_diag_hwnd, IDC_D_LPS, d[0] ? d : "(none)");
     }
 
     {
@@ -1608,12 +1892,12 @@ static void update_diag_monitor(void) {
         memcpy(d, p.ert, ERT_LENGTH); d[ERT_LENGTH] = '\0';
         for (int i = ERT_LENGTH - 1; i >= 0 && (d[i] == ' ' || d[i] == '\r'); i--)
             d[i] = '\0';
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_ERT, d[0] ? d : "(none)");
+        set_dlg_text(g_diag_hwnd, IDC_D_ERT, d[0] ? d : "(none)");
     }
 
     {
         char *af = show_af_list(p.af);
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_AF, (af && af[0]) ? af : "(none)");
+        set_dlg_text(g_diag_hwnd, IDC_D_AF, (af && af[0]) ? af : "(none)");
     }
 
     /* RT+ diagnostic: show positions AND extracted text */
@@ -1637,32 +1921,64 @@ static void update_diag_monitor(void) {
                 snprintf(buf, sizeof(buf), "%s (start=%u, len=%u) \"%s\"",
                     tname ? tname : "DUMMY",
                     rtp.start[t], rtp.len[t], extracted);
-                SetDlgItemTextA(g_diag_hwnd,
+                set_dlg_text(g_diag_hwnd,
                     t == 0 ? IDC_D_RTP1 : IDC_D_RTP2, buf);
             }
             snprintf(buf, sizeof(buf), "Running: YES  Toggle: %u", rtp.toggle);
         } else {
-            SetDlgItemTextA(g_diag_hwnd, IDC_D_RTP1, "(inactive)");
-            SetDlgItemTextA(g_diag_hwnd, IDC_D_RTP2, "(inactive)");
+            set_dlg_text(g_diag_hwnd, IDC_D_RTP1, "(inactive)");
+            set_dlg_text(g_diag_hwnd, IDC_D_RTP2, "(inactive)");
             snprintf(buf, sizeof(buf), "Running: NO");
         }
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_RTP_STATUS, buf);
+        set_dlg_text(g_diag_hwnd, IDC_D_RTP_STATUS, buf);
     }
+}
+
+/* Engine stats: refreshed on a timer while the window is shown */
+static void update_diag_stats(void) {
+    char buf[128];
+
+    if (!g_diag_hwnd || !g_engine_running) return;
 
-    /* Engine stats */
     {
         DWORD elapsed = GetTickCount() - g_engine_start_tick;
         int secs = (int)(elapsed / 1000);
         int hrs = secs / 3600; secs %= 3600;
         int mins = secs / 60; secs %= 60;
         snprintf(buf, sizeof(buf), "%02d:%02d:%02d", hrs, mins, secs);
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_UPTIME, buf);
+        set_dlg_text(g_diag_hwnd, IDC_D_UPTIME, buf);
 
         snprintf(buf, sizeof(buf), "%lu", g_loop_count);
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_ITERATIONS, buf);
+        set_dlg_text(g_diag_hwnd, IDC_D_ITERATIONS, buf);
 
         snprintf(buf, sizeof(buf), "%ld", (long)g_total_restarts);
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_RESTARTS, buf);
+        set_dlg_text(g_diag_hwnd, IDC_D_RESTARTS, buf);
+    }
+
+    /* Pipeline telemetry (same counters as STATS and /metrics) */
+    if (g_station.metrics) {
+        struct station_metrics_t *m = g_station.metrics;
+        struct metrics_hist_t *h[2] = { &m->gen_time, &m->play_time };
+        int ids[2] = { IDC_D_GEN_TIME, IDC_D_PLAY_TIME };
+        uint64_t in = atomic_load_explicit(&m->frames_in, memory_order_relaxed);
+        uint64_t out = atomic_load_explicit(&m->frames_out, memory_order_relaxed);
+        double nominal = (double)OUTPUT_SAMPLE_RATE / (double)atomic_load(&m->mpx_rate);
+
+        for (int i = 0; i < 2; i++) {
+            snprintf(buf, sizeof(buf), "p50 %.0f / p99 %.0f / max %.0f us",
+                metrics_quantile_ns(h[i], 0.5) / 1e3,
+                metrics_quantile_ns(h[i], 0.99) / 1e3,
+                atomic_load_explicit(&h[i]->max_ns, memory_order_relaxed) / 1e3);
+            set_dlg_text(g_diag_hwnd, ids[i], buf);
+        }
+
+        if (in) {
+            snprintf(buf, sizeof(buf), "%.6f (%+.1f ppm)", (double)out / in,
+                ((double)out / in / nominal - 1.0) * 1e6);
+        } else {
+            snprintf(buf, sizeof(buf), "-");
+        }
+        set_dlg_text(g_diag_hwnd, IDC_D_SRC_DRIFT, buf);
     }
 
     /* Peak meter */
@@ -1671,7 +1987,7 @@ static void update_diag_monitor(void) {
         SendDlgItemMessageA(g_diag_hwnd, IDC_D_PEAK_BAR, PBM_SETPOS, peak, 0);
         float db = (peak > 0) ? 20.0f * log10f((float)peak / 1000.0f) : -60.0f;
         snprintf(buf, sizeof(buf), "%.1f dB", db);
-        SetDlgItemTextA(g_diag_hwnd, IDC_D_PEAK_LABEL, buf);
+        set_dlg_text(g_diag_hwnd, IDC_D_PEAK_LABEL, buf);
     }
 }
 
@@ -1848,9 +2164,6 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
     case WM_CREATE:
         g_main_hwnd = hwnd;
         create_main_controls(hwnd);
-        SetTimer(hwnd, IDT_MONITOR_TIMER, MONITOR_TIMER_MS, NULL);
-        SetTimer(hwnd, IDT_LOG_TIMER, LOG_TIMER_MS, NULL);
-        SetTimer(hwnd, IDT_FILEWATCH_TIMER, FILEWATCH_TIMER_MS, NULL);
         return 0;
 
     case WM_COMMAND:
@@ -1864,7 +2177,7 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
         case IDC_M_TA_BTN:
             if (g_engine_running) {
                 BOOL chk = (IsDlgButtonChecked(hwnd, IDC_M_TA_BTN) == BST_CHECKED);
-                set_rds_ta(chk ? 1 : 0);
+                set_rds_ta(g_station.rds, chk ? 1 : 0);
                 if (g_settings_hwnd)
                     CheckDlgButton(g_settings_hwnd, IDC_S_TA_CHK, chk ? BST_CHECKED : BST_UNCHECKED);
             }
@@ -1872,7 +2185,7 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
         case IDC_M_MS_BTN:
             if (g_engine_running) {
                 BOOL chk = (IsDlgButtonChecked(hwnd, IDC_M_MS_BTN) == BST_CHECKED);
-                set_rds_ms(chk ? 1 : 0);
+                set_rds_ms(g_station.rds, chk ? 1 : 0);
                 if (g_settings_hwnd)
                     CheckDlgButton(g_settings_hwnd, IDC_S_MS_CHK, chk ? BST_CHECKED : BST_UNCHECKED);
             }
@@ -1880,7 +2193,7 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
         case IDC_M_TP_BTN:
             if (g_engine_running) {
                 BOOL chk = (IsDlgButtonChecked(hwnd, IDC_M_TP_BTN) == BST_CHECKED);
-                set_rds_tp(chk ? 1 : 0);
+                set_rds_tp(g_station.rds, chk ? 1 : 0);
                 if (g_settings_hwnd)
                     CheckDlgButton(g_settings_hwnd, IDC_S_TP_CHK, chk ? BST_CHECKED : BST_UNCHECKED);
             }
@@ -1895,7 +2208,7 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
             char lbl[16];
             snprintf(lbl, sizeof(lbl), "%d%%", pos);
             SetDlgItemTextA(hwnd, IDC_M_VOL_LABEL, lbl);
-            if (g_engine_running) set_output_volume((float)pos);
+            if (g_engine_running) set_output_volume(g_station.mpx, (float)pos);
             if (g_settings_hwnd) {
                 SendDlgItemMessageA(g_settings_hwnd, IDC_S_VOL_SLIDER, TBM_SETPOS, TRUE, pos);
                 SetDlgItemTextA(g_settings_hwnd, IDC_S_VOL_LABEL, lbl);
@@ -1918,22 +2231,23 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
         break;
     }
 
-    case WM_TIMER:
-        switch (wParam) {
-        case IDT_MONITOR_TIMER:
-            update_main_monitor();
-            update_diag_monitor();
-            break;
-        case IDT_LOG_TIMER:
-            drain_stderr_to_log();
-            break;
-        case IDT_FILEWATCH_TIMER:
-            check_file_watches();
-            break;
-        }
+    case WM_APP_LOG:
+        append_log((const char *)lParam);
+        free((void *)lParam);
+        return 0;
+
+    case WM_APP_FILE_CHANGED:
+        check_file_watches((DWORD)wParam);
         return 0;
 
-    case WM_APP + 1:
+    case WM_APP_RDS_CHANGED:
+        /* clear first so a change made while painting posts again */
+        InterlockedExchange(&g_monitor_posted, 0);
+        update_main_monitor();
+        update_diag_params();
+        return 0;
+
+    case WM_APP_ENGINE_STOPPED:
         /* Engine stopped (posted from engine thread) */
         SetDlgItemTextA(hwnd, IDC_M_STATUS_LABEL, "  STOPPED");
         EnableWindow(GetDlgItem(hwnd, IDC_M_START_BTN), TRUE);
@@ -1948,9 +2262,6 @@ static LRESULT CALLBACK MainWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 
     case WM_CLOSE:
         if (g_engine_running) stop_engine();
-        KillTimer(hwnd, IDT_MONITOR_TIMER);
-        KillTimer(hwnd, IDT_LOG_TIMER);
-        KillTimer(hwnd, IDT_FILEWATCH_TIMER);
         if (g_settings_hwnd) { DestroyWindow(g_settings_hwnd); g_settings_hwnd = NULL; }
         if (g_diag_hwnd) { DestroyWindow(g_diag_hwnd); g_diag_hwnd = NULL; }
         DestroyWindow(hwnd);
@@ -2132,6 +2443,7 @@ static void execute_command_file(HWND hwnd) {
     int count = 0;
     GetDlgItemTextA(hwnd, IDC_S_CMD_EDIT, fp, MAX_PATH);
     if (!fp[0]) { log_msg("No command file specified.\r\n"); return; }
+    if (!g_engine_running) { log_msg("Start the engine first.\r\n"); return; }
     f = fopen(fp, "r");
     if (!f) { log_msg("Error: cannot open file: %s\r\n", fp); return; }
     log_msg("Executing commands from: %s\r\n", fp);
@@ -2141,7 +2453,7 @@ static void execute_command_file(HWND hwnd) {
             line[--len] = '\0';
         if (len == 0 || line[0] == '#') continue;
         log_msg("  CMD: %s\r\n", line);
-        process_ascii_cmd((unsigned char *)line);
+        process_ascii_cmd(&g_station, (unsigned char *)line, (uint16_t)len);
         count++;
     }
     fclose(f);
@@ -2219,7 +2531,7 @@ static LRESULT CALLBACK SettingsWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPAR
             char lbl[16];
             snprintf(lbl, sizeof(lbl), "%d%%", pos);
             SetDlgItemTextA(hwnd, IDC_S_VOL_LABEL, lbl);
-            if (g_engine_running) set_output_volume((float)pos);
+            if (g_engine_running) set_output_volume(g_station.mpx, (float)pos);
             SendDlgItemMessageA(g_main_hwnd, IDC_M_VOL_SLIDER, TBM_SETPOS, TRUE, pos);
             SetDlgItemTextA(g_main_hwnd, IDC_M_VOL_LABEL, lbl);
             schedule_autosave();
@@ -2317,12 +2629,16 @@ static void create_diag_controls(HWND hwnd) {
     y += 8;
 
     /* Engine Status */
-    mk_group(hwnd, "Engine Status", 10, y, gw, 58);
+    mk_group(hwnd, "Engine Status", 10, y, gw, 112);
     y += 18;
     diag_row(hwnd, "Uptime:", IDC_D_UPTIME, 20, y, 50, 100);
     diag_row(hwnd, "Iter:", IDC_D_ITERATIONS, 180, y, 32, 120);
     diag_row(hwnd, "Restarts:", IDC_D_RESTARTS, 340, y, 58, 60);
-    y += 22;
+    y += 18;
+    y += diag_row(hwnd, "Block:", IDC_D_GEN_TIME, 20, y, 50, gw - 80);
+    y += diag_row(hwnd, "ao_play:", IDC_D_PLAY_TIME, 20, y, 50, gw - 80);
+    y += diag_row(hwnd, "SRC:", IDC_D_SRC_DRIFT, 20, y, 50, gw - 80);
+    y += 4;
 
     /* Peak meter */
     mk_label(hwnd, "Output:", 20, y + 2, 50, 16);
@@ -2354,7 +2670,8 @@ static void create_diag_controls(HWND hwnd) {
         int ids[] = { IDC_D_PI, IDC_D_PS, IDC_D_RT, IDC_D_PTY, IDC_D_PTYN,
                       IDC_D_TP, IDC_D_TA, IDC_D_MS, IDC_D_LPS, IDC_D_ERT, IDC_D_AF,
                       IDC_D_RTP1, IDC_D_RTP2, IDC_D_RTP_STATUS,
-                      IDC_D_UPTIME, IDC_D_ITERATIONS, IDC_D_RESTARTS, IDC_D_PEAK_LABEL };
+                      IDC_D_UPTIME, IDC_D_ITERATIONS, IDC_D_RESTARTS,
+                      IDC_D_GEN_TIME, IDC_D_PLAY_TIME, IDC_D_SRC_DRIFT, IDC_D_PEAK_LABEL };
         int i;
         for (i = 0; i < (int)(sizeof(ids) / sizeof(ids[0])); i++) {
             HWND h = GetDlgItem(hwnd, ids[i]);
@@ -2377,11 +2694,23 @@ static LRESULT CALLBACK DiagWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
         return 0;
 
     case WM_SHOWWINDOW:
-        if (wParam)
+        if (wParam) {
             g_log_edit = GetDlgItem(hwnd, IDC_D_LOG_EDIT);
+            SetTimer(hwnd, IDT_MONITOR_TIMER, MONITOR_TIMER_MS, NULL);
+            update_diag_params();
+            update_diag_stats();
+        } else {
+            KillTimer(hwnd, IDT_MONITOR_TIMER);
+        }
         break;
 
+    case WM_TIMER:
+        if (wParam == IDT_MONITOR_TIMER)
+            update_diag_stats();
+        return 0;
+
     case WM_DESTROY:
+        KillTimer(hwnd, IDT_MONITOR_TIMER);
         g_log_edit = NULL;
         g_diag_hwnd = NULL;
         return 0;
@@ -2484,6 +2813,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     }
 
     setup_stderr_capture();
+    InitializeCriticalSection(&g_watch_lock);
 
     /* Register main window class */
     memset(&wc, 0, sizeof(wc));
@@ -2522,6 +2852,12 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     ShowWindow(g_main_hwnd, nCmdShow);
     UpdateWindow(g_main_hwnd);
 
+    /* the reader posts to the main window, so it starts once that exists */
+    if (g_stderr_read) {
+        HANDLE h = CreateThread(NULL, 0, stderr_reader_proc, NULL, 0, NULL);
+        if (h) CloseHandle(h);
+    }
+
     /* Auto-open settings on first launch */
     show_settings_window(hInstance);
 
@@ -2543,7 +2879,8 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     if (g_font_mono) DeleteObject(g_font_mono);
     if (g_font_large) DeleteObject(g_font_large);
     if (g_font_title) DeleteObject(g_font_title);
-    if (g_stderr_read) CloseHandle(g_stderr_read);
+    DeleteCriticalSection(&g_watch_lock);
+    /* g_stderr_read stays open: the reader thread blocks on it until exit */
 
     return (int)msg.wParam;
 }
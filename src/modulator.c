@@ -22,162 +22,457 @@
 #include "rds2.h"
 #endif
 #include "fm_mpx.h"
-#include "waveforms.h"
 #include "modulator.h"
+#include "arena.h"
+#include "tables.h"
+#ifdef BUILTIN_TABLES
+#include "builtin_tables.h"
+#endif
+#include <stdatomic.h>
 
-static struct rds_t **rds_ctx;
-static float **waveform;
+/*
+ * Envelope tables
+ *
+ * These only depend on the sample rate, so there is one set per rate
+ * for all modulators. They are read-only once made.
+ */
+static struct rds_envelope_t *envelopes;
+static atomic_flag envelopes_lock = ATOMIC_FLAG_INIT;
+
+static inline const float *get_slice(const struct rds_envelope_t *env,
+	uint16_t phase, uint8_t tap) {
+	return &env->slices[
+		(phase * POLYPHASE_TAPS + tap) * env->max_bit_len];
+}
 
 /*
- * Create the RDS objects
+ * Set up a stream to start on a bit boundary
  *
  */
-void init_rds_objects() {
-	rds_ctx = malloc(NUM_STREAMS * sizeof(struct rds_t *));
+static void reset_rds_object(struct rds_modulator_t *mod,
+	uint8_t stream_num) {
+	struct rds_t *rds = &mod->streams[stream_num];
+	const struct rds_envelope_t *env = mod->env;
+	/* symbol shift in quarter bits */
+	uint8_t shift = 0;
 
-	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
-		rds_ctx[i] = calloc(1, sizeof(struct rds_t));
-		rds_ctx[i]->bit_buffer = calloc(BITS_PER_GROUP, 1);
-		rds_ctx[i]->sample_buffer =
-			calloc(SAMPLE_BUFFER_SIZE, sizeof(float));
+	memset(rds->slice_buf, 0, env->max_bit_len * sizeof(float));
+
+	/* the first bit fetches a group, instead of sending zeros */
+	rds->block_pos = GROUP_LENGTH;
+	rds->bit_pos = 0;
+
+	rds->history = 0;
+	rds->history_len = 0;
+	rds->phase = 0;
+	rds->bit_len = 0;
+	rds->sample_count = 0;
 
 #ifdef RDS2_SYMBOL_SHIFTING
-		/*
-		 * symbol shifting to reduce total power of aggregate carriers
-		 *
-		 * see:
-		 * https://ietresearch.onlinelibrary.wiley.com/doi/pdf/10.1049/el.2019.0292
-		 * for more information
-		 */
-		switch (i) {
-		case 1:
-			/* time offset of 1/2 */
-			rds_ctx[i]->symbol_shift = SAMPLES_PER_BIT / 2;
-			rds_ctx[i]->symbol_shift_buf = malloc(
-				rds_ctx[i]->symbol_shift * sizeof(float));
-			memset(rds_ctx[i]->symbol_shift_buf, 0,
-				rds_ctx[i]->symbol_shift * sizeof(float));
-			break;
-		case 2:
-			/* time offset of 1/4 */
-			rds_ctx[i]->symbol_shift = SAMPLES_PER_BIT / 4;
-			rds_ctx[i]->symbol_shift_buf = malloc(
-				rds_ctx[i]->symbol_shift * sizeof(float));
-			memset(rds_ctx[i]->symbol_shift_buf, 0,
-				rds_ctx[i]->symbol_shift * sizeof(float));
-			break;
-		case 3:
-			/* time offset of 3/4 */
-			rds_ctx[i]->symbol_shift = (SAMPLES_PER_BIT / 4) * 3;
-			rds_ctx[i]->symbol_shift_buf = malloc(
-				rds_ctx[i]->symbol_shift * sizeof(float));
-			memset(rds_ctx[i]->symbol_shift_buf, 0,
-				rds_ctx[i]->symbol_shift * sizeof(float));
-			break;
-		default: /* stream 0 */
-			/* no time offset */
-			rds_ctx[i]->symbol_shift = 0;
-			break;
-		}
+	/*
+	 * symbol shifting to reduce total power of aggregate carriers
+	 *
+	 * see:
+	 * https://ietresearch.onlinelibrary.wiley.com/doi/pdf/10.1049/el.2019.0292
+	 * for more information
+	 *
+	 * The offset is applied by holding the stream silent
+	 * for that many samples before the first bit.
+	 */
+	switch (stream_num) {
+	case 1:
+		/* time offset of 1/2 */
+		shift = 2;
+		break;
+	case 2:
+		/* time offset of 1/4 */
+		shift = 1;
+		break;
+	case 3:
+		/* time offset of 3/4 */
+		shift = 3;
+		break;
+	default: /* stream 0 */
+		/* no time offset */
+		shift = 0;
+		break;
+	}
 #endif
-		rds_ctx[i]->symbol_shift_buf_idx = 0;
+	rds->symbol_shift = (uint16_t)lround(
+		(double)env->spb_num * shift / (4.0 * env->spb_den));
+}
 
+#ifdef BUILTIN_TABLES
+static const struct builtin_envelope_t *find_builtin_envelope(
+	uint32_t sample_rate) {
+	for (size_t i = 0; i < num_builtin_envelopes; i++) {
+		if (builtin_envelopes[i].sample_rate == sample_rate)
+			return &builtin_envelopes[i];
 	}
+	return NULL;
+}
+#endif
 
-	waveform = malloc(2 * sizeof(float *));
+/*
+ * Generate the envelope tables for a sample rate
+ *
+ * The tables are put right after the context in one arena:
+ * bit_len, then the slices, then the polyphase rows. Built-in
+ * tables are used in place.
+ */
+static struct rds_envelope_t *create_envelope(uint32_t sample_rate) {
+	struct rds_envelope_t *env;
+	uint32_t spb_num, spb_den;
+	uint16_t max_bit_len;
+	size_t bit_len_size, slices_size, polyphase_size;
+	uint8_t *arena;
+	uint16_t *bit_len;
+	float *slices, *polyphase = NULL;
+#ifdef BUILTIN_TABLES
+	const struct builtin_envelope_t *builtin;
+#endif
 
-	for (uint8_t i = 0; i < 2; i++) {
-		waveform[i] = malloc(FILTER_SIZE * sizeof(float));
-		for (uint16_t j = 0; j < FILTER_SIZE; j++) {
-			waveform[i][j] = i ?
-				+waveform_biphase[j] : -waveform_biphase[j];
-		}
+	get_envelope_size(sample_rate, &spb_num, &spb_den, &max_bit_len);
+
+#ifdef BUILTIN_TABLES
+	builtin = find_builtin_envelope(sample_rate);
+	if (builtin) {
+		env = alloc_arena(sizeof(struct rds_envelope_t));
+		if (env == NULL) return NULL;
+
+		env->sample_rate = sample_rate;
+		env->spb_num = spb_num;
+		env->spb_den = spb_den;
+		env->max_bit_len = max_bit_len;
+		env->bit_len = builtin->bit_len;
+		env->slices = builtin->slices;
+		env->polyphase = builtin->polyphase;
+		return env;
 	}
+#endif
+
+	bit_len_size = ARENA_SIZE(spb_den * sizeof(uint16_t));
+	slices_size = ARENA_SIZE(spb_den * POLYPHASE_TAPS *
+		max_bit_len * sizeof(float));
+	polyphase_size = spb_den == 1 ?
+		ARENA_SIZE(POLYPHASE_ROWS * max_bit_len * sizeof(float)) : 0;
+
+	arena = alloc_arena(ARENA_SIZE(sizeof(struct rds_envelope_t)) +
+		bit_len_size + slices_size + polyphase_size);
+	if (arena == NULL) return NULL;
+
+	env = (struct rds_envelope_t *)arena;
+	arena += ARENA_SIZE(sizeof(struct rds_envelope_t));
+	bit_len = (uint16_t *)arena;
+	arena += bit_len_size;
+	slices = (float *)arena;
+	arena += slices_size;
+	if (polyphase_size) polyphase = (float *)arena;
+
+	env->sample_rate = sample_rate;
+	env->spb_num = spb_num;
+	env->spb_den = spb_den;
+	env->max_bit_len = max_bit_len;
+
+	create_slices(spb_num, spb_den, max_bit_len, bit_len, slices);
+	if (polyphase) create_polyphase(max_bit_len, slices, polyphase);
+
+	env->bit_len = bit_len;
+	env->slices = slices;
+	env->polyphase = polyphase;
+
+	return env;
 }
 
-void exit_rds_objects() {
-	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
-		free(rds_ctx[i]->sample_buffer);
-		free(rds_ctx[i]->bit_buffer);
-		if (rds_ctx[i]->symbol_shift && rds_ctx[i]->symbol_shift_buf) {
-			free(rds_ctx[i]->symbol_shift_buf);
+static void lock_envelopes() {
+	while (atomic_flag_test_and_set_explicit(&envelopes_lock,
+		memory_order_acquire))
+		; /* spin */
+}
+
+static void unlock_envelopes() {
+	atomic_flag_clear_explicit(&envelopes_lock, memory_order_release);
+}
+
+/* find or create the tables for a rate */
+static struct rds_envelope_t *get_envelope(uint32_t sample_rate) {
+	struct rds_envelope_t *env;
+
+	lock_envelopes();
+
+	for (env = envelopes; env; env = env->next) {
+		if (env->sample_rate == sample_rate) {
+			env->refs++;
+			goto done;
 		}
-		free(rds_ctx[i]);
 	}
 
-	free(rds_ctx);
+	env = create_envelope(sample_rate);
+	if (env == NULL) goto done;
+	env->refs = 1;
+	env->next = envelopes;
+	envelopes = env;
+
+done:
+	unlock_envelopes();
+	return env;
+}
 
-	for (uint8_t i = 0; i < 2; i++) {
-		free(waveform[i]);
+/* free the tables when the last modulator using them is gone */
+static void put_envelope(struct rds_envelope_t *env) {
+	struct rds_envelope_t **link;
+
+	lock_envelopes();
+
+	if (--env->refs == 0) {
+		for (link = &envelopes; *link; link = &(*link)->next) {
+			if (*link == env) {
+				*link = env->next;
+				break;
+			}
+		}
+		free_arena(env);
 	}
 
-	free(waveform);
+	unlock_envelopes();
 }
 
-/* Get an RDS sample. This generates the envelope of the waveform using
- * pre-generated elementary waveform samples.
+/*
+ * Create a modulator for an encoder at a sample rate
+ *
+ * Called by fm_mpx_init, which uses the MPX rate.
  */
-float get_rds_sample(uint8_t stream_num) {
-	struct rds_t *rds;
-	uint16_t idx;
-	float *cur_waveform;
-	float sample;
+struct rds_modulator_t *init_rds_modulator(struct rds_encoder_t *enc,
+	uint32_t sample_rate) {
+	struct rds_modulator_t *mod;
+	struct rds_envelope_t *env;
+	size_t slice_size;
+	uint8_t *arena;
 
-	/* select context */
-	rds = rds_ctx[stream_num];
+	env = get_envelope(sample_rate);
+	if (env == NULL) return NULL;
 
-	if (rds->sample_count == SAMPLES_PER_BIT) {
-		if (rds->bit_pos == BITS_PER_GROUP) {
+	/* the modulator, then a slice buffer for each stream */
+	slice_size = ARENA_SIZE(env->max_bit_len * sizeof(float));
+	arena = alloc_arena(ARENA_SIZE(sizeof(struct rds_modulator_t)) +
+		NUM_STREAMS * slice_size);
+	if (arena == NULL) {
+		put_envelope(env);
+		return NULL;
+	}
+
+	mod = (struct rds_modulator_t *)arena;
+	arena += ARENA_SIZE(sizeof(struct rds_modulator_t));
+	mod->enc = enc;
 #ifdef RDS2
-			if (stream_num > 0) {
-				get_rds2_bits(stream_num, rds->bit_buffer);
-			} else {
-				get_rds_bits(rds->bit_buffer);
-			}
+	mod->rds2 = get_rds2_encoder(enc);
+#endif
+	mod->env = env;
+
+	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+		mod->streams[i].slice_buf = (float *)(arena + i * slice_size);
+		reset_rds_object(mod, i);
+	}
+
+	return mod;
+}
+
+void exit_rds_modulator(struct rds_modulator_t *mod) {
+	put_envelope((struct rds_envelope_t *)mod->env);
+	free_arena(mod);
+}
+
+/* get the next group of a stream from its encoder */
+static void fetch_group(struct rds_modulator_t *mod, uint8_t stream_num,
+	uint32_t *bits) {
+#ifdef RDS2
+	if (stream_num > 0) {
+		get_rds2_bits(mod->rds2, stream_num, bits);
+	} else {
+		get_rds_bits(mod->enc, bits);
+	}
 #else
-			get_rds_bits(rds->bit_buffer);
+	(void)stream_num;
+	get_rds_bits(mod->enc, bits);
 #endif
-			rds->bit_pos = 0;
+}
+
+/*
+ * Move on to the next bit and select its envelope
+ *
+ */
+static void next_bit(struct rds_modulator_t *mod, uint8_t stream_num,
+	struct rds_t *rds) {
+	const struct rds_envelope_t *env = mod->env;
+	const float *slice;
+	float *out;
+	uint16_t phase;
+	uint8_t taps;
+
+	if (rds->bit_pos == BITS_PER_BLOCK) {
+		rds->bit_pos = 0;
+		rds->block_pos++;
+	}
+
+	if (rds->block_pos == GROUP_LENGTH) {
+		if (rds->queued) {
+			memcpy(rds->bit_buffer, rds->queue[rds->queue_pos],
+				GROUP_LENGTH * sizeof(uint32_t));
+			rds->queue_pos = (rds->queue_pos + 1) % RDS_GROUP_QUEUE;
+			rds->queued--;
+		} else {
+			fetch_group(mod, stream_num, rds->bit_buffer);
 		}
+		rds->block_pos = 0;
+	}
+
+	/* do differential encoding */
+	rds->cur_output ^= (rds->bit_buffer[rds->block_pos]
+		>> (BITS_PER_BLOCK - 1 - rds->bit_pos++)) & 1;
+	rds->history = ((rds->history << 1) | rds->cur_output)
+		& POLYPHASE_MASK;
+	if (rds->history_len < POLYPHASE_TAPS) rds->history_len++;
 
-		/* do differential encoding */
-		rds->cur_bit = rds->bit_buffer[rds->bit_pos++];
-		rds->prev_output = rds->cur_output;
-		rds->cur_output = rds->prev_output ^ rds->cur_bit;
+	phase = rds->phase;
+	if (++rds->phase == env->spb_den) rds->phase = 0;
 
-		idx = rds->in_sample_index;
-		cur_waveform = waveform[rds->cur_output];
+	rds->bit_len = env->bit_len[phase];
+	rds->sample_count = 0;
 
-		for (uint16_t i = 0; i < FILTER_SIZE; i++) {
-			rds->sample_buffer[idx++] += *cur_waveform++;
-			if (idx == SAMPLE_BUFFER_SIZE) idx = 0;
+	if (env->polyphase && rds->history_len == POLYPHASE_TAPS) {
+		rds->cur_slice =
+			&env->polyphase[rds->history * env->max_bit_len];
+		return;
+	}
+
+	/*
+	 * Add up the slices of the pulses sent so far. This is needed
+	 * until the history fills up or if the bits don't all start on
+	 * a sample.
+	 */
+	taps = rds->history_len;
+	out = rds->slice_buf;
+	for (uint16_t i = 0; i < rds->bit_len; i++)
+		out[i] = 0.0f;
+	for (int8_t j = taps - 1; j >= 0; j--) {
+		slice = get_slice(env, phase, j);
+		for (uint16_t i = 0; i < rds->bit_len; i++) {
+			if (rds->history & (1 << j)) {
+				out[i] += slice[i];
+			} else {
+				out[i] += -slice[i];
+			}
 		}
+	}
+	rds->cur_slice = out;
+}
+
+/* Get an RDS sample. This generates the envelope of the waveform using
+ * the polyphase table.
+ */
+float get_rds_sample(struct rds_modulator_t *mod, uint8_t stream_num) {
+	float sample;
 
-		rds->in_sample_index += SAMPLES_PER_BIT;
-		if (rds->in_sample_index == SAMPLE_BUFFER_SIZE)
-			rds->in_sample_index = 0;
+	get_rds_samples(mod, stream_num, &sample, 1);
+	return sample;
+}
+
+/*
+ * Count the groups that the next num_samples samples will start
+ *
+ * This steps through the bits the same way as get_rds_samples but
+ * leaves the stream as it is.
+ */
+static uint8_t count_rds_groups(struct rds_modulator_t *mod,
+	struct rds_t *rds, size_t num_samples) {
+	const struct rds_envelope_t *env = mod->env;
+	uint16_t phase = rds->phase;
+	uint16_t bit_len = rds->bit_len;
+	uint16_t sample_count = rds->sample_count;
+	uint8_t block_pos = rds->block_pos;
+	uint8_t bit_pos = rds->bit_pos;
+	uint8_t groups = 0;
+	size_t len;
+
+	if (num_samples <= rds->symbol_shift) return 0;
+	num_samples -= rds->symbol_shift;
 
-		rds->sample_count = 0;
+	while (num_samples) {
+		if (sample_count == bit_len) {
+			if (bit_pos == BITS_PER_BLOCK) {
+				bit_pos = 0;
+				block_pos++;
+			}
+			if (block_pos == GROUP_LENGTH) {
+				groups++;
+				block_pos = 0;
+			}
+			bit_pos++;
+			bit_len = env->bit_len[phase];
+			if (++phase == env->spb_den) phase = 0;
+			sample_count = 0;
+		}
+
+		len = bit_len - sample_count;
+		if (len > num_samples) len = num_samples;
+		num_samples -= len;
+		sample_count += len;
 	}
-	rds->sample_count++;
 
-	if (rds->symbol_shift) {
-		rds->symbol_shift_buf[rds->symbol_shift_buf_idx++] =
-			rds->sample_buffer[rds->out_sample_index];
+	return groups;
+}
+
+/*
+ * Fetch the groups needed for the next num_samples samples
+ *
+ * After this get_rds_samples doesn't touch the encoder for that many
+ * samples, so the streams can then be generated on other threads.
+ * The groups are fetched in the same order as they would have been
+ * otherwise.
+ */
+void prefetch_rds_groups(struct rds_modulator_t *mod, uint8_t stream_num,
+	size_t num_samples) {
+	struct rds_t *rds = &mod->streams[stream_num];
+	uint8_t groups = count_rds_groups(mod, rds, num_samples);
+	uint8_t slot;
+
+	while (groups > rds->queued && rds->queued < RDS_GROUP_QUEUE) {
+		slot = (rds->queue_pos + rds->queued) % RDS_GROUP_QUEUE;
+		fetch_group(mod, stream_num, rds->queue[slot]);
+		rds->queued++;
+	}
+}
 
-		if (rds->symbol_shift_buf_idx == rds->symbol_shift)
-			rds->symbol_shift_buf_idx = 0;
+/*
+ * Get a block of RDS samples
+ *
+ * Whole bit periods are copied straight out of the table
+ */
+void get_rds_samples(struct rds_modulator_t *mod, uint8_t stream_num,
+	float *out, size_t num_samples) {
+	struct rds_t *rds;
+	size_t len;
 
-		sample = rds->symbol_shift_buf[rds->symbol_shift_buf_idx];
+	/* select context */
+	rds = &mod->streams[stream_num];
 
-		goto done;
+	while (rds->symbol_shift && num_samples) {
+		*out++ = 0.0f;
+		rds->symbol_shift--;
+		num_samples--;
 	}
 
-	sample = rds->sample_buffer[rds->out_sample_index];
-done:
-	rds->sample_buffer[rds->out_sample_index++] = 0;
-	if (rds->out_sample_index == SAMPLE_BUFFER_SIZE)
-		rds->out_sample_index = 0;
+	while (num_samples) {
+		if (rds->sample_count == rds->bit_len)
+			next_bit(mod, stream_num, rds);
 
-	return sample;
+		len = rds->bit_len - rds->sample_count;
+		if (len > num_samples) len = num_samples;
+
+		memcpy(out, &rds->cur_slice[rds->sample_count],
+			len * sizeof(float));
+		out += len;
+		num_samples -= len;
+		rds->sample_count += len;
+	}
 }
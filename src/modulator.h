@@ -22,21 +22,110 @@
 #define NUM_STREAMS	1
 #endif
 
-/* RDS signal context */
+/*
+ * Polyphase envelope
+ *
+ * The biphase pulse spans POLYPHASE_TAPS bit periods, so each output
+ * bit is the sum of one slice from each of the last POLYPHASE_TAPS
+ * pulses. With the differential bits as the index the sums can all
+ * be precomputed.
+ */
+#define POLYPHASE_TAPS		(FILTER_SIZE / SAMPLES_PER_BIT)
+#define POLYPHASE_ROWS		(1 << POLYPHASE_TAPS)
+#define POLYPHASE_MASK		(POLYPHASE_ROWS - 1)
+
+/* 1187.5 bps */
+#define RDS_BIT_RATE_NUM	2375
+#define RDS_BIT_RATE_DEN	2
+
+/*
+ * Envelope tables for one sample rate
+ *
+ * The number of samples per bit is spb_num / spb_den. When this is
+ * not a whole number the bits start at spb_den different sub-sample
+ * offsets (phases), each with its own set of pulse slices.
+ */
+typedef struct rds_envelope_t {
+	uint32_t sample_rate;
+	uint32_t spb_num;
+	uint32_t spb_den;
+
+	/* length of a bit for each phase */
+	const uint16_t *bit_len; /* spb_den */
+	uint16_t max_bit_len;
+
+	/* [spb_den][POLYPHASE_TAPS][max_bit_len] */
+	const float *slices;
+
+	/* [POLYPHASE_ROWS][max_bit_len], only if spb_den is 1 */
+	const float *polyphase;
+
+	/* tables are shared by all modulators at this rate */
+	uint32_t refs;
+	struct rds_envelope_t *next;
+} rds_envelope_t;
+
+/*
+ * Groups fetched ahead of time by prefetch_rds_groups
+ *
+ * A block of NUM_MPX_FRAMES_IN samples starts at most one new group
+ * at any supported MPX rate, so this leaves some room.
+ */
+#define RDS_GROUP_QUEUE	2
+
+/*
+ * RDS signal context
+ *
+ * Each stream starts on its own cache line, so streams rendered on
+ * different threads don't share one.
+ */
 typedef struct rds_t {
-	uint8_t *bit_buffer; /* BITS_PER_GROUP */
+	/* packed blocks of the current group */
+	_Alignas(CACHE_LINE) uint32_t bit_buffer[GROUP_LENGTH];
+	uint8_t block_pos;
 	uint8_t bit_pos;
-	float *sample_buffer; /* SAMPLE_BUFFER_SIZE */
-	uint8_t prev_output;
 	uint8_t cur_output;
-	uint8_t cur_bit;
-	uint8_t sample_count;
-	uint16_t in_sample_index;
-	uint16_t out_sample_index;
-	uint8_t symbol_shift;
-	float *symbol_shift_buf;
-	uint8_t symbol_shift_buf_idx;
+	/* last POLYPHASE_TAPS differential bits, newest in bit 0 */
+	uint8_t history;
+	/* number of pulses in the history (until it fills up) */
+	uint8_t history_len;
+	/* envelope of the current bit */
+	const float *cur_slice;
+	/* used when the envelope has to be summed (max_bit_len) */
+	float *slice_buf;
+	uint16_t phase;
+	uint16_t bit_len;
+	uint16_t sample_count;
+	/* silent samples left before the first bit */
+	uint16_t symbol_shift;
+	/* prefetched groups, used before fetching new ones */
+	uint32_t queue[RDS_GROUP_QUEUE][GROUP_LENGTH];
+	uint8_t queue_pos;
+	uint8_t queued;
 } rds_t;
 
-extern void init_rds_objects();
-extern void exit_rds_objects();
+/*
+ * RDS modulator
+ *
+ * Turns the groups of one encoder into the envelopes of all of its
+ * streams at one sample rate. The slice buffers of the streams follow
+ * it in the same arena.
+ */
+typedef struct rds_modulator_t {
+	struct rds_t streams[NUM_STREAMS];
+	const struct rds_envelope_t *env;
+	struct rds_encoder_t *enc;
+#ifdef RDS2
+	struct rds2_encoder_t *rds2;
+#endif
+} rds_modulator_t;
+
+extern struct rds_modulator_t *init_rds_modulator(
+	struct rds_encoder_t *enc, uint32_t sample_rate);
+extern void exit_rds_modulator(struct rds_modulator_t *mod);
+extern float get_rds_sample(struct rds_modulator_t *mod,
+	uint8_t stream_num);
+extern void prefetch_rds_groups(struct rds_modulator_t *mod,
+	uint8_t stream_num, size_t num_samples);
+extern void get_rds_samples(struct rds_modulator_t *mod,
+	uint8_t stream_num, float *out, size_t num_samples);
@@ -0,0 +1,715 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "mpx_simd.h"
+
+/*
+ * Vector kernels for the MPX block loop
+ *
+ * The x86 kernels are compiled with per-function target attributes
+ * so a generic build can still pick AVX2 at runtime. NEON is part of
+ * the baseline on AArch64 (and on ARMv7 builds using -mfpu=neon), so
+ * it is used whenever the compiler has it enabled.
+ *
+ * The kernels deliberately avoid fused multiply-add so that they give
+ * the same results as the scalar reference path, and the conversions
+ * round to nearest even like lrintf().
+ */
+
+#if defined(__x86_64__) || defined(_M_X64) || \
+	defined(__i386__) || defined(_M_IX86)
+#define MPX_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MPX_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2	__attribute__((target("sse2")))
+#define TARGET_AVX2	__attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+/* full scale for the integer conversions */
+#define S16_MAX		32767.0f
+#define S16_MIN		-32768.0f
+/* the largest float below 2^31 */
+#define S32_LIMIT	2147483520.0f
+
+/*
+ * Generic C kernels
+ *
+ */
+static void scale_c(float *dst, const float *src, float gain, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] = src[i] * gain;
+}
+
+static void mul_acc_c(float *acc, const float *carrier, const float *env,
+	float gain, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		acc[i] += carrier[i] * env[i] * gain;
+}
+
+static void mul_c(float *dst, const float *a, const float *b, float gain,
+	size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] = a[i] * b[i] * gain;
+}
+
+static void add_c(float *acc, const float *src, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		acc[i] += src[i];
+}
+
+static void clip_c(float *out, const float *acc, float vol, size_t n) {
+	float sample;
+
+	for (size_t i = 0; i < n; i++) {
+		sample = fminf(+1.0f, acc[i]);
+		sample = fmaxf(-1.0f, sample);
+		out[i] = sample * vol;
+	}
+}
+
+static inline float quantize_c(const float *in, const float *dither,
+	float scale, size_t i) {
+	float v = in[i] * scale;
+
+	if (dither) v += dither[i];
+	return v;
+}
+
+static void to_s16_c(int16_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	float v;
+
+	for (size_t i = 0; i < n; i++) {
+		v = fminf(S16_MAX, quantize_c(in, dither, scale, i));
+		v = fmaxf(S16_MIN, v);
+		out[i] = (int16_t)lrintf(v);
+	}
+}
+
+static void to_s16_2ch_c(int16_t *out, const float *in,
+	const float *dither, float scale, size_t n) {
+	float v;
+
+	for (size_t i = 0; i < n; i++) {
+		v = fminf(S16_MAX, quantize_c(in, dither, scale, i));
+		v = fmaxf(S16_MIN, v);
+		out[2 * i + 0] = out[2 * i + 1] = (int16_t)lrintf(v);
+	}
+}
+
+static void to_s32_c(int32_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	float v;
+
+	for (size_t i = 0; i < n; i++) {
+		v = fminf(S32_LIMIT, quantize_c(in, dither, scale, i));
+		v = fmaxf(-S32_LIMIT, v);
+		out[i] = (int32_t)lrintf(v);
+	}
+}
+
+static float dot_c(const float *a, const float *b, size_t n) {
+	float sum = 0.0f;
+
+	for (size_t i = 0; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+/* the rest of a block after the vector part */
+#define TAIL(d, i)	((d) ? (d) + (i) : NULL)
+
+static const struct mpx_kernels_t kernels_c = {
+	"scalar", scale_c, mul_acc_c, mul_c, add_c, clip_c,
+	to_s16_c, to_s16_2ch_c, to_s32_c, dot_c
+};
+
+#ifdef MPX_SIMD_X86
+/*
+ * SSE2
+ *
+ */
+TARGET_SSE2
+static void scale_sse2(float *dst, const float *src, float gain, size_t n) {
+	const __m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+	scale_c(dst + i, src + i, gain, n - i);
+}
+
+TARGET_SSE2
+static void mul_acc_sse2(float *acc, const float *carrier, const float *env,
+	float gain, size_t n) {
+	const __m128 g = _mm_set1_ps(gain);
+	__m128 v;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		v = _mm_mul_ps(_mm_loadu_ps(carrier + i), _mm_loadu_ps(env + i));
+		v = _mm_mul_ps(v, g);
+		_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), v));
+	}
+	mul_acc_c(acc + i, carrier + i, env + i, gain, n - i);
+}
+
+TARGET_SSE2
+static void mul_sse2(float *dst, const float *a, const float *b,
+	float gain, size_t n) {
+	const __m128 g = _mm_set1_ps(gain);
+	__m128 v;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		v = _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(v, g));
+	}
+	mul_c(dst + i, a + i, b + i, gain, n - i);
+}
+
+TARGET_SSE2
+static void add_sse2(float *acc, const float *src, size_t n) {
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+			_mm_loadu_ps(src + i)));
+	add_c(acc + i, src + i, n - i);
+}
+
+TARGET_SSE2
+static void clip_sse2(float *out, const float *acc, float vol, size_t n) {
+	const __m128 v_vol = _mm_set1_ps(vol);
+	const __m128 v_max = _mm_set1_ps(+1.0f);
+	const __m128 v_min = _mm_set1_ps(-1.0f);
+	__m128 v;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		v = _mm_min_ps(_mm_loadu_ps(acc + i), v_max);
+		v = _mm_max_ps(v, v_min);
+		_mm_storeu_ps(out + i, _mm_mul_ps(v, v_vol));
+	}
+	clip_c(out + i, acc + i, vol, n - i);
+}
+
+/* four samples scaled, dithered and clamped, as 32-bit integers */
+TARGET_SSE2
+static inline __m128i quantize_sse2(const float *in, const float *dither,
+	__m128 scale, __m128 lo, __m128 hi) {
+	__m128 v = _mm_mul_ps(_mm_loadu_ps(in), scale);
+
+	if (dither) v = _mm_add_ps(v, _mm_loadu_ps(dither));
+	v = _mm_max_ps(_mm_min_ps(v, hi), lo);
+	return _mm_cvtps_epi32(v);
+}
+
+/* eight 16-bit samples */
+TARGET_SSE2
+static inline __m128i quantize_s16_sse2(const float *in, const float *dither,
+	__m128 scale) {
+	const __m128 lo = _mm_set1_ps(S16_MIN);
+	const __m128 hi = _mm_set1_ps(S16_MAX);
+
+	return _mm_packs_epi32(quantize_sse2(in, dither, scale, lo, hi),
+		quantize_sse2(in + 4, TAIL(dither, 4), scale, lo, hi));
+}
+
+TARGET_SSE2
+static void to_s16_sse2(int16_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	const __m128 s = _mm_set1_ps(scale);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		_mm_storeu_si128((__m128i *)(out + i),
+			quantize_s16_sse2(in + i, TAIL(dither, i), s));
+	}
+	to_s16_c(out + i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+TARGET_SSE2
+static void to_s16_2ch_sse2(int16_t *out, const float *in,
+	const float *dither, float scale, size_t n) {
+	const __m128 s = _mm_set1_ps(scale);
+	__m128i v;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		v = quantize_s16_sse2(in + i, TAIL(dither, i), s);
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 0),
+			_mm_unpacklo_epi16(v, v));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 8),
+			_mm_unpackhi_epi16(v, v));
+	}
+	to_s16_2ch_c(out + 2 * i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+TARGET_SSE2
+static void to_s32_sse2(int32_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	const __m128 s = _mm_set1_ps(scale);
+	const __m128 lo = _mm_set1_ps(-S32_LIMIT);
+	const __m128 hi = _mm_set1_ps(S32_LIMIT);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128((__m128i *)(out + i),
+			quantize_sse2(in + i, TAIL(dither, i), s, lo, hi));
+	}
+	to_s32_c(out + i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+TARGET_SSE2
+static float dot_sse2(const float *a, const float *b, size_t n) {
+	__m128 sum = _mm_setzero_ps();
+	float lanes[4];
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i),
+			_mm_loadu_ps(b + i)));
+	_mm_storeu_ps(lanes, sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		dot_c(a + i, b + i, n - i);
+}
+
+static const struct mpx_kernels_t kernels_sse2 = {
+	"sse2", scale_sse2, mul_acc_sse2, mul_sse2, add_sse2, clip_sse2,
+	to_s16_sse2, to_s16_2ch_sse2, to_s32_sse2, dot_sse2
+};
+
+/*
+ * AVX2
+ *
+ */
+TARGET_AVX2
+static void scale_avx2(float *dst, const float *src, float gain, size_t n) {
+	const __m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i,
+			_mm256_mul_ps(_mm256_loadu_ps(src + i), g));
+	scale_c(dst + i, src + i, gain, n - i);
+}
+
+TARGET_AVX2
+static void mul_acc_avx2(float *acc, const float *carrier, const float *env,
+	float gain, size_t n) {
+	const __m256 g = _mm256_set1_ps(gain);
+	__m256 v;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		v = _mm256_mul_ps(_mm256_loadu_ps(carrier + i),
+			_mm256_loadu_ps(env + i));
+		v = _mm256_mul_ps(v, g);
+		_mm256_storeu_ps(acc + i,
+			_mm256_add_ps(_mm256_loadu_ps(acc + i), v));
+	}
+	mul_acc_c(acc + i, carrier + i, env + i, gain, n - i);
+}
+
+TARGET_AVX2
+static void mul_avx2(float *dst, const float *a, const float *b,
+	float gain, size_t n) {
+	const __m256 g = _mm256_set1_ps(gain);
+	__m256 v;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		v = _mm256_mul_ps(_mm256_loadu_ps(a + i),
+			_mm256_loadu_ps(b + i));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(v, g));
+	}
+	mul_c(dst + i, a + i, b + i, gain, n - i);
+}
+
+TARGET_AVX2
+static void add_avx2(float *acc, const float *src, size_t n) {
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(acc + i, _mm256_add_ps(
+			_mm256_loadu_ps(acc + i), _mm256_loadu_ps(src + i)));
+	add_c(acc + i, src + i, n - i);
+}
+
+TARGET_AVX2
+static void clip_avx2(float *out, const float *acc, float vol, size_t n) {
+	const __m256 v_vol = _mm256_set1_ps(vol);
+	const __m256 v_max = _mm256_set1_ps(+1.0f);
+	const __m256 v_min = _mm256_set1_ps(-1.0f);
+	__m256 v;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		v = _mm256_min_ps(_mm256_loadu_ps(acc + i), v_max);
+		v = _mm256_max_ps(v, v_min);
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(v, v_vol));
+	}
+	clip_c(out + i, acc + i, vol, n - i);
+}
+
+/* eight samples scaled, dithered and clamped, as 32-bit integers */
+TARGET_AVX2
+static inline __m256i quantize_avx2(const float *in, const float *dither,
+	__m256 scale, __m256 lo, __m256 hi) {
+	__m256 v = _mm256_mul_ps(_mm256_loadu_ps(in), scale);
+
+	if (dither) v = _mm256_add_ps(v, _mm256_loadu_ps(dither));
+	v = _mm256_max_ps(_mm256_min_ps(v, hi), lo);
+	return _mm256_cvtps_epi32(v);
+}
+
+/* sixteen 16-bit samples */
+TARGET_AVX2
+static inline __m256i quantize_s16_avx2(const float *in, const float *dither,
+	__m256 scale) {
+	const __m256 lo = _mm256_set1_ps(S16_MIN);
+	const __m256 hi = _mm256_set1_ps(S16_MAX);
+	__m256i v;
+
+	v = _mm256_packs_epi32(quantize_avx2(in, dither, scale, lo, hi),
+		quantize_avx2(in + 8, TAIL(dither, 8), scale, lo, hi));
+	/* pack works per 128-bit lane so fix up the order */
+	return _mm256_permute4x64_epi64(v, 0xd8);
+}
+
+TARGET_AVX2
+static void to_s16_avx2(int16_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	const __m256 s = _mm256_set1_ps(scale);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		_mm256_storeu_si256((__m256i *)(out + i),
+			quantize_s16_avx2(in + i, TAIL(dither, i), s));
+	}
+	to_s16_c(out + i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+TARGET_AVX2
+static void to_s16_2ch_avx2(int16_t *out, const float *in,
+	const float *dither, float scale, size_t n) {
+	const __m256 s = _mm256_set1_ps(scale);
+	__m256i v, lo, hi;
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		v = quantize_s16_avx2(in + i, TAIL(dither, i), s);
+		lo = _mm256_unpacklo_epi16(v, v);
+		hi = _mm256_unpackhi_epi16(v, v);
+		_mm256_storeu_si256((__m256i *)(out + 2 * i + 0),
+			_mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 2 * i + 16),
+			_mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	to_s16_2ch_c(out + 2 * i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+TARGET_AVX2
+static void to_s32_avx2(int32_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	const __m256 s = _mm256_set1_ps(scale);
+	const __m256 lo = _mm256_set1_ps(-S32_LIMIT);
+	const __m256 hi = _mm256_set1_ps(S32_LIMIT);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i *)(out + i),
+			quantize_avx2(in + i, TAIL(dither, i), s, lo, hi));
+	}
+	to_s32_c(out + i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+TARGET_AVX2
+static float dot_avx2(const float *a, const float *b, size_t n) {
+	__m256 sum = _mm256_setzero_ps();
+	__m128 half;
+	float lanes[4];
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+			_mm256_loadu_ps(b + i)));
+	half = _mm_add_ps(_mm256_castps256_ps128(sum),
+		_mm256_extractf128_ps(sum, 1));
+	_mm_storeu_ps(lanes, half);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		dot_c(a + i, b + i, n - i);
+}
+
+static const struct mpx_kernels_t kernels_avx2 = {
+	"avx2", scale_avx2, mul_acc_avx2, mul_avx2, add_avx2, clip_avx2,
+	to_s16_avx2, to_s16_2ch_avx2, to_s32_avx2, dot_avx2
+};
+
+static bool cpu_has_sse2() {
+#if defined(__x86_64__) || defined(_M_X64)
+	/* always available on x86-64 */
+	return true;
+#elif defined(__GNUC__) || defined(__clang__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#else
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] >> 26) & 1;
+#endif
+}
+
+static bool cpu_has_avx2() {
+#if defined(__GNUC__) || defined(__clang__)
+	/* this also checks that the OS saves the YMM registers */
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+
+	/* OSXSAVE and AVX */
+	__cpuid(info, 1);
+	if (((info[2] >> 27) & 1) == 0 || ((info[2] >> 28) & 1) == 0)
+		return false;
+
+	/* XMM and YMM state enabled by the OS */
+	if ((_xgetbv(0) & 6) != 6) return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+#endif
+}
+#endif /* MPX_SIMD_X86 */
+
+#ifdef MPX_SIMD_NEON
+/*
+ * NEON
+ *
+ */
+static void scale_neon(float *dst, const float *src, float gain, size_t n) {
+	const float32x4_t g = vdupq_n_f32(gain);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		vst1q_f32(dst + i, vmulq_f32(vld1q_f32(src + i), g));
+	scale_c(dst + i, src + i, gain, n - i);
+}
+
+static void mul_acc_neon(float *acc, const float *carrier, const float *env,
+	float gain, size_t n) {
+	const float32x4_t g = vdupq_n_f32(gain);
+	float32x4_t v;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		v = vmulq_f32(vld1q_f32(carrier + i), vld1q_f32(env + i));
+		v = vmulq_f32(v, g);
+		vst1q_f32(acc + i, vaddq_f32(vld1q_f32(acc + i), v));
+	}
+	mul_acc_c(acc + i, carrier + i, env + i, gain, n - i);
+}
+
+static void mul_neon(float *dst, const float *a, const float *b,
+	float gain, size_t n) {
+	const float32x4_t g = vdupq_n_f32(gain);
+	float32x4_t v;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		v = vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+		vst1q_f32(dst + i, vmulq_f32(v, g));
+	}
+	mul_c(dst + i, a + i, b + i, gain, n - i);
+}
+
+static void add_neon(float *acc, const float *src, size_t n) {
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		vst1q_f32(acc + i, vaddq_f32(vld1q_f32(acc + i),
+			vld1q_f32(src + i)));
+	add_c(acc + i, src + i, n - i);
+}
+
+static void clip_neon(float *out, const float *acc, float vol, size_t n) {
+	const float32x4_t v_vol = vdupq_n_f32(vol);
+	const float32x4_t v_max = vdupq_n_f32(+1.0f);
+	const float32x4_t v_min = vdupq_n_f32(-1.0f);
+	float32x4_t v;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		v = vminq_f32(vld1q_f32(acc + i), v_max);
+		v = vmaxq_f32(v, v_min);
+		vst1q_f32(out + i, vmulq_f32(v, v_vol));
+	}
+	clip_c(out + i, acc + i, vol, n - i);
+}
+
+/* four samples scaled, dithered and clamped, as 32-bit integers */
+static inline int32x4_t quantize_neon(const float *in, const float *dither,
+	float32x4_t scale, float32x4_t lo, float32x4_t hi) {
+	float32x4_t v = vmulq_f32(vld1q_f32(in), scale);
+
+	if (dither) v = vaddq_f32(v, vld1q_f32(dither));
+	v = vmaxq_f32(vminq_f32(v, hi), lo);
+#if defined(__aarch64__) || defined(__ARM_FEATURE_DIRECTED_ROUNDING)
+	return vcvtnq_s32_f32(v);
+#else
+	/*
+	 * ARMv7 only converts by truncation, so round first
+	 *
+	 * Adding and taking away 2^23 with the sign of v leaves it
+	 * rounded to nearest even, which is the only mode NEON has.
+	 * From 2^23 up every float is already a whole number.
+	 */
+	const uint32x4_t sign = vdupq_n_u32(0x80000000u);
+	float32x4_t m = vreinterpretq_f32_u32(vorrq_u32(
+		vandq_u32(vreinterpretq_u32_f32(v), sign),
+		vreinterpretq_u32_f32(vdupq_n_f32(8388608.0f))));
+	float32x4_t r = vsubq_f32(vaddq_f32(v, m), m);
+
+	v = vbslq_f32(vcltq_f32(vabsq_f32(v),
+		vdupq_n_f32(8388608.0f)), r, v);
+	return vcvtq_s32_f32(v);
+#endif
+}
+
+/* eight 16-bit samples */
+static inline int16x8_t quantize_s16_neon(const float *in,
+	const float *dither, float32x4_t scale) {
+	const float32x4_t lo = vdupq_n_f32(S16_MIN);
+	const float32x4_t hi = vdupq_n_f32(S16_MAX);
+
+	return vcombine_s16(
+		vqmovn_s32(quantize_neon(in, dither, scale, lo, hi)),
+		vqmovn_s32(quantize_neon(in + 4, TAIL(dither, 4), scale,
+		lo, hi)));
+}
+
+static void to_s16_neon(int16_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	const float32x4_t s = vdupq_n_f32(scale);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		vst1q_s16(out + i,
+			quantize_s16_neon(in + i, TAIL(dither, i), s));
+	}
+	to_s16_c(out + i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+static void to_s16_2ch_neon(int16_t *out, const float *in,
+	const float *dither, float scale, size_t n) {
+	const float32x4_t s = vdupq_n_f32(scale);
+	int16x8x2_t both;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		both.val[0] = quantize_s16_neon(in + i, TAIL(dither, i), s);
+		both.val[1] = both.val[0];
+		/* interleaving store puts the sample into both channels */
+		vst2q_s16(out + 2 * i, both);
+	}
+	to_s16_2ch_c(out + 2 * i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+static void to_s32_neon(int32_t *out, const float *in, const float *dither,
+	float scale, size_t n) {
+	const float32x4_t s = vdupq_n_f32(scale);
+	const float32x4_t lo = vdupq_n_f32(-S32_LIMIT);
+	const float32x4_t hi = vdupq_n_f32(S32_LIMIT);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		vst1q_s32(out + i,
+			quantize_neon(in + i, TAIL(dither, i), s, lo, hi));
+	}
+	to_s32_c(out + i, in + i, TAIL(dither, i), scale, n - i);
+}
+
+static float dot_neon(const float *a, const float *b, size_t n) {
+	float32x4_t sum = vdupq_n_f32(0.0f);
+	float lanes[4];
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		sum = vmlaq_f32(sum, vld1q_f32(a + i), vld1q_f32(b + i));
+	vst1q_f32(lanes, sum);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		dot_c(a + i, b + i, n - i);
+}
+
+static const struct mpx_kernels_t kernels_neon = {
+	"neon", scale_neon, mul_acc_neon, mul_neon, add_neon, clip_neon,
+	to_s16_neon, to_s16_2ch_neon, to_s32_neon, dot_neon
+};
+#endif /* MPX_SIMD_NEON */
+
+/*
+ * Pick the best kernel set for the CPU we're running on
+ *
+ */
+const struct mpx_kernels_t *mpx_select_kernels() {
+#ifdef MPX_SIMD_X86
+	if (cpu_has_avx2()) return &kernels_avx2;
+	if (cpu_has_sse2()) return &kernels_sse2;
+#endif
+#ifdef MPX_SIMD_NEON
+	return &kernels_neon;
+#endif
+	return &kernels_c;
+}
+
+/*
+ * Look up a kernel set by name (for testing and benchmarking)
+ *
+ * Returns NULL if the kernel set is unknown or not supported by the CPU.
+ */
+const struct mpx_kernels_t *mpx_get_kernels(const char *name) {
+	if (strcmp(name, kernels_c.name) == 0) return &kernels_c;
+#ifdef MPX_SIMD_X86
+	if (strcmp(name, kernels_sse2.name) == 0 && cpu_has_sse2())
+		return &kernels_sse2;
+	if (strcmp(name, kernels_avx2.name) == 0 && cpu_has_avx2())
+		return &kernels_avx2;
+#endif
+#ifdef MPX_SIMD_NEON
+	if (strcmp(name, kernels_neon.name) == 0) return &kernels_neon;
+#endif
+	return NULL;
+}
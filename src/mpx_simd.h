@@ -0,0 +1,65 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Block kernels used by the MPX generator and the output conversion
+ *
+ * All kernels work on contiguous arrays. Buffers do not need to be
+ * aligned and n does not need to be a multiple of the vector width.
+ */
+typedef struct mpx_kernels_t {
+	const char *name;
+
+	/* dst[i] = src[i] * gain */
+	void (*scale)(float *dst, const float *src, float gain, size_t n);
+
+	/* acc[i] += carrier[i] * env[i] * gain */
+	void (*mul_acc)(float *acc, const float *carrier, const float *env,
+		float gain, size_t n);
+
+	/*
+	 * dst[i] = a[i] * b[i] * gain and acc[i] += src[i]
+	 *
+	 * The same as mul_acc done in two steps, so that subcarriers can
+	 * be generated apart and mixed later with the same result
+	 */
+	void (*mul)(float *dst, const float *a, const float *b,
+		float gain, size_t n);
+	void (*add)(float *acc, const float *src, size_t n);
+
+	/* out[i] = clip(acc[i]) * vol */
+	void (*clip)(float *out, const float *acc, float vol, size_t n);
+
+	/*
+	 * out[i] = in[i] * scale + dither[i], rounded to nearest (even)
+	 * and saturated. dither may be NULL. to_s16_2ch puts every
+	 * sample into two channels.
+	 */
+	void (*to_s16)(int16_t *out, const float *in, const float *dither,
+		float scale, size_t n);
+	void (*to_s16_2ch)(int16_t *out, const float *in,
+		const float *dither, float scale, size_t n);
+	void (*to_s32)(int32_t *out, const float *in, const float *dither,
+		float scale, size_t n);
+
+	/* sum of a[i] * b[i] (the order of the additions varies) */
+	float (*dot)(const float *a, const float *b, size_t n);
+} mpx_kernels_t;
+
+extern const struct mpx_kernels_t *mpx_select_kernels();
+extern const struct mpx_kernels_t *mpx_get_kernels(const char *name);
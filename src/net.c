@@ -22,20 +22,66 @@
  */
 
 #include "common.h"
+#include "rds.h"
+#include "fm_mpx.h"
+#include "station.h"
 #include "net.h"
 #include "ascii_cmd.h"
+#include "uecp.h"
+#include "event_loop.h"
+#include "metrics.h"
 
 #ifdef _WIN32
-/* Windows implementation */
-
-static SOCKET listener_fd = INVALID_SOCKET;
-static SOCKET current_fd = INVALID_SOCKET;
-static struct sockaddr_in6 my_sock;
-static struct sockaddr_in6 peer_sock;
-static socklen_t peer_addr_size;
-
-uint8_t already_connected = 0;
+typedef SOCKET ctl_socket_t;
+#define NO_SOCKET	INVALID_SOCKET
+#define close_socket	closesocket
+#else
+typedef int ctl_socket_t;
+#define NO_SOCKET	-1
+#define close_socket	close
+#endif
+
+/* TCP clients handled at the same time */
+#define MAX_CTL_CLIENTS	16
+
+/* an ASCII and a UECP listener for each station and the metrics */
+#define MAX_CTL_LISTENERS	33
+
+/* reply bytes a client may leave unread before it is dropped */
+#define MAX_CTL_OUTPUT	(METRICS_TEXT_SIZE + 256)
+
+/* what is spoken on a socket */
+#define CTL_ASCII	0
+#define CTL_UECP	1
+#define CTL_HTTP	2
+
+typedef struct ctl_conn_t {
+	ctl_socket_t fd;
+	event_handle_t event;
+	uint8_t type;
+	uint8_t proto; /* 1 = tcp, 0 = udp */
+	struct station_t *station;
+
+	/* sender of the last datagram, replies go there */
+	struct sockaddr_in6 peer;
+	socklen_t peer_len;
+
+	struct cmd_framer_t framer;
+	struct uecp_decoder_t uecp;
+
+	/* replies the socket had no room for yet */
+	uint8_t *out_buf;
+	size_t out_len;
+	bool closing;	/* drop it once they are sent */
+	bool broken;	/* drop it when back in read_event */
+} ctl_conn_t;
+
+static struct ctl_conn_t listeners[MAX_CTL_LISTENERS];
+static uint8_t num_listeners;
+static struct ctl_conn_t clients[MAX_CTL_CLIENTS];
+static bool clients_init;
 
+#ifdef _WIN32
 void net_init() {
 	WSADATA wsaData;
 	WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -44,218 +90,423 @@ void net_init() {
 void net_cleanup() {
 	WSACleanup();
 }
+#endif
 
-int open_ctl_socket(uint16_t port, uint8_t proto) {
-	struct in6_addr my_addr;
-	unsigned char listen_addr[sizeof(struct in6_addr)];
-	u_long mode = 1; /* non-blocking */
-
-	listener_fd = socket(AF_INET6, proto ? SOCK_STREAM : SOCK_DGRAM, 0);
-	if (listener_fd == INVALID_SOCKET) return -1;
-
-	memset(&my_sock, 0, sizeof(struct sockaddr_in6));
-	memset(&my_addr, 0, sizeof(struct in6_addr));
-	memset(&peer_sock, 0, sizeof(struct sockaddr_in6));
-	memset(listen_addr, 0, sizeof(struct in6_addr));
+static void set_nonblocking(ctl_socket_t fd) {
+#ifdef _WIN32
+	u_long mode = 1;
+	ioctlsocket(fd, FIONBIO, &mode);
+#else
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+}
 
-	my_sock.sin6_family = AF_INET6;
-	inet_pton(AF_INET6, "::", &listen_addr);
-	memcpy(my_addr.s6_addr, listen_addr, sizeof(struct in6_addr));
-	my_sock.sin6_addr = my_addr;
-	my_sock.sin6_port = htons(port);
+/*
+ * Register a socket with the event loop
+ *
+ * On Windows the socket gets an event object that is signalled
+ * for the given network events
+ */
+static int watch_socket(struct ctl_conn_t *conn, long net_events,
+	event_cb_t cb) {
+#ifdef _WIN32
+	conn->event = WSACreateEvent();
+	if (conn->event == WSA_INVALID_EVENT) return -1;
+	WSAEventSelect(conn->fd, conn->event, net_events);
+#else
+	(void)net_events;
+	conn->event = conn->fd;
+#endif
+	return add_event_source(conn->event, cb, conn);
+}
 
-	if (bind(listener_fd, (struct sockaddr *)&my_sock,
-		sizeof(struct sockaddr_in6)) == SOCKET_ERROR)
-		return -1;
+static void close_conn(struct ctl_conn_t *conn) {
+	if (conn->fd == NO_SOCKET) return;
 
-	listen(listener_fd, 1);
+	remove_event_source(conn->event);
+#ifdef _WIN32
+	WSACloseEvent(conn->event);
+#endif
+	close_socket(conn->fd);
+	conn->fd = NO_SOCKET;
+
+	free(conn->out_buf);
+	conn->out_buf = NULL;
+	conn->out_len = 0;
+}
 
-	/* set non-blocking mode */
-	ioctlsocket(listener_fd, FIONBIO, &mode);
+/* find out what happened on a socket (resets the event on Windows) */
+static bool socket_closed(struct ctl_conn_t *conn) {
+#ifdef _WIN32
+	WSANETWORKEVENTS ne;
+
+	WSAEnumNetworkEvents(conn->fd, conn->event, &ne);
+	return (ne.lNetworkEvents & FD_CLOSE) != 0 &&
+		(ne.lNetworkEvents & FD_READ) == 0;
+#else
+	(void)conn;
+	return false;
+#endif
+}
 
-	peer_addr_size = sizeof(struct sockaddr_in6);
+static bool would_block() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
 
-	return 0;
+/* be woken up when there is room for the rest of the output */
+static void watch_output(struct ctl_conn_t *conn, bool on) {
+#ifdef _WIN32
+	WSAEventSelect(conn->fd, conn->event,
+		on ? FD_READ | FD_CLOSE | FD_WRITE : FD_READ | FD_CLOSE);
+#else
+	set_event_output(conn->event, on);
+#endif
 }
 
-void poll_ctl_socket() {
-	static unsigned char pipe_buf[CTL_BUFFER_SIZE];
-	static unsigned char cmd_buf[CMD_BUFFER_SIZE];
-	char *token;
-	fd_set readfds;
-	struct timeval tv;
+/*
+ * Send a reply without waiting
+ *
+ * Whatever the socket buffer has no room for is kept and sent from
+ * the event loop when the peer has read some. A peer that leaves
+ * more than MAX_CTL_OUTPUT unread is dropped.
+ */
+static void queue_output(struct ctl_conn_t *conn, const uint8_t *data,
+	size_t len) {
+	uint8_t *buf;
 	int ret;
 
-	tv.tv_sec = 0;
-	tv.tv_usec = READ_TIMEOUT_MS * 1000;
-
-	if (!already_connected) {
-		FD_ZERO(&readfds);
-		FD_SET(listener_fd, &readfds);
+	if (conn->broken) return;
 
-		ret = select(0, &readfds, NULL, NULL, &tv);
-		if (ret <= 0) return;
-
-		current_fd = accept(listener_fd, (struct sockaddr *)&peer_sock,
-			&peer_addr_size);
-		if (current_fd == INVALID_SOCKET)
+	if (conn->out_len == 0) {
+		ret = send(conn->fd, (const char *)data, (int)len, 0);
+		if (ret < 0 && !would_block()) {
+			conn->broken = true;
 			return;
+		}
+		if (ret > 0) {
+			data += ret;
+			len -= ret;
+		}
+		if (len == 0) return;
+	}
 
-		already_connected = 1;
+	if (conn->out_len + len > MAX_CTL_OUTPUT) {
+		conn->broken = true;
 		return;
 	}
 
-	FD_ZERO(&readfds);
-	FD_SET(current_fd, &readfds);
+	buf = realloc(conn->out_buf, conn->out_len + len);
+	if (buf == NULL) {
+		conn->broken = true;
+		return;
+	}
+	memcpy(buf + conn->out_len, data, len);
+	conn->out_buf = buf;
+	if (conn->out_len == 0) watch_output(conn, true);
+	conn->out_len += len;
+}
 
-	ret = select(0, &readfds, NULL, NULL, &tv);
-	if (ret <= 0) return;
+/* send what the socket has room for now */
+static void flush_output(struct ctl_conn_t *conn) {
+	int ret;
 
-	memset(pipe_buf, 0, CTL_BUFFER_SIZE);
-	ret = recv(current_fd, (char *)pipe_buf, CTL_BUFFER_SIZE - 1, 0);
-	if (ret <= 0) {
-		already_connected = 0;
-		closesocket(current_fd);
-		current_fd = INVALID_SOCKET;
+	ret = send(conn->fd, (const char *)conn->out_buf,
+		(int)conn->out_len, 0);
+	if (ret < 0) {
+		if (!would_block()) conn->broken = true;
 		return;
 	}
 
-	token = strtok((char *)pipe_buf, "\n");
-	while (token != NULL) {
-		memset(cmd_buf, 0, CMD_BUFFER_SIZE);
-		memcpy(cmd_buf, token, CMD_BUFFER_SIZE - 1);
-		token = strtok(NULL, "\n");
+	conn->out_len -= ret;
+	memmove(conn->out_buf, conn->out_buf + ret, conn->out_len);
+	if (conn->out_len) return;
 
-		process_ascii_cmd(cmd_buf);
+	free(conn->out_buf);
+	conn->out_buf = NULL;
+	watch_output(conn, false);
+}
+
+/* UECP acknowledgements and STATS replies */
+static void send_reply(void *ctx, uint8_t *data, size_t len) {
+	struct ctl_conn_t *conn = ctx;
+
+	if (conn->proto) {
+		queue_output(conn, data, len);
+	} else {
+		/* a lost datagram is lost, don't wait for room */
+		sendto(conn->fd, (const char *)data, (int)len, 0,
+			(struct sockaddr *)&conn->peer, conn->peer_len);
 	}
 }
 
-void close_ctl_socket() {
-	if (current_fd != INVALID_SOCKET) closesocket(current_fd);
-	if (listener_fd != INVALID_SOCKET) closesocket(listener_fd);
+static void init_conn(struct ctl_conn_t *conn, uint8_t type, uint8_t proto,
+	struct station_t *station) {
+	conn->type = type;
+	conn->proto = proto;
+	conn->station = station;
+	conn->closing = conn->broken = false;
+	init_cmd_framer(&conn->framer, station);
+	set_cmd_framer_reply(&conn->framer, send_reply, conn);
+
+	/* the metrics endpoint is not tied to a station */
+	if (station)
+		init_uecp_decoder(&conn->uecp, station->rds, send_reply, conn);
 }
 
-#else /* POSIX */
+/* the peer went away */
+static void drop_conn(struct ctl_conn_t *conn) {
+	if (conn->type == CTL_ASCII) close_cmd_framer(&conn->framer);
+	close_conn(conn);
+}
 
-static int listener_fd; /* fd of the listener */
-static int current_fd; /* fd of the current connection */
-static struct sockaddr_in6 my_sock;
-static struct sockaddr_in6 peer_sock;
-static socklen_t peer_addr_size;
-static struct pollfd sock_poller;
-static struct pollfd peer_poller;
-static struct pollfd curr_sock_poller;
+/*
+ * Answer a scrape
+ *
+ * Just enough HTTP for Prometheus: the metrics for GET /metrics (or
+ * /), 404 for anything else, and the connection is closed after
+ * every response.
+ */
+static void serve_metrics(struct ctl_conn_t *conn, char *req, size_t len) {
+	char *text, header[128];
+	size_t text_len;
+	int header_len;
+
+	req[len] = 0;
+	if (strncmp(req, "GET /metrics ", 13) != 0 &&
+		strncmp(req, "GET / ", 6) != 0) {
+		header_len = snprintf(header, sizeof(header),
+			"HTTP/1.0 404 Not Found\r\n"
+			"Content-Length: 0\r\n\r\n");
+		queue_output(conn, (uint8_t *)header, header_len);
+		return;
+	}
 
-uint8_t already_connected = 0;
+	text = malloc(METRICS_TEXT_SIZE);
+	if (text == NULL) return;
+	text_len = format_prometheus_metrics(text, METRICS_TEXT_SIZE);
+
+	header_len = snprintf(header, sizeof(header),
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\n\r\n", (unsigned long)text_len);
+	queue_output(conn, (uint8_t *)header, header_len);
+	queue_output(conn, (uint8_t *)text, text_len);
+	free(text);
+}
 
 /*
- * Opens a socket to be used to control the RDS coder.
+ * Commands from a connected TCP client or a UDP datagram
+ *
+ * TCP is a byte stream, so a command may arrive in pieces. Each
+ * datagram holds whole commands, the last one needs no newline.
+ * This is also where the rest of a reply is sent when the socket
+ * has room for it again.
  */
+static void read_event(void *arg) {
+	static uint8_t uecp_buf[CTL_BUFFER_SIZE];
+	struct ctl_conn_t *conn = arg;
+	unsigned char *buf;
+	size_t size;
+	int ret;
+
+	if (socket_closed(conn)) {
+		drop_conn(conn);
+		return;
+	}
+
+	if (conn->out_len) {
+		flush_output(conn);
+		if (conn->broken || (conn->closing && conn->out_len == 0)) {
+			drop_conn(conn);
+			return;
+		}
+	}
+
+	if (conn->type == CTL_ASCII) {
+		buf = get_cmd_framer_buf(&conn->framer, &size);
+	} else if (conn->type == CTL_HTTP) {
+		/* the request line comes in the first segment */
+		buf = uecp_buf;
+		size = sizeof(uecp_buf) - 1;
+	} else {
+		buf = uecp_buf;
+		size = sizeof(uecp_buf);
+	}
+
+	conn->peer_len = sizeof(struct sockaddr_in6);
+	ret = recvfrom(conn->fd, (char *)buf, (int)size, 0,
+		(struct sockaddr *)&conn->peer, &conn->peer_len);
+
+	if (ret == 0 && conn->proto) {
+		/* client disconnected */
+		drop_conn(conn);
+		return;
+	}
+
+	if (ret < 0) {
+		if (would_block()) return;
+		if (conn->proto) drop_conn(conn);
+		return;
+	}
+
+	if (conn->type == CTL_HTTP) {
+		/* one response, anything after the request is ignored */
+		if (!conn->closing) serve_metrics(conn, (char *)buf, ret);
+		conn->closing = true;
+		if (conn->out_len == 0 || conn->broken) drop_conn(conn);
+		return;
+	}
 
-int open_ctl_socket(uint16_t port, uint8_t proto) {
-	struct in6_addr my_addr;
-	unsigned char listen_addr[sizeof(struct in6_addr)];
+	if (conn->type == CTL_UECP) {
+		feed_uecp_decoder(&conn->uecp, buf, ret);
+	} else {
+		feed_cmd_framer(&conn->framer, ret);
+		if (!conn->proto) flush_cmd_framer(&conn->framer);
+	}
+
+	if (conn->broken) drop_conn(conn);
+}
+
+/* New TCP client */
+static void accept_event(void *arg) {
+	struct ctl_conn_t *listener = arg;
+	struct sockaddr_in6 peer_sock;
+	socklen_t peer_addr_size = sizeof(struct sockaddr_in6);
+	struct ctl_conn_t *conn = NULL;
+	ctl_socket_t fd;
+
+	socket_closed(listener);
+
+	fd = accept(listener->fd, (struct sockaddr *)&peer_sock,
+		&peer_addr_size);
+	if (fd == NO_SOCKET) return;
+
+	for (uint8_t i = 0; i < MAX_CTL_CLIENTS; i++) {
+		if (clients[i].fd == NO_SOCKET) {
+			conn = &clients[i];
+			break;
+		}
+	}
+
+	if (conn == NULL) {
+		/* too many clients */
+		close_socket(fd);
+		return;
+	}
+
+	set_nonblocking(fd);
+	conn->fd = fd;
+	/* clients talk to the station of the port they came in on */
+	init_conn(conn, listener->type, 1, listener->station);
+
+#ifdef _WIN32
+	if (watch_socket(conn, FD_READ | FD_CLOSE, read_event) < 0) {
+#else
+	if (watch_socket(conn, 0, read_event) < 0) {
+#endif
+		close_conn(conn);
+	}
+}
+
+static int open_listener(uint8_t type, uint16_t port, uint8_t proto,
+	struct station_t *station) {
+	struct ctl_conn_t *listener;
+	struct sockaddr_in6 my_sock;
+	int opt = 1;
+
+	if (!clients_init) {
+		for (uint8_t i = 0; i < MAX_CTL_CLIENTS; i++)
+			clients[i].fd = NO_SOCKET;
+		clients_init = true;
+	}
+
+	if (num_listeners == MAX_CTL_LISTENERS) return -1;
+	listener = &listeners[num_listeners];
 
 	/*
 	 * 1 = tcp
 	 * 0 = udp
 	 */
-	listener_fd = socket(AF_INET6, proto ? SOCK_STREAM : SOCK_DGRAM, 0);
-	if (listener_fd == -1) return -1;
+	init_conn(listener, type, proto, station);
+	listener->fd = socket(AF_INET6, proto ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (listener->fd == NO_SOCKET) return -1;
+
+	setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR,
+		(const char *)&opt, sizeof(opt));
 
 	/* use ipv6 sock stuct to support both v4 and v6 */
 	memset(&my_sock, 0, sizeof(struct sockaddr_in6));
-	memset(&my_addr, 0, sizeof(struct in6_addr));
-	memset(&peer_sock, 0, sizeof(struct sockaddr_in6));
-	memset(listen_addr, 0, sizeof(struct in6_addr));
 
 	/* configure listening address and port */
 	my_sock.sin6_family = AF_INET6;
-	inet_pton(AF_INET6, "::", &listen_addr); /* listen on both v4 and v6 */
-	memcpy(my_addr.s6_addr, listen_addr, sizeof(struct in6_addr));
-	my_sock.sin6_addr = my_addr;
+	my_sock.sin6_addr = in6addr_any; /* listen on both v4 and v6 */
 	my_sock.sin6_port = htons(port);
 
 	/* setup the socket */
-	if (bind(listener_fd, (struct sockaddr *)&my_sock,
-		sizeof(struct sockaddr_in6) == -1))
-		return -1;
-
-	/* start listening (accept only 1 connection) */
-	listen(listener_fd, 1);
-
-	/* setup the socket poller */
-	sock_poller.fd = listener_fd;
-	sock_poller.events = POLLIN;
+	if (bind(listener->fd, (struct sockaddr *)&my_sock,
+		sizeof(struct sockaddr_in6)) != 0)
+		goto fail;
 
-	curr_sock_poller.events = POLLIN;
+	set_nonblocking(listener->fd);
 
-	/* setup the command poller events */
-	peer_poller.events = POLLIN;
-
-	/* peer socket */
-	peer_addr_size = sizeof(struct sockaddr_in6);
+	if (proto) {
+		listen(listener->fd, MAX_CTL_CLIENTS);
+#ifdef _WIN32
+		if (watch_socket(listener, FD_ACCEPT, accept_event) < 0)
+#else
+		if (watch_socket(listener, 0, accept_event) < 0)
+#endif
+			goto fail;
+	} else {
+		/* every datagram is read straight from the listener */
+#ifdef _WIN32
+		if (watch_socket(listener, FD_READ, read_event) < 0)
+#else
+		if (watch_socket(listener, 0, read_event) < 0)
+#endif
+			goto fail;
+	}
 
+	num_listeners++;
 	return 0;
+
+fail:
+	close_socket(listener->fd);
+	listener->fd = NO_SOCKET;
+	return -1;
 }
 
 /*
- * Polls the current socket, and if a command is received,
- * calls process_ascii_cmd.
+ * Opens a socket to be used to control a station.
+ *
+ * Any number of TCP clients (up to MAX_CTL_CLIENTS, shared with
+ * UECP) can be connected at the same time.
  */
-void poll_ctl_socket() {
-	static unsigned char pipe_buf[CTL_BUFFER_SIZE];
-	static unsigned char cmd_buf[CMD_BUFFER_SIZE];
-	char *token;
-
-	if (!already_connected) {
-		/* check for a new connection */
-		if (poll(&sock_poller, 1, READ_TIMEOUT_MS) <= 0) return;
-
-		/* return early if there are no new connections */
-		if (sock_poller.revents == 0) return;
-
-		/* check for new clients */
-		current_fd = accept(listener_fd, (struct sockaddr *)&peer_sock,
-			&peer_addr_size);
-		if (current_fd == -1)
-			return;
-
-		/* setup the command poller */
-		peer_poller.fd = current_fd;
-
-		already_connected = 1;
-		return;
-	}
-
-	/* check for new commands */
-	if (poll(&peer_poller, 1, READ_TIMEOUT_MS) <= 0) return;
-
-	/* return early if there are no new commands */
-	if (peer_poller.revents == 0) return;
-
-	memset(pipe_buf, 0, CTL_BUFFER_SIZE);
-	if (read(current_fd, pipe_buf, CTL_BUFFER_SIZE - 1) == -1) {
-		/* client might have disconnected */
-		already_connected = 0;
-		close(current_fd);
-		return;
-	}
+int open_ctl_socket(uint16_t port, uint8_t proto, struct station_t *station) {
+	return open_listener(CTL_ASCII, port, proto, station);
+}
 
-	/* handle commands per line */
-	token = strtok((char *)pipe_buf, "\n");
-	while (token != NULL) {
-		memset(cmd_buf, 0, CMD_BUFFER_SIZE);
-		memcpy(cmd_buf, token, CMD_BUFFER_SIZE - 1);
-		token = strtok(NULL, "\n");
+/* Same for UECP (binary) control */
+int open_uecp_socket(uint16_t port, uint8_t proto,
+	struct station_t *station) {
+	return open_listener(CTL_UECP, port, proto, station);
+}
 
-		process_ascii_cmd(cmd_buf);
-	}
+/*
+ * Prometheus metrics of all stations over HTTP (always TCP)
+ */
+int open_metrics_socket(uint16_t port) {
+	return open_listener(CTL_HTTP, port, 1, NULL);
 }
 
 void close_ctl_socket() {
-	if (current_fd > 0) close(current_fd);
-	if (listener_fd > 0) close(listener_fd);
+	for (uint8_t i = 0; i < MAX_CTL_CLIENTS && clients_init; i++)
+		close_conn(&clients[i]);
+	for (uint8_t i = 0; i < num_listeners; i++)
+		close_conn(&listeners[i]);
+	num_listeners = 0;
 }
-
-#endif /* _WIN32 */
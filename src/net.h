@@ -22,16 +22,20 @@
   #pragma comment(lib, "ws2_32.lib")
   typedef int socklen_t;
 #else
+  #include <errno.h>
   #include <fcntl.h>
-  #include <poll.h>
   #include <sys/socket.h>
   #include <netinet/in.h>
   #include <arpa/inet.h>
+  #include <sys/select.h>
 #endif
 
-extern int open_ctl_socket(uint16_t port, uint8_t proto);
+extern int open_ctl_socket(uint16_t port, uint8_t proto,
+	struct station_t *station);
+extern int open_uecp_socket(uint16_t port, uint8_t proto,
+	struct station_t *station);
+extern int open_metrics_socket(uint16_t port);
 extern void close_ctl_socket();
-extern void poll_ctl_socket();
 
 #ifdef _WIN32
 extern void net_init();
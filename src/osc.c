@@ -18,86 +18,199 @@
 
 #include "common.h"
 #include "osc.h"
+#include "arena.h"
+#include "tables.h"
+#ifdef BUILTIN_TABLES
+#include "builtin_tables.h"
+#endif
+#include <stdatomic.h>
 
 /*
  * Code for MPX oscillator
  *
  * This uses lookup tables to speed up the waveform generation
  *
+ * When the frequency divides evenly into the sample rate, the table
+ * holds exactly one repeating period (rate / gcd(rate, freq) samples)
+ * and the phase just steps through it. Otherwise a single cycle table
+ * is driven by a 32-bit phase accumulator with linear interpolation.
+ *
  */
 
 /*
- * DDS function generator
+ * Shared tables
+ *
+ * A table only depends on its length and the number of cycles in
+ * it, so all oscillators for the same carrier at the same rate
+ * (in every station) can read the same one. Tables are never
+ * written once they are made; the positions are per oscillator.
  *
- * Create wave constants for a given frequency
+ * Every table has a guard sample after the end for interpolation.
+ * The sine and cosine follow the context in the same arena, unless
+ * the table was built in (see builtin_tables.h).
  */
-static void create_wave(uint32_t rate, float freq,
-		float *sin_wave, float *cos_wave, uint16_t *max_phase) {
-	double sin_sample, cos_sample;
-	/* used to determine if we have completed a cycle */
-	uint8_t zero_crossings = 0;
-	uint16_t i = 1;
-	const double w = M_2PI * freq;
-	double phase;
-
-	/* First value of a sine wave is always 0 */
-	*sin_wave++ = 0.0f;
-	*cos_wave++ = 1.0f;
-
-	while (zero_crossings < 2 && i < rate) {
-		phase = (double)i / (double)rate;
-		sin_sample = sin(w * phase);
-		cos_sample = cos(w * phase);
-		if (sin_sample > -0.1e-4 && sin_sample < 0.1e-4) {
-			zero_crossings++;
-			sin_sample = 0.0f;
+struct osc_table_t {
+	uint32_t len;
+	uint32_t cycles;
+	const float *sin_wave;
+	const float *cos_wave;
+	uint32_t refs;
+	struct osc_table_t *next;
+};
+
+static struct osc_table_t *tables;
+static atomic_flag tables_lock = ATOMIC_FLAG_INIT;
+
+static void lock_tables() {
+	while (atomic_flag_test_and_set_explicit(&tables_lock,
+		memory_order_acquire))
+		; /* spin */
+}
+
+static void unlock_tables() {
+	atomic_flag_clear_explicit(&tables_lock, memory_order_release);
+}
+
+#ifdef BUILTIN_TABLES
+static const struct builtin_wave_t *find_builtin_wave(uint32_t len,
+	uint32_t cycles) {
+	for (size_t i = 0; i < num_builtin_waves; i++) {
+		if (builtin_waves[i].len == len &&
+			builtin_waves[i].cycles == cycles)
+			return &builtin_waves[i];
+	}
+	return NULL;
+}
+#endif
+
+/* find or create a table, NULL if out of memory */
+static struct osc_table_t *get_table(uint32_t len, uint32_t cycles) {
+	struct osc_table_t *table;
+	size_t wave_size;
+	uint8_t *arena;
+	float *sin_wave, *cos_wave;
+#ifdef BUILTIN_TABLES
+	const struct builtin_wave_t *builtin;
+#endif
+
+	lock_tables();
+
+	for (table = tables; table; table = table->next) {
+		if (table->len == len && table->cycles == cycles) {
+			table->refs++;
+			goto done;
 		}
-		*sin_wave++ = (float)sin_sample;
-		*cos_wave++ = (float)cos_sample;
-		i++;
 	}
 
-	*max_phase = i - 1;
+#ifdef BUILTIN_TABLES
+	builtin = find_builtin_wave(len, cycles);
+	if (builtin) {
+		table = alloc_arena(sizeof(struct osc_table_t));
+		if (table == NULL) goto done;
+		table->len = len;
+		table->cycles = cycles;
+		table->sin_wave = builtin->sin_wave;
+		table->cos_wave = builtin->cos_wave;
+		goto add;
+	}
+#endif
+
+	wave_size = ARENA_SIZE((len + 1) * sizeof(float));
+	arena = alloc_arena(ARENA_SIZE(sizeof(struct osc_table_t)) +
+		2 * wave_size);
+	if (arena == NULL) {
+		table = NULL;
+		goto done;
+	}
+	table = (struct osc_table_t *)arena;
+	arena += ARENA_SIZE(sizeof(struct osc_table_t));
+	sin_wave = (float *)arena;
+	cos_wave = (float *)(arena + wave_size);
+	table->len = len;
+	table->cycles = cycles;
+	table->sin_wave = sin_wave;
+	table->cos_wave = cos_wave;
+
+	/* create waveform data and load into lookup tables */
+	create_wave(len, cycles, sin_wave, cos_wave);
+	sin_wave[len] = sin_wave[0];
+	cos_wave[len] = cos_wave[0];
+
+#ifdef BUILTIN_TABLES
+add:
+#endif
+	table->refs = 1;
+	table->next = tables;
+	tables = table;
+
+done:
+	unlock_tables();
+	return table;
+}
+
+/* free a table when its last user is gone */
+static void put_table(struct osc_table_t *table) {
+	struct osc_table_t **link;
+
+	if (table == NULL) return;
+
+	lock_tables();
+
+	if (--table->refs == 0) {
+		for (link = &tables; *link; link = &(*link)->next) {
+			if (*link == table) {
+				*link = table->next;
+				break;
+			}
+		}
+		free_arena(table);
+	}
+
+	unlock_tables();
 }
 
 /*
  * Oscillator object initialization
  *
+ * Returns -1 if out of memory
  */
-void osc_init(struct osc_t *osc, uint32_t sample_rate, float freq) {
+int8_t osc_init(struct osc_t *osc, uint32_t sample_rate, float freq) {
+	uint32_t cycles = 1;
 
 	/* sample rate for the objects */
 	osc->sample_rate = sample_rate;
+	osc->freq = freq;
 
-	/*
-	 * Compute the exact period length first so we only allocate
-	 * what is actually needed instead of sample_rate floats.
-	 * This saves ~750 KB per oscillator at 190 kHz.
-	 */
-	uint16_t period = 0;
-	{
-		uint8_t zc = 0;
-		uint16_t i = 1;
-		const double w = M_2PI * (double)freq;
-		while (zc < 2 && i < sample_rate) {
-			double s = sin(w * (double)i / (double)sample_rate);
-			if (s > -0.1e-4 && s < 0.1e-4) zc++;
-			i++;
-		}
-		period = i; /* includes the leading zero sample */
+	/* set current position to 0 */
+	osc->cur = 0;
+	osc->phase = 0;
+
+	osc->max = get_exact_period(sample_rate, freq, &cycles);
+	osc->interpolate = osc->max == 0;
+
+	if (osc->interpolate) {
+		/* one cycle plus a guard sample for the interpolation */
+		cycles = 1;
+		osc->max = OSC_INTERP_SIZE;
+		osc->step = (uint32_t)llround(
+			(double)freq / sample_rate * 4294967296.0);
 	}
 
-	/* waveform tables – allocate only one period */
-	osc->sin_wave = malloc(period * sizeof(float));
-	osc->cos_wave = malloc(period * sizeof(float));
+	/* waveform tables */
+	osc->table = get_table(osc->max, cycles);
+	if (osc->table == NULL) return -1;
+	osc->sin_wave = osc->table->sin_wave;
+	osc->cos_wave = osc->table->cos_wave;
 
-	/* set current position to 0 */
-	osc->cur = 0;
+	return 0;
+}
 
-	/* create waveform data and load into lookup tables */
-	create_wave(osc->sample_rate, freq,
-		osc->sin_wave, osc->cos_wave,
-		&osc->max);
+static inline float interpolate(const float *wave, uint32_t phase) {
+	uint32_t idx = phase >> (32 - OSC_INTERP_BITS);
+	float frac = (float)(phase & ((1u << (32 - OSC_INTERP_BITS)) - 1))
+		* (1.0f / (1u << (32 - OSC_INTERP_BITS)));
+
+	return wave[idx] + frac * (wave[idx + 1] - wave[idx]);
 }
 
 /*
@@ -107,18 +220,66 @@ void osc_init(struct osc_t *osc, uint32_t sample_rate, float freq) {
  *
  */
 float osc_get_cos(struct osc_t *osc) {
+	if (osc->interpolate) return interpolate(osc->cos_wave, osc->phase);
 	return osc->cos_wave[osc->cur];
 }
 
 float osc_get_sin(struct osc_t *osc) {
+	if (osc->interpolate) return interpolate(osc->sin_wave, osc->phase);
 	return osc->sin_wave[osc->cur];
 }
 
+/*
+ * Get a block of waveform samples
+ *
+ * This copies the next n samples into out and advances the
+ * oscillator past them, which is the same as calling
+ * osc_get_cos() and osc_update_pos() n times
+ *
+ */
+static void get_block(struct osc_t *osc, const float *wave,
+	float *out, size_t n) {
+	size_t len;
+
+	if (osc->interpolate) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = interpolate(wave, osc->phase);
+			osc->phase += osc->step;
+		}
+		return;
+	}
+
+	while (n) {
+		len = osc->max - osc->cur;
+		if (len > n) len = n;
+
+		memcpy(out, &wave[osc->cur], len * sizeof(float));
+		out += len;
+		n -= len;
+
+		osc->cur += len;
+		if (osc->cur == osc->max) osc->cur = 0;
+	}
+}
+
+void osc_get_cos_block(struct osc_t *osc, float *out, size_t n) {
+	get_block(osc, osc->cos_wave, out, n);
+}
+
+void osc_get_sin_block(struct osc_t *osc, float *out, size_t n) {
+	get_block(osc, osc->sin_wave, out, n);
+}
+
 /*
  * Shift the oscillator to the next position
  *
  */
 void osc_update_pos(struct osc_t *osc) {
+	if (osc->interpolate) {
+		/* wraps around by itself */
+		osc->phase += osc->step;
+		return;
+	}
 	if (++osc->cur == osc->max) osc->cur = 0;
 }
 
@@ -127,8 +288,87 @@ void osc_update_pos(struct osc_t *osc) {
  *
  */
 void osc_exit(struct osc_t *osc) {
-	free(osc->sin_wave);
-	free(osc->cos_wave);
+	put_table(osc->table);
+	osc->table = NULL;
+	osc->sin_wave = NULL;
+	osc->cos_wave = NULL;
 	osc->cur = 0;
 	osc->max = 0;
 }
+
+/*
+ * Phase-locked harmonic bank
+ *
+ * Every carrier is a whole multiple of the base frequency, so they
+ * can all be read from one table of the base period using a shared
+ * phase: harmonic h at sample n is entry (h * n) of the table. This
+ * keeps the carriers locked to each other.
+ *
+ * Returns -1 if the base frequency has no exact period at this rate
+ * or out of memory.
+ */
+int8_t osc_bank_init(struct osc_bank_t *bank, uint32_t sample_rate,
+	float base_freq) {
+	uint32_t cycles;
+
+	bank->sample_rate = sample_rate;
+	bank->base_freq = base_freq;
+	bank->cur = 0;
+
+	bank->table = NULL;
+	bank->sin_wave = NULL;
+	bank->cos_wave = NULL;
+
+	bank->max = get_exact_period(sample_rate, base_freq, &cycles);
+	if (bank->max == 0) return -1;
+
+	bank->table = get_table(bank->max, cycles);
+	if (bank->table == NULL) return -1;
+	bank->sin_wave = bank->table->sin_wave;
+	bank->cos_wave = bank->table->cos_wave;
+
+	return 0;
+}
+
+static void get_bank_block(struct osc_bank_t *bank, const float *wave,
+	uint8_t harmonic, float *out, size_t n) {
+	uint32_t step = harmonic % bank->max;
+	uint32_t idx = (uint32_t)(((uint64_t)bank->cur * harmonic) % bank->max);
+
+	for (size_t i = 0; i < n; i++) {
+		out[i] = wave[idx];
+		idx += step;
+		if (idx >= bank->max) idx -= bank->max;
+	}
+}
+
+/*
+ * Get a block of a harmonic without moving the shared phase
+ *
+ */
+void osc_bank_get_cos_block(struct osc_bank_t *bank, uint8_t harmonic,
+	float *out, size_t n) {
+	get_bank_block(bank, bank->cos_wave, harmonic, out, n);
+}
+
+void osc_bank_get_sin_block(struct osc_bank_t *bank, uint8_t harmonic,
+	float *out, size_t n) {
+	get_bank_block(bank, bank->sin_wave, harmonic, out, n);
+}
+
+/*
+ * Move the shared phase forward by n samples
+ *
+ */
+void osc_bank_update_pos(struct osc_bank_t *bank, size_t n) {
+	bank->cur = (uint32_t)((bank->cur + n) % bank->max);
+}
+
+void osc_bank_exit(struct osc_bank_t *bank) {
+	put_table(bank->table);
+	bank->table = NULL;
+	bank->sin_wave = NULL;
+	bank->cos_wave = NULL;
+	bank->cur = 0;
+	bank->max = 0;
+}
@@ -16,6 +16,19 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* frequency resolution for exact tables (1/4 Hz) */
+#define OSC_FREQ_RES		4
+
+/* longest table for an exact period */
+#define OSC_MAX_TABLE_SIZE	8192
+
+/* single cycle table for interpolation */
+#define OSC_INTERP_BITS		10
+#define OSC_INTERP_SIZE		(1 << OSC_INTERP_BITS)
+
+/* waveform tables shared by all oscillators, see osc.c */
+typedef struct osc_table_t osc_table_t;
+
 /* context for MPX oscillator */
 typedef struct osc_t {
 	/* the sample rate at which the oscillator operates */
@@ -30,21 +43,59 @@ typedef struct osc_t {
 	/*
 	 * Arrays of carrier wave constants
 	 *
+	 * These are shared and read-only
 	 */
-	float *sin_wave;
-	float *cos_wave;
+	struct osc_table_t *table;
+	const float *sin_wave;
+	const float *cos_wave;
 
 	/*
 	 * Wave phase
 	 *
+	 * For an exact period table this steps through the
+	 * table one sample at a time
 	 */
-	uint16_t cur;
-	uint16_t max;
+	uint32_t cur;
+	uint32_t max;
+
+	/*
+	 * Phase accumulator used when there is no exact period
+	 *
+	 */
+	bool interpolate;
+	uint32_t phase;
+	uint32_t step;
 } osc_t;
 
-extern void osc_init(struct osc_t *osc, uint32_t sample_rate,
+/* harmonics of one base frequency sharing a phase */
+typedef struct osc_bank_t {
+	uint32_t sample_rate;
+	float base_freq;
+
+	/* one period of the base frequency (shared) */
+	struct osc_table_t *table;
+	const float *sin_wave;
+	const float *cos_wave;
+
+	/* shared phase */
+	uint32_t cur;
+	uint32_t max;
+} osc_bank_t;
+
+extern int8_t osc_init(struct osc_t *osc, uint32_t sample_rate,
 	const float freq);
 extern float osc_get_sin(struct osc_t *osc);
 extern float osc_get_cos(struct osc_t *osc);
+extern void osc_get_sin_block(struct osc_t *osc, float *out, size_t n);
+extern void osc_get_cos_block(struct osc_t *osc, float *out, size_t n);
 extern void osc_update_pos(struct osc_t *osc);
 extern void osc_exit(struct osc_t *osc);
+
+extern int8_t osc_bank_init(struct osc_bank_t *bank, uint32_t sample_rate,
+	float base_freq);
+extern void osc_bank_get_sin_block(struct osc_bank_t *bank, uint8_t harmonic,
+	float *out, size_t n);
+extern void osc_bank_get_cos_block(struct osc_bank_t *bank, uint8_t harmonic,
+	float *out, size_t n);
+extern void osc_bank_update_pos(struct osc_bank_t *bank, size_t n);
+extern void osc_bank_exit(struct osc_bank_t *bank);
@@ -16,6 +16,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* for gmtime_r() and localtime_r() */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "common.h"
 #include "rds.h"
 #include "modulator.h"
@@ -23,90 +28,406 @@
 #include "rds2.h"
 #endif
 #include "lib.h"
+#include <stdatomic.h>
 
-static struct rds_params_t rds_data;
+/*
+ * Group sources
+ *
+ * Everything the encoder sends besides CT. Each one has an interval:
+ * it is sent once every that many groups, and never later than one
+ * interval (and the group CT may have taken) after it was due. Those
+ * with an interval of 0 fill the groups left over, in turn. See
+ * build_group_sequence().
+ */
+#define NUM_GROUP_SOURCES	9
 
-/* RDS data controls */
-static struct {
-	uint8_t ps_update;
-	uint8_t rt_update;
-	uint8_t ab;
-	uint8_t rt_segments;
-	uint8_t rt_bursting;
-	uint8_t ptyn_update;
+/* longest cycle of the group sequence */
+#define MAX_GROUP_SEQUENCE	960
 
-	/* Long PS */
-	uint8_t lps_update;
-	uint8_t lps_segments;
+/* a group left over for the fill sources */
+#define GROUP_FILL		0xff
 
-	/* eRT */
-	uint8_t ert_update;
-	uint8_t ert_segments;
-	uint8_t ert_bursting;
-} rds_state;
+/*
+ * Parameter snapshots
+ *
+ * The control threads never touch the encoder state directly. Each
+ * setter updates a complete copy of the parameters (pending) and
+ * publishes it to snapshot through a seqlock. The encoder checks
+ * the sequence number at group boundaries and copies the latest
+ * snapshot when it has changed, so a group is always built from one
+ * consistent set of parameters and the sample path never blocks.
+ *
+ * Writers are serialized with a spinlock, which is only ever
+ * contended by other control threads.
+ */
+typedef struct rds_snapshot_t {
+	struct rds_params_t params;
 
-/* ODA */
-static struct rds_oda_t odas[MAX_ODAS];
-static struct {
-	uint8_t current;
-	uint8_t count;
-} oda_state;
+	/* RT+ and eRT+ flags and tags */
+	struct rds_rtplus_info_t rtplus;
+	struct rds_rtplus_info_t ertplus;
 
-/* RT+ */
-static struct {
+	/* text segment counts */
+	uint8_t rt_segments;
+	uint8_t lps_segments;
+	uint8_t ert_segments;
+
+	/* bumped every time the matching text is set */
+	uint16_t ps_version;
+	uint16_t rt_version;
+	uint16_t ptyn_version;
+	uint16_t lps_version;
+	uint16_t ert_version;
+
+	/* group intervals, see group_sources */
+	uint8_t intervals[NUM_GROUP_SOURCES];
+	uint16_t sched_version;
+
+	/* how long a group takes to get on air (ms) */
+	uint16_t ct_latency;
+	/* the output plays in real time, CT follows the wall clock */
+	uint8_t ct_live;
+
+	/* PS texts sent in turn, each for ps_hold groups */
+	unsigned char ps_list[MAX_PS_LIST][PS_LENGTH];
+	uint8_t ps_list_len;
+	uint16_t ps_hold;
+} rds_snapshot_t;
+
+/* RT+ and eRT+ settings */
+typedef struct rds_rtplus_cfg_t {
 	uint8_t group;
 	uint8_t running;
 	uint8_t toggle;
 	uint8_t type[2];
 	uint8_t start[2];
 	uint8_t len[2];
-} rtplus_cfg;
+} rds_rtplus_cfg_t;
 
-/* eRT */
-static struct {
-	uint8_t group;
-} ert_cfg;
+/*
+ * Encoder context
+ *
+ * Everything one station needs. The tables in lib.c are shared by
+ * all of them.
+ */
+struct rds_encoder_t {
+	/* written by the control threads */
+	struct rds_snapshot_t pending;
+	struct rds_snapshot_t snapshot;
+	atomic_uint snapshot_seq;
+	atomic_flag writer_lock;
+
+	/* batch nesting, only touched by the thread holding the lock */
+	uint8_t batch_depth;
+	struct rds_encoder_t *batch_next;
+
+	/* encoder copy of the snapshot and the parameters */
+	struct rds_snapshot_t latest;
+	struct rds_params_t data;
+
+	/* RDS data controls */
+	struct {
+		/* last snapshot picked up */
+		uint32_t seq;
+		uint16_t ps_version;
+		uint16_t rt_version;
+		uint16_t ptyn_version;
+		uint16_t lps_version;
+		uint16_t ert_version;
+
+		uint8_t ps_update;
+		uint8_t rt_update;
+		uint8_t ab;
+		uint8_t rt_segments;
+		uint8_t rt_bursting;
+		uint8_t ptyn_update;
+
+		/* Long PS */
+		uint8_t lps_update;
+		uint8_t lps_segments;
+
+		/* eRT */
+		uint8_t ert_update;
+		uint8_t ert_segments;
+		uint8_t ert_bursting;
+	} state;
+
+	/* ODA */
+	struct rds_oda_t odas[MAX_ODAS];
+	struct {
+		uint8_t current;
+		uint8_t count;
+	} oda_state;
+
+	struct rds_rtplus_cfg_t rtplus_cfg;
+	struct rds_rtplus_cfg_t ertplus_cfg;
 
-/* eRT+ */
-static struct {
-	uint8_t group;
-	uint8_t running;
-	uint8_t toggle;
-	uint8_t type[2];
-	uint8_t start[2];
-	uint8_t len[2];
-} ertplus_cfg;
+	/* eRT */
+	struct {
+		uint8_t group;
+	} ert_cfg;
+
+	/* group sequencing */
+	struct {
+		uint16_t version;
+
+		/* sources that have something to send, one bit each */
+		uint16_t ready;
+
+		/* what each group of the cycle goes to */
+		uint8_t seq[MAX_GROUP_SEQUENCE];
+		uint16_t len;
+		uint16_t pos;
+
+		/* the fill sources and the next one */
+		uint8_t fill[NUM_GROUP_SOURCES];
+		uint8_t num_fill;
+		uint8_t next_fill;
+	} sched;
+	uint8_t af_state;
+
+	/* CT, see schedule_ct() */
+	struct {
+		/* groups made so far, the clock CT is timed on */
+		uint32_t groups;
+
+		/* the group that goes out at the next minute */
+		uint32_t due;
+		bool armed;
+
+		/* that minute, and when exactly it starts (groups after due) */
+		time_t minute;
+		double frac;
+
+		/* its blocks 2 to 4 */
+		uint16_t blocks[3];
+	} ct;
+
+	/* PS list, the current text and the group that can end it */
+	struct {
+		uint8_t pos;
+		uint32_t next;
+	} ps_list;
+
+	/*
+	 * Status for displays, written by the encoder
+	 *
+	 * The PS on air is packed into one word so it can be read
+	 * without a lock.
+	 */
+	atomic_uint_least64_t ps_on_air;
+	atomic_uint on_air_changes;
+
+	/* text being sent */
+	unsigned char ps_text[PS_LENGTH];
+	uint8_t ps_state;
+	unsigned char rt_text[RT_LENGTH];
+	uint8_t rt_state;
+	unsigned char ptyn_text[PTYN_LENGTH];
+	uint8_t ptyn_state;
+	unsigned char lps_text[LPS_LENGTH];
+	uint8_t lps_state;
+	unsigned char ert_text[ERT_LENGTH];
+	uint8_t ert_state;
+
+	/* groups sent of each type, read by the control threads */
+	atomic_uint_fast64_t group_mix[NUM_GROUP_CODES];
+
+#ifdef RDS2
+	struct rds2_encoder_t *rds2;
+#endif
+};
+
+/* encoders whose writer locks this thread holds for a batch */
+static _Thread_local struct rds_encoder_t *batch_encs;
+
+static bool in_batch(struct rds_encoder_t *enc) {
+	for (struct rds_encoder_t *e = batch_encs; e; e = e->batch_next)
+		if (e == enc) return true;
+	return false;
+}
+
+static void begin_update(struct rds_encoder_t *enc) {
+	if (in_batch(enc)) return; /* already ours */
+
+	while (atomic_flag_test_and_set_explicit(&enc->writer_lock,
+		memory_order_acquire))
+		; /* spin */
+}
+
+/* publish the pending parameters and let other writers in */
+static void end_update(struct rds_encoder_t *enc) {
+	uint32_t seq;
+
+	if (in_batch(enc)) return; /* published by end_rds_batch */
+
+	seq = atomic_load_explicit(&enc->snapshot_seq, memory_order_relaxed);
+
+	/* odd while the snapshot is being written */
+	atomic_store_explicit(&enc->snapshot_seq, seq + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(&enc->snapshot, &enc->pending, sizeof(struct rds_snapshot_t));
+
+	atomic_store_explicit(&enc->snapshot_seq, seq + 2,
+		memory_order_release);
+
+	atomic_flag_clear_explicit(&enc->writer_lock, memory_order_release);
+}
+
+/*
+ * Group several parameter changes
+ *
+ * The calling thread keeps the writer lock from begin_rds_batch to
+ * end_rds_batch and the encoder sees all of the changes at once,
+ * never only some of them. Other writers wait meanwhile, so make
+ * the changes right away and don't wait for anything in between.
+ *
+ * Batches nest, also on different encoders, and each encoder is
+ * published when its outermost batch ends.
+ */
+void begin_rds_batch(struct rds_encoder_t *enc) {
+	if (!in_batch(enc)) {
+		begin_update(enc);
+		enc->batch_depth = 0;
+		enc->batch_next = batch_encs;
+		batch_encs = enc;
+	}
+	enc->batch_depth++;
+}
+
+void end_rds_batch(struct rds_encoder_t *enc) {
+	struct rds_encoder_t **e = &batch_encs;
+
+	if (!in_batch(enc) || --enc->batch_depth) return;
+
+	while (*e != enc) e = &(*e)->batch_next;
+	*e = enc->batch_next;
+	end_update(enc);
+}
+
+/*
+ * Get a consistent copy of the latest snapshot
+ *
+ * Returns the sequence number of the copy
+ */
+static uint32_t read_snapshot(struct rds_encoder_t *enc,
+	struct rds_snapshot_t *out) {
+	uint32_t seq1, seq2;
+
+	do {
+		seq1 = atomic_load_explicit(&enc->snapshot_seq,
+			memory_order_acquire);
+		memcpy(out, &enc->snapshot, sizeof(struct rds_snapshot_t));
+		atomic_thread_fence(memory_order_acquire);
+		seq2 = atomic_load_explicit(&enc->snapshot_seq,
+			memory_order_relaxed);
+	} while ((seq1 & 1) || seq1 != seq2);
+
+	return seq1;
+}
+
+static void copy_rtplus_info(struct rds_rtplus_info_t *info,
+	struct rds_rtplus_cfg_t *cfg) {
+	cfg->running = info->running;
+	cfg->toggle = info->toggle;
+	memcpy(cfg->type, info->type, 2);
+	memcpy(cfg->start, info->start, 2);
+	memcpy(cfg->len, info->len, 2);
+}
+
+/*
+ * Pick up new parameters at a group boundary
+ *
+ * Returns false if there were none
+ */
+static bool update_rds_data(struct rds_encoder_t *enc) {
+	struct rds_snapshot_t *snap = &enc->latest;
+
+	if (atomic_load_explicit(&enc->snapshot_seq, memory_order_acquire)
+		== enc->state.seq)
+		return false;
+
+	enc->state.seq = read_snapshot(enc, snap);
 
-static void register_oda(uint8_t group, uint16_t aid, uint16_t scb) {
+	memcpy(&enc->data, &snap->params, sizeof(struct rds_params_t));
 
-	if (oda_state.count == MAX_ODAS) return; /* can't accept more ODAs */
+	copy_rtplus_info(&snap->rtplus, &enc->rtplus_cfg);
+	copy_rtplus_info(&snap->ertplus, &enc->ertplus_cfg);
 
-	odas[oda_state.count].group = group;
-	odas[oda_state.count].aid = aid;
-	odas[oda_state.count].scb = scb;
-	oda_state.count++;
+	if (snap->ps_version != enc->state.ps_version) {
+		enc->state.ps_version = snap->ps_version;
+		enc->state.ps_update = 1;
+		enc->ps_list.pos = 0;
+	}
+
+	/* the text of a list goes before the PS of the snapshot */
+	if (snap->ps_list_len)
+		memcpy(enc->data.ps, snap->ps_list[enc->ps_list.pos],
+			PS_LENGTH);
+
+	if (snap->rt_version != enc->state.rt_version) {
+		enc->state.rt_version = snap->rt_version;
+		enc->state.rt_update = 1;
+		enc->state.rt_segments = snap->rt_segments;
+		enc->state.rt_bursting = snap->rt_segments;
+	}
+
+	if (snap->ptyn_version != enc->state.ptyn_version) {
+		enc->state.ptyn_version = snap->ptyn_version;
+		enc->state.ptyn_update = 1;
+	}
+
+	if (snap->lps_version != enc->state.lps_version) {
+		enc->state.lps_version = snap->lps_version;
+		enc->state.lps_update = 1;
+		enc->state.lps_segments = snap->lps_segments;
+	}
+
+	if (snap->ert_version != enc->state.ert_version) {
+		enc->state.ert_version = snap->ert_version;
+		enc->state.ert_update = 1;
+		enc->state.ert_segments = snap->ert_segments;
+		enc->state.ert_bursting = snap->ert_segments;
+	}
+
+	return true;
+}
+
+static void register_oda(struct rds_encoder_t *enc,
+	uint8_t group, uint16_t aid, uint16_t scb) {
+
+	/* can't accept more ODAs */
+	if (enc->oda_state.count == MAX_ODAS) return;
+
+	enc->odas[enc->oda_state.count].group = group;
+	enc->odas[enc->oda_state.count].aid = aid;
+	enc->odas[enc->oda_state.count].scb = scb;
+	enc->oda_state.count++;
 }
 
 /* Get the next AF entry
  */
-static uint16_t get_next_af() {
-	static uint8_t af_state;
+static uint16_t get_next_af(struct rds_encoder_t *enc) {
 	uint16_t out;
 
-	if (rds_data.af.num_afs) {
-		if (af_state == 0) {
-			out = (AF_CODE_NUM_AFS_BASE + rds_data.af.num_afs) << 8;
-			out |= rds_data.af.afs[0];
-			af_state += 1;
+	if (enc->data.af.num_afs) {
+		if (enc->af_state == 0) {
+			out = AF_CODE_NUM_AFS_BASE + enc->data.af.num_afs;
+			out <<= 8;
+			out |= enc->data.af.afs[0];
+			enc->af_state += 1;
 		} else {
-			out = rds_data.af.afs[af_state] << 8;
-			if (rds_data.af.afs[af_state + 1])
-				out |= rds_data.af.afs[af_state + 1];
+			out = enc->data.af.afs[enc->af_state] << 8;
+			if (enc->data.af.afs[enc->af_state + 1])
+				out |= enc->data.af.afs[enc->af_state + 1];
 			else
 				out |= AF_CODE_FILLER;
-			af_state += 2;
+			enc->af_state += 2;
 		}
-		if (af_state >= rds_data.af.num_entries) af_state = 0;
+		if (enc->af_state >= enc->data.af.num_entries)
+			enc->af_state = 0;
 	} else {
 		out = AF_CODE_NO_AF << 8 | AF_CODE_FILLER;
 	}
@@ -114,425 +435,652 @@ static uint16_t get_next_af() {
 	return out;
 }
 
+static void publish_ps_on_air(struct rds_encoder_t *enc,
+	const unsigned char *ps) {
+	uint64_t packed;
+
+	memcpy(&packed, ps, PS_LENGTH);
+	if (packed == atomic_load_explicit(&enc->ps_on_air,
+		memory_order_relaxed))
+		return;
+
+	atomic_store_explicit(&enc->ps_on_air, packed, memory_order_relaxed);
+	atomic_fetch_add_explicit(&enc->on_air_changes, 1,
+		memory_order_release);
+}
+
 /* PS group (0A)
  */
-static void get_rds_ps_group(uint16_t *blocks) {
-	static unsigned char ps_text[PS_LENGTH];
-	static uint8_t ps_state;
+static void get_rds_ps_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 
-	if (ps_state == 0 && rds_state.ps_update) {
-		memcpy(ps_text, rds_data.ps, PS_LENGTH);
-		rds_state.ps_update = 0; /* rewind */
+	if (enc->ps_state == 0 && enc->state.ps_update) {
+		memcpy(enc->ps_text, enc->data.ps, PS_LENGTH);
+		enc->state.ps_update = 0; /* rewind */
+		enc->ps_list.next = enc->ct.groups + enc->latest.ps_hold;
+		publish_ps_on_air(enc, enc->ps_text);
 	}
 
 	/* TA */
-	blocks[1] |= rds_data.ta << 4;
+	blocks[1] |= enc->data.ta << 4;
 
 	/* MS */
-	blocks[1] |= rds_data.ms << 3;
+	blocks[1] |= enc->data.ms << 3;
 
 	/* DI */
-	blocks[1] |= ((rds_data.di >> (3 - ps_state)) & INT8_0) << 2;
+	blocks[1] |= ((enc->data.di >> (3 - enc->ps_state)) & INT8_0) << 2;
 
 	/* PS segment address */
-	blocks[1] |= ps_state;
+	blocks[1] |= enc->ps_state;
 
 	/* AF */
-	blocks[2] = get_next_af();
+	blocks[2] = get_next_af(enc);
 
 	/* PS */
-	blocks[3] = ps_text[ps_state * 2] << 8 | ps_text[ps_state * 2 + 1];
+	blocks[3] =  enc->ps_text[enc->ps_state * 2] << 8;
+	blocks[3] |= enc->ps_text[enc->ps_state * 2 + 1];
 
-	ps_state++;
-	if (ps_state == 4) ps_state = 0;
+	enc->ps_state++;
+	if (enc->ps_state == 4) enc->ps_state = 0;
 }
 
 /* Slow labeling (1A)
  */
-static void get_rds_1a_group(uint16_t *blocks) {
+static void get_rds_1a_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 	blocks[1] |= 1 << 12;
-	blocks[2] |= rds_data.ecc;
+	blocks[2] |= enc->data.ecc;
 }
 
 /* RT group (2A)
  */
-static void get_rds_rt_group(uint16_t *blocks) {
-	static unsigned char rt_text[RT_LENGTH];
-	static uint8_t rt_state;
+static void get_rds_rt_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 
-	if (rds_state.rt_bursting) rds_state.rt_bursting--;
+	if (enc->state.rt_bursting) enc->state.rt_bursting--;
 
-	if (rds_state.rt_update) {
-		memcpy(rt_text, rds_data.rt, RT_LENGTH);
-		rds_state.ab ^= 1;
-		rds_state.rt_update = 0;
-		rt_state = 0; /* rewind when new RT arrives */
+	if (enc->state.rt_update) {
+		memcpy(enc->rt_text, enc->data.rt, RT_LENGTH);
+		enc->state.ab ^= 1;
+		enc->state.rt_update = 0;
+		enc->rt_state = 0; /* rewind when new RT arrives */
 	}
 
 	blocks[1] |= 2 << 12;
-	blocks[1] |= rds_state.ab << 4;
-	blocks[1] |= rt_state;
-	blocks[2] =  rt_text[rt_state * 4    ] << 8;
-	blocks[2] |= rt_text[rt_state * 4 + 1];
-	blocks[3] =  rt_text[rt_state * 4 + 2] << 8;
-	blocks[3] |= rt_text[rt_state * 4 + 3];
-
-	rt_state++;
-	if (rt_state == rds_state.rt_segments) rt_state = 0;
+	blocks[1] |= enc->state.ab << 4;
+	blocks[1] |= enc->rt_state;
+	blocks[2] =  enc->rt_text[enc->rt_state * 4    ] << 8;
+	blocks[2] |= enc->rt_text[enc->rt_state * 4 + 1];
+	blocks[3] =  enc->rt_text[enc->rt_state * 4 + 2] << 8;
+	blocks[3] |= enc->rt_text[enc->rt_state * 4 + 3];
+
+	enc->rt_state++;
+	if (enc->rt_state == enc->state.rt_segments) enc->rt_state = 0;
 }
 
 /* ODA group (3A)
  */
-static void get_rds_oda_group(uint16_t *blocks) {
+static void get_rds_oda_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 	blocks[1] |= 3 << 12;
 
 	/* select ODA */
-	struct rds_oda_t this_oda = odas[oda_state.current];
+	struct rds_oda_t this_oda = enc->odas[enc->oda_state.current];
 
 	blocks[1] |= GET_GROUP_TYPE(this_oda.group) << 1;
 	blocks[1] |= GET_GROUP_VER(this_oda.group);
 	blocks[2] = this_oda.scb;
 	blocks[3] = this_oda.aid;
 
-	oda_state.current++;
-	if (oda_state.current == oda_state.count) oda_state.current = 0;
+	enc->oda_state.current++;
+	if (enc->oda_state.current == enc->oda_state.count)
+		enc->oda_state.current = 0;
 }
 
-/* Generates a CT (clock time) group if the minute has just changed
- * Returns 1 if the CT group was generated, 0 otherwise
+/*
+ * Clock time
+ *
+ * The encoder makes groups at a fixed rate, so it counts them
+ * instead of reading the clock for each one. The first minute is
+ * found from the wall clock (plus the output latency). After that
+ * each minute is due 60 s worth of groups after the previous one,
+ * and its 4A group is made ahead. Every other group only compares
+ * the count.
+ *
+ * This also holds when rendering faster than real time. A live
+ * output reads the wall clock once a minute as well, and follows it
+ * when the count has drifted away from it or the clock jumped
+ * ahead. A minute is never sent twice, not even if the clock goes
+ * back.
  */
-static uint8_t get_rds_ct_group(uint16_t *blocks) {
-	static uint8_t latest_minutes;
-	struct tm *utc, *local_time;
-	time_t now;
+
+/* seconds per group */
+#define GROUP_TIME \
+	((double)BITS_PER_GROUP * SAMPLES_PER_BIT / RDS_SAMPLE_RATE)
+
+/* how far the count may be off the wall clock (s) */
+#define CT_MAX_DRIFT	0.25
+
+static void get_utc_time(time_t t, struct tm *tm) {
+#ifdef _WIN32
+	gmtime_s(tm, &t);
+#else
+	gmtime_r(&t, tm);
+#endif
+}
+
+static void get_local_time(time_t t, struct tm *tm) {
+#ifdef _WIN32
+	localtime_s(tm, &t);
+#else
+	localtime_r(&t, tm);
+#endif
+}
+
+/* local time offset in half hours */
+static int16_t get_local_offset(time_t t) {
+#ifdef _WIN32
+	TIME_ZONE_INFORMATION tzi;
+	DWORD tz_result = GetTimeZoneInformation(&tzi);
+	long bias_minutes = tzi.Bias;
+
+	(void)t;
+	if (tz_result == TIME_ZONE_ID_DAYLIGHT)
+		bias_minutes += tzi.DaylightBias;
+	else if (tz_result == TIME_ZONE_ID_STANDARD)
+		bias_minutes += tzi.StandardBias;
+	/* bias is in minutes west of UTC (negative = east) */
+	return -(bias_minutes / 30);
+#else
+	struct tm utc, local;
+	long minutes, days;
+
+	/* tm_gmtoff isn't in POSIX, so compare the two times instead */
+	get_utc_time(t, &utc);
+	get_local_time(t, &local);
+
+	days = local.tm_yday - utc.tm_yday;
+	if (local.tm_year != utc.tm_year)
+		days = local.tm_year > utc.tm_year ? 1 : -1;
+	minutes = days * 1440 + (local.tm_hour - utc.tm_hour) * 60 +
+		local.tm_min - utc.tm_min;
+
+	return minutes / 30;
+#endif
+}
+
+/* the 4A group of a minute */
+static void make_ct_blocks(time_t minute, uint16_t *blocks) {
+	struct tm utc;
 	uint8_t l;
 	uint32_t mjd;
 	int16_t offset;
 
-	/* Check time */
-	now = time(NULL);
-	utc = gmtime(&now);
+	get_utc_time(minute, &utc);
+
+	l = utc.tm_mon <= 1 ? 1 : 0;
+	mjd = 14956 + utc.tm_mday +
+		(uint32_t)((utc.tm_year - l) * 365.25f) +
+		(uint32_t)((utc.tm_mon + 2 + l * 12) * 30.6001f);
 
-	if (utc->tm_min != latest_minutes) {
-		/* Generate CT group */
-		latest_minutes = utc->tm_min;
+	blocks[0] = 4 << 12 | (mjd >> 15);
+	blocks[1] = (mjd << 1) | (utc.tm_hour >> 4);
+	blocks[2] = (utc.tm_hour & INT16_L4) << 12 | utc.tm_min << 6;
 
-		l = utc->tm_mon <= 1 ? 1 : 0;
-		mjd = 14956 + utc->tm_mday +
-			(uint32_t)((utc->tm_year - l) * 365.25f) +
-			(uint32_t)((utc->tm_mon + 2 + l * 12) * 30.6001f);
+	offset = get_local_offset(minute);
+	if (offset < 0) {
+		blocks[2] |= 1 << 5;
+		blocks[2] |= abs(offset);
+	} else {
+		blocks[2] |= offset;
+	}
+}
+
+/*
+ * Find the next minute on the wall clock
+ *
+ * Returns it and sets *wait to the number of groups from the next
+ * one to be made until it is on air.
+ */
+static time_t get_wall_minute(struct rds_encoder_t *enc, double *wait) {
+	struct timespec now;
+	double on_air;
+	time_t minute;
+
+	timespec_get(&now, TIME_UTC);
+
+	/* when the next group will be heard, after the one just made */
+	on_air = now.tv_nsec / 1e9 + enc->latest.ct_latency / 1e3 +
+		GROUP_TIME;
+	minute = now.tv_sec + (time_t)on_air;
+	on_air -= (time_t)on_air;
+
+	/* the start of the next minute */
+	*wait = (60 - (long)(minute % 60) - on_air) / GROUP_TIME;
+	return minute + 60 - minute % 60;
+}
 
-		blocks[1] |= 4 << 12 | (mjd >> 15);
-		blocks[2] = (mjd << 1) | (utc->tm_hour >> 4);
-		blocks[3] = (utc->tm_hour & INT16_L4) << 12 | utc->tm_min << 6;
+/*
+ * Find the group that goes on air closest to the next minute
+ *
+ * The next group to be made is ct.groups
+ */
+static void schedule_ct(struct rds_encoder_t *enc) {
+	double wait = 0.0, wall_wait;
+	time_t minute = 0, wall_minute;
+	long groups;
+
+	if (enc->ct.armed) {
+		minute = enc->ct.minute + 60;
+		wait = (int32_t)(enc->ct.due - enc->ct.groups) +
+			enc->ct.frac + 60 / GROUP_TIME;
+	}
 
-		/* get local time (for the offset) */
-		local_time = localtime(&now);
+	if (!enc->ct.armed || enc->latest.ct_live) {
+		wall_minute = get_wall_minute(enc, &wall_wait);
 
-#ifdef _WIN32
-		{
-			TIME_ZONE_INFORMATION tzi;
-			DWORD tz_result = GetTimeZoneInformation(&tzi);
-			long bias_minutes = tzi.Bias;
-			if (tz_result == TIME_ZONE_ID_DAYLIGHT)
-				bias_minutes += tzi.DaylightBias;
-			else if (tz_result == TIME_ZONE_ID_STANDARD)
-				bias_minutes += tzi.StandardBias;
-			/* bias is in minutes west of UTC (negative = east) */
-			offset = -(bias_minutes / 30);
-		}
-#else
-		/* tm_gmtoff doesn't exist in POSIX but __tm_gmtoff does */
-		offset = local_time->__tm_gmtoff / (30 * 60);
-#endif
-		if (offset < 0) {
-			blocks[3] |= 1 << 5;
-			blocks[3] |= abs(offset);
+		if (!enc->ct.armed || wall_minute > minute) {
+			/* the start, or the clock jumped ahead */
+			minute = wall_minute;
+			wait = wall_wait;
 		} else {
-			blocks[3] |= offset;
+			/* when our minute starts by the clock */
+			wall_wait += (double)(minute - wall_minute) /
+				GROUP_TIME;
+			if (fabs(wall_wait - wait) * GROUP_TIME > CT_MAX_DRIFT)
+				wait = wall_wait;
 		}
+	}
+
+	groups = lround(wait);
+	enc->ct.due = enc->ct.groups + (uint32_t)groups;
+	enc->ct.frac = wait - groups;
+	enc->ct.minute = minute;
+	enc->ct.armed = true;
+	make_ct_blocks(minute, enc->ct.blocks);
+}
+
+/* Generates a CT (clock time) group if the minute has just changed
+ * Returns 1 if the CT group was generated, 0 otherwise
+ */
+static uint8_t get_rds_ct_group(struct rds_encoder_t *enc, uint16_t *blocks) {
+	bool send;
+
+	if (enc->ct.groups != enc->ct.due) {
+		enc->ct.groups++;
+		return 0;
+	}
 
-		return 1;
+	/* not armed for the very first group */
+	send = enc->ct.armed && enc->data.tx_ctime;
+	if (send) {
+		blocks[1] |= enc->ct.blocks[0];
+		blocks[2] = enc->ct.blocks[1];
+		blocks[3] = enc->ct.blocks[2];
 	}
 
-	return 0;
+	enc->ct.groups++;
+	schedule_ct(enc);
+	return send;
 }
 
 /* PTYN group (10A)
  */
-static void get_rds_ptyn_group(uint16_t *blocks) {
-	static unsigned char ptyn_text[PTYN_LENGTH];
-	static uint8_t ptyn_state;
+static void get_rds_ptyn_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 
-	if (ptyn_state == 0 && rds_state.ptyn_update) {
-		memcpy(ptyn_text, rds_data.ptyn, PTYN_LENGTH);
-		rds_state.ptyn_update = 0;
+	if (enc->ptyn_state == 0 && enc->state.ptyn_update) {
+		memcpy(enc->ptyn_text, enc->data.ptyn, PTYN_LENGTH);
+		enc->state.ptyn_update = 0;
 	}
 
-	blocks[1] |= 10 << 12 | ptyn_state;
-	blocks[2] =  ptyn_text[ptyn_state * 4    ] << 8;
-	blocks[2] |= ptyn_text[ptyn_state * 4 + 1];
-	blocks[3] =  ptyn_text[ptyn_state * 4 + 2] << 8;
-	blocks[3] |= ptyn_text[ptyn_state * 4 + 3];
+	blocks[1] |= 10 << 12 | enc->ptyn_state;
+	blocks[2] =  enc->ptyn_text[enc->ptyn_state * 4    ] << 8;
+	blocks[2] |= enc->ptyn_text[enc->ptyn_state * 4 + 1];
+	blocks[3] =  enc->ptyn_text[enc->ptyn_state * 4 + 2] << 8;
+	blocks[3] |= enc->ptyn_text[enc->ptyn_state * 4 + 3];
 
-	ptyn_state++;
-	if (ptyn_state == 2) ptyn_state = 0;
+	enc->ptyn_state++;
+	if (enc->ptyn_state == 2) enc->ptyn_state = 0;
 }
 
 /* Long PS group (15A) */
-static void get_rds_lps_group(uint16_t *blocks) {
-	static unsigned char lps_text[LPS_LENGTH];
-	static uint8_t lps_state;
+static void get_rds_lps_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 
-	if (lps_state == 0 && rds_state.lps_update) {
-		memcpy(lps_text, rds_data.lps, LPS_LENGTH);
-		rds_state.lps_update = 0;
+	if (enc->lps_state == 0 && enc->state.lps_update) {
+		memcpy(enc->lps_text, enc->data.lps, LPS_LENGTH);
+		enc->state.lps_update = 0;
 	}
 
-	blocks[1] |= 15 << 12 | lps_state;
-	blocks[2] =  lps_text[lps_state * 4    ] << 8;
-	blocks[2] |= lps_text[lps_state * 4 + 1];
-	blocks[3] =  lps_text[lps_state * 4 + 2] << 8;
-	blocks[3] |= lps_text[lps_state * 4 + 3];
+	blocks[1] |= 15 << 12 | enc->lps_state;
+	blocks[2] =  enc->lps_text[enc->lps_state * 4    ] << 8;
+	blocks[2] |= enc->lps_text[enc->lps_state * 4 + 1];
+	blocks[3] =  enc->lps_text[enc->lps_state * 4 + 2] << 8;
+	blocks[3] |= enc->lps_text[enc->lps_state * 4 + 3];
 
-	lps_state++;
-	if (lps_state == rds_state.lps_segments) lps_state = 0;
+	enc->lps_state++;
+	if (enc->lps_state == enc->state.lps_segments) enc->lps_state = 0;
 }
 
 /* RT+ */
-static void init_rtplus(uint8_t group) {
-	register_oda(group, ODA_AID_RTPLUS, 0);
-	rtplus_cfg.group = group;
+static void init_rtplus(struct rds_encoder_t *enc, uint8_t group) {
+	register_oda(enc, group, ODA_AID_RTPLUS, 0);
+	enc->rtplus_cfg.group = group;
 }
 
 /* eRT */
-static void init_ert(uint8_t group) {
+static void init_ert(struct rds_encoder_t *enc, uint8_t group) {
 	if (GET_GROUP_VER(group) == 1) {
 		/* type B groups cannot be used for eRT */
 		return;
 	}
-	register_oda(group, ODA_AID_ERT, 1 /* UTF-8 */);
-	ert_cfg.group = group;
+	register_oda(enc, group, ODA_AID_ERT, 1 /* UTF-8 */);
+	enc->ert_cfg.group = group;
 }
 
 /* eRT+ */
-static void init_ertp(uint8_t group) {
-	register_oda(group, ODA_AID_ERTPLUS, 0);
-	ertplus_cfg.group = group;
+static void init_ertp(struct rds_encoder_t *enc, uint8_t group) {
+	register_oda(enc, group, ODA_AID_ERTPLUS, 0);
+	enc->ertplus_cfg.group = group;
 }
 
 /* RT+ group
  */
-static void get_rds_rtplus_group(uint16_t *blocks) {
+static void get_rds_rtplus_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 	/* RT+ block format */
-	blocks[1] |= GET_GROUP_TYPE(rtplus_cfg.group) << 12;
-	blocks[1] |= GET_GROUP_VER(rtplus_cfg.group) << 11;
-	blocks[1] |= rtplus_cfg.toggle << 4 | rtplus_cfg.running << 3;
-	blocks[1] |= (rtplus_cfg.type[0] & INT8_U5) >> 3;
-
-	blocks[2] =  (rtplus_cfg.type[0] & INT8_L3) << 13;
-	blocks[2] |= (rtplus_cfg.start[0] & INT8_L6) << 7;
-	blocks[2] |= (rtplus_cfg.len[0] & INT8_L6) << 1;
-	blocks[2] |= (rtplus_cfg.type[1] & INT8_U3) >> 5;
-
-	blocks[3] =  (rtplus_cfg.type[1] & INT8_L5) << 11;
-	blocks[3] |= (rtplus_cfg.start[1] & INT8_L6) << 5;
-	blocks[3] |= rtplus_cfg.len[1] & INT8_L5;
+	blocks[1] |= GET_GROUP_TYPE(enc->rtplus_cfg.group) << 12;
+	blocks[1] |= GET_GROUP_VER(enc->rtplus_cfg.group) << 11;
+	blocks[1] |= enc->rtplus_cfg.toggle << 4;
+	blocks[1] |= enc->rtplus_cfg.running << 3;
+	blocks[1] |= (enc->rtplus_cfg.type[0] & INT8_U5) >> 3;
+
+	blocks[2] =  (enc->rtplus_cfg.type[0] & INT8_L3) << 13;
+	blocks[2] |= (enc->rtplus_cfg.start[0] & INT8_L6) << 7;
+	blocks[2] |= (enc->rtplus_cfg.len[0] & INT8_L6) << 1;
+	blocks[2] |= (enc->rtplus_cfg.type[1] & INT8_U3) >> 5;
+
+	blocks[3] =  (enc->rtplus_cfg.type[1] & INT8_L5) << 11;
+	blocks[3] |= (enc->rtplus_cfg.start[1] & INT8_L6) << 5;
+	blocks[3] |= enc->rtplus_cfg.len[1] & INT8_L5;
 }
 
 /* eRT group */
-static void get_rds_ert_group(uint16_t *blocks) {
-	static unsigned char ert_text[ERT_LENGTH];
-	static uint8_t ert_state;
+static void get_rds_ert_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 
-	if (rds_state.ert_bursting) rds_state.ert_bursting--;
+	if (enc->state.ert_bursting) enc->state.ert_bursting--;
 
-	if (rds_state.ert_update) {
-		memcpy(ert_text, rds_data.ert, ERT_LENGTH);
-		rds_state.ert_update = 0;
-		ert_state = 0; /* rewind when new eRT arrives */
+	if (enc->state.ert_update) {
+		memcpy(enc->ert_text, enc->data.ert, ERT_LENGTH);
+		enc->state.ert_update = 0;
+		enc->ert_state = 0; /* rewind when new eRT arrives */
 	}
 
 	/* eRT block format */
-	blocks[1] |= GET_GROUP_TYPE(ert_cfg.group) << 12;
-	blocks[1] |= ert_state;
-	blocks[2] =  ert_text[ert_state * 4    ] << 8;
-	blocks[2] |= ert_text[ert_state * 4 + 1];
-	blocks[3] =  ert_text[ert_state * 4 + 2] << 8;
-	blocks[3] |= ert_text[ert_state * 4 + 3];
-
-	ert_state++;
-	if (ert_state == rds_state.ert_segments) ert_state = 0;
+	blocks[1] |= GET_GROUP_TYPE(enc->ert_cfg.group) << 12;
+	blocks[1] |= enc->ert_state;
+	blocks[2] =  enc->ert_text[enc->ert_state * 4    ] << 8;
+	blocks[2] |= enc->ert_text[enc->ert_state * 4 + 1];
+	blocks[3] =  enc->ert_text[enc->ert_state * 4 + 2] << 8;
+	blocks[3] |= enc->ert_text[enc->ert_state * 4 + 3];
+
+	enc->ert_state++;
+	if (enc->ert_state == enc->state.ert_segments) enc->ert_state = 0;
 }
 
 /* eRT+ group */
-static void get_rds_ertplus_group(uint16_t *blocks) {
+static void get_rds_ertplus_group(struct rds_encoder_t *enc, uint16_t *blocks) {
 	/* RT+ block format */
-	blocks[1] |= GET_GROUP_TYPE(ertplus_cfg.group) << 12;
-	blocks[1] |= GET_GROUP_VER(ertplus_cfg.group) << 11;
-	blocks[1] |= ertplus_cfg.toggle << 4 | ertplus_cfg.running << 3;
-	blocks[1] |= (ertplus_cfg.type[0] & INT8_U5) >> 3;
+	blocks[1] |= GET_GROUP_TYPE(enc->ertplus_cfg.group) << 12;
+	blocks[1] |= GET_GROUP_VER(enc->ertplus_cfg.group) << 11;
+	blocks[1] |= enc->ertplus_cfg.toggle << 4;
+	blocks[1] |= enc->ertplus_cfg.running << 3;
+	blocks[1] |= (enc->ertplus_cfg.type[0] & INT8_U5) >> 3;
+
+	blocks[2] =  (enc->ertplus_cfg.type[0] & INT8_L3) << 13;
+	blocks[2] |= (enc->ertplus_cfg.start[0] & INT8_L6) << 7;
+	blocks[2] |= (enc->ertplus_cfg.len[0] & INT8_L6) << 1;
+	blocks[2] |= (enc->ertplus_cfg.type[1] & INT8_U3) >> 5;
+
+	blocks[3] =  (enc->ertplus_cfg.type[1] & INT8_L5) << 11;
+	blocks[3] |= (enc->ertplus_cfg.start[1] & INT8_L6) << 5;
+	blocks[3] |= enc->ertplus_cfg.len[1] & INT8_L5;
+}
+
+/*
+ * Group scheduling
+ *
+ */
+static bool has_ecc(struct rds_encoder_t *enc) {
+	return enc->data.ecc != 0;
+}
 
-	blocks[2] =  (ertplus_cfg.type[0] & INT8_L3) << 13;
-	blocks[2] |= (ertplus_cfg.start[0] & INT8_L6) << 7;
-	blocks[2] |= (ertplus_cfg.len[0] & INT8_L6) << 1;
-	blocks[2] |= (ertplus_cfg.type[1] & INT8_U3) >> 5;
+static bool has_oda(struct rds_encoder_t *enc) {
+	return enc->oda_state.count != 0;
+}
 
-	blocks[3] =  (ertplus_cfg.type[1] & INT8_L5) << 11;
-	blocks[3] |= (ertplus_cfg.start[1] & INT8_L6) << 5;
-	blocks[3] |= ertplus_cfg.len[1] & INT8_L5;
+static bool has_ptyn(struct rds_encoder_t *enc) {
+	return enc->data.ptyn[0] != 0;
 }
 
-/* Lower priority groups are placed in a subsequence
- */
-static uint8_t get_rds_other_groups(uint16_t *blocks) {
-	static uint8_t group_counter[GROUP_15B];
-
-	if (rds_data.ecc) {
-		if (++group_counter[GROUP_1A] >= 60) {
-			group_counter[GROUP_1A] = 0;
-			get_rds_1a_group(blocks);
-			return 1;
-		}
+static bool has_ert(struct rds_encoder_t *enc) {
+	return enc->data.ert[0] != 0;
+}
+
+static bool has_lps(struct rds_encoder_t *enc) {
+	return enc->data.lps[0] != 0;
+}
+
+static const struct {
+	/* as assigned in init_rds_encoder() */
+	uint8_t group;
+
+	/* default interval in groups, 0 = fill */
+	uint8_t interval;
+
+	/* NULL if it always has something to send */
+	bool (*ready)(struct rds_encoder_t *enc);
+
+	void (*get)(struct rds_encoder_t *enc, uint16_t *blocks);
+} group_sources[NUM_GROUP_SOURCES] = {
+	{GROUP_0A,	0,	NULL,		get_rds_ps_group},
+	{GROUP_2A,	0,	NULL,		get_rds_rt_group},
+	{GROUP_1A,	60,	has_ecc,	get_rds_1a_group},
+	{GROUP_3A,	20,	has_oda,	get_rds_oda_group},
+	{GROUP_10A,	10,	has_ptyn,	get_rds_ptyn_group},
+	{GROUP_11A,	30,	NULL,		get_rds_rtplus_group},
+	{GROUP_12A,	5,	has_ert,	get_rds_ert_group},
+	{GROUP_13A,	30,	has_ert,	get_rds_ertplus_group},
+	{GROUP_15A,	16,	has_lps,	get_rds_lps_group}
+};
+
+static int8_t find_group_source(uint8_t group) {
+	for (uint8_t i = 0; i < NUM_GROUP_SOURCES; i++) {
+		if (group_sources[i].group == group) return (int8_t)i;
 	}
+	return -1;
+}
 
-	/* Type 3A groups */
-	if (oda_state.count) {
-		if (++group_counter[GROUP_3A] >= 20) {
-			group_counter[GROUP_3A] = 0;
-			get_rds_oda_group(blocks);
-			return 1;
-		}
+static uint16_t get_ready_sources(struct rds_encoder_t *enc) {
+	uint16_t ready = 0;
+
+	for (uint8_t i = 0; i < NUM_GROUP_SOURCES; i++) {
+		if (group_sources[i].ready == NULL ||
+			group_sources[i].ready(enc))
+			ready |= 1 << i;
+	}
+	return ready;
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+	uint32_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
 	}
+	return a;
+}
 
-	/* Type 10A groups */
-	if (rds_data.ptyn[0]) {
-		if (++group_counter[GROUP_10A] >= 10) {
-			group_counter[GROUP_10A] = 0;
-			/* Do not generate a 10A group if PTYN is off */
-			get_rds_ptyn_group(blocks);
-			return 1;
+/*
+ * Lay out one cycle of groups
+ *
+ * The cycle is as long as the least common multiple of the intervals
+ * (at most MAX_GROUP_SEQUENCE), so that a source with an interval of
+ * n gets len / n groups of it. Those are spread evenly: the k-th one
+ * may go out from k * n on and is due by (k + 1) * n. Each group of
+ * the cycle goes to the source whose next group is due first, and
+ * to the fill sources if none is waiting. With all intervals adding
+ * up to at most one group per group, none is late in the sequence.
+ * CT takes one group a minute on top of it, so a source can go out
+ * one group after it was due then. set_rds_group_interval() keeps
+ * CT's share free, along with room for the fill sources.
+ *
+ * Done only when the intervals or the sources that have something
+ * to send change, so picking a group is a table lookup.
+ */
+static void build_group_sequence(struct rds_encoder_t *enc) {
+	const uint8_t *intervals = enc->latest.intervals;
+	uint16_t jobs[NUM_GROUP_SOURCES], sent[NUM_GROUP_SOURCES];
+	uint32_t len = 1, release, due, best_due;
+	uint8_t best;
+
+	enc->sched.num_fill = 0;
+	for (uint8_t i = 0; i < NUM_GROUP_SOURCES; i++) {
+		if (!(enc->sched.ready & (1 << i))) continue;
+		if (intervals[i] == 0) {
+			enc->sched.fill[enc->sched.num_fill++] = i;
+			continue;
 		}
+		len = len / gcd(len, intervals[i]) * intervals[i];
+		if (len > MAX_GROUP_SEQUENCE) len = MAX_GROUP_SEQUENCE;
 	}
 
-	/* RT+ groups */
-	if (++group_counter[rtplus_cfg.group] >= 30) {
-		group_counter[rtplus_cfg.group] = 0;
-		get_rds_rtplus_group(blocks);
-		return 1;
+	/* a station always has PS to send */
+	if (enc->sched.num_fill == 0)
+		enc->sched.fill[enc->sched.num_fill++] = 0;
+
+	for (uint8_t i = 0; i < NUM_GROUP_SOURCES; i++) {
+		jobs[i] = 0;
+		if ((enc->sched.ready & (1 << i)) && intervals[i])
+			jobs[i] = (len + intervals[i] - 1) / intervals[i];
+		sent[i] = 0;
 	}
 
-	/* eRT+ groups */
-	if (rds_data.ert[0]) {
-		if (++group_counter[ertplus_cfg.group] >= 30) {
-			group_counter[ertplus_cfg.group] = 0;
-			get_rds_ertplus_group(blocks);
-			return 1;
+	for (uint32_t t = 0; t < len; t++) {
+		best = GROUP_FILL;
+		best_due = UINT32_MAX;
+
+		for (uint8_t i = 0; i < NUM_GROUP_SOURCES; i++) {
+			if (sent[i] == jobs[i]) continue;
+
+			release = sent[i] * len / jobs[i];
+			if (release > t) continue;
+
+			/* ties go to the first in the table */
+			due = (sent[i] + 1) * len / jobs[i];
+			if (due < best_due) {
+				best = i;
+				best_due = due;
+			}
 		}
+
+		enc->sched.seq[t] = best;
+		if (best != GROUP_FILL) sent[best]++;
 	}
 
-	return 0;
+	enc->sched.len = (uint16_t)len;
+	enc->sched.pos = 0;
+	enc->sched.next_fill = 0;
 }
 
-/*
- * Codes a group once every 3 groups
- * Ex: 0A, 2A, 0A, 12A, 2A, 0A, 2A, 12A, etc
- */
-static uint8_t get_rds_long_text_groups(uint16_t *blocks) {
-	static uint8_t group_selector = 0;
-	static uint8_t group_slot_counter = 0;
+/* lay out the groups again if the parameters changed anything */
+static void update_group_sequence(struct rds_encoder_t *enc) {
+	uint16_t ready = get_ready_sources(enc);
 
-	/* exit early until the 4th call */
-	if (++group_slot_counter < 4)
-		return 0;
+	if (enc->latest.sched_version == enc->sched.version &&
+		ready == enc->sched.ready)
+		return;
 
-	/* reset the slot counter */
-	group_slot_counter = 0;
-
-	/* 3:1 ratio */
-	switch (group_selector) {
-	case 0:
-	case 1:
-	case 2: /* eRT */
-		if (rds_data.ert[0]) {
-			get_rds_ert_group(blocks);
-			goto group_coded;
-		}
-		break;
-	case 3: /* Long PS */
-		if (rds_data.lps[0]) {
-			get_rds_lps_group(blocks);
-			goto group_coded;
-		}
-		break;
-	}
+	enc->sched.version = enc->latest.sched_version;
+	enc->sched.ready = ready;
+	build_group_sequence(enc);
+}
 
-	/* if no group was coded */
-	if (++group_selector == 4) group_selector = 0;
-	return 0;
+/* the source that gets the next group */
+static uint8_t next_group_source(struct rds_encoder_t *enc) {
+	uint8_t i = enc->sched.seq[enc->sched.pos];
 
-group_coded:
-	if (++group_selector == 4) group_selector = 0;
-	return 1;
+	if (++enc->sched.pos == enc->sched.len) enc->sched.pos = 0;
+	if (i != GROUP_FILL) return i;
+
+	i = enc->sched.fill[enc->sched.next_fill];
+
+	/* a new RT or eRT goes out in one burst */
+	if (group_sources[i].group == GROUP_2A && enc->state.rt_bursting)
+		return i;
+	if (group_sources[i].group == GROUP_12A && enc->state.ert_bursting)
+		return i;
+
+	if (++enc->sched.next_fill == enc->sched.num_fill)
+		enc->sched.next_fill = 0;
+	return i;
 }
 
 /* Creates an RDS group.
- * This generates sequences of the form 0A, 2A, 0A, 2A, 0A, 2A, etc.
+ * CT goes out when the minute changes, everything else as the group
+ * sequence has it.
  */
-static void get_rds_group(uint16_t *blocks) {
-	static uint8_t state;
+/*
+ * Move on to the next text of the PS list
+ *
+ * This is timed on the group count like CT. The hold starts when a
+ * text goes on air, which is at its first segment like any other PS
+ * change, so every text is sent in full at least once.
+ */
+static void next_ps_segment(struct rds_encoder_t *enc) {
+	struct rds_snapshot_t *snap = &enc->latest;
+
+	if (snap->ps_list_len < 2 || enc->state.ps_update) return;
+	if ((int32_t)(enc->ct.groups - enc->ps_list.next) < 0) return;
+
+	if (++enc->ps_list.pos == snap->ps_list_len) enc->ps_list.pos = 0;
+
+	memcpy(enc->data.ps, snap->ps_list[enc->ps_list.pos], PS_LENGTH);
+	enc->state.ps_update = 1;
+}
+
+static void get_rds_group(struct rds_encoder_t *enc, uint16_t *blocks) {
+	/* Apply any new parameters */
+	if (update_rds_data(enc)) update_group_sequence(enc);
+	next_ps_segment(enc);
 
 	/* Basic block data */
-	blocks[0] = rds_data.pi;
-	blocks[1] = rds_data.tp << 10;
-	blocks[1] |= rds_data.pty << 5;
+	blocks[0] = enc->data.pi;
+	blocks[1] = enc->data.tp << 10;
+	blocks[1] |= enc->data.pty << 5;
 	blocks[2] = 0;
 	blocks[3] = 0;
 
 	/* Generate block content */
 
 	/* CT (clock time) has priority over other group types */
-	if (rds_data.tx_ctime && get_rds_ct_group(blocks)) {
-		goto group_coded;
-	}
-
-	/* Longer text groups get medium priority */
-	if (get_rds_long_text_groups(blocks)) {
-		goto group_coded;
-	}
-
-	/* Other groups */
-	if (get_rds_other_groups(blocks)) {
+	if (get_rds_ct_group(enc, blocks)) {
 		goto group_coded;
 	}
 
-	/* Standard group sequence */
-	switch (state) {
-	case 0:
-		/* Type 0A groups */
-		get_rds_ps_group(blocks);
-		state++;
-		break;
-	case 1:
-		/* Type 2A groups */
-		get_rds_rt_group(blocks);
-		if (!rds_state.rt_bursting) {
-			state++;
-		}
-		break;
-	}
-	if (state == 2) state = 0;
+	group_sources[next_group_source(enc)].get(enc, blocks);
 
 group_coded:
 	/* for version B groups */
 	if (IS_TYPE_B(blocks)) {
-		blocks[2] = rds_data.pi;
+		blocks[2] = enc->data.pi;
 	}
 }
 
-void get_rds_bits(uint8_t *bits) {
-	static uint16_t out_blocks[GROUP_LENGTH];
-	get_rds_group(out_blocks);
+void get_rds_bits(struct rds_encoder_t *enc, uint32_t *bits) {
+	uint16_t out_blocks[GROUP_LENGTH];
+
+	get_rds_group(enc, out_blocks);
+
+	atomic_fetch_add_explicit(&enc->group_mix[out_blocks[1] >> 11], 1,
+		memory_order_relaxed);
+
 #ifdef RDS2
 	add_checkwords(out_blocks, bits, false);
 #else
@@ -540,105 +1088,148 @@ void get_rds_bits(uint8_t *bits) {
 #endif
 }
 
-void init_rds_encoder(struct rds_params_t rds_params) {
+/*
+ * Create an encoder
+ *
+ * Any number of them can run at the same time, each one is only
+ * used by one sample thread (and any number of control threads).
+ */
+struct rds_encoder_t *init_rds_encoder(struct rds_params_t rds_params) {
+	struct rds_encoder_t *enc;
+
+	/* checkword and CRC lookup tables */
+	init_crc_tables();
+
+	enc = calloc(1, sizeof(struct rds_encoder_t));
+	if (enc == NULL) return NULL;
+
+	atomic_init(&enc->snapshot_seq, 0);
+	atomic_flag_clear(&enc->writer_lock);
+
+	for (uint8_t i = 0; i < NUM_GROUP_SOURCES; i++)
+		enc->pending.intervals[i] = group_sources[i].interval;
+	enc->pending.sched_version = 1;
+	enc->pending.ct_live = 1;
 
 	/* AF */
 	if (rds_params.af.num_afs) {
-		set_rds_af(rds_params.af);
+		set_rds_af(enc, rds_params.af);
 		fprintf(stderr, show_af_list(rds_params.af));
 	}
 
-	set_rds_pi(rds_params.pi);
-	set_rds_ps(rds_params.ps);
-	rds_state.ab = 1;
-	set_rds_rt(rds_params.rt);
-	set_rds_pty(rds_params.pty);
-	set_rds_ptyn(rds_params.ptyn);
-	set_rds_tp(rds_params.tp);
-	set_rds_ct(1);
-	set_rds_ms(1);
-	set_rds_di(DI_STEREO);
+	set_rds_pi(enc, rds_params.pi);
+	set_rds_ps(enc, rds_params.ps);
+	publish_ps_on_air(enc, enc->pending.params.ps);
+	enc->state.ab = 1;
+	set_rds_rt(enc, rds_params.rt);
+	set_rds_pty(enc, rds_params.pty);
+	set_rds_ptyn(enc, rds_params.ptyn);
+	set_rds_tp(enc, rds_params.tp);
+	set_rds_ct(enc, 1);
+	set_rds_ms(enc, 1);
+	set_rds_di(enc, DI_STEREO);
 
 	/* Assign the RT+ AID to group 11A */
-	init_rtplus(GROUP_11A);
+	init_rtplus(enc, GROUP_11A);
 
 	/* Assign the eRT AID to group 12A */
-	init_ert(GROUP_12A);
+	init_ert(enc, GROUP_12A);
 
 	/* Assign the eRT+ AID to group 13A */
-	init_ertp(GROUP_13A);
+	init_ertp(enc, GROUP_13A);
 
-	/* initialize modulator objects */
-	init_rds_objects();
 #ifdef RDS2
 	/* XXX: don't hardcode file paths */
 #ifdef _WIN32
-	init_rds2_encoder("rds2-image\\stationlogo.png");
+	enc->rds2 = init_rds2_encoder("rds2-image\\stationlogo.png");
 #else
-	init_rds2_encoder("/tmp/rds2-image/stationlogo.png");
+	enc->rds2 = init_rds2_encoder("/tmp/rds2-image/stationlogo.png");
 #endif
+	if (enc->rds2 == NULL) {
+		free(enc);
+		return NULL;
+	}
 #endif
+
+	return enc;
 }
 
-void exit_rds_encoder() {
-	exit_rds_objects();
+void exit_rds_encoder(struct rds_encoder_t *enc) {
 #ifdef RDS2
-	exit_rds2_encoder();
+	exit_rds2_encoder(enc->rds2);
 #endif
+	free(enc);
 }
 
-void set_rds_pi(uint16_t pi_code) {
-	rds_data.pi = pi_code;
+#ifdef RDS2
+/* the RDS2 streams of an encoder (for the modulator) */
+struct rds2_encoder_t *get_rds2_encoder(struct rds_encoder_t *enc) {
+	return enc->rds2;
+}
+#endif
+
+void set_rds_pi(struct rds_encoder_t *enc, uint16_t pi_code) {
+	begin_update(enc);
+	enc->pending.params.pi = pi_code;
+	end_update(enc);
 }
 
-void set_rds_ecc(uint8_t ecc) {
-	rds_data.ecc = ecc;
+void set_rds_ecc(struct rds_encoder_t *enc, uint8_t ecc) {
+	begin_update(enc);
+	enc->pending.params.ecc = ecc;
+	end_update(enc);
 }
 
-void set_rds_rt(unsigned char *rt) {
+void set_rds_rt(struct rds_encoder_t *enc, unsigned char *rt) {
+	unsigned char *text = enc->pending.params.rt;
 	uint8_t i = 0, len = 0;
 
-	rds_state.rt_update = 1;
-	memset(rds_data.rt, ' ', RT_LENGTH);
+	begin_update(enc);
+
+	enc->pending.rt_version++;
+	memset(text, ' ', RT_LENGTH);
 	while (*rt != 0 && len < RT_LENGTH)
-		rds_data.rt[len++] = *rt++;
+		text[len++] = *rt++;
 
 	if (len < RT_LENGTH) {
-		rds_state.rt_segments = 0;
+		enc->pending.rt_segments = 0;
 
 		/* Terminate RT with '\r' (carriage return) if RT
 		 * is < 64 characters long
 		 */
-		rds_data.rt[len++] = '\r';
+		text[len++] = '\r';
 
 		/* find out how many segments are needed */
 		while (i < len) {
 			i += 4;
-			rds_state.rt_segments++;
+			enc->pending.rt_segments++;
 		}
 	} else {
 		/* Default to 16 if RT is 64 characters long */
-		rds_state.rt_segments = 16;
+		enc->pending.rt_segments = 16;
 	}
 
-	rds_state.rt_bursting = rds_state.rt_segments;
+	end_update(enc);
 }
 
-void set_rds_ert(unsigned char *ert) {
+void set_rds_ert(struct rds_encoder_t *enc, unsigned char *ert) {
+	unsigned char *text = enc->pending.params.ert;
 	uint8_t i = 0, len = 0;
 
+	begin_update(enc);
+
 	if (!ert[0]) {
-		memset(rds_data.ert, 0, ERT_LENGTH);
-		return;
+		memset(text, 0, ERT_LENGTH);
+		goto done;
 	}
 
-	rds_state.ert_update = 1;
-	memset(rds_data.ert, '\r', ERT_LENGTH);
+	enc->pending.ert_version++;
+	memset(text, '\r', ERT_LENGTH);
 	while (*ert != 0 && len < ERT_LENGTH)
-		rds_data.ert[len++] = *ert++;
+		text[len++] = *ert++;
 
 	if (len < ERT_LENGTH) {
-		rds_state.ert_segments = 0;
+		enc->pending.ert_segments = 0;
 
 		/* increment to allow adding an '\r' in all cases */
 		len++;
@@ -646,40 +1237,78 @@ void set_rds_ert(unsigned char *ert) {
 		/* find out how many segments are needed */
 		while (i < len) {
 			i += 4;
-			rds_state.ert_segments++;
+			enc->pending.ert_segments++;
 		}
 	} else {
 		/* Default to 32 if eRT is 128 characters long */
-		rds_state.ert_segments = 32;
+		enc->pending.ert_segments = 32;
 	}
 
-	rds_state.ert_bursting = rds_state.ert_segments;
+done:
+	end_update(enc);
 }
 
-void set_rds_ps(unsigned char *ps) {
+void set_rds_ps(struct rds_encoder_t *enc, unsigned char *ps) {
+	unsigned char *text = enc->pending.params.ps;
 	uint8_t len = 0;
 
-	rds_state.ps_update = 1;
-	memset(rds_data.ps, ' ', PS_LENGTH);
+	begin_update(enc);
+
+	enc->pending.ps_version++;
+	enc->pending.ps_list_len = 0;
+	memset(text, ' ', PS_LENGTH);
 	while (*ps != 0 && len < PS_LENGTH)
-		rds_data.ps[len++] = *ps++;
+		text[len++] = *ps++;
+
+	end_update(enc);
+}
+
+/*
+ * Send several PS texts in turn
+ *
+ * segments holds count texts of PS_LENGTH chars, each one is sent for
+ * hold_ms. The encoder steps through them on its own group count, so
+ * they keep time with the output and not with the caller. A count of
+ * 0 stops the list on the text being sent.
+ */
+void set_rds_ps_list(struct rds_encoder_t *enc,
+	const unsigned char *segments, uint8_t count, uint16_t hold_ms) {
+	long hold = lround(hold_ms / 1e3 / GROUP_TIME);
+
+	if (count > MAX_PS_LIST) count = MAX_PS_LIST;
+	if (hold < 1) hold = 1;
+
+	begin_update(enc);
+
+	if (count) {
+		enc->pending.ps_version++;
+		memcpy(enc->pending.ps_list, segments, count * PS_LENGTH);
+		memcpy(enc->pending.params.ps, segments, PS_LENGTH);
+	}
+	enc->pending.ps_list_len = count;
+	enc->pending.ps_hold = (uint16_t)hold;
+
+	end_update(enc);
 }
 
-void set_rds_lps(unsigned char *lps) {
+void set_rds_lps(struct rds_encoder_t *enc, unsigned char *lps) {
+	unsigned char *text = enc->pending.params.lps;
 	uint8_t i = 0, len = 0;
 
+	begin_update(enc);
+
 	if (!lps[0]) {
-		memset(rds_data.lps, 0, LPS_LENGTH);
-		return;
+		memset(text, 0, LPS_LENGTH);
+		goto done;
 	}
 
-	rds_state.lps_update = 1;
-	memset(rds_data.lps, '\r', LPS_LENGTH);
+	enc->pending.lps_version++;
+	memset(text, '\r', LPS_LENGTH);
 	while (*lps != 0 && len < LPS_LENGTH)
-		rds_data.lps[len++] = *lps++;
+		text[len++] = *lps++;
 
 	if (len < LPS_LENGTH) {
-		rds_state.lps_segments = 0;
+		enc->pending.lps_segments = 0;
 
 		/* increment to allow adding an '\r' in all cases */
 		len++;
@@ -687,100 +1316,244 @@ void set_rds_lps(unsigned char *lps) {
 		/* find out how many segments are needed */
 		while (i < len) {
 			i += 4;
-			rds_state.lps_segments++;
+			enc->pending.lps_segments++;
 		}
 	} else {
 		/* default to 8 if LPS is 32 characters long */
-		rds_state.lps_segments = 8;
+		enc->pending.lps_segments = 8;
 	}
+
+done:
+	end_update(enc);
 }
 
-void set_rds_rtplus_flags(uint8_t flags) {
-	rtplus_cfg.running	= (flags & INT8_1) >> 1;
-	rtplus_cfg.toggle	= flags & INT8_0;
+static void set_rtplus_flags(struct rds_encoder_t *enc,
+	struct rds_rtplus_info_t *info, uint8_t flags) {
+	begin_update(enc);
+	info->running	= (flags & INT8_1) >> 1;
+	info->toggle	= flags & INT8_0;
+	end_update(enc);
 }
 
-void set_rds_rtplus_tags(uint8_t *tags) {
-	rtplus_cfg.type[0]	= tags[0] & INT8_L6;
-	rtplus_cfg.start[0]	= tags[1] & INT8_L6;
-	rtplus_cfg.len[0]	= tags[2] & INT8_L6;
-	rtplus_cfg.type[1]	= tags[3] & INT8_L6;
-	rtplus_cfg.start[1]	= tags[4] & INT8_L6;
-	rtplus_cfg.len[1]	= tags[5] & INT8_L5;
+static void set_rtplus_tags(struct rds_encoder_t *enc,
+	struct rds_rtplus_info_t *info, uint8_t *tags) {
+	begin_update(enc);
+	info->type[0]	= tags[0] & INT8_L6;
+	info->start[0]	= tags[1] & INT8_L6;
+	info->len[0]	= tags[2] & INT8_L6;
+	info->type[1]	= tags[3] & INT8_L6;
+	info->start[1]	= tags[4] & INT8_L6;
+	info->len[1]	= tags[5] & INT8_L5;
+	end_update(enc);
+}
+
+void set_rds_rtplus_flags(struct rds_encoder_t *enc, uint8_t flags) {
+	set_rtplus_flags(enc, &enc->pending.rtplus, flags);
+}
+
+void set_rds_rtplus_tags(struct rds_encoder_t *enc, uint8_t *tags) {
+	set_rtplus_tags(enc, &enc->pending.rtplus, tags);
 }
 
 /* eRT+ */
-void set_rds_ertplus_flags(uint8_t flags) {
-	ertplus_cfg.running	= (flags & INT8_1) >> 1;
-	ertplus_cfg.toggle	= flags & INT8_0;
+void set_rds_ertplus_flags(struct rds_encoder_t *enc, uint8_t flags) {
+	set_rtplus_flags(enc, &enc->pending.ertplus, flags);
 }
 
-void set_rds_ertplus_tags(uint8_t *tags) {
-	ertplus_cfg.type[0]	= tags[0] & INT8_L6;
-	ertplus_cfg.start[0]	= tags[1] & INT8_L6;
-	ertplus_cfg.len[0]	= tags[2] & INT8_L6;
-	ertplus_cfg.type[1]	= tags[3] & INT8_L6;
-	ertplus_cfg.start[1]	= tags[4] & INT8_L6;
-	ertplus_cfg.len[1]	= tags[5] & INT8_L5;
+void set_rds_ertplus_tags(struct rds_encoder_t *enc, uint8_t *tags) {
+	set_rtplus_tags(enc, &enc->pending.ertplus, tags);
 }
 
-void set_rds_af(struct rds_af_t new_af_list) {
-	memcpy(&rds_data.af, &new_af_list, sizeof(struct rds_af_t));
+void set_rds_af(struct rds_encoder_t *enc,
+	struct rds_af_t new_af_list) {
+	begin_update(enc);
+	memcpy(&enc->pending.params.af, &new_af_list, sizeof(struct rds_af_t));
+	end_update(enc);
 }
 
-void clear_rds_af() {
-	memset(&rds_data.af, 0, sizeof(struct rds_af_t));
+void clear_rds_af(struct rds_encoder_t *enc) {
+	begin_update(enc);
+	memset(&enc->pending.params.af, 0, sizeof(struct rds_af_t));
+	end_update(enc);
 }
 
-void set_rds_pty(uint8_t pty) {
-	rds_data.pty = pty & INT8_L5;
+void set_rds_pty(struct rds_encoder_t *enc, uint8_t pty) {
+	begin_update(enc);
+	enc->pending.params.pty = pty & INT8_L5;
+	end_update(enc);
 }
 
-void set_rds_ptyn(unsigned char *ptyn) {
+void set_rds_ptyn(struct rds_encoder_t *enc, unsigned char *ptyn) {
+	unsigned char *text = enc->pending.params.ptyn;
 	uint8_t len = 0;
 
+	begin_update(enc);
+
 	if (!ptyn[0]) {
-		memset(rds_data.ptyn, 0, PTYN_LENGTH);
-		return;
+		memset(text, 0, PTYN_LENGTH);
+		goto done;
 	}
 
-	rds_state.ptyn_update = 1;
-	memset(rds_data.ptyn, ' ', PTYN_LENGTH);
+	enc->pending.ptyn_version++;
+	memset(text, ' ', PTYN_LENGTH);
 	while (*ptyn != 0 && len < PTYN_LENGTH)
-		rds_data.ptyn[len++] = *ptyn++;
+		text[len++] = *ptyn++;
+
+done:
+	end_update(enc);
+}
+
+void set_rds_ta(struct rds_encoder_t *enc, uint8_t ta) {
+	begin_update(enc);
+	enc->pending.params.ta = ta & INT8_0;
+	end_update(enc);
 }
 
-void set_rds_ta(uint8_t ta) {
-	rds_data.ta = ta & INT8_0;
+void set_rds_tp(struct rds_encoder_t *enc, uint8_t tp) {
+	begin_update(enc);
+	enc->pending.params.tp = tp & INT8_0;
+	end_update(enc);
 }
 
-void set_rds_tp(uint8_t tp) {
-	rds_data.tp = tp & INT8_0;
+void set_rds_ms(struct rds_encoder_t *enc, uint8_t ms) {
+	begin_update(enc);
+	enc->pending.params.ms = ms & INT8_0;
+	end_update(enc);
 }
 
-void set_rds_ms(uint8_t ms) {
-	rds_data.ms = ms & INT8_0;
+void set_rds_di(struct rds_encoder_t *enc, uint8_t di) {
+	begin_update(enc);
+	enc->pending.params.di = di & INT8_L4;
+	end_update(enc);
 }
 
-void set_rds_di(uint8_t di) {
-	rds_data.di = di & INT8_L4;
+void set_rds_ct(struct rds_encoder_t *enc, uint8_t ct) {
+	begin_update(enc);
+	enc->pending.params.tx_ctime = ct & INT8_0;
+	end_update(enc);
 }
 
-void set_rds_ct(uint8_t ct) {
-	rds_data.tx_ctime = ct & INT8_0;
+/*
+ * How long a group takes to get on air, in ms
+ *
+ * CT is sent early by as much so that it is heard at the start of
+ * the minute. Takes effect from the next minute.
+ */
+void set_rds_ct_latency(struct rds_encoder_t *enc, uint16_t ms) {
+	begin_update(enc);
+	enc->pending.ct_latency = ms;
+	end_update(enc);
+}
+
+/* follow the wall clock (live output) or only count the groups */
+void set_rds_ct_live(struct rds_encoder_t *enc, uint8_t live) {
+	begin_update(enc);
+	enc->pending.ct_live = live;
+	end_update(enc);
+}
+
+/*
+ * Set how often a group is sent
+ *
+ * Once every interval groups, or in the groups left over if it is 0.
+ * Returns -1 if the encoder doesn't make that group or all intervals
+ * together would need more groups than there are. The groups taken
+ * by CT count, and so does at least some room for the fill sources
+ * if there are any.
+ */
+int set_rds_group_interval(struct rds_encoder_t *enc, uint8_t group,
+	uint8_t interval) {
+	int8_t i = find_group_source(group);
+	uint8_t *intervals = enc->pending.intervals;
+	uint8_t old;
+	double load = 0.0;
+	bool fill = false;
+	int r = 0;
+
+	if (i < 0) return -1;
+
+	begin_update(enc);
+
+	old = intervals[i];
+	intervals[i] = interval;
+	for (uint8_t j = 0; j < NUM_GROUP_SOURCES; j++) {
+		if (intervals[j]) {
+			load += 1.0 / intervals[j];
+		} else {
+			fill = true;
+		}
+	}
+
+	/* CT can be turned on at any time, keep its group a minute */
+	load += GROUP_TIME / 60;
+
+	/* the fill sources need some groups left over too */
+	if (fill ? load >= 1.0 : load > 1.0) {
+		intervals[i] = old;
+		r = -1;
+	} else {
+		enc->pending.sched_version++;
+	}
+
+	end_update(enc);
+	return r;
 }
 
-void get_rds_params_copy(struct rds_params_t *out) {
-	memcpy(out, &rds_data, sizeof(struct rds_params_t));
+/*
+ * Read-back functions
+ *
+ * These return what was last published, which is what the
+ * encoder will be using from the next group on
+ */
+void get_rds_params_copy(struct rds_encoder_t *enc,
+	struct rds_params_t *out) {
+	struct rds_snapshot_t snap;
+
+	read_snapshot(enc, &snap);
+	memcpy(out, &snap.params, sizeof(struct rds_params_t));
+}
+
+void get_rds_rtplus_info(struct rds_encoder_t *enc,
+	struct rds_rtplus_info_t *out) {
+	struct rds_snapshot_t snap;
+
+	read_snapshot(enc, &snap);
+	memcpy(out, &snap.rtplus, sizeof(struct rds_rtplus_info_t));
+}
+
+/* The interval of a group, -1 if the encoder doesn't make it */
+int get_rds_group_interval(struct rds_encoder_t *enc, uint8_t group) {
+	struct rds_snapshot_t snap;
+	int8_t i = find_group_source(group);
+
+	if (i < 0) return -1;
+	read_snapshot(enc, &snap);
+	return snap.intervals[i];
+}
+
+/*
+ * Change counter for status displays
+ *
+ * Moves whenever new parameters are published or the PS on air
+ * changes, so a display only has to be redrawn when it does.
+ */
+uint32_t get_rds_change_count(struct rds_encoder_t *enc) {
+	return atomic_load_explicit(&enc->snapshot_seq, memory_order_acquire)
+		+ atomic_load_explicit(&enc->on_air_changes,
+			memory_order_acquire);
+}
+
+/* The PS being sent right now (PS_LENGTH chars) */
+void get_rds_ps_on_air(struct rds_encoder_t *enc, unsigned char *ps) {
+	uint64_t packed = atomic_load_explicit(&enc->ps_on_air,
+		memory_order_relaxed);
+
+	memcpy(ps, &packed, PS_LENGTH);
 }
 
-void get_rds_rtplus_info(struct rds_rtplus_info_t *out) {
-	out->running = rtplus_cfg.running;
-	out->toggle = rtplus_cfg.toggle;
-	out->type[0] = rtplus_cfg.type[0];
-	out->start[0] = rtplus_cfg.start[0];
-	out->len[0] = rtplus_cfg.len[0];
-	out->type[1] = rtplus_cfg.type[1];
-	out->start[1] = rtplus_cfg.start[1];
-	out->len[1] = rtplus_cfg.len[1];
+/* How many groups of each type have gone out (NUM_GROUP_CODES) */
+void get_rds_group_mix(struct rds_encoder_t *enc, uint64_t *counts) {
+	for (uint8_t i = 0; i < NUM_GROUP_CODES; i++)
+		counts[i] = atomic_load_explicit(&enc->group_mix[i],
+			memory_order_relaxed);
 }
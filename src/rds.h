@@ -27,7 +27,8 @@
 #define BLOCK_SIZE		16
 
 #define GROUP_LENGTH		4
-#define BITS_PER_GROUP		(GROUP_LENGTH * (BLOCK_SIZE + POLY_DEG))
+#define BITS_PER_BLOCK		(BLOCK_SIZE + POLY_DEG)
+#define BITS_PER_GROUP		(GROUP_LENGTH * BITS_PER_BLOCK)
 #define RDS_SAMPLE_RATE		190000
 #define SAMPLES_PER_BIT		160
 #define FILTER_SIZE		1120
@@ -42,6 +43,9 @@
 #define LPS_LENGTH	32
 #define ERT_LENGTH	128
 
+/* PS texts sent in turn, see set_rds_ps_list */
+#define MAX_PS_LIST	64
+
 /* AF list size
  *
  */
@@ -88,6 +92,15 @@ typedef struct rds_params_t {
 	/* eRT */
 	unsigned char ert[ERT_LENGTH];
 } rds_params_t;
+/* RT+ and eRT+ flags and tags */
+typedef struct rds_rtplus_info_t {
+	uint8_t running;
+	uint8_t toggle;
+	uint8_t type[2];
+	uint8_t start[2];
+	uint8_t len[2];
+} rds_rtplus_info_t;
+
 /* Here, the first member of the struct must be a scalar to avoid a
    warning on -Wmissing-braces with GCC < 4.8.3
    (bug: https://gcc.gnu.org/bugzilla/show_bug.cgi?id=53119)
@@ -161,6 +174,9 @@ typedef struct rds_params_t {
 #define GET_GROUP_TYPE(x)	((x >> 4) & 15)
 #define GET_GROUP_VER(x)	(x & 1) /* only check bit 0 */
 
+/* 5-bit group type codes as sent in block 2 (0A = 0 ... 15B = 31) */
+#define NUM_GROUP_CODES		32
+
 #define DI_STEREO	(1 << 0) /* 1 - Stereo */
 #define DI_AH		(1 << 1) /* 2 - Artificial Head */
 #define DI_COMPRESSED	(1 << 2) /* 4 - Compressed */
@@ -286,40 +302,54 @@ typedef struct rds_oda_t {
 #define ODA_AID_RFT	0xff7f
 #define ODA_AID_RFTPLUS	0xff80
 
-extern void init_rds_encoder(struct rds_params_t rds_params);
-extern void exit_rds_encoder();
-extern void get_rds_bits(uint8_t *bits);
-extern void set_rds_pi(uint16_t pi_code);
-extern void set_rds_ecc(uint8_t ecc);
-extern void set_rds_rt(unsigned char *rt);
-extern void set_rds_ps(unsigned char *ps);
-extern void set_rds_lps(unsigned char *lps);
-extern void set_rds_ert(unsigned char *ert);
-extern void set_rds_rtplus_flags(uint8_t flags);
-extern void set_rds_rtplus_tags(uint8_t *tags);
-extern void set_rds_ertplus_flags(uint8_t flags);
-extern void set_rds_ertplus_tags(uint8_t *tags);
-extern void set_rds_ta(uint8_t ta);
-extern void set_rds_pty(uint8_t pty);
-extern void set_rds_ptyn(unsigned char *ptyn);
-extern void set_rds_af(struct rds_af_t new_af_list);
-extern void clear_rds_af();
-extern void set_rds_tp(uint8_t tp);
-extern void set_rds_ms(uint8_t ms);
-extern void set_rds_ct(uint8_t ct);
-extern void set_rds_di(uint8_t di);
-extern float get_rds_sample(uint8_t stream_num);
+/* one station's encoder, see rds.c */
+typedef struct rds_encoder_t rds_encoder_t;
 
-/* Read-back functions for GUI monitor */
-extern void get_rds_params_copy(struct rds_params_t *out);
+extern struct rds_encoder_t *init_rds_encoder(struct rds_params_t rds_params);
+extern void exit_rds_encoder(struct rds_encoder_t *enc);
+extern void get_rds_bits(struct rds_encoder_t *enc, uint32_t *bits);
+#ifdef RDS2
+extern struct rds2_encoder_t *get_rds2_encoder(struct rds_encoder_t *enc);
+#endif
+extern void set_rds_pi(struct rds_encoder_t *enc, uint16_t pi_code);
+extern void set_rds_ecc(struct rds_encoder_t *enc, uint8_t ecc);
+extern void set_rds_rt(struct rds_encoder_t *enc, unsigned char *rt);
+extern void set_rds_ps(struct rds_encoder_t *enc, unsigned char *ps);
+extern void set_rds_ps_list(struct rds_encoder_t *enc,
+	const unsigned char *segments, uint8_t count, uint16_t hold_ms);
+extern void set_rds_lps(struct rds_encoder_t *enc, unsigned char *lps);
+extern void set_rds_ert(struct rds_encoder_t *enc, unsigned char *ert);
+extern void set_rds_rtplus_flags(struct rds_encoder_t *enc, uint8_t flags);
+extern void set_rds_rtplus_tags(struct rds_encoder_t *enc, uint8_t *tags);
+extern void set_rds_ertplus_flags(struct rds_encoder_t *enc, uint8_t flags);
+extern void set_rds_ertplus_tags(struct rds_encoder_t *enc, uint8_t *tags);
+extern void set_rds_ta(struct rds_encoder_t *enc, uint8_t ta);
+extern void set_rds_pty(struct rds_encoder_t *enc, uint8_t pty);
+extern void set_rds_ptyn(struct rds_encoder_t *enc, unsigned char *ptyn);
+extern void set_rds_af(struct rds_encoder_t *enc,
+	struct rds_af_t new_af_list);
+extern void clear_rds_af(struct rds_encoder_t *enc);
+extern void set_rds_tp(struct rds_encoder_t *enc, uint8_t tp);
+extern void set_rds_ms(struct rds_encoder_t *enc, uint8_t ms);
+extern void set_rds_ct(struct rds_encoder_t *enc, uint8_t ct);
+extern void set_rds_ct_latency(struct rds_encoder_t *enc, uint16_t ms);
+extern void set_rds_ct_live(struct rds_encoder_t *enc, uint8_t live);
+extern void set_rds_di(struct rds_encoder_t *enc, uint8_t di);
+extern void begin_rds_batch(struct rds_encoder_t *enc);
+extern void end_rds_batch(struct rds_encoder_t *enc);
+extern int set_rds_group_interval(struct rds_encoder_t *enc, uint8_t group,
+	uint8_t interval);
 
-struct rds_rtplus_info_t {
-	uint8_t running;
-	uint8_t toggle;
-	uint8_t type[2];
-	uint8_t start[2];
-	uint8_t len[2];
-};
-extern void get_rds_rtplus_info(struct rds_rtplus_info_t *out);
+/* Read-back functions for GUI monitor */
+extern void get_rds_params_copy(struct rds_encoder_t *enc,
+	struct rds_params_t *out);
+
+extern void get_rds_rtplus_info(struct rds_encoder_t *enc,
+	struct rds_rtplus_info_t *out);
+extern int get_rds_group_interval(struct rds_encoder_t *enc,
+	uint8_t group);
+extern void get_rds_group_mix(struct rds_encoder_t *enc, uint64_t *counts);
+extern uint32_t get_rds_change_count(struct rds_encoder_t *enc);
+extern void get_rds_ps_on_air(struct rds_encoder_t *enc, unsigned char *ps);
 
 #endif /* RDS_H */
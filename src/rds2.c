@@ -17,9 +17,14 @@
  */
 
 #include "common.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "rds.h"
 #include "rds2.h"
 #include "lib.h"
+#include "rft_source.h"
+#include "modulator.h"
 
 /*
  * RDS2-specific stuff
@@ -31,228 +36,308 @@
 /* fallback station logo */
 #include "rds2_image_data.c"
 
-/* station logo */
-static struct rft_t station_logo_stream;
-
-static void init_rft(struct rft_t *rft, uint8_t file_id,
-	bool usecrc, uint8_t crc_mode, char *file_path) {
-	uint32_t seg_counter = 0;
-	uint32_t crc_chunk_counter = 0;
-	uint16_t crc_chunk_size = 0;
-	FILE *image_file_hdlr;
-
-	rft->file_path = malloc(MAX_FILE_NAME_LEN + 1);
-	rft->file_path[MAX_FILE_NAME_LEN] = 0;
-	rft->file_data = malloc(MAX_IMAGE_LEN);
-	rft->crcs = malloc(MAX_CRC_CHUNK_ADDR * sizeof(uint16_t));
-
-	/* unused data must be padded with zeroes */
-	memset(rft->file_data, 0, MAX_IMAGE_LEN);
+/*
+ * Group sequence of a file
+ *
+ * Every RFT_SEQUENCE_LEN groups start with RFT_META_GROUPS groups of
+ * metadata (variants 0 and 1), the rest carry the file.
+ */
+#define RFT_SEQUENCE_LEN	50
+#define RFT_META_GROUPS		4
+
+/* RDS2 groups per second over all streams */
+#define RDS2_GROUPS_PER_SEC	((NUM_STREAMS - 1) * \
+	((double)RDS_BIT_RATE_NUM / RDS_BIT_RATE_DEN / BITS_PER_GROUP))
+
+/* RDS2 streams of one encoder */
+struct rds2_encoder_t {
+	/* RFT carousel, the first file is the station logo */
+	struct rft_t files[MAX_RFT_FILES];
+	uint8_t num_files;
+	/* file whose turn it is */
+	uint8_t cur_file;
+
+	/* the files are loaded on their own thread, see load_rds2_files */
+	atomic_flag loader_started;
+	bool loader_running;
+#ifdef _WIN32
+	HANDLE loader;
+#else
+	pthread_t loader;
+#endif
+	atomic_bool ready;
+};
 
-	strncpy(rft->file_path, file_path, MAX_FILE_NAME_LEN);
+/* the CRC chunk size (in groups) for a mode and file length */
+static uint16_t get_crc_chunk_size(uint8_t *crc_mode, size_t len) {
+	switch (*crc_mode) {
+	case RFT_CRC_MODE_16_GROUPS:
+		return 16;
 
-	/* open file in binary mode */
-	image_file_hdlr = fopen(file_path, "rb");
-	if (image_file_hdlr != NULL) {
-		fseek(image_file_hdlr, 0, SEEK_END);
-		rft->file_len = ftell(image_file_hdlr);
-		rewind(image_file_hdlr);
+	case RFT_CRC_MODE_32_GROUPS:
+		return 32;
 
-		/* image cannot be larger than 163840 bytes */
-		if (rft->file_len > MAX_IMAGE_LEN) {
-#ifdef RDS2_DEBUG
-			fprintf(stderr, "W: Image too large!\n");
-#endif
-			rft->file_len = MAX_IMAGE_LEN;
-		}
+	case RFT_CRC_MODE_64_GROUPS:
+		return 64;
 
-		/* copy image data to local buffer */
-		fread(rft->file_data, rft->file_len, 1, image_file_hdlr);
+	case RFT_CRC_MODE_128_GROUPS:
+		return 128;
 
-		fclose(image_file_hdlr);
-	} else { /* fallback in case file can't be read at startup */
-		rft->file_len = station_logo_len;
+	case RFT_CRC_MODE_256_GROUPS:
+		return 256;
 
-		if (rft->file_len > MAX_IMAGE_LEN) {
-			rft->file_len = MAX_IMAGE_LEN;
+	case RFT_CRC_MODE_RFU: /* reserved - use auto mode */
+	case RFT_CRC_MODE_AUTO:
+		if (len >= 81920) {
+			*crc_mode = RFT_CRC_MODE_64_GROUPS;
+			return 64;
+		} else if (len > 40960) {
+			*crc_mode = RFT_CRC_MODE_32_GROUPS;
+			return 32;
 		}
+		*crc_mode = RFT_CRC_MODE_16_GROUPS;
+		return 16;
 
-		memcpy(rft->file_data, station_logo, rft->file_len);
+	case RFT_CRC_MODE_ENTIRE_FILE:
+	default:
+		return 0;
 	}
+}
 
-	/* keep track of file lengths so we know when to toggle */
-	rft->prev_file_len = rft->file_len;
-	rft->channel = 0;
-	rft->file_id = file_id;
-	rft->toggle = 0;
-	rft->num_segs = 0;
-
-	/* determine how many segments we need */
-	while (seg_counter < rft->file_len) {
-		seg_counter += 5;
-		rft->num_segs++;
-	}
+/* length of a CRC chunk, the last one may have less bytes */
+static uint16_t get_chunk_len(const struct rft_file_t *file,
+	uint16_t chunk) {
+	if (chunk == file->num_crc_chunks - 1 && file->len % file->pkt_size)
+		return file->len % file->pkt_size;
+	return file->pkt_size;
+}
 
-	rft->use_crc = usecrc;
+/*
+ * Calculate the chunk CRCs
+ *
+ * Chunks that are the same as in the previous version of the file
+ * keep their CRC, so only the parts of the file that changed cost
+ * anything. Comparing the bytes is a lot cheaper than the CRC.
+ */
+static void calc_chunk_crcs(struct rft_file_t *file,
+	const struct rft_file_t *prev) {
+	uint16_t reused = 0;
+	uint16_t chunk_len;
+	size_t pos;
+
+	/* the chunks only line up if they are the same size */
+	if (prev && prev->pkt_size != file->pkt_size) prev = NULL;
+
+	for (uint16_t i = 0; i < file->num_crc_chunks; i++) {
+		pos = (size_t)i * file->pkt_size;
+		chunk_len = get_chunk_len(file, i);
+
+		if (prev && i < prev->num_crc_chunks &&
+			get_chunk_len(prev, i) == chunk_len &&
+			memcmp(prev->data + pos, file->data + pos,
+				chunk_len) == 0) {
+			file->crcs[i] = prev->crcs[i];
+			reused++;
+			continue;
+		}
 
-	/* if CRC is disabled exit early */
-	if (!rft->use_crc) {
-		rft->crc_mode = 0;
-		rft->num_crc_chunks = 1; /* only 1 */
-		rft->crcs[0] = 0x0000;
-		return;
+		file->crcs[i] = crc16(file->data + pos, chunk_len);
 	}
 
-	rft->crc_mode = crc_mode & 7;
-
-	switch (rft->crc_mode) {
-	case RFT_CRC_MODE_ENTIRE_FILE:
-		/* no-op */
-		break;
+#ifdef RDS2_DEBUG
+	fprintf(stderr, "RFT: %u of %u chunk CRCs unchanged\n",
+		reused, file->num_crc_chunks);
+#else
+	(void)reused;
+#endif
+}
 
-	case RFT_CRC_MODE_16_GROUPS:
-		crc_chunk_size = 16;
-		break;
+/*
+ * Build a version of a file: segments and CRCs
+ *
+ * prev is the version before it (if any), for reusing its CRCs.
+ * Returns NULL if out of memory
+ */
+static struct rft_file_t *build_rft_file(struct rft_t *rft,
+	const unsigned char *data, size_t len,
+	const struct rft_file_t *prev) {
+	struct rft_file_t *file;
+	uint16_t crc_chunk_size = 0;
+	size_t buf_len;
 
-	case RFT_CRC_MODE_32_GROUPS:
-		crc_chunk_size = 32;
-		break;
+	file = calloc(1, sizeof(struct rft_file_t));
+	if (file == NULL) return NULL;
 
-	case RFT_CRC_MODE_64_GROUPS:
-		crc_chunk_size = 64;
-		break;
+	file->len = len;
 
-	case RFT_CRC_MODE_128_GROUPS:
-		crc_chunk_size = 128;
-		break;
+	/* determine how many segments we need */
+	file->num_segs = (len + 4) / 5;
 
-	case RFT_CRC_MODE_256_GROUPS:
-		crc_chunk_size = 256;
-		break;
+	if (rft->use_crc) {
+		file->crc_mode = rft->crc_mode & 7;
+		crc_chunk_size = get_crc_chunk_size(&file->crc_mode, len);
+	}
 
-	case RFT_CRC_MODE_RFU: /* reserved - use auto mode */
-	case RFT_CRC_MODE_AUTO:
-		if (rft->file_len >= 81920) {
-			crc_chunk_size = 64;
-			rft->crc_mode = RFT_CRC_MODE_64_GROUPS;
-		} else if (rft->file_len > 40960) {
-			crc_chunk_size = 32;
-			rft->crc_mode = RFT_CRC_MODE_32_GROUPS;
-		} else {
-			crc_chunk_size = 16;
-			rft->crc_mode = RFT_CRC_MODE_16_GROUPS;
+	if (crc_chunk_size) { /* chunked modes */
+		/*
+		 * There's only room for so many chunk addresses, so use
+		 * the next larger chunks if needed. Even a file of
+		 * MAX_IMAGE_LEN fits in 64 group chunks.
+		 */
+		while ((len + crc_chunk_size * 5 - 1) / (crc_chunk_size * 5) >
+			MAX_CRC_CHUNK_ADDR + 1 &&
+			file->crc_mode < RFT_CRC_MODE_256_GROUPS) {
+			crc_chunk_size *= 2;
+			file->crc_mode++;
 		}
-		break;
-	}
 
-	if (rft->crc_mode) { /* chunked modes */
 		/* RFT packet size = chunk size * 5 data bytes per group */
-		rft->pkt_size = crc_chunk_size * 5;
-
-		/* the remainder (if file size is not a multiple of pkt_size) */
-		rft->pkt_size_rem = rft->file_len % rft->pkt_size;
-
-		/* calculate number of CRC chunks */
-		while (crc_chunk_counter <= rft->file_len) {
-			crc_chunk_counter += rft->pkt_size;
-			rft->num_crc_chunks++;
-		}
+		file->pkt_size = crc_chunk_size * 5;
+		file->num_crc_chunks = (len + file->pkt_size - 1) /
+			file->pkt_size;
+	} else {
+		file->num_crc_chunks = 1; /* only 1 */
+	}
 
-		rft->crc_chunks = malloc(rft->pkt_size);
-
-		/* calculate CRC's for chunks */
-		for (uint16_t i = 0; i < rft->num_crc_chunks; i++) {
-			memset(rft->crc_chunks, 0, rft->pkt_size);
-			memcpy(rft->crc_chunks,
-				rft->file_data + i * rft->pkt_size, rft->pkt_size);
-			if ((i == rft->num_crc_chunks - 1) && rft->pkt_size_rem) {
-				/* last chunk may have less bytes */
-				rft->crcs[i] = crc16(rft->crc_chunks, rft->pkt_size_rem);
-			} else {
-				rft->crcs[i] = crc16(rft->crc_chunks, rft->pkt_size);
-			}
-		}
+	/*
+	 * Unused data must be padded with zeroes. The data groups go
+	 * one segment past the end and the CRCs are over whole chunks.
+	 */
+	buf_len = (file->num_segs + 1) * 5;
+	if (buf_len < (size_t)file->num_crc_chunks * file->pkt_size)
+		buf_len = (size_t)file->num_crc_chunks * file->pkt_size;
+
+	file->data = calloc(buf_len, 1);
+	if (file->data == NULL) {
+		free(file);
+		return NULL;
+	}
+	memcpy(file->data, data, len);
 
-		free(rft->crc_chunks);
+	if (!rft->use_crc) {
+		/* no CRC */
+	} else if (crc_chunk_size) {
+		calc_chunk_crcs(file, prev);
 	} else { /* CRC of entire file */
-		rft->num_crc_chunks = 1; /* only 1 */
-		rft->crcs[0] = crc16(rft->file_data, rft->file_len);
+		file->crcs[0] = crc16(file->data, len);
 	}
+
+	return file;
 }
 
-static void update_rft(struct rft_t *rft) {
-	uint32_t seg_counter = 0;
-	FILE *image_file_hdlr;
+static void free_rft_file(struct rft_file_t *file) {
+	if (file == NULL) return;
+	free(file->data);
+	free(file);
+}
 
-	/* open file in binary mode */
-	image_file_hdlr = fopen(rft->file_path, "rb");
-	if (image_file_hdlr == NULL) {
+/*
+ * The file was read or has changed (on the watcher thread)
+ *
+ * The new version is picked up by the encoder once it has finished
+ * sending the current one.
+ */
+static void rft_file_changed(void *ctx, const unsigned char *data,
+	size_t len) {
+	struct rft_t *rft = ctx;
+	struct rft_file_t *file;
+
+	/* same contents, only touched */
+	if (rft->latest_file && rft->latest_file->len == len &&
+		memcmp(rft->latest_file->data, data, len) == 0)
 		return;
-	}
 
-	rft->prev_file_len = rft->file_len;
+	file = build_rft_file(rft, data, len, rft->latest_file);
+	if (file == NULL) return;
+	rft->latest_file = file;
 
-	/* update size field */
-	fseek(image_file_hdlr, 0, SEEK_END);
-	rft->file_len = ftell(image_file_hdlr);
-	rewind(image_file_hdlr);
+	/* drop a version that never got sent */
+	free_rft_file(atomic_exchange(&rft->next_file, file));
+}
 
-	/* file didn't change so return early */
-	if (rft->file_len == rft->prev_file_len) {
-		fclose(image_file_hdlr);
-		return;
-	}
+/* start sending the newest version of the file (at the end of one) */
+static void update_rft(struct rft_t *rft) {
+	struct rft_file_t *file;
 
-	/* image cannot be larger than 163840 bytes */
-	if (rft->file_len > MAX_IMAGE_LEN) {
-#ifdef RDS2_DEBUG
-		fprintf(stderr, "W: Image too large!\n");
-#endif
-		rft->file_len = MAX_IMAGE_LEN;
+	file = atomic_exchange(&rft->next_file, NULL);
+	if (file == NULL) return;
+
+	/* the first version of a file that wasn't there */
+	if (rft->file && ++rft->file_version == 8) {
+		rft->file_version = 0;
 	}
 
-	/* copy image data to local buffer */
-	fread(rft->file_data, rft->file_len, 1, image_file_hdlr);
+	free_rft_file(rft->file);
+	rft->file = file;
+	rft->crc_chunk_addr = 0;
+	atomic_store(&rft->sent_len, file->len);
+}
 
-	fclose(image_file_hdlr);
+/*
+ * Set up a file
+ *
+ * Nothing is read yet, that is left to load_rft. The path is copied.
+ * Returns -1 if out of memory
+ */
+static int init_rft(struct rft_t *rft, uint8_t file_id, uint8_t channel,
+	uint8_t share, bool usecrc, uint8_t crc_mode, const char *file_path,
+	const unsigned char *fallback, size_t fallback_len) {
+	rft->path = malloc(strlen(file_path) + 1);
+	if (rft->path == NULL) return -1;
+	strcpy(rft->path, file_path);
+
+	rft->channel = channel;
+	rft->share = share;
+	rft->file_id = file_id;
+	rft->toggle = 0;
+	rft->use_crc = usecrc;
+	rft->crc_mode = usecrc ? crc_mode & 7 : 0;
+	rft->fallback = fallback;
+	rft->fallback_len = fallback_len > MAX_IMAGE_LEN ?
+		MAX_IMAGE_LEN : fallback_len;
+	atomic_init(&rft->next_file, NULL);
+	atomic_init(&rft->sent_len, 0);
+	atomic_init(&rft->groups_sent, 0);
+
+	return 0;
+}
 
-	rft->num_segs = 0;
+/*
+ * Start a file
+ *
+ * Files that can't be read are sent once they appear. The fallback
+ * (if any) is sent until then. latest_file belongs to the watcher
+ * once it runs, so the fallback is put there before.
+ */
+static void load_rft(struct rft_t *rft) {
+	struct rft_file_t *fallback = NULL;
 
-	/* recalculate # of needed segments */
-	while (seg_counter < rft->file_len) {
-		seg_counter += 5;
-		rft->num_segs++;
+	if (rft->fallback) {
+		fallback = build_rft_file(rft, rft->fallback,
+			rft->fallback_len, NULL);
+		rft->latest_file = fallback;
 	}
 
-	if (rft->crc_mode) {
-		/* recalculate CRC's for chunks */
-		for (uint16_t i = 0; i < rft->num_crc_chunks; i++) {
-			memset(rft->crc_chunks, 0, rft->pkt_size);
-			memcpy(rft->crc_chunks,
-				rft->file_data + i * rft->pkt_size, rft->pkt_size);
-			if ((i == rft->num_crc_chunks - 1) && rft->pkt_size_rem) {
-				/* last chunk may have less bytes */
-				rft->crcs[i] = crc16(rft->crc_chunks, rft->pkt_size_rem);
-			} else {
-				rft->crcs[i] = crc16(rft->crc_chunks, rft->pkt_size);
-			}
-		}
-
-		free(rft->crc_chunks);
-	} else { /* CRC of entire file */
-		rft->num_crc_chunks = 1; /* only 1 */
-		rft->crcs[0] = crc16(rft->file_data, rft->file_len);
-	}
+	/* reads the file now if it's there */
+	rft->source = open_rft_source(rft->path, MAX_IMAGE_LEN,
+		rft_file_changed, rft);
+	rft->file = atomic_exchange(&rft->next_file, NULL);
 
-	if (++rft->file_version == 8) {
-		rft->file_version = 0;
+	/* the file can't be read (or is the fallback) */
+	if (rft->file == NULL) {
+		rft->file = fallback;
+	} else {
+		free_rft_file(fallback);
 	}
+	if (rft->file) atomic_store(&rft->sent_len, rft->file->len);
 }
 
 static void exit_rft(struct rft_t *rft) {
-	free(rft->file_data);
-	free(rft->file_path);
-	free(rft->crcs);
+	/* stop the watcher first */
+	if (rft->source) close_rft_source(rft->source);
+	free_rft_file(atomic_exchange(&rft->next_file, NULL));
+	free_rft_file(rft->file);
+	free(rft->path);
 }
 
 /*
@@ -279,9 +364,9 @@ static void get_rft_var_0_data_group(struct rft_t *rft, uint16_t *blocks) {
 	blocks[2] |= ((rft->use_crc ? 1 : 0) & INT8_L1) << 11; /* CRC */
 	blocks[2] |= (rft->file_version & INT8_L3) << 8; /* file version */
 	blocks[2] |= (rft->file_id & INT8_L6) << 2; /* file ID */
-	blocks[2] |= (rft->file_len & INT18_U2) >> 16;
+	blocks[2] |= (rft->file->len & INT18_U2) >> 16;
 
-	blocks[3] = rft->file_len & INT16_ALL;
+	blocks[3] = rft->file->len & INT16_ALL;
 }
 
 /*
@@ -305,14 +390,14 @@ static void get_rft_var_1_data_group(struct rft_t *rft, uint16_t *blocks) {
 	blocks[1] = ODA_AID_RFT;
 
 	blocks[2] = (1 & INT8_L4) << 12; /* variant code */
-	blocks[2] |= (rft->crc_mode & INT8_L3) << 9; /* CRC mode */
+	blocks[2] |= (rft->file->crc_mode & INT8_L3) << 9; /* CRC mode */
 	/* chunk address */
 	blocks[2] |= rft->crc_chunk_addr & INT16_L9;
 
 	/* CRC */
-	blocks[3] = rft->crcs[rft->crc_chunk_addr];
+	blocks[3] = rft->file->crcs[rft->crc_chunk_addr];
 
-	if (++rft->crc_chunk_addr > rft->num_crc_chunks) {
+	if (++rft->crc_chunk_addr == rft->file->num_crc_chunks) {
 #ifdef RDS2_DEBUG
 		fprintf(stderr, "File CRC sending complete\n");
 #endif
@@ -357,6 +442,8 @@ static void get_rft_var_2_15_data_group(struct rft_t *rft, uint16_t *blocks) {
  * - File data (5 bytes per group)
  */
 static void get_rft_file_data_group(struct rft_t *rft, uint16_t *blocks) {
+	const unsigned char *data;
+
 	/* function header */
 	blocks[0] = 2 << 12;
 	blocks[0] |= (rft->channel & INT8_L4) << 8; /* pipe number */
@@ -369,13 +456,14 @@ static void get_rft_file_data_group(struct rft_t *rft, uint16_t *blocks) {
 	blocks[1] = (rft->seg_addr_img & INT16_L8) << 8;
 
 	/* image data */
-	blocks[1] |= rft->file_data[rft->seg_addr_img * 5 + 0];
-	blocks[2] =  rft->file_data[rft->seg_addr_img * 5 + 1] << 8;
-	blocks[2] |= rft->file_data[rft->seg_addr_img * 5 + 2];
-	blocks[3] =  rft->file_data[rft->seg_addr_img * 5 + 3] << 8;
-	blocks[3] |= rft->file_data[rft->seg_addr_img * 5 + 4];
-
-	if (++rft->seg_addr_img > rft->num_segs) {
+	data = &rft->file->data[rft->seg_addr_img * 5];
+	blocks[1] |= data[0];
+	blocks[2] =  data[1] << 8;
+	blocks[2] |= data[2];
+	blocks[3] =  data[3] << 8;
+	blocks[3] |= data[4];
+
+	if (++rft->seg_addr_img > rft->file->num_segs) {
 #ifdef RDS2_DEBUG
 		fprintf(stderr, "File sending complete\n");
 #endif
@@ -385,43 +473,77 @@ static void get_rft_file_data_group(struct rft_t *rft, uint16_t *blocks) {
 	}
 }
 
-static void get_rft_stream(uint16_t *blocks) {
-	static uint8_t rft_state;
-
-	switch (rft_state) {
+static void get_rft_group(struct rft_t *rft, uint16_t *blocks) {
+	switch (rft->state) {
 		case 0:
-			get_rft_var_0_data_group(&station_logo_stream, blocks);
+			get_rft_var_0_data_group(rft, blocks);
 			break;
 		case 1:
-			get_rft_var_1_data_group(&station_logo_stream, blocks);
+			get_rft_var_1_data_group(rft, blocks);
 			break;
 		case 2:
-			get_rft_var_0_data_group(&station_logo_stream, blocks);
+			get_rft_var_0_data_group(rft, blocks);
 			break;
 		case 3:
-			get_rft_var_1_data_group(&station_logo_stream, blocks);
+			get_rft_var_1_data_group(rft, blocks);
 			break;
 
 		default:
-			get_rft_file_data_group(&station_logo_stream, blocks);
+			get_rft_file_data_group(rft, blocks);
 			break;
 	}
 
-	rft_state++;
-	if (rft_state == 50) rft_state = 0;
+	rft->state++;
+	if (rft->state == RFT_SEQUENCE_LEN) rft->state = 0;
+	atomic_fetch_add_explicit(&rft->groups_sent, 1, memory_order_relaxed);
+}
+
+/*
+ * RFT carousel
+ *
+ * Deficit round robin over the files: when a file's turn comes up
+ * its share is added to its deficit, and it sends that many groups
+ * in a row before the next file gets its turn. A file that has
+ * nothing to send yet gives its turn away, so its groups go to the
+ * others instead of being wasted.
+ *
+ * All RDS2 streams take their groups from here, so every file gets
+ * its share of each of them.
+ */
+static void get_rft_stream(struct rds2_encoder_t *enc, uint16_t *blocks) {
+	struct rft_t *rft;
+
+	for (;;) {
+		rft = &enc->files[enc->cur_file];
+
+		/* may have appeared since */
+		if (rft->file == NULL) update_rft(rft);
+
+		if (rft->file && rft->deficit) {
+			rft->deficit--;
+			get_rft_group(rft, blocks);
+			return;
+		}
+		rft->deficit = 0;
+
+		if (++enc->cur_file == enc->num_files) enc->cur_file = 0;
+		rft = &enc->files[enc->cur_file];
+		rft->deficit += rft->share;
+	}
 }
 
 /*
  * RDS 2 group sequence
  */
-static void get_rds2_group(uint8_t stream_num, uint16_t *blocks) {
+static void get_rds2_group(struct rds2_encoder_t *enc, uint8_t stream_num,
+	uint16_t *blocks) {
 
 	switch (stream_num) {
 	case 1:
 	case 2:
 	case 3:
 	default:
-		get_rft_stream(blocks);
+		get_rft_stream(enc, blocks);
 		break;
 	}
 
@@ -431,22 +553,189 @@ static void get_rds2_group(uint8_t stream_num, uint16_t *blocks) {
 #endif
 }
 
-void get_rds2_bits(uint8_t stream, uint8_t *bits) {
-	static uint16_t out_blocks[GROUP_LENGTH];
-	get_rds2_group(stream, out_blocks);
+void get_rds2_bits(struct rds2_encoder_t *enc, uint8_t stream,
+	uint32_t *bits) {
+	uint16_t out_blocks[GROUP_LENGTH];
+
+	if (!atomic_load_explicit(&enc->ready, memory_order_acquire)) {
+		start_rds2_encoder(enc);
+		/* nothing to send until the files are there */
+		memset(bits, 0, GROUP_LENGTH * sizeof(uint32_t));
+		return;
+	}
+
+	get_rds2_group(enc, stream, out_blocks);
 	add_checkwords(out_blocks, bits, true);
 }
 
-void init_rds2_encoder(char *station_logo_path) {
+struct rds2_encoder_t *init_rds2_encoder(char *station_logo_path) {
+	struct rds2_encoder_t *enc;
+
+	enc = calloc(1, sizeof(struct rds2_encoder_t));
+	if (enc == NULL) return NULL;
+	atomic_flag_clear(&enc->loader_started);
+	atomic_init(&enc->ready, false);
+
 	/* create a new stream for the station logo */
-	init_rft(&station_logo_stream,
+	if (init_rft(&enc->files[0],
 		0 /* file ID */,
+		0 /* channel */,
+		1 /* share */,
 		false /* don't use crc */,
 		RFT_CRC_MODE_AUTO,
-		station_logo_path
-	);
+		station_logo_path,
+		station_logo, station_logo_len
+	) < 0) {
+		free(enc);
+		return NULL;
+	}
+	enc->num_files = 1;
+
+	/* the logo has the first turn */
+	enc->files[0].deficit = enc->files[0].share;
+
+	return enc;
 }
 
-void exit_rds2_encoder() {
-	exit_rft(&station_logo_stream);
+/*
+ * Add a file to the carousel
+ *
+ * Must be called before the encoder is started. The share sets how
+ * many groups the file gets relative to the others (the logo has 1).
+ * These files are sent with chunk CRCs so that receivers can tell
+ * which parts of a large file they have to wait for again.
+ * Returns the file's index or -1 if the carousel is full
+ */
+int add_rds2_file(struct rds2_encoder_t *enc, uint8_t file_id,
+	uint8_t channel, uint8_t share, char *file_path) {
+	if (enc->num_files == MAX_RFT_FILES || share == 0) return -1;
+
+	if (init_rft(&enc->files[enc->num_files], file_id, channel, share,
+		true, RFT_CRC_MODE_AUTO, file_path, NULL, 0) < 0)
+		return -1;
+
+	return enc->num_files++;
+}
+
+/*
+ * Load the files of the carousel (on the loader thread)
+ *
+ * Reading the files and making their segments and CRCs is kept off
+ * the startup path, so the RDS stream can start right away. The RDS2
+ * streams are silent until everything is there.
+ */
+static void load_rds2_files(struct rds2_encoder_t *enc) {
+	for (uint8_t i = 0; i < enc->num_files; i++)
+		load_rft(&enc->files[i]);
+
+	atomic_store_explicit(&enc->ready, true, memory_order_release);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI loader_thread(LPVOID arg) {
+	load_rds2_files(arg);
+	return 0;
+}
+#else
+static void *loader_thread(void *arg) {
+	load_rds2_files(arg);
+	return NULL;
+}
+#endif
+
+/*
+ * Start loading the files
+ *
+ * Only the first call does anything. get_rds2_bits calls this too,
+ * so it is only needed to start earlier. If there is no thread the
+ * files are loaded right away.
+ */
+void start_rds2_encoder(struct rds2_encoder_t *enc) {
+	if (atomic_flag_test_and_set(&enc->loader_started)) return;
+
+#ifdef _WIN32
+	enc->loader = CreateThread(NULL, 0, loader_thread, enc, 0, NULL);
+	enc->loader_running = enc->loader != NULL;
+#else
+	enc->loader_running = pthread_create(&enc->loader, NULL,
+		loader_thread, enc) == 0;
+#endif
+	if (!enc->loader_running) load_rds2_files(enc);
+}
+
+/*
+ * Wait until the files are loaded
+ *
+ * Must be on the thread that started the encoder (or the only one
+ * using it).
+ */
+void wait_rds2_encoder(struct rds2_encoder_t *enc) {
+	start_rds2_encoder(enc);
+	if (!enc->loader_running) return;
+
+#ifdef _WIN32
+	WaitForSingleObject(enc->loader, INFINITE);
+	CloseHandle(enc->loader);
+#else
+	pthread_join(enc->loader, NULL);
+#endif
+	enc->loader_running = false;
+}
+
+uint8_t get_rds2_num_files(struct rds2_encoder_t *enc) {
+	return enc->num_files;
+}
+
+/*
+ * Expected delivery time of a file
+ *
+ * A pass over the file takes its segments plus the metadata groups.
+ * Every file is assumed to have data, so the times only get better
+ * while some are still missing. The time is 0 for those.
+ */
+int get_rft_file_info(struct rds2_encoder_t *enc, uint8_t file,
+	struct rft_file_info_t *info) {
+	struct rft_t *rft;
+	uint16_t total_share = 0;
+	double groups;
+
+	if (file >= enc->num_files) return -1;
+	rft = &enc->files[file];
+
+	for (uint8_t i = 0; i < enc->num_files; i++)
+		total_share += enc->files[i].share;
+
+	info->file_id = rft->file_id;
+	info->channel = rft->channel;
+	info->share = rft->share;
+	info->len = atomic_load(&rft->sent_len);
+	info->capacity = (float)rft->share / total_share;
+	info->groups = atomic_load_explicit(&rft->groups_sent,
+		memory_order_relaxed);
+
+	/* not there yet */
+	if (info->len == 0) {
+		info->delivery_time = 0.0f;
+		return 0;
+	}
+
+	/* segments and the segment past the end */
+	groups = (info->len + 4) / 5 + 1;
+	groups *= (double)RFT_SEQUENCE_LEN /
+		(RFT_SEQUENCE_LEN - RFT_META_GROUPS);
+	info->delivery_time = (float)(groups /
+		(RDS2_GROUPS_PER_SEC * info->capacity));
+
+	return 0;
+}
+
+void exit_rds2_encoder(struct rds2_encoder_t *enc) {
+	if (enc == NULL) return;
+
+	/* a file may still be loading */
+	if (enc->loader_running) wait_rds2_encoder(enc);
+
+	for (uint8_t i = 0; i < enc->num_files; i++)
+		exit_rft(&enc->files[i]);
+	free(enc);
 }
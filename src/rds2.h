@@ -16,6 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdatomic.h>
+
 typedef struct rds2_oda_t {
 	uint16_t aid;
 	uint8_t channel;
@@ -23,8 +25,8 @@ typedef struct rds2_oda_t {
 
 #define GET_RDS2_ODA_CHANNEL(x)	(x & INT8_L5)
 
-#define MAX_FILE_NAME_LEN	64 /* does not include terminating null char */
 #define MAX_IMAGE_LEN		163840
+#define MAX_RFT_FILES		8
 #define MAX_CRC_CHUNK_ADDR	511
 
 /* RFT CRC mode */
@@ -39,33 +41,90 @@ enum rft_crc_mode {
 	RFT_CRC_MODE_AUTO		/* automatic between 1-3 based on size */
 };
 
+/*
+ * One version of an RFT file
+ *
+ * Built by the file watcher and not changed after that, so it can be
+ * sent while the next version is being built.
+ */
+typedef struct rft_file_t {
+	/* padded with zeroes past the end of the file */
+	unsigned char *data;
+	size_t len;
+	uint16_t num_segs;
+
+	/* CRC chunk map */
+	uint8_t crc_mode;
+	uint16_t pkt_size; /* bytes per chunk, 0 for the entire file */
+	uint16_t num_crc_chunks;
+	uint16_t crcs[MAX_CRC_CHUNK_ADDR + 1];
+} rft_file_t;
+
 /* RDS2 File Transfer */
 typedef struct rft_t {
 	uint8_t channel;
 
-	char *file_path;
-	unsigned char *file_data;
-	size_t file_len;
-	size_t prev_file_len;
+	/* position in the group sequence of the file */
+	uint8_t state;
+
+	/* carousel share and groups left in this turn */
+	uint8_t share;
+	uint16_t deficit;
+
 	uint8_t file_version;
 	uint8_t file_id;
 	uint8_t variant_code;
 	uint8_t toggle;
 
-	uint16_t pkt_size;
-	uint16_t pkt_size_rem;
 	uint16_t seg_addr_img;
-	uint16_t num_segs;
 
-	/* CRC chunk map */
 	bool use_crc;
 	uint8_t crc_mode;
 	uint16_t crc_chunk_addr;
-	uint16_t num_crc_chunks;
-	uint8_t *crc_chunks;
-	uint16_t *crcs;
+
+	/* where the file is read from, and what is sent until then */
+	char *path;
+	const unsigned char *fallback;
+	size_t fallback_len;
+
+	/* the version being sent */
+	struct rft_file_t *file;
+	/* a newer version, swapped in when the current one is done */
+	_Atomic(struct rft_file_t *) next_file;
+	/* the newest version, only used by the watcher */
+	struct rft_file_t *latest_file;
+	struct rft_source_t *source;
+	/* length of the version being sent, for get_rft_file_info */
+	atomic_size_t sent_len;
+	/* groups sent so far, same */
+	atomic_uint_fast64_t groups_sent;
 } rft_t;
 
-extern void get_rds2_bits(uint8_t stream_num, uint8_t *bits);
-extern void init_rds2_encoder(char *station_logo_path);
-extern void exit_rds2_encoder();
+/* what a file gets from the carousel */
+typedef struct rft_file_info_t {
+	uint8_t file_id;
+	uint8_t channel;
+	uint8_t share;
+	size_t len;
+	/* share of the RDS2 groups */
+	float capacity;
+	/* seconds to send the whole file once */
+	float delivery_time;
+	/* groups sent so far */
+	uint64_t groups;
+} rft_file_info_t;
+
+/* RDS2 part of an encoder, see rds2.c */
+typedef struct rds2_encoder_t rds2_encoder_t;
+
+extern void get_rds2_bits(struct rds2_encoder_t *enc, uint8_t stream_num,
+	uint32_t *bits);
+extern struct rds2_encoder_t *init_rds2_encoder(char *station_logo_path);
+extern int add_rds2_file(struct rds2_encoder_t *enc, uint8_t file_id,
+	uint8_t channel, uint8_t share, char *file_path);
+extern void start_rds2_encoder(struct rds2_encoder_t *enc);
+extern void wait_rds2_encoder(struct rds2_encoder_t *enc);
+extern uint8_t get_rds2_num_files(struct rds2_encoder_t *enc);
+extern int get_rft_file_info(struct rds2_encoder_t *enc, uint8_t file,
+	struct rft_file_info_t *info);
+extern void exit_rds2_encoder(struct rds2_encoder_t *enc);
@@ -0,0 +1,591 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <stdatomic.h>
+#include "rds.h"
+#ifdef RDS2
+#include "rds2.h"
+#endif
+#include "osc.h"
+#include "mpx_simd.h"
+#include "modulator.h"
+#include "lib.h"
+#include "arena.h"
+#include "rds_decoder.h"
+
+/* samples mixed down at a time */
+#define DECODER_CHUNK		1024
+
+/* quarter bits a second */
+#define QUARTER_RATE		4750
+
+/* how fast the timing metric of each quarter forgets (1/64 a bit) */
+#define PHASE_DECAY		(1.0f / 64.0f)
+
+/* another quarter has to be this much better to take over */
+#define PHASE_HYSTERESIS	1.25f
+
+/* bad blocks in a row before sync is given up */
+#define SYNC_LOSS_BLOCKS	12
+
+/* offset word indexes (see offset_words in lib.c) */
+#define OFFSET_C		2
+#define OFFSET_C_PRIME		4
+
+/* 15-bit RFT segment addresses */
+#define DECODER_RFT_SEGS	(1 << 15)
+
+/* metadata of an RFT pipe packed into one word */
+#define RFT_META_SEEN		(1u << 31)
+#define RFT_META(id, ver, len)	(RFT_META_SEEN | (uint32_t)(id) << 21 | \
+	(uint32_t)(ver) << 18 | (uint32_t)(len))
+
+static const float stream_freqs[NUM_STREAMS] = {
+	57000.0f,
+#ifdef RDS2
+	66500.0f, 71250.0f, 76000.0f
+#endif
+};
+
+typedef struct decoder_stream_t {
+	/*
+	 * Mixing carrier
+	 *
+	 * cos + sin, which any of the four carrier phases the generator
+	 * uses comes through with the same gain. The polarity doesn't
+	 * matter since the bits are differentially coded.
+	 */
+	struct osc_t osc_cos;
+	struct osc_t osc_sin;
+
+	/* quarter bit filter, see rise and fall */
+	uint64_t quarter;
+	size_t pos;
+	size_t left;
+	float rise;
+	float fall;
+	float last_rise;
+	float sums[4];
+
+	/*
+	 * Symbol timing
+	 *
+	 * A biphase symbol is two quarters one way and two the other,
+	 * so the sum over the last four quarters (++--) peaks in
+	 * magnitude when they line up with a symbol. Each of the four
+	 * quarter phases keeps an average of it and the best one gets
+	 * the symbols.
+	 */
+	float energy[4];
+	uint8_t phase;
+	bool last_symbol;
+
+	/* block sync */
+	uint32_t reg;
+	bool in_sync;
+	uint8_t bits;
+	uint8_t next_block;
+	uint8_t bad_blocks;
+	uint8_t cand_bits;
+	uint8_t cand_next;
+	uint16_t cand_data;
+	uint16_t blocks[GROUP_LENGTH];
+	uint8_t good;
+
+	atomic_uint_fast64_t num_blocks;
+	atomic_uint_fast64_t num_errors;
+	atomic_uint_fast64_t num_groups;
+	atomic_uint_fast64_t sync_losses;
+	atomic_bool synced;
+} decoder_stream_t;
+
+#ifdef RDS2
+typedef struct decoder_pipe_t {
+	/* from the last metadata group, 0 if none yet */
+	uint32_t meta;
+	uint16_t num_segs;
+	uint16_t segs;
+	uint8_t have[DECODER_RFT_SEGS / 8];
+
+	/* for get_decoder_rft */
+	atomic_uint_fast32_t meta_out;
+	atomic_uint_fast32_t segs_out;
+} decoder_pipe_t;
+#endif
+
+typedef struct rds_decoder_t {
+	const struct mpx_kernels_t *kernels;
+	uint32_t sample_rate;
+
+	float carrier[DECODER_CHUNK];
+	float sine[DECODER_CHUNK];
+	float mixed[DECODER_CHUNK];
+
+	/*
+	 * Quarter bit filter
+	 *
+	 * Every quarter is summed once with weights rising from 0 to 1
+	 * and once with weights falling from 1 to 0. The falling sum of
+	 * one quarter and the rising sum of the one before make a
+	 * triangle two quarters wide. It still has a zero at every
+	 * multiple of 4750 Hz, and its sidelobes are half as high (in
+	 * dB) as those of a plain quarter sum, which keeps the top of
+	 * the stereo subcarrier out of the 57 kHz one.
+	 *
+	 * The quarters start half way into those of the generator, so
+	 * the triangles are centred on its quarters.
+	 */
+	float *rise;
+	float *fall;
+
+	struct decoder_stream_t streams[NUM_STREAMS];
+
+	/* what has been received of PS and RT */
+	unsigned char ps[PS_LENGTH];
+	unsigned char rt[RT_LENGTH];
+	uint8_t rt_ab;
+
+	/* the same for get_decoder_ps and get_decoder_rt */
+	atomic_uint_fast64_t ps_out;
+	atomic_uint_fast64_t rt_out[RT_LENGTH / 8];
+
+	atomic_uint_fast64_t group_mix[NUM_GROUP_CODES];
+
+#ifdef RDS2
+	struct decoder_pipe_t pipes[DECODER_RFT_PIPES];
+#endif
+} rds_decoder_t;
+
+/* first sample of a quarter bit (quarter 0 is half of one) */
+static inline uint64_t quarter_start(uint32_t sample_rate,
+	uint64_t quarter) {
+	if (quarter == 0) return 0;
+	return ((2 * quarter - 1) * sample_rate + 2 * QUARTER_RATE - 1) /
+		(2 * QUARTER_RATE);
+}
+
+/* make a text readable from other threads, 8 characters at a time */
+static void publish_text(atomic_uint_fast64_t *out,
+	const unsigned char *text, size_t len) {
+	uint64_t word;
+
+	for (size_t i = 0; i < len; i += 8) {
+		memcpy(&word, &text[i], 8);
+		atomic_store_explicit(&out[i / 8], word,
+			memory_order_relaxed);
+	}
+}
+
+struct rds_decoder_t *init_rds_decoder(uint32_t sample_rate) {
+	const size_t len = sample_rate / QUARTER_RATE + 1;
+	const size_t size = ARENA_SIZE(sizeof(struct rds_decoder_t));
+	const size_t ramp_size = ARENA_SIZE(len * sizeof(float));
+	const float quarter = (float)sample_rate / QUARTER_RATE;
+	struct rds_decoder_t *dec;
+	struct decoder_stream_t *st;
+	uint8_t *arena;
+
+	init_crc_tables();
+
+	arena = alloc_arena(size + 2 * ramp_size);
+	if (arena == NULL) return NULL;
+
+	dec = (struct rds_decoder_t *)arena;
+	dec->rise = (float *)(arena + size);
+	dec->fall = (float *)(arena + size + ramp_size);
+	for (size_t i = 0; i < len; i++) {
+		dec->rise[i] = (i + 0.5f) / quarter;
+		dec->fall[i] = 1.0f - dec->rise[i];
+	}
+
+	dec->kernels = mpx_select_kernels();
+	dec->sample_rate = sample_rate;
+
+	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+		st = &dec->streams[i];
+		if (osc_init(&st->osc_cos, sample_rate, stream_freqs[i]) < 0 ||
+			osc_init(&st->osc_sin, sample_rate,
+			stream_freqs[i]) < 0) {
+			exit_rds_decoder(dec);
+			return NULL;
+		}
+		st->left = quarter_start(sample_rate, 1);
+		st->cand_next = UINT8_MAX;
+	}
+
+	memset(dec->ps, ' ', PS_LENGTH);
+	memset(dec->rt, ' ', RT_LENGTH);
+	publish_text(&dec->ps_out, dec->ps, PS_LENGTH);
+	publish_text(dec->rt_out, dec->rt, RT_LENGTH);
+
+	return dec;
+}
+
+static void decode_rds_group(struct rds_decoder_t *dec,
+	const uint16_t *blocks) {
+	uint8_t code = blocks[1] >> 11;
+	uint8_t addr;
+	uint8_t ab;
+
+	atomic_fetch_add_explicit(&dec->group_mix[code], 1,
+		memory_order_relaxed);
+
+	switch (code >> 1) {
+	case 0:
+		addr = blocks[1] & INT8_L2;
+		dec->ps[addr * 2] = blocks[3] >> 8;
+		dec->ps[addr * 2 + 1] = blocks[3] & INT16_L8;
+		publish_text(&dec->ps_out, dec->ps, PS_LENGTH);
+		break;
+	case 2:
+		/* a new text clears what is there */
+		ab = (blocks[1] >> 4) & INT8_L1;
+		if (ab != dec->rt_ab) {
+			dec->rt_ab = ab;
+			memset(dec->rt, ' ', RT_LENGTH);
+		}
+
+		addr = blocks[1] & INT8_L4;
+		if (code & 1) {
+			dec->rt[addr * 2] = blocks[3] >> 8;
+			dec->rt[addr * 2 + 1] = blocks[3] & INT16_L8;
+		} else {
+			dec->rt[addr * 4] = blocks[2] >> 8;
+			dec->rt[addr * 4 + 1] = blocks[2] & INT16_L8;
+			dec->rt[addr * 4 + 2] = blocks[3] >> 8;
+			dec->rt[addr * 4 + 3] = blocks[3] & INT16_L8;
+		}
+		publish_text(dec->rt_out, dec->rt, RT_LENGTH);
+		break;
+	}
+}
+
+#ifdef RDS2
+static uint16_t count_segs(struct decoder_pipe_t *pipe, uint32_t num) {
+	uint16_t segs = 0;
+
+	for (uint32_t i = 0; i < num; i++)
+		segs += (pipe->have[i >> 3] >> (i & 7)) & 1;
+
+	return segs;
+}
+
+/* file metadata (variant 0) */
+static void decode_rft_meta(struct decoder_pipe_t *pipe,
+	const uint16_t *blocks) {
+	uint32_t meta;
+	uint32_t len;
+
+	/* only variant 0 says which file is being sent */
+	if (blocks[2] >> 12) return;
+
+	len = (blocks[2] & INT8_L2) << 16 | blocks[3];
+	meta = RFT_META((blocks[2] >> 2) & INT8_L6,
+		(blocks[2] >> 8) & INT8_L3, len);
+	if (meta == pipe->meta) return;
+
+	/* another file (or version): start again */
+	if (pipe->meta) memset(pipe->have, 0, sizeof(pipe->have));
+
+	pipe->meta = meta;
+	pipe->num_segs = (len + 4) / 5;
+	pipe->segs = count_segs(pipe, pipe->num_segs);
+	atomic_store_explicit(&pipe->meta_out, meta, memory_order_relaxed);
+	atomic_store_explicit(&pipe->segs_out, pipe->segs,
+		memory_order_relaxed);
+}
+
+static void decode_rft_data(struct decoder_pipe_t *pipe,
+	const uint16_t *blocks) {
+	uint16_t seg = (blocks[0] & INT16_L7) << 8 | blocks[1] >> 8;
+	uint8_t mask = 1 << (seg & 7);
+
+	if (pipe->have[seg >> 3] & mask) return;
+	pipe->have[seg >> 3] |= mask;
+
+	/* the last group only has padding */
+	if (pipe->meta && seg >= pipe->num_segs) return;
+
+	pipe->segs++;
+	atomic_store_explicit(&pipe->segs_out, pipe->segs,
+		memory_order_relaxed);
+}
+
+static void decode_rds2_group(struct rds_decoder_t *dec,
+	const uint16_t *blocks) {
+	/* function header */
+	switch (blocks[0] >> 12) {
+	case 2:
+		decode_rft_data(&dec->pipes[(blocks[0] >> 8) & INT8_L4],
+			blocks);
+		break;
+	case 8:
+		if (blocks[1] == ODA_AID_RFT)
+			decode_rft_meta(&dec->pipes[blocks[0] & INT8_L4],
+				blocks);
+		break;
+	}
+}
+#endif
+
+/*
+ * Take one bit of a stream
+ *
+ * Until a block is found it is checked at every bit. Sync needs two
+ * good blocks in the right order 26 bits apart, after that only every
+ * 26th bit is a block boundary, and sync is lost again after
+ * SYNC_LOSS_BLOCKS bad blocks in a row.
+ */
+static void decode_bit(struct rds_decoder_t *dec, uint8_t stream_num,
+	bool bit) {
+	struct decoder_stream_t *st = &dec->streams[stream_num];
+	uint8_t expected;
+	int8_t offset;
+	bool ok;
+
+	st->reg = (st->reg << 1 | bit) & 0x3ffffff;
+
+	if (!st->in_sync) {
+		if (st->cand_bits < UINT8_MAX) st->cand_bits++;
+
+		offset = get_block_offset(st->reg);
+		if (offset < 0) return;
+		if (offset == OFFSET_C_PRIME) offset = OFFSET_C;
+
+		if (st->cand_bits == BITS_PER_BLOCK &&
+			offset == st->cand_next) {
+			st->in_sync = true;
+			st->bits = 0;
+			st->bad_blocks = 0;
+			st->good = 0;
+			if (offset > 0) {
+				st->blocks[offset - 1] = st->cand_data;
+				st->good |= 1 << (offset - 1);
+			}
+			st->blocks[offset] = st->reg >> POLY_DEG;
+			st->good |= 1 << offset;
+			st->next_block = (offset + 1) % GROUP_LENGTH;
+			atomic_store_explicit(&st->synced, true,
+				memory_order_relaxed);
+			return;
+		}
+
+		st->cand_bits = 0;
+		st->cand_next = (offset + 1) % GROUP_LENGTH;
+		st->cand_data = st->reg >> POLY_DEG;
+		return;
+	}
+
+	if (++st->bits < BITS_PER_BLOCK) return;
+	st->bits = 0;
+
+	expected = st->next_block;
+	st->next_block = (expected + 1) % GROUP_LENGTH;
+	if (expected == 0) st->good = 0;
+
+	offset = get_block_offset(st->reg);
+	ok = offset == expected ||
+		(expected == OFFSET_C && offset == OFFSET_C_PRIME);
+
+	atomic_fetch_add_explicit(&st->num_blocks, 1, memory_order_relaxed);
+	if (ok) {
+		st->blocks[expected] = st->reg >> POLY_DEG;
+		st->good |= 1 << expected;
+		st->bad_blocks = 0;
+	} else {
+		atomic_fetch_add_explicit(&st->num_errors, 1,
+			memory_order_relaxed);
+		if (++st->bad_blocks == SYNC_LOSS_BLOCKS) {
+			st->in_sync = false;
+			st->cand_bits = 0;
+			st->cand_next = UINT8_MAX;
+			atomic_fetch_add_explicit(&st->sync_losses, 1,
+				memory_order_relaxed);
+			atomic_store_explicit(&st->synced, false,
+				memory_order_relaxed);
+			return;
+		}
+	}
+
+	if (expected != GROUP_LENGTH - 1 || st->good != 0x0f) return;
+
+	atomic_fetch_add_explicit(&st->num_groups, 1, memory_order_relaxed);
+#ifdef RDS2
+	if (stream_num) {
+		decode_rds2_group(dec, st->blocks);
+		return;
+	}
+#endif
+	decode_rds_group(dec, st->blocks);
+}
+
+/* a quarter bit has been summed */
+static void end_quarter(struct rds_decoder_t *dec, uint8_t stream_num) {
+	struct decoder_stream_t *st = &dec->streams[stream_num];
+	uint8_t q = st->quarter & 3;
+	uint8_t best = 0;
+	float d;
+	bool symbol;
+
+	st->sums[q] = st->last_rise + st->fall;
+	st->last_rise = st->rise;
+	st->rise = 0.0f;
+	st->fall = 0.0f;
+	st->pos = 0;
+
+	/* the quarters before this one are at q + 1, q + 2 and q + 3 */
+	d = st->sums[(q + 1) & 3] + st->sums[(q + 2) & 3]
+		- st->sums[(q + 3) & 3] - st->sums[q];
+	st->energy[q] += fabsf(d) - st->energy[q] * PHASE_DECAY;
+
+	st->quarter++;
+	st->left = quarter_start(dec->sample_rate, st->quarter + 1) -
+		quarter_start(dec->sample_rate, st->quarter);
+
+	if (q != st->phase) return;
+
+	symbol = d > 0.0f;
+	decode_bit(dec, stream_num, symbol ^ st->last_symbol);
+	st->last_symbol = symbol;
+
+	for (uint8_t i = 1; i < 4; i++)
+		if (st->energy[i] > st->energy[best]) best = i;
+	if (st->energy[best] > st->energy[st->phase] * PHASE_HYSTERESIS)
+		st->phase = best;
+}
+
+/* mixed down samples of a stream */
+static void integrate(struct rds_decoder_t *dec, uint8_t stream_num,
+	const float *mixed, size_t n) {
+	struct decoder_stream_t *st = &dec->streams[stream_num];
+	size_t len;
+
+	while (n) {
+		len = st->left < n ? st->left : n;
+		st->rise += dec->kernels->dot(mixed, &dec->rise[st->pos], len);
+		st->fall += dec->kernels->dot(mixed, &dec->fall[st->pos], len);
+		st->pos += len;
+		st->left -= len;
+		mixed += len;
+		n -= len;
+		if (st->left == 0) end_quarter(dec, stream_num);
+	}
+}
+
+/*
+ * Decode a block of MPX
+ *
+ * Must get every block the generator makes from the first one on,
+ * since the oscillators here are only in phase with its carriers if
+ * both started at the same time.
+ */
+void decode_rds_mpx(struct rds_decoder_t *dec, const float *mpx,
+	size_t n) {
+	struct decoder_stream_t *st;
+	size_t len;
+
+	for (size_t done = 0; done < n; done += len) {
+		len = n - done;
+		if (len > DECODER_CHUNK) len = DECODER_CHUNK;
+
+		for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+			st = &dec->streams[i];
+			osc_get_cos_block(&st->osc_cos, dec->carrier, len);
+			osc_get_sin_block(&st->osc_sin, dec->sine, len);
+			dec->kernels->add(dec->carrier, dec->sine, len);
+			dec->kernels->mul(dec->mixed, &mpx[done], dec->carrier,
+				1.0f, len);
+			integrate(dec, i, dec->mixed, len);
+		}
+	}
+}
+
+void get_decoder_counts(struct rds_decoder_t *dec, uint8_t stream_num,
+	struct decoder_counts_t *counts) {
+	struct decoder_stream_t *st = &dec->streams[stream_num];
+
+	counts->blocks = atomic_load_explicit(&st->num_blocks,
+		memory_order_relaxed);
+	counts->errors = atomic_load_explicit(&st->num_errors,
+		memory_order_relaxed);
+	counts->groups = atomic_load_explicit(&st->num_groups,
+		memory_order_relaxed);
+	counts->sync_losses = atomic_load_explicit(&st->sync_losses,
+		memory_order_relaxed);
+	counts->in_sync = atomic_load_explicit(&st->synced,
+		memory_order_relaxed);
+}
+
+/* Groups received of each type (NUM_GROUP_CODES) */
+void get_decoder_group_mix(struct rds_decoder_t *dec, uint64_t *counts) {
+	for (uint8_t i = 0; i < NUM_GROUP_CODES; i++) {
+		counts[i] = atomic_load_explicit(&dec->group_mix[i],
+			memory_order_relaxed);
+	}
+}
+
+static void read_text(atomic_uint_fast64_t *in, char *text, size_t len) {
+	uint64_t word;
+
+	for (size_t i = 0; i < len; i += 8) {
+		word = atomic_load_explicit(&in[i / 8], memory_order_relaxed);
+		memcpy(&text[i], &word, 8);
+	}
+	text[len] = 0;
+}
+
+/* PS as received so far (PS_LENGTH + 1 bytes) */
+void get_decoder_ps(struct rds_decoder_t *dec, char *ps) {
+	read_text(&dec->ps_out, ps, PS_LENGTH);
+}
+
+/* RT as received so far, up to the end of text (RT_LENGTH + 1 bytes) */
+void get_decoder_rt(struct rds_decoder_t *dec, char *rt) {
+	char *end;
+
+	read_text(dec->rt_out, rt, RT_LENGTH);
+	end = memchr(rt, '\r', RT_LENGTH);
+	if (end) *end = 0;
+}
+
+#ifdef RDS2
+void get_decoder_rft(struct rds_decoder_t *dec, uint8_t pipe,
+	struct decoder_rft_t *rft) {
+	uint32_t meta = atomic_load_explicit(&dec->pipes[pipe].meta_out,
+		memory_order_relaxed);
+
+	rft->seen = meta & RFT_META_SEEN;
+	rft->file_id = (meta >> 21) & INT8_L6;
+	rft->version = (meta >> 18) & INT8_L3;
+	rft->len = meta & 0x3ffff;
+	rft->num_segs = (rft->len + 4) / 5;
+	rft->segs = atomic_load_explicit(&dec->pipes[pipe].segs_out,
+		memory_order_relaxed);
+}
+#endif
+
+void exit_rds_decoder(struct rds_decoder_t *dec) {
+	if (dec == NULL) return;
+
+	for (uint8_t i = 0; i < NUM_STREAMS; i++) {
+		osc_exit(&dec->streams[i].osc_cos);
+		osc_exit(&dec->streams[i].osc_sin);
+	}
+	free_arena(dec);
+}
@@ -0,0 +1,77 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loopback RDS decoder
+ *
+ * Decodes the MPX a station has just generated, so a running encoder
+ * can check its own output: the block error rate of every stream, the
+ * group mix and PS/RT as a receiver sees them, and how much of each
+ * RFT file has come through. It runs on the thread that renders the
+ * station, after the block is made. The results are relaxed atomics
+ * that the STATS command and the Prometheus endpoint read.
+ *
+ * The subcarriers are known, so there is no carrier recovery. Each
+ * one is mixed down with the generator's oscillator tables and then
+ * summed over quarter bits (1/4750 s), which all the carriers are
+ * whole periods of, so the other subcarriers and the pilot cancel
+ * out. The rest works on the 4750 quarter sums a second.
+ */
+
+/* RFT pipes per station */
+#define DECODER_RFT_PIPES	16
+
+typedef struct rds_decoder_t rds_decoder_t;
+
+/* one stream */
+typedef struct decoder_counts_t {
+	/* blocks checked while in sync and how many of them were bad */
+	uint64_t blocks;
+	uint64_t errors;
+	/* groups with all their blocks good */
+	uint64_t groups;
+	uint64_t sync_losses;
+	bool in_sync;
+} decoder_counts_t;
+
+/* one RFT pipe */
+typedef struct decoder_rft_t {
+	/* false until the file metadata has been seen */
+	bool seen;
+	uint8_t file_id;
+	uint8_t version;
+	uint32_t len;
+	/* segments received out of num_segs */
+	uint16_t segs;
+	uint16_t num_segs;
+} decoder_rft_t;
+
+extern struct rds_decoder_t *init_rds_decoder(uint32_t sample_rate);
+extern void decode_rds_mpx(struct rds_decoder_t *dec, const float *mpx,
+	size_t n);
+extern void get_decoder_counts(struct rds_decoder_t *dec,
+	uint8_t stream_num, struct decoder_counts_t *counts);
+extern void get_decoder_group_mix(struct rds_decoder_t *dec,
+	uint64_t *counts);
+extern void get_decoder_ps(struct rds_decoder_t *dec, char *ps);
+extern void get_decoder_rt(struct rds_decoder_t *dec, char *rt);
+#ifdef RDS2
+extern void get_decoder_rft(struct rds_decoder_t *dec, uint8_t pipe,
+	struct decoder_rft_t *rft);
+#endif
+extern void exit_rds_decoder(struct rds_decoder_t *dec);
@@ -0,0 +1,208 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "convert.h"
+#include "render.h"
+
+#ifdef _WIN32
+  #include <fcntl.h>
+#endif
+
+/*
+ * Offline rendering
+ *
+ * Writes the output to a WAV file, a raw file or stdout ("-")
+ * instead of the sound card, in the sample format and channels of
+ * the sink. Output is a .wav file if the name ends in ".wav", raw
+ * samples otherwise.
+ */
+
+/* frames converted per fwrite */
+#define RENDER_BLOCK_FRAMES	8192
+
+/* stdio buffer size */
+#define RENDER_FILE_BUFFER	(1 << 20)
+
+/* WAV format tags */
+#define WAVE_FORMAT_PCM		1
+#define WAVE_FORMAT_IEEE_FLOAT	3
+
+#define WAV_HEADER_SIZE		44
+
+struct render_t {
+	FILE *file;
+	uint32_t rate;
+	uint8_t sample_fmt;
+	uint8_t channels;
+	uint8_t bytes;
+	bool wav;
+	uint64_t data_bytes;
+	struct converter_t *conv;
+	uint8_t *buf;
+};
+
+static inline uint8_t *put_le16(uint8_t *p, uint16_t v) {
+	p[0] = v & 255;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static inline uint8_t *put_le32(uint8_t *p, uint32_t v) {
+	p[0] = v & 255;
+	p[1] = (v >> 8) & 255;
+	p[2] = (v >> 16) & 255;
+	p[3] = v >> 24;
+	return p + 4;
+}
+
+/* RIFF header for the given data size (capped at the 32-bit limit) */
+static void write_wav_header(struct render_t *r, uint64_t data_size) {
+	uint8_t header[WAV_HEADER_SIZE];
+	uint8_t *p = header;
+	uint32_t size;
+
+	if (data_size > UINT32_MAX - (WAV_HEADER_SIZE - 8))
+		data_size = UINT32_MAX - (WAV_HEADER_SIZE - 8);
+	size = (uint32_t)data_size;
+
+	memcpy(p, "RIFF", 4); p += 4;
+	p = put_le32(p, size + WAV_HEADER_SIZE - 8);
+	memcpy(p, "WAVE", 4); p += 4;
+
+	memcpy(p, "fmt ", 4); p += 4;
+	p = put_le32(p, 16);
+	p = put_le16(p, r->sample_fmt == SAMPLE_FMT_F32 ?
+		WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM);
+	p = put_le16(p, r->channels);
+	p = put_le32(p, r->rate);
+	p = put_le32(p, r->rate * r->channels * r->bytes);
+	p = put_le16(p, r->channels * r->bytes);
+	p = put_le16(p, r->bytes * 8);
+
+	memcpy(p, "data", 4); p += 4;
+	put_le32(p, size);
+
+	fwrite(header, 1, WAV_HEADER_SIZE, r->file);
+}
+
+/*
+ * Open an output file
+ *
+ * Returns NULL on failure
+ */
+struct render_t *open_render_file(char *filename,
+	const struct sink_format_t *fmt, uint32_t rate) {
+	struct sink_format_t le = *fmt;
+	struct render_t *r;
+	size_t len = strlen(filename);
+
+	r = calloc(1, sizeof(struct render_t));
+	if (r == NULL) return NULL;
+
+	r->sample_fmt = fmt->sample_fmt;
+	r->channels = fmt->channels;
+	r->bytes = get_sample_size(fmt->sample_fmt);
+	r->rate = rate;
+
+	/* WAV files are little-endian */
+	le.big_endian = false;
+	r->conv = init_converter(&le);
+	if (r->conv == NULL) goto fail;
+
+	if (strcmp(filename, "-") == 0) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		r->file = stdout;
+		r->wav = false;
+	} else {
+		r->file = fopen(filename, "wb");
+		if (r->file == NULL) goto fail;
+		r->wav = len > 4 &&
+			strcasecmp(filename + len - 4, ".wav") == 0;
+	}
+
+	r->buf = malloc(RENDER_BLOCK_FRAMES * get_sink_frame_size(r->conv));
+	if (r->buf == NULL) goto fail;
+
+	setvbuf(r->file, NULL, _IOFBF, RENDER_FILE_BUFFER);
+
+	/* sizes are filled in when the file is closed */
+	if (r->wav) write_wav_header(r, 0);
+
+	return r;
+
+fail:
+	if (r->file != NULL && r->file != stdout) fclose(r->file);
+	exit_converter(r->conv);
+	free(r);
+	return NULL;
+}
+
+/*
+ * Write MPX frames
+ *
+ * Returns -1 if the output can't be written anymore
+ */
+int write_render_frames(struct render_t *r, const float *in,
+	size_t frames) {
+	size_t chunk, bytes;
+
+	while (frames) {
+		chunk = frames;
+		if (chunk > RENDER_BLOCK_FRAMES) chunk = RENDER_BLOCK_FRAMES;
+
+		convert_frames(r->conv, in, r->buf, chunk);
+
+		bytes = chunk * get_sink_frame_size(r->conv);
+		if (fwrite(r->buf, 1, bytes, r->file) != bytes) return -1;
+
+		r->data_bytes += bytes;
+		in += chunk;
+		frames -= chunk;
+	}
+
+	return 0;
+}
+
+void close_render_file(struct render_t *r) {
+	if (r == NULL) return;
+
+	if (r->wav) {
+		if (r->data_bytes > UINT32_MAX - (WAV_HEADER_SIZE - 8)) {
+			fprintf(stderr, "Warning: WAV data exceeds 4 GiB, "
+				"the header sizes are capped.\n");
+		}
+
+		/* go back and fill in the sizes */
+		fflush(r->file);
+		if (fseek(r->file, 0, SEEK_SET) == 0)
+			write_wav_header(r, r->data_bytes);
+	}
+
+	if (r->file == stdout) {
+		fflush(r->file);
+	} else {
+		fclose(r->file);
+	}
+
+	exit_converter(r->conv);
+	free(r->buf);
+	free(r);
+}
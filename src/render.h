@@ -0,0 +1,28 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+typedef struct render_t render_t;
+
+/* see convert.h */
+struct sink_format_t;
+
+extern struct render_t *open_render_file(char *filename,
+	const struct sink_format_t *fmt, uint32_t rate);
+extern int write_render_frames(struct render_t *r, const float *in,
+	size_t frames);
+extern void close_render_file(struct render_t *r);
@@ -0,0 +1,454 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#ifndef _WIN32
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <pthread.h>
+  #include <sys/types.h>
+  #include <sys/stat.h>
+  #ifdef __linux__
+    #define RFT_INOTIFY
+    #include <sys/inotify.h>
+  #endif
+#endif
+
+#include "rft_source.h"
+
+struct rft_source_t {
+	char *path;
+	char *dir;
+	const char *name; /* file name part of path */
+
+	size_t max_len;
+	rft_source_cb_t cb;
+	void *ctx;
+
+#ifdef _WIN32
+	HANDLE thread;
+	HANDLE wake;
+	HANDLE dir_handle;
+	OVERLAPPED olap;
+	DWORD notify_buf[1024];
+	WCHAR wname[MAX_PATH];
+#else
+	pthread_t thread;
+	int wake_pipe[2];
+#ifdef RFT_INOTIFY
+	int inotify_fd;
+	int wd;
+#endif
+	/* last seen state of the file, for polling */
+	bool exists;
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+#endif
+};
+
+/*
+ * Read the file and pass its contents to the callback
+ *
+ * The file is copied into memory first: a mapping of it would fault
+ * if the writer truncated it while we look at it. Empty and
+ * unreadable files are ignored, as they are most likely still being
+ * written.
+ */
+static int load_file(struct rft_source_t *src) {
+#ifdef _WIN32
+	HANDLE file;
+	LARGE_INTEGER size;
+	unsigned char *data;
+	size_t len, got = 0;
+	DWORD bytes;
+
+	file = CreateFileA(src->path, GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return -1;
+
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return -1;
+	}
+	len = (size_t)size.QuadPart;
+	if ((uint64_t)size.QuadPart > src->max_len) len = src->max_len;
+
+	data = malloc(len);
+	if (data == NULL) {
+		CloseHandle(file);
+		return -1;
+	}
+
+	/* it may have become shorter since */
+	while (got < len && ReadFile(file, data + got, (DWORD)(len - got),
+		&bytes, NULL) && bytes)
+		got += bytes;
+	CloseHandle(file);
+
+	if (got) src->cb(src->ctx, data, got);
+
+	free(data);
+	return got ? 0 : -1;
+#else
+	struct stat st;
+	unsigned char *data;
+	size_t len, got = 0;
+	ssize_t bytes;
+	int fd;
+
+	fd = open(src->path, O_RDONLY);
+	if (fd == -1) return -1;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	len = (size_t)st.st_size;
+	if (len > src->max_len) len = src->max_len;
+
+	data = malloc(len);
+	if (data == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	/* it may have become shorter since */
+	while (got < len) {
+		bytes = read(fd, data + got, len - got);
+		if (bytes == -1 && errno == EINTR) continue;
+		if (bytes <= 0) break;
+		got += (size_t)bytes;
+	}
+	close(fd);
+
+	src->exists = true;
+	src->mtime = st.st_mtime;
+	src->size = st.st_size;
+	src->ino = st.st_ino;
+
+	if (got) src->cb(src->ctx, data, got);
+
+	free(data);
+	return got ? 0 : -1;
+#endif
+}
+
+#ifdef _WIN32
+/* (re)start reading the directory's changes */
+static int watch_dir(struct rft_source_t *src) {
+	ResetEvent(src->olap.hEvent);
+	if (!ReadDirectoryChangesW(src->dir_handle, src->notify_buf,
+		sizeof(src->notify_buf), FALSE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE |
+		FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &src->olap, NULL))
+		return -1;
+	return 0;
+}
+
+static int open_dir_watch(struct rft_source_t *src) {
+	src->dir_handle = CreateFileA(src->dir, FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (src->dir_handle == INVALID_HANDLE_VALUE) return -1;
+
+	if (watch_dir(src) < 0) {
+		CloseHandle(src->dir_handle);
+		src->dir_handle = INVALID_HANDLE_VALUE;
+		return -1;
+	}
+	return 0;
+}
+
+static void close_dir_watch(struct rft_source_t *src) {
+	if (src->dir_handle == INVALID_HANDLE_VALUE) return;
+	CancelIo(src->dir_handle);
+	CloseHandle(src->dir_handle);
+	src->dir_handle = INVALID_HANDLE_VALUE;
+}
+
+/* see if any of the changes are to our file */
+static bool check_changes(struct rft_source_t *src, DWORD bytes) {
+	FILE_NOTIFY_INFORMATION *info;
+	unsigned char *p = (unsigned char *)src->notify_buf;
+	size_t name_len = wcslen(src->wname);
+
+	/* the buffer overflowed so we don't know */
+	if (bytes == 0) return true;
+
+	for (;;) {
+		info = (FILE_NOTIFY_INFORMATION *)p;
+		if (info->FileNameLength / sizeof(WCHAR) == name_len &&
+			_wcsnicmp(info->FileName, src->wname, name_len) == 0)
+			return true;
+		if (info->NextEntryOffset == 0) break;
+		p += info->NextEntryOffset;
+	}
+	return false;
+}
+
+static DWORD WINAPI watch_thread(LPVOID arg) {
+	struct rft_source_t *src = arg;
+	HANDLE handles[2];
+	DWORD num_handles, ret, bytes;
+	bool changed;
+
+	for (;;) {
+		changed = false;
+
+		/* the directory may not be there yet */
+		if (src->dir_handle == INVALID_HANDLE_VALUE &&
+			open_dir_watch(src) == 0)
+			changed = true;
+
+		handles[0] = src->wake;
+		num_handles = 1;
+		if (src->dir_handle != INVALID_HANDLE_VALUE)
+			handles[num_handles++] = src->olap.hEvent;
+
+		ret = WaitForMultipleObjects(num_handles, handles, FALSE,
+			num_handles == 2 ? INFINITE : 1000);
+		if (ret == WAIT_OBJECT_0) break;
+
+		if (ret == WAIT_OBJECT_0 + 1) {
+			if (GetOverlappedResult(src->dir_handle, &src->olap,
+				&bytes, FALSE)) {
+				if (check_changes(src, bytes)) changed = true;
+				if (watch_dir(src) < 0) close_dir_watch(src);
+			} else {
+				/* the directory is gone */
+				close_dir_watch(src);
+			}
+		}
+
+		if (changed) load_file(src);
+	}
+
+	return 0;
+}
+#else
+#ifdef RFT_INOTIFY
+static void add_watch(struct rft_source_t *src) {
+	src->wd = inotify_add_watch(src->inotify_fd, src->dir,
+		IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+
+/* see if any of the events are for our file */
+static bool read_events(struct rft_source_t *src) {
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct inotify_event *ev;
+	bool changed = false;
+	ssize_t len;
+
+	while ((len = read(src->inotify_fd, u.buf, sizeof(u.buf))) > 0) {
+		for (char *p = u.buf; p < u.buf + len;
+			p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			/* the directory was removed */
+			if (ev->mask & IN_IGNORED) src->wd = -1;
+
+			if (ev->len && strcmp(ev->name, src->name) == 0)
+				changed = true;
+		}
+	}
+
+	return changed;
+}
+#endif
+
+/* check the file's time and size when there are no notifications */
+static bool poll_file(struct rft_source_t *src) {
+	struct stat st;
+
+	if (stat(src->path, &st) == -1) {
+		src->exists = false;
+		return false;
+	}
+
+	return !src->exists || st.st_mtime != src->mtime ||
+		st.st_size != src->size || st.st_ino != src->ino;
+}
+
+static void *watch_thread(void *arg) {
+	struct rft_source_t *src = arg;
+	struct pollfd fds[2];
+	int timeout;
+	bool changed;
+
+	fds[0].fd = src->wake_pipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = -1;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		changed = false;
+		timeout = 1000;
+
+#ifdef RFT_INOTIFY
+		if (src->inotify_fd != -1) {
+			/* the directory may not be there yet */
+			if (src->wd == -1) {
+				add_watch(src);
+				if (src->wd != -1) changed = true;
+			}
+			fds[1].fd = src->inotify_fd;
+			if (src->wd != -1) timeout = -1;
+		}
+#endif
+
+		if (poll(fds, 2, timeout) == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[0].revents) break;
+
+#ifdef RFT_INOTIFY
+		if (fds[1].revents & POLLIN && read_events(src))
+			changed = true;
+#endif
+		if (timeout != -1 && poll_file(src)) changed = true;
+
+		if (changed) load_file(src);
+	}
+
+	return NULL;
+}
+#endif
+
+static void free_source(struct rft_source_t *src) {
+#ifdef _WIN32
+	close_dir_watch(src);
+	if (src->olap.hEvent) CloseHandle(src->olap.hEvent);
+	if (src->wake) CloseHandle(src->wake);
+#else
+	if (src->wake_pipe[0] != -1) close(src->wake_pipe[0]);
+	if (src->wake_pipe[1] != -1) close(src->wake_pipe[1]);
+#ifdef RFT_INOTIFY
+	if (src->inotify_fd != -1) close(src->inotify_fd);
+#endif
+#endif
+	free(src->path);
+	free(src->dir);
+	free(src);
+}
+
+/*
+ * Open a file and start watching it
+ *
+ * The callback is called with the current contents before this
+ * returns, unless the file can't be read yet. Returns NULL on failure
+ */
+struct rft_source_t *open_rft_source(const char *path, size_t max_len,
+	rft_source_cb_t cb, void *ctx) {
+	struct rft_source_t *src;
+	const char *sep = NULL;
+	size_t dir_len;
+
+	src = calloc(1, sizeof(struct rft_source_t));
+	if (src == NULL) return NULL;
+
+	src->max_len = max_len;
+	src->cb = cb;
+	src->ctx = ctx;
+#ifdef _WIN32
+	src->dir_handle = INVALID_HANDLE_VALUE;
+#else
+	src->wake_pipe[0] = src->wake_pipe[1] = -1;
+#ifdef RFT_INOTIFY
+	src->inotify_fd = src->wd = -1;
+#endif
+#endif
+
+	/* split into directory and file name */
+	for (const char *p = path; *p; p++) {
+#ifdef _WIN32
+		if (*p == '\\' || *p == '/') sep = p;
+#else
+		if (*p == '/') sep = p;
+#endif
+	}
+	dir_len = sep ? (size_t)(sep - path) : 1;
+	if (sep == path) dir_len = 1; /* root */
+
+	src->path = malloc(strlen(path) + 1);
+	src->dir = malloc(dir_len + 1);
+	if (src->path == NULL || src->dir == NULL) goto fail;
+	strcpy(src->path, path);
+	if (sep) {
+		memcpy(src->dir, path, dir_len);
+	} else {
+		src->dir[0] = '.';
+	}
+	src->dir[dir_len] = 0;
+	src->name = sep ? src->path + (sep - path) + 1 : src->path;
+
+	/* start watching before the first read so nothing is missed */
+#ifdef _WIN32
+	if (MultiByteToWideChar(CP_ACP, 0, src->name, -1, src->wname,
+		MAX_PATH) == 0)
+		goto fail;
+	src->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	src->olap.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (src->wake == NULL || src->olap.hEvent == NULL) goto fail;
+	open_dir_watch(src);
+#else
+	if (pipe(src->wake_pipe) == -1) goto fail;
+#ifdef RFT_INOTIFY
+	src->inotify_fd = inotify_init1(IN_NONBLOCK);
+	if (src->inotify_fd != -1) add_watch(src);
+#endif
+#endif
+
+	load_file(src);
+
+#ifdef _WIN32
+	src->thread = CreateThread(NULL, 0, watch_thread, src, 0, NULL);
+	if (src->thread == NULL) goto fail;
+#else
+	if (pthread_create(&src->thread, NULL, watch_thread, src) != 0)
+		goto fail;
+#endif
+
+	return src;
+
+fail:
+	free_source(src);
+	return NULL;
+}
+
+void close_rft_source(struct rft_source_t *src) {
+#ifdef _WIN32
+	SetEvent(src->wake);
+	WaitForSingleObject(src->thread, INFINITE);
+	CloseHandle(src->thread);
+#else
+	/* the watcher sees the pipe hang up, this can't fail */
+	close(src->wake_pipe[1]);
+	src->wake_pipe[1] = -1;
+	pthread_join(src->thread, NULL);
+#endif
+	free_source(src);
+}
@@ -0,0 +1,42 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * RFT file source
+ *
+ * Reads a file into memory and hands its contents to a callback, then
+ * watches the file and does the same every time it changes. The
+ * callback runs on the watcher thread, so reading the file and any
+ * work done on it stays out of the audio path.
+ *
+ * Changes are picked up with inotify on Linux and
+ * ReadDirectoryChangesW on Windows. The directory is watched rather
+ * than the file so that files replaced by a rename, or created after
+ * the source was opened, are seen too. Other systems check the file
+ * every second.
+ */
+
+/* called with the (at most max_len) bytes of the file */
+typedef void (*rft_source_cb_t)(void *ctx, const unsigned char *data,
+	size_t len);
+
+typedef struct rft_source_t rft_source_t;
+
+extern struct rft_source_t *open_rft_source(const char *path,
+	size_t max_len, rft_source_cb_t cb, void *ctx);
+extern void close_rft_source(struct rft_source_t *src);
@@ -0,0 +1,581 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* for sendmmsg() and CLOCK_TAI */
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+  typedef SOCKET rtp_socket_t;
+  #define NO_SOCKET	INVALID_SOCKET
+  #define close_socket	closesocket
+#else
+  #include <errno.h>
+  #include <netdb.h>
+  #include <sys/socket.h>
+  #include <sys/uio.h>
+  #include <netinet/in.h>
+  typedef int rtp_socket_t;
+  #define NO_SOCKET	-1
+  #define close_socket	close
+#endif
+
+#include "audio_ring.h"
+#include "convert.h"
+#include "rtp_out.h"
+
+#define RTP_VERSION		2
+#define RTP_PAYLOAD_TYPE	96
+#define RTP_HEADER_SIZE		12
+
+/* AES67 packet time, shortened for rates that would not fit */
+#define RTP_PACKET_US		1000
+#define RTP_MAX_PAYLOAD		1440
+
+/*
+ * Packets per wake-up and send call
+ *
+ * Each batch goes out when its first packet is due, so receivers see
+ * packets up to RTP_BATCH - 1 packet times early. A sender that fell
+ * behind catches up with up to RTP_MAX_BATCH at a time.
+ */
+#define RTP_BATCH		4
+#define RTP_MAX_BATCH		32
+
+#define RTP_MULTICAST_TTL	16
+
+/* Expedited Forwarding, as AES67 asks for media */
+#define RTP_DSCP		46
+
+#define NS			1000000000u
+
+struct rtp_output_t {
+	rtp_socket_t fd;
+
+	/* for the SDP */
+	char host[64];
+	char local[64];
+	uint16_t port;
+	bool ipv6;
+	bool multicast;
+
+	uint32_t rate;
+	uint8_t bits;
+	uint8_t channels;
+	struct converter_t *conv;
+	size_t frame_size;
+	size_t packet_frames;
+
+	uint32_t ssrc;
+	uint16_t seq;
+	uint32_t ts;
+
+	/* packet k is due packet_frames * k frames after start_ns */
+	uint64_t start_ns;
+	uint64_t sent;
+
+	uint8_t hdr[RTP_MAX_BATCH][RTP_HEADER_SIZE];
+	uint8_t silence[RTP_MAX_PAYLOAD];
+#ifdef _WIN32
+	HANDLE timer;
+	WSABUF iov[RTP_MAX_BATCH][3];
+	DWORD iov_len[RTP_MAX_BATCH];
+#else
+	struct iovec iov[RTP_MAX_BATCH][3];
+	struct msghdr msg[RTP_MAX_BATCH];
+#ifdef __linux__
+	struct mmsghdr mmsg[RTP_MAX_BATCH];
+#endif
+#endif
+};
+
+/* clock the packets are paced with */
+static uint64_t monotonic_ns() {
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * NS +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * NS /
+		(uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * Media clock
+ *
+ * AES67 timestamps count samples since the PTP epoch, which is TAI.
+ * Where there is no TAI clock, UTC is the closest we have.
+ */
+static uint32_t media_clock(uint32_t rate) {
+	struct timespec ts;
+
+#ifdef CLOCK_TAI
+	clock_gettime(CLOCK_TAI, &ts);
+#else
+	timespec_get(&ts, TIME_UTC);
+#endif
+	return (uint32_t)((uint64_t)ts.tv_sec * rate +
+		(uint64_t)ts.tv_nsec * rate / NS);
+}
+
+static void sleep_until(struct rtp_output_t *rtp, uint64_t deadline) {
+	uint64_t now = monotonic_ns();
+#ifdef _WIN32
+	LARGE_INTEGER due;
+
+	if (now >= deadline) return;
+
+	/* relative, in 100 ns units */
+	due.QuadPart = -(LONGLONG)((deadline - now) / 100);
+	if (rtp->timer && SetWaitableTimer(rtp->timer, &due, 0,
+		NULL, NULL, FALSE)) {
+		WaitForSingleObject(rtp->timer, INFINITE);
+	} else {
+		Sleep((DWORD)((deadline - now) / 1000000));
+	}
+#elif defined(TIMER_ABSTIME)
+	struct timespec ts;
+
+	(void)rtp;
+	if (now >= deadline) return;
+	ts.tv_sec = (time_t)(deadline / NS);
+	ts.tv_nsec = (long)(deadline % NS);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+		NULL) == EINTR);
+#else
+	struct timespec ts;
+
+	(void)rtp;
+	if (now >= deadline) return;
+	ts.tv_sec = (time_t)((deadline - now) / NS);
+	ts.tv_nsec = (long)((deadline - now) % NS);
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/*
+ * Split "host:port", "host" or "[v6 host]:port"
+ *
+ * Returns the port, 0 if it is invalid
+ */
+static uint16_t parse_dest(const char *dest, char *host, size_t size) {
+	const char *end, *colon;
+	unsigned long port = RTP_DEFAULT_PORT;
+	size_t len;
+
+	if (dest[0] == '[') {
+		dest++;
+		end = strchr(dest, ']');
+		if (end == NULL) return 0;
+		colon = end[1] == ':' ? end + 1 : NULL;
+		if (end[1] && colon == NULL) return 0;
+	} else {
+		/* more than one colon is a bare IPv6 address */
+		colon = strchr(dest, ':');
+		if (colon && strchr(colon + 1, ':')) colon = NULL;
+		end = colon ? colon : dest + strlen(dest);
+	}
+
+	if (colon) port = strtoul(colon + 1, NULL, 10);
+	if (port == 0 || port > UINT16_MAX) return 0;
+
+	len = (size_t)(end - dest);
+	if (len == 0 || len >= size) return 0;
+	memcpy(host, dest, len);
+	host[len] = 0;
+
+	return (uint16_t)port;
+}
+
+static bool is_multicast(const struct sockaddr *sa) {
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *in = (const void *)sa;
+
+		return (ntohl(in->sin_addr.s_addr) >> 28) == 14;
+	}
+	return ((const struct sockaddr_in6 *)(const void *)sa)
+		->sin6_addr.s6_addr[0] == 0xff;
+}
+
+/* make the socket and point it at the receiver */
+static int open_socket(struct rtp_output_t *rtp) {
+	struct addrinfo hints, *ai;
+	struct sockaddr_storage local;
+	socklen_t local_len = sizeof(local);
+	char port[8];
+	int ttl = RTP_MULTICAST_TTL;
+	int tos = RTP_DSCP << 2;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	snprintf(port, sizeof(port), "%u", rtp->port);
+
+	if (getaddrinfo(rtp->host, port, &hints, &ai) != 0) {
+		fprintf(stderr, "Unknown RTP destination %s.\n", rtp->host);
+		return -1;
+	}
+
+	rtp->fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+	if (rtp->fd == NO_SOCKET) goto fail;
+
+	rtp->ipv6 = ai->ai_family == AF_INET6;
+	rtp->multicast = is_multicast(ai->ai_addr);
+	if (rtp->ipv6) {
+		setsockopt(rtp->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+			(const char *)&ttl, sizeof(ttl));
+	} else {
+		setsockopt(rtp->fd, IPPROTO_IP, IP_MULTICAST_TTL,
+			(const char *)&ttl, sizeof(ttl));
+		setsockopt(rtp->fd, IPPROTO_IP, IP_TOS,
+			(const char *)&tos, sizeof(tos));
+	}
+
+	/* a connected socket needs no address per packet */
+	if (connect(rtp->fd, ai->ai_addr, (socklen_t)ai->ai_addrlen) != 0)
+		goto fail;
+
+	/* the address we send from, for the SDP */
+	if (getsockname(rtp->fd, (struct sockaddr *)&local,
+		&local_len) != 0 ||
+		getnameinfo((struct sockaddr *)&local, local_len,
+		rtp->local, sizeof(rtp->local), NULL, 0,
+		NI_NUMERICHOST) != 0) {
+		snprintf(rtp->local, sizeof(rtp->local), "%s",
+			rtp->ipv6 ? "::" : "0.0.0.0");
+	}
+
+	freeaddrinfo(ai);
+	return 0;
+
+fail:
+	fprintf(stderr, "Could not open an RTP socket to %s port %u.\n",
+		rtp->host, rtp->port);
+	freeaddrinfo(ai);
+	return -1;
+}
+
+/*
+ * Open the RTP output of a station
+ *
+ * Station n sends to the port of dest plus 2 * (n - 1), keeping the
+ * odd ports free for RTCP. The samples are s16 (L16) or s24 (L24),
+ * always big-endian. Returns NULL on failure.
+ */
+struct rtp_output_t *open_rtp_output(const char *dest, uint8_t id,
+	uint32_t rate, const struct sink_format_t *fmt) {
+	struct sink_format_t net = *fmt;
+	struct rtp_output_t *rtp;
+	uint32_t port;
+
+	rtp = calloc(1, sizeof(struct rtp_output_t));
+	if (rtp == NULL) return NULL;
+	rtp->fd = NO_SOCKET;
+
+	port = parse_dest(dest, rtp->host, sizeof(rtp->host));
+	if (port) port += 2u * (id - 1);
+	if (port == 0 || port > UINT16_MAX) {
+		fprintf(stderr, "Invalid RTP destination %s.\n", dest);
+		goto fail;
+	}
+	rtp->port = (uint16_t)port;
+
+	if (open_socket(rtp) < 0) goto fail;
+
+	net.big_endian = true;
+	rtp->conv = init_converter(&net);
+	if (rtp->conv == NULL) goto fail;
+
+	rtp->rate = rate;
+	rtp->bits = get_sample_size(fmt->sample_fmt) * 8;
+	rtp->channels = fmt->channels;
+	rtp->frame_size = get_sink_frame_size(rtp->conv);
+	rtp->packet_frames = (size_t)rate * RTP_PACKET_US / 1000000;
+	while (rtp->packet_frames * rtp->frame_size > RTP_MAX_PAYLOAD)
+		rtp->packet_frames /= 2;
+
+	/* random enough to tell the stations and runs apart */
+	rtp->ssrc = media_clock(NS) ^ (id * 0x9e3779b9u);
+	rtp->seq = (uint16_t)(rtp->ssrc >> 16);
+
+#ifdef _WIN32
+	rtp->timer = CreateWaitableTimerA(NULL, TRUE, NULL);
+#endif
+
+	return rtp;
+
+fail:
+	close_rtp_output(rtp);
+	return NULL;
+}
+
+void close_rtp_output(struct rtp_output_t *rtp) {
+	if (rtp == NULL) return;
+	if (rtp->fd != NO_SOCKET) close_socket(rtp->fd);
+#ifdef _WIN32
+	if (rtp->timer) CloseHandle(rtp->timer);
+#endif
+	exit_converter(rtp->conv);
+	free(rtp);
+}
+
+/* bytes per frame in the ring */
+size_t get_rtp_frame_size(struct rtp_output_t *rtp) {
+	return rtp->frame_size;
+}
+
+/*
+ * Queue a block of MPX for sending
+ *
+ * Packs it straight into the free space of the ring. Returns the
+ * frames that fit.
+ */
+size_t write_rtp_frames(struct rtp_output_t *rtp,
+	struct audio_ring_t *ring, const float *mpx, size_t frames) {
+	return convert_into_ring(rtp->conv, ring, mpx, frames);
+}
+
+/* when packet k is due */
+static uint64_t packet_time(struct rtp_output_t *rtp, uint64_t k) {
+	uint64_t frames = k * rtp->packet_frames;
+
+	return rtp->start_ns + frames / rtp->rate * NS +
+		frames % rtp->rate * NS / rtp->rate;
+}
+
+/* packets due by now */
+static uint64_t packets_due(struct rtp_output_t *rtp, uint64_t now) {
+	uint64_t elapsed = now > rtp->start_ns ? now - rtp->start_ns : 0;
+	uint64_t frames = elapsed / NS * rtp->rate +
+		elapsed % NS * rtp->rate / NS;
+
+	return frames / rtp->packet_frames + 1;
+}
+
+/* starts the packet clock, with the first packet due now */
+void start_rtp_clock(struct rtp_output_t *rtp) {
+	rtp->ts = media_clock(rtp->rate);
+	rtp->start_ns = monotonic_ns();
+	rtp->sent = 0;
+}
+
+/*
+ * Sleep until the next batch is due
+ *
+ * Returns how late we woke up (ns)
+ */
+uint64_t wait_rtp_batch(struct rtp_output_t *rtp) {
+	uint64_t deadline = packet_time(rtp, rtp->sent);
+	uint64_t now;
+
+	sleep_until(rtp, deadline);
+
+	now = monotonic_ns();
+	return now > deadline ? now - deadline : 0;
+}
+
+static void put_header(struct rtp_output_t *rtp, uint8_t *hdr) {
+	hdr[0] = RTP_VERSION << 6;
+	hdr[1] = RTP_PAYLOAD_TYPE;
+	hdr[2] = (uint8_t)(rtp->seq >> 8);
+	hdr[3] = (uint8_t)rtp->seq;
+	hdr[4] = (uint8_t)(rtp->ts >> 24);
+	hdr[5] = (uint8_t)(rtp->ts >> 16);
+	hdr[6] = (uint8_t)(rtp->ts >> 8);
+	hdr[7] = (uint8_t)rtp->ts;
+	hdr[8] = (uint8_t)(rtp->ssrc >> 24);
+	hdr[9] = (uint8_t)(rtp->ssrc >> 16);
+	hdr[10] = (uint8_t)(rtp->ssrc >> 8);
+	hdr[11] = (uint8_t)rtp->ssrc;
+}
+
+#ifdef _WIN32
+static void set_iov(WSABUF *iov, void *data, size_t len) {
+	iov->buf = data;
+	iov->len = (ULONG)len;
+}
+#else
+static void set_iov(struct iovec *iov, void *data, size_t len) {
+	iov->iov_base = data;
+	iov->iov_len = len;
+}
+#endif
+
+/*
+ * Hand n prepared packets to the kernel, returns how many it took
+ *
+ * A receiver that went away makes the next send fail once with the
+ * ICMP error of an earlier packet; that packet can still go.
+ */
+static size_t send_packets(struct rtp_output_t *rtp, size_t n) {
+	size_t done = 0;
+#ifdef _WIN32
+	DWORD bytes;
+
+	for (; done < n; done++) {
+		if (WSASend(rtp->fd, rtp->iov[done], rtp->iov_len[done],
+			&bytes, 0, NULL, NULL) != 0)
+			break;
+	}
+#elif defined(__linux__)
+	bool retried = false;
+	int r;
+
+	while (done < n) {
+		r = sendmmsg(rtp->fd, rtp->mmsg + done,
+			(unsigned int)(n - done), 0);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0 && errno == ECONNREFUSED && !retried) {
+			retried = true;
+			continue;
+		}
+		if (r <= 0) break;
+		done += (size_t)r;
+	}
+#else
+	bool retried = false;
+
+	for (; done < n; done++) {
+		while (sendmsg(rtp->fd, &rtp->msg[done], 0) < 0) {
+			if (errno == ECONNREFUSED && !retried) {
+				retried = true;
+				continue;
+			}
+			if (errno != EINTR) return done;
+		}
+	}
+#endif
+	return done;
+}
+
+/*
+ * Send the packets that are due, and the rest of their batch
+ *
+ * Every packet is its header and the frames in place in the ring,
+ * which are let go once the batch went out. If the ring runs short
+ * the packet carries silence, so the receiver keeps its timing.
+ */
+void send_rtp_batch(struct rtp_output_t *rtp, struct audio_ring_t *ring,
+	struct rtp_batch_t *batch) {
+	const size_t pf = rtp->packet_frames;
+	struct audio_ring_span_t span;
+	uint64_t due = packets_due(rtp, monotonic_ns());
+	size_t n, iovs, queued = 0;
+
+	memset(batch, 0, sizeof(struct rtp_batch_t));
+
+	/* woke up early */
+	if (due <= rtp->sent) due = rtp->sent + 1;
+
+	/* more than a second behind, give up on the lost time */
+	if (due - rtp->sent > rtp->rate / pf) {
+		rtp->ts += (uint32_t)((due - 1 - rtp->sent) * pf);
+		batch->late += due - 1 - rtp->sent;
+		rtp->sent = due - 1;
+	}
+
+	n = due - rtp->sent + RTP_BATCH - 1;
+	if (n > RTP_MAX_BATCH) n = RTP_MAX_BATCH;
+	batch->late += due - rtp->sent - 1;
+
+	for (size_t k = 0; k < n; k++) {
+		put_header(rtp, rtp->hdr[k]);
+		set_iov(&rtp->iov[k][0], rtp->hdr[k], RTP_HEADER_SIZE);
+
+		if (audio_ring_read_span(ring, queued, pf, &span) < pf) {
+			set_iov(&rtp->iov[k][1], rtp->silence,
+				pf * rtp->frame_size);
+			iovs = 2;
+			batch->silent++;
+		} else {
+			set_iov(&rtp->iov[k][1], span.data[0],
+				span.frames[0] * rtp->frame_size);
+			set_iov(&rtp->iov[k][2], span.data[1],
+				span.frames[1] * rtp->frame_size);
+			iovs = span.frames[1] ? 3 : 2;
+			queued += pf;
+		}
+
+#ifdef _WIN32
+		rtp->iov_len[k] = (DWORD)iovs;
+#else
+		memset(&rtp->msg[k], 0, sizeof(struct msghdr));
+		rtp->msg[k].msg_iov = rtp->iov[k];
+		rtp->msg[k].msg_iovlen = iovs;
+#ifdef __linux__
+		rtp->mmsg[k].msg_hdr = rtp->msg[k];
+		rtp->mmsg[k].msg_len = 0;
+#endif
+#endif
+
+		rtp->seq++;
+		rtp->ts += (uint32_t)pf;
+	}
+
+	batch->packets = send_packets(rtp, n);
+	batch->failed = n - batch->packets;
+
+	/* unsent packets are dropped, the clock moves on */
+	audio_ring_commit_read(ring, queued);
+	rtp->sent += n;
+}
+
+/*
+ * Session description for the receivers
+ *
+ * Returns the length of the text
+ */
+size_t format_rtp_sdp(struct rtp_output_t *rtp, char *buf, size_t size) {
+	const char *ip = rtp->ipv6 ? "IP6" : "IP4";
+	char ttl[8] = "";
+	int n;
+
+	if (rtp->multicast && !rtp->ipv6)
+		snprintf(ttl, sizeof(ttl), "/%u", RTP_MULTICAST_TTL);
+
+	n = snprintf(buf, size,
+		"v=0\n"
+		"o=- %u 0 IN %s %s\n"
+		"s=MiniRDS MPX\n"
+		"c=IN %s %s%s\n"
+		"t=0 0\n"
+		"m=audio %u RTP/AVP %u\n"
+		"a=rtpmap:%u L%u/%u/%u\n"
+		"a=ptime:%g\n"
+		"a=ts-refclk:ptp=IEEE1588-2008:traceable\n"
+		"a=mediaclk:direct=0\n",
+		rtp->ssrc, ip, rtp->local, ip, rtp->host, ttl,
+		rtp->port, RTP_PAYLOAD_TYPE, RTP_PAYLOAD_TYPE, rtp->bits,
+		rtp->rate, rtp->channels, rtp->packet_frames * 1000.0 / rtp->rate);
+
+	if (n < 0) return 0;
+	return (size_t)n < size ? (size_t)n : size - 1;
+}
@@ -0,0 +1,67 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * RTP output
+ *
+ * Sends the MPX to a remote exciter as L16 or L24 audio (RFC 3190),
+ * on one channel or several, unicast or multicast, in the AES67 format:
+ * packets of 1 ms, payload type 96 and timestamps on the PTP media
+ * clock (the system clock, when phc2sys keeps it on PTP time).
+ *
+ * The samples are packed in network order straight into the output
+ * ring, and the packets are sent from there: each one is the RTP
+ * header and pointers into the ring, handed to the kernel several
+ * at a time (sendmmsg() on Linux).
+ */
+#define RTP_DEFAULT_PORT	5004
+
+typedef struct rtp_output_t rtp_output_t;
+
+/* see convert.h */
+struct sink_format_t;
+
+/* what one send call did, in packets */
+typedef struct rtp_batch_t {
+	size_t packets;
+
+	/* the ring had no frames for them, they carry silence */
+	size_t silent;
+
+	/* sent more than one packet time after they were due */
+	size_t late;
+
+	/* which the network refused */
+	size_t failed;
+} rtp_batch_t;
+
+extern struct rtp_output_t *open_rtp_output(const char *dest, uint8_t id,
+	uint32_t rate, const struct sink_format_t *fmt);
+extern void close_rtp_output(struct rtp_output_t *rtp);
+
+extern size_t get_rtp_frame_size(struct rtp_output_t *rtp);
+extern size_t write_rtp_frames(struct rtp_output_t *rtp,
+	struct audio_ring_t *ring, const float *mpx, size_t frames);
+
+extern void start_rtp_clock(struct rtp_output_t *rtp);
+extern uint64_t wait_rtp_batch(struct rtp_output_t *rtp);
+extern void send_rtp_batch(struct rtp_output_t *rtp,
+	struct audio_ring_t *ring, struct rtp_batch_t *batch);
+
+extern size_t format_rtp_sdp(struct rtp_output_t *rtp, char *buf,
+	size_t size);
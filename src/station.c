@@ -0,0 +1,282 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#ifndef _WIN32
+  #include <pthread.h>
+#endif
+
+#include "rds.h"
+#include "fm_mpx.h"
+#include "lib.h"
+#include "work_pool.h"
+#include "metrics.h"
+#include "rds_decoder.h"
+#include "station.h"
+
+/*
+ * Multi-station rendering
+ *
+ * A pool of threads renders all stations. Each thread keeps going
+ * round the stations (starting at a different one every time) and
+ * renders a block for any station that isn't taken by another thread
+ * and whose output can take it. A station whose output is full is
+ * just skipped, so a slow output never holds up the others, and a
+ * station is only ever rendered by one thread at a time.
+ */
+typedef struct station_pool_t {
+	struct station_t *stations;
+	uint8_t num;
+	atomic_uint next;
+	atomic_bool *stop;
+} station_pool_t;
+
+int init_station(struct station_t *st, uint8_t id,
+	struct rds_params_t rds_params, uint32_t mpx_rate) {
+	memset(st, 0, sizeof(struct station_t));
+	st->id = id;
+	st->mpx_rate = mpx_rate;
+	atomic_flag_clear(&st->busy);
+
+	st->rds = init_rds_encoder(rds_params);
+	if (st->rds == NULL) return -1;
+
+	st->mpx = fm_mpx_init(mpx_rate, st->rds);
+	st->buf = malloc(NUM_MPX_FRAMES_IN * sizeof(float));
+	if (st->mpx == NULL || st->buf == NULL) {
+		exit_station(st);
+		return -1;
+	}
+
+	st->metrics = register_station_metrics(id, st->rds);
+
+	return 0;
+}
+
+/*
+ * Render the RDS streams of a station on threads threads
+ *
+ * Every block is still finished before it goes to the output, so this
+ * doesn't add any latency. 1 goes back to rendering the streams on
+ * the station's own thread.
+ */
+int set_station_stream_threads(struct station_t *st, uint8_t threads) {
+	struct work_pool_t *pool = NULL;
+
+	if (threads > 1) {
+		pool = init_work_pool(threads);
+		if (pool == NULL) return -1;
+		if (set_mpx_work_pool(st->mpx, pool) < 0) {
+			exit_work_pool(pool);
+			return -1;
+		}
+	} else {
+		set_mpx_work_pool(st->mpx, NULL);
+	}
+
+	if (st->pool) exit_work_pool(st->pool);
+	st->pool = pool;
+	return 0;
+}
+
+/*
+ * Decode every block the station makes and report what a receiver
+ * would get (see rds_decoder.h)
+ *
+ * Must be set before the first block, the decoder's carriers are only
+ * in phase with the generator's if both start together.
+ */
+int set_station_verify(struct station_t *st, bool verify) {
+	struct rds_decoder_t *dec = NULL;
+
+	if (verify && st->decoder) return 0;
+
+	if (verify) {
+		dec = init_rds_decoder(st->mpx_rate);
+		if (dec == NULL) return -1;
+	}
+
+	if (st->metrics) set_metrics_decoder(st->metrics, dec);
+	exit_rds_decoder(st->decoder);
+	st->decoder = dec;
+	return 0;
+}
+
+void exit_station(struct station_t *st) {
+	unregister_station_metrics(st->metrics);
+	st->metrics = NULL;
+	exit_rds_decoder(st->decoder);
+	st->decoder = NULL;
+	if (st->mpx) fm_mpx_exit(st->mpx);
+	if (st->pool) exit_work_pool(st->pool);
+	if (st->rds) exit_rds_encoder(st->rds);
+	free(st->buf);
+	st->mpx = NULL;
+	st->rds = NULL;
+	st->pool = NULL;
+	st->buf = NULL;
+}
+
+/*
+ * Render one block of a station if it needs one
+ *
+ * Returns 1 if a block was rendered, 0 if not and -1 if the
+ * station has finished
+ */
+static int8_t render_station(struct station_t *st) {
+	uint64_t start;
+	int8_t ret = 0;
+
+	/* another thread has it */
+	if (atomic_flag_test_and_set_explicit(&st->busy,
+		memory_order_acquire))
+		return 0;
+
+	if (st->done) {
+		ret = -1;
+		goto unlock;
+	}
+
+	if (st->ready && !st->ready(st->ctx)) goto unlock;
+
+	start = metrics_now_ns();
+	fm_rds_get_frames(st->mpx, st->buf, NUM_MPX_FRAMES_IN);
+	if (st->metrics) {
+		metrics_record(&st->metrics->gen_time,
+			metrics_since_ns(start));
+		metrics_add(&st->metrics->blocks, 1);
+	}
+
+	if (st->decoder)
+		decode_rds_mpx(st->decoder, st->buf, NUM_MPX_FRAMES_IN);
+
+	if (st->output(st->ctx, st->buf, NUM_MPX_FRAMES_IN) < 0)
+		st->done = true;
+	ret = 1;
+
+unlock:
+	atomic_flag_clear_explicit(&st->busy, memory_order_release);
+	return ret;
+}
+
+static void render_loop(struct station_pool_t *pool) {
+	uint8_t finished;
+	bool rendered;
+	int8_t r;
+
+	while (!atomic_load_explicit(pool->stop, memory_order_relaxed)) {
+		rendered = false;
+		finished = 0;
+
+		for (uint8_t i = 0; i < pool->num; i++) {
+			r = render_station(&pool->stations[
+				atomic_fetch_add_explicit(&pool->next, 1,
+				memory_order_relaxed) % pool->num]);
+			if (r > 0) rendered = true;
+			if (r < 0) finished++;
+		}
+
+		/* only stations that have finished were seen */
+		if (finished == pool->num) break;
+
+		/* every output is full */
+		if (!rendered) msleep(1);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI render_worker(LPVOID param) {
+	render_loop(param);
+	return 0;
+}
+#else
+static void *render_worker(void *param) {
+	render_loop(param);
+	return NULL;
+}
+#endif
+
+/*
+ * Render the stations until all of them have finished or stop is set
+ *
+ * The calling thread is one of the render threads.
+ */
+void run_stations(struct station_t *stations, uint8_t num,
+	uint8_t threads, atomic_bool *stop) {
+	struct station_pool_t pool;
+#ifdef _WIN32
+	HANDLE workers[MAX_STATIONS];
+#else
+	pthread_t workers[MAX_STATIONS];
+#endif
+	uint8_t started = 0;
+
+	pool.stations = stations;
+	pool.num = num;
+	pool.stop = stop;
+	atomic_init(&pool.next, 0);
+
+	/* more threads than stations would have nothing to do */
+	if (threads > num) threads = num;
+	if (threads == 0) threads = 1;
+
+	for (uint8_t i = 1; i < threads; i++) {
+#ifdef _WIN32
+		workers[started] = CreateThread(NULL, 0, render_worker,
+			&pool, 0, NULL);
+		if (workers[started] == NULL) break;
+#else
+		if (pthread_create(&workers[started], NULL, render_worker,
+			&pool) != 0) break;
+#endif
+		started++;
+	}
+
+	if (started + 1 < threads) {
+		fprintf(stderr, "Could only start %u of %u render threads.\n",
+			started + 1, threads);
+	}
+
+	render_loop(&pool);
+
+	for (uint8_t i = 0; i < started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+#else
+		pthread_join(workers[i], NULL);
+#endif
+	}
+}
+
+/* number of CPUs available, for the default number of threads */
+uint8_t get_cpu_count() {
+	long count;
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	count = info.dwNumberOfProcessors;
+#else
+	count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (count < 1) return 1;
+	if (count > MAX_STATIONS) return MAX_STATIONS;
+	return (uint8_t)count;
+}
@@ -0,0 +1,77 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+
+/*
+ * Stations
+ *
+ * A station is one RDS encoder with its MPX generator. Any number of
+ * them can run in one process: they only share the read-only tables,
+ * and each one has its own output and control channels.
+ */
+#define MAX_STATIONS	16
+
+/*
+ * Output of a station
+ *
+ * ready says whether the output can take another block now (NULL if
+ * it always can). output gets every block that was generated and
+ * returns -1 when the station should stop.
+ */
+typedef bool (*station_ready_t)(void *ctx);
+typedef int (*station_output_t)(void *ctx, float *mpx, size_t frames);
+
+typedef struct station_t {
+	/* station number, from 1 */
+	uint8_t id;
+
+	struct rds_encoder_t *rds;
+	struct mpx_generator_t *mpx;
+
+	/* renders the RDS streams in parallel, NULL if not used */
+	struct work_pool_t *pool;
+
+	/* telemetry, NULL if the registry was full */
+	struct station_metrics_t *metrics;
+
+	/* decodes every block again to check it, NULL if not used */
+	struct rds_decoder_t *decoder;
+	uint32_t mpx_rate;
+
+	station_ready_t ready;
+	station_output_t output;
+	void *ctx;
+
+	/* taken by the thread rendering the station */
+	atomic_flag busy;
+	bool done;
+
+	/* MPX block (NUM_MPX_FRAMES_IN frames, one channel) */
+	float *buf;
+} station_t;
+
+extern int init_station(struct station_t *st, uint8_t id,
+	struct rds_params_t rds_params, uint32_t mpx_rate);
+extern int set_station_stream_threads(struct station_t *st,
+	uint8_t threads);
+extern int set_station_verify(struct station_t *st, bool verify);
+extern void exit_station(struct station_t *st);
+extern void run_stations(struct station_t *stations, uint8_t num,
+	uint8_t threads, atomic_bool *stop);
+extern uint8_t get_cpu_count();
@@ -0,0 +1,317 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "audio_input.h"
+#include "stereo.h"
+
+/*
+ * Upsampler
+ *
+ * A polyphase FIR takes the audio from the input rate to the MPX
+ * rate exactly: for a ratio of L/M every output sample is one of L
+ * phases of a Kaiser windowed sinc, and the input moves on by M
+ * samples every L outputs. The same filter is the 15 kHz low-pass,
+ * with its stopband starting at the pilot.
+ */
+#define AUDIO_PASS_FREQ		15000.0
+#define AUDIO_STOP_FREQ		19000.0
+
+/* 70 dB stopband */
+#define FILTER_ATTEN_TAPS	4.4
+#define FILTER_KAISER_BETA	6.76
+
+#define MIN_FILTER_TAPS		16
+#define MAX_FILTER_TAPS		256
+#define MAX_FILTER_PHASES	4096
+
+#define MIN_AUDIO_RATE		8000
+#define MAX_AUDIO_RATE		192000
+
+/* output samples made per input read */
+#define STEREO_CHUNK		4096
+
+/* upper corner of the pre-emphasis, keeps the boost finite */
+#define PREEMPHASIS_LIMIT_FREQ	20000.0
+
+struct stereo_encoder_t {
+	struct audio_input_t *in;
+
+	/* L and M */
+	uint16_t phases;
+	uint16_t step;
+	uint16_t taps;
+	float *coefs;
+
+	/* time since the newest input sample, in 1/L samples */
+	uint32_t acc;
+
+	/* pre-emphasis, for mono and difference */
+	bool preemphasis;
+	float b0, b1, a1;
+	float x1[2], y1[2];
+
+	/* mono and difference at the input rate, taps of history first */
+	float *hist[2];
+	int16_t *pcm;
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* zeroth order modified Bessel function of the first kind */
+static double bessel_i0(double x) {
+	double sum = 1.0, term = 1.0;
+
+	for (int k = 1; k < 50; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12) break;
+	}
+	return sum;
+}
+
+/*
+ * Low-pass of every phase
+ *
+ * The taps of a phase are stored oldest sample first and each phase
+ * is scaled to unity gain at DC.
+ */
+static void design_filter(struct stereo_encoder_t *st, uint32_t in_rate) {
+	double pass = fmin(AUDIO_PASS_FREQ, in_rate * 0.45);
+	double stop = fmin(AUDIO_STOP_FREQ, in_rate - pass);
+	double fc = (pass + stop) / 2.0 / in_rate;
+	double center = (st->taps - 1) / 2.0;
+	double half = st->taps / 2.0;
+	double t, x, h, w, sum;
+	float *c;
+
+	for (uint16_t p = 0; p < st->phases; p++) {
+		c = st->coefs + (size_t)p * st->taps;
+		sum = 0.0;
+
+		for (uint16_t j = 0; j < st->taps; j++) {
+			/* from this tap to the output sample */
+			t = (double)p / st->phases + center - j;
+			x = t / half;
+
+			h = 2.0 * fc;
+			if (t != 0.0) h = sin(2.0 * M_PI * fc * t) / (M_PI * t);
+			w = fabs(x) < 1.0 ? bessel_i0(FILTER_KAISER_BETA *
+				sqrt(1.0 - x * x)) : 0.0;
+			h *= w / bessel_i0(FILTER_KAISER_BETA);
+
+			c[j] = (float)h;
+			sum += h;
+		}
+
+		for (uint16_t j = 0; j < st->taps; j++)
+			c[j] = (float)(c[j] / sum);
+	}
+}
+
+/* number of taps for the transition band at this rate */
+static uint16_t get_filter_taps(uint32_t in_rate) {
+	double pass = fmin(AUDIO_PASS_FREQ, in_rate * 0.45);
+	double stop = fmin(AUDIO_STOP_FREQ, in_rate - pass);
+	uint32_t taps = (uint32_t)ceil(FILTER_ATTEN_TAPS * in_rate /
+		(stop - pass));
+
+	taps = (taps + 3) & ~3u;
+	if (taps < MIN_FILTER_TAPS) taps = MIN_FILTER_TAPS;
+	if (taps > MAX_FILTER_TAPS) taps = MAX_FILTER_TAPS;
+	return (uint16_t)taps;
+}
+
+/*
+ * Pre-emphasis
+ *
+ * The analog 1 + s*tau, with a second corner above the audio band,
+ * through the bilinear transform warped at the first corner. It runs
+ * after the upsampler, where the MPX rate leaves both corners far
+ * below Nyquist.
+ */
+static void init_preemphasis(struct stereo_encoder_t *st, uint32_t rate,
+	uint8_t us) {
+	double tau1 = us * 1e-6;
+	double tau2 = 1.0 / (2.0 * M_PI * PREEMPHASIS_LIMIT_FREQ);
+	double k = 1.0 / tau1 / tan(1.0 / (2.0 * tau1 * rate));
+
+	st->preemphasis = us != 0;
+	st->b0 = (float)((1.0 + k * tau1) / (1.0 + k * tau2));
+	st->b1 = (float)((1.0 - k * tau1) / (1.0 + k * tau2));
+	st->a1 = (float)((1.0 - k * tau2) / (1.0 + k * tau2));
+}
+
+/*
+ * Create a stereo encoder for an audio input
+ *
+ * preemphasis is the time constant in us (0 for none). Returns NULL
+ * if the rates can't be converted.
+ */
+struct stereo_encoder_t *init_stereo_encoder(struct audio_input_t *in,
+	uint32_t sample_rate, uint8_t preemphasis) {
+	struct stereo_encoder_t *st;
+	uint32_t in_rate = get_audio_input_rate(in);
+	uint32_t g, phases, step;
+	size_t max_in;
+
+	if (in_rate < MIN_AUDIO_RATE || in_rate > MAX_AUDIO_RATE) {
+		fprintf(stderr, "Audio input rate must be between %u-%u Hz.\n",
+			MIN_AUDIO_RATE, MAX_AUDIO_RATE);
+		return NULL;
+	}
+
+	g = gcd(in_rate, sample_rate);
+	phases = sample_rate / g;
+	step = in_rate / g;
+	if (phases > MAX_FILTER_PHASES) {
+		fprintf(stderr, "Can't convert %u Hz audio to %u Hz.\n",
+			in_rate, sample_rate);
+		return NULL;
+	}
+
+	st = calloc(1, sizeof(struct stereo_encoder_t));
+	if (st == NULL) return NULL;
+
+	st->in = in;
+	st->phases = (uint16_t)phases;
+	st->step = (uint16_t)step;
+	st->taps = get_filter_taps(in_rate);
+
+	/* most input samples one chunk can take */
+	max_in = ((size_t)phases + step + (STEREO_CHUNK - 1) * step) /
+		phases + 1;
+
+	st->coefs = malloc((size_t)phases * st->taps * sizeof(float));
+	st->hist[0] = calloc(st->taps + max_in, sizeof(float));
+	st->hist[1] = calloc(st->taps + max_in, sizeof(float));
+	st->pcm = malloc(max_in * 2 * sizeof(int16_t));
+	if (st->coefs == NULL || st->hist[0] == NULL ||
+		st->hist[1] == NULL || st->pcm == NULL) {
+		exit_stereo_encoder(st);
+		return NULL;
+	}
+
+	design_filter(st, in_rate);
+	init_preemphasis(st, sample_rate, preemphasis);
+
+	return st;
+}
+
+static inline float preemphasize(struct stereo_encoder_t *st, uint8_t ch,
+	float x) {
+	float y = st->b0 * x + st->b1 * st->x1[ch] - st->a1 * st->y1[ch];
+
+	st->x1[ch] = x;
+	st->y1[ch] = y;
+	return y;
+}
+
+/* one phase over both signals, in four lanes (taps is a multiple of 4) */
+static inline void filter_2ch(const float *c, const float *a,
+	const float *b, uint16_t taps, float *out_a, float *out_b) {
+	float sa[4] = { 0.0f }, sb[4] = { 0.0f };
+
+	for (uint16_t j = 0; j < taps; j += 4) {
+		for (uint8_t q = 0; q < 4; q++) {
+			sa[q] += c[j + q] * a[j + q];
+			sb[q] += c[j + q] * b[j + q];
+		}
+	}
+
+	*out_a = (sa[0] + sa[1]) + (sa[2] + sa[3]);
+	*out_b = (sb[0] + sb[1]) + (sb[2] + sb[3]);
+}
+
+static void get_stereo_chunk(struct stereo_encoder_t *st, float *mono,
+	float *diff, float gain, size_t n) {
+	const float scale = 0.5f / 32768.0f;
+	uint32_t acc = st->acc;
+	size_t pushes, pos = 0;
+	float m, s;
+
+	/* input samples passed before the last output */
+	pushes = (acc + (n - 1) * (size_t)st->step) / st->phases;
+	read_audio_input(st->in, st->pcm, pushes);
+
+	for (size_t i = 0; i < pushes; i++) {
+		m = (st->pcm[i * 2 + 0] + st->pcm[i * 2 + 1]) * scale;
+		s = (st->pcm[i * 2 + 0] - st->pcm[i * 2 + 1]) * scale;
+		st->hist[0][st->taps + i] = m;
+		st->hist[1][st->taps + i] = s;
+	}
+
+	for (size_t k = 0; k < n; k++) {
+		while (acc >= st->phases) {
+			acc -= st->phases;
+			pos++;
+		}
+
+		filter_2ch(st->coefs + (size_t)acc * st->taps,
+			st->hist[0] + pos, st->hist[1] + pos, st->taps,
+			&m, &s);
+		if (st->preemphasis) {
+			m = preemphasize(st, 0, m);
+			s = preemphasize(st, 1, s);
+		}
+		mono[k] = m * gain;
+		diff[k] = s * gain;
+
+		acc += st->step;
+	}
+	st->acc = acc;
+
+	/* keep the newest taps samples */
+	for (uint8_t ch = 0; ch < 2; ch++)
+		memmove(st->hist[ch], st->hist[ch] + pushes,
+			st->taps * sizeof(float));
+}
+
+/*
+ * Next n samples of (L+R)/2 and (L-R)/2 at the MPX rate
+ *
+ * Full scale input gives 1.0 before the gain.
+ */
+void get_stereo_samples(struct stereo_encoder_t *st, float *mono,
+	float *diff, float gain, size_t n) {
+	size_t chunk;
+
+	while (n) {
+		chunk = n > STEREO_CHUNK ? STEREO_CHUNK : n;
+		get_stereo_chunk(st, mono, diff, gain, chunk);
+		mono += chunk;
+		diff += chunk;
+		n -= chunk;
+	}
+}
+
+void exit_stereo_encoder(struct stereo_encoder_t *st) {
+	if (st == NULL) return;
+	free(st->coefs);
+	free(st->hist[0]);
+	free(st->hist[1]);
+	free(st->pcm);
+	free(st);
+}
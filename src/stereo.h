@@ -0,0 +1,38 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stereo encoder
+ *
+ * Turns the audio input into the mono (L+R)/2 and difference (L-R)/2
+ * signals at the MPX rate. Both are pre-emphasized and cut off above
+ * 15 kHz, so nothing reaches the pilot or the 38 kHz subcarrier.
+ */
+#define PREEMPHASIS_US		50
+#define PREEMPHASIS_US_RBDS	75
+
+typedef struct stereo_encoder_t stereo_encoder_t;
+
+/* see audio_input.h */
+struct audio_input_t;
+
+extern struct stereo_encoder_t *init_stereo_encoder(
+	struct audio_input_t *in, uint32_t sample_rate, uint8_t preemphasis);
+extern void get_stereo_samples(struct stereo_encoder_t *st, float *mono,
+	float *diff, float gain, size_t n);
+extern void exit_stereo_encoder(struct stereo_encoder_t *st);
@@ -0,0 +1,183 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "rds.h"
+#include "osc.h"
+#include "waveforms.h"
+#include "modulator.h"
+#include "tables.h"
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+	uint32_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Find the exact period for a frequency
+ *
+ * The frequency is taken in quarter Hz so carriers like 71.25 kHz
+ * work. Returns the table length and sets the number of cycles in it,
+ * or returns 0 if the period is too long for a table.
+ */
+uint32_t get_exact_period(uint32_t rate, float freq, uint32_t *cycles) {
+	uint32_t rate_q, freq_q, g;
+	double f = (double)freq * OSC_FREQ_RES;
+
+	if (f <= 0.0 || f != floor(f)) return 0;
+
+	rate_q = rate * OSC_FREQ_RES;
+	freq_q = (uint32_t)f;
+	g = gcd(rate_q, freq_q);
+
+	if (rate_q / g > OSC_MAX_TABLE_SIZE) return 0;
+
+	*cycles = freq_q / g;
+	return rate_q / g;
+}
+
+/*
+ * DDS function generator
+ *
+ * Fill a table with len samples covering the given number of cycles
+ */
+void create_wave(uint32_t len, uint32_t cycles,
+		float *sin_wave, float *cos_wave) {
+	double phase;
+
+	for (uint32_t i = 0; i < len; i++) {
+		/* reduce first to keep the phase accurate */
+		phase = M_2PI * (double)(((uint64_t)i * cycles) % len) / len;
+		sin_wave[i] = (float)sin(phase);
+		cos_wave[i] = (float)cos(phase);
+	}
+}
+
+/*
+ * Biphase symbol
+ *
+ * This is the same shape as waveform_biphase: two opposite root
+ * raised cosine pulses (alpha = 1, symbol time of half a bit) spaced
+ * half a bit apart and centered in the POLYPHASE_TAPS bit window.
+ *
+ * t is in bit periods from the start of the window
+ */
+static double rrc_pulse(double t) {
+	double x = 8.0 * t;
+
+	/* removable singularity */
+	if (fabs(fabs(x) - 1.0) < 1e-9) return M_PI / 4.0;
+
+	return cos(4.0 * M_PI * t) / (1.0 - x * x);
+}
+
+static double biphase_pulse(double t) {
+	t -= POLYPHASE_TAPS / 2.0;
+	return (1.6 / M_PI) * (rrc_pulse(t + 0.25) - rrc_pulse(t - 0.25));
+}
+
+void get_envelope_size(uint32_t sample_rate, uint32_t *spb_num,
+	uint32_t *spb_den, uint16_t *max_bit_len) {
+	uint32_t g;
+
+	/* samples per bit = sample_rate / 1187.5 */
+	*spb_num = sample_rate * RDS_BIT_RATE_DEN;
+	*spb_den = RDS_BIT_RATE_NUM;
+	g = gcd(*spb_num, *spb_den);
+	*spb_num /= g;
+	*spb_den /= g;
+	*max_bit_len = (*spb_num + *spb_den - 1) / *spb_den;
+}
+
+/*
+ * Pulse slices
+ *
+ * At RDS_SAMPLE_RATE this uses waveform_biphase as is, otherwise the
+ * pulse is sampled at the requested rate.
+ */
+void create_slices(uint32_t spb_num, uint32_t spb_den,
+	uint16_t max_bit_len, uint16_t *bit_len, float *slices) {
+	uint32_t start, end;
+	double spb = (double)spb_num / spb_den;
+	double offset;
+	float *slice;
+
+	for (uint32_t p = 0; p < spb_den; p++) {
+		/* first sample of this bit and of the next one */
+		start = (p * spb_num + spb_den - 1) / spb_den;
+		end = ((p + 1) * spb_num + spb_den - 1) / spb_den;
+		bit_len[p] = end - start;
+
+		/* how far the first sample is after the bit boundary */
+		offset = start - p * spb;
+
+		for (uint8_t j = 0; j < POLYPHASE_TAPS; j++) {
+			slice = &slices[(p * POLYPHASE_TAPS + j) * max_bit_len];
+			for (uint16_t i = 0; i < max_bit_len; i++) {
+				if (spb_num == SAMPLES_PER_BIT &&
+					spb_den == 1) {
+					slice[i] = waveform_biphase[
+						j * SAMPLES_PER_BIT + i];
+				} else if (i < bit_len[p]) {
+					slice[i] = (float)biphase_pulse(
+						(i + offset) / spb + j);
+				} else {
+					slice[i] = 0.0f;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Polyphase table
+ *
+ * Row n holds the envelope of one bit period given the last
+ * POLYPHASE_TAPS differential bits n. Bit j of n selects the sign of
+ * the pulse sent j bits ago, which contributes slice j of the pulse.
+ *
+ */
+void create_polyphase(uint16_t max_bit_len, const float *slices,
+	float *polyphase) {
+	float *row;
+	const float *slice;
+	float sample;
+
+	for (uint16_t n = 0; n < POLYPHASE_ROWS; n++) {
+		row = &polyphase[n * max_bit_len];
+		for (uint16_t i = 0; i < max_bit_len; i++) {
+			/* add the oldest pulse first */
+			sample = 0.0f;
+			for (int8_t j = POLYPHASE_TAPS - 1; j >= 0; j--) {
+				slice = &slices[j * max_bit_len];
+				if (n & (1 << j)) {
+					sample += slice[i];
+				} else {
+					sample += -slice[i];
+				}
+			}
+			row[i] = sample;
+		}
+	}
+}
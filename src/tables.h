@@ -0,0 +1,46 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Table math
+ *
+ * The oscillator and RDS envelope tables are made by these functions,
+ * both at run time and by gen_tables at build time, so a built-in
+ * table is the same as one made on the fly.
+ */
+
+/* table length and cycles for an exact period, 0 if there is none */
+extern uint32_t get_exact_period(uint32_t rate, float freq,
+	uint32_t *cycles);
+extern void create_wave(uint32_t len, uint32_t cycles,
+	float *sin_wave, float *cos_wave);
+
+/*
+ * RDS envelope
+ *
+ * get_envelope_size finds the samples per bit (spb_num / spb_den) and
+ * the longest bit for a rate. create_slices fills bit_len[spb_den]
+ * and slices[spb_den][POLYPHASE_TAPS][max_bit_len]. create_polyphase
+ * sums the phase 0 slices into [POLYPHASE_ROWS][max_bit_len].
+ */
+extern void get_envelope_size(uint32_t sample_rate, uint32_t *spb_num,
+	uint32_t *spb_den, uint16_t *max_bit_len);
+extern void create_slices(uint32_t spb_num, uint32_t spb_den,
+	uint16_t max_bit_len, uint16_t *bit_len, float *slices);
+extern void create_polyphase(uint16_t max_bit_len, const float *slices,
+	float *polyphase);
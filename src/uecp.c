@@ -0,0 +1,313 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "rds.h"
+#include "lib.h"
+#include "uecp.h"
+
+/*
+ * UECP message handling
+ *
+ * Only data set 1 and the main program service (PSN 0) exist here,
+ * so DSN 0 (current), 1 and 255 (all) are accepted and every other
+ * data set or service is refused. Frames are accepted for any site
+ * and encoder address.
+ *
+ * A frame is checked in full before anything is applied, then all
+ * of its messages are applied as one batch so the encoder picks them
+ * up together.
+ */
+
+typedef struct uecp_msg_spec_t {
+	/* message carries data set and program service numbers */
+	bool addressed;
+	/* data length, or 0 if a MEL byte gives it */
+	uint8_t len;
+} uecp_msg_spec_t;
+
+static bool get_msg_spec(uint8_t mec, struct uecp_msg_spec_t *spec) {
+	switch (mec) {
+	case UECP_MEC_PI:
+		*spec = (struct uecp_msg_spec_t){ true, 2 };
+		return true;
+	case UECP_MEC_PS:
+	case UECP_MEC_PTYN:
+		*spec = (struct uecp_msg_spec_t){ true, 8 };
+		return true;
+	case UECP_MEC_TA_TP:
+	case UECP_MEC_DI:
+	case UECP_MEC_MS:
+	case UECP_MEC_PTY:
+		*spec = (struct uecp_msg_spec_t){ true, 1 };
+		return true;
+	case UECP_MEC_RT:
+		*spec = (struct uecp_msg_spec_t){ true, 0 };
+		return true;
+	case UECP_MEC_RTC:
+		*spec = (struct uecp_msg_spec_t){ false, 8 };
+		return true;
+	case UECP_MEC_CT_ON:
+	case UECP_MEC_DSN_SELECT:
+		*spec = (struct uecp_msg_spec_t){ false, 1 };
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool our_dsn(uint8_t dsn) {
+	return dsn == UECP_DSN_CURRENT || dsn == 1 || dsn == UECP_DSN_ALL;
+}
+
+/* copy fixed length text, it is already in the RDS character set */
+static void copy_text(unsigned char *dst, uint8_t *src, uint8_t len) {
+	memcpy(dst, src, len);
+	dst[len] = 0;
+}
+
+/*
+ * Check (apply = false) or apply one message
+ *
+ * data points at the message data after the MEC, DSN/PSN and MEL.
+ */
+static uint8_t do_msg(struct rds_encoder_t *enc, uint8_t mec, uint8_t *data,
+	uint8_t len, bool apply) {
+	unsigned char text[RT_LENGTH + 1];
+
+	switch (mec) {
+	case UECP_MEC_PI:
+		if (apply) set_rds_pi(enc, data[0] << 8 | data[1]);
+		break;
+	case UECP_MEC_PS:
+		if (apply) {
+			copy_text(text, data, PS_LENGTH);
+			set_rds_ps(enc, text);
+		}
+		break;
+	case UECP_MEC_PTYN:
+		if (apply) {
+			copy_text(text, data, PTYN_LENGTH);
+			set_rds_ptyn(enc, text);
+		}
+		break;
+	case UECP_MEC_TA_TP:
+		if (apply) {
+			set_rds_ta(enc, data[0] & 1);
+			set_rds_tp(enc, data[0] >> 1 & 1);
+		}
+		break;
+	case UECP_MEC_DI:
+		if (data[0] > 15) return UECP_ACK_RANGE;
+		if (apply) set_rds_di(enc, data[0]);
+		break;
+	case UECP_MEC_MS:
+		if (apply) set_rds_ms(enc, data[0] & 1);
+		break;
+	case UECP_MEC_PTY:
+		if (data[0] > 31) return UECP_ACK_RANGE;
+		if (apply) set_rds_pty(enc, data[0]);
+		break;
+	case UECP_MEC_RT:
+		/* configuration byte (A/B, repeats, buffer) and the text */
+		if (len < 1 || len - 1 > RT_LENGTH) return UECP_ACK_MEL;
+		/* an empty RT only flushes the buffer */
+		if (apply && len > 1) {
+			copy_text(text, data + 1, len - 1);
+			set_rds_rt(enc, text);
+		}
+		break;
+	case UECP_MEC_RTC:
+		/* CT always comes from the system clock */
+		break;
+	case UECP_MEC_CT_ON:
+		if (apply) set_rds_ct(enc, data[0] & 1);
+		break;
+	case UECP_MEC_DSN_SELECT:
+		if (!our_dsn(data[0])) return UECP_ACK_DSN;
+		break;
+	}
+
+	return UECP_ACK_OK;
+}
+
+/* Walk the message field, applying the messages or just checking them */
+static uint8_t do_msg_field(struct rds_encoder_t *enc, uint8_t *msg,
+	uint8_t mfl, bool apply) {
+	struct uecp_msg_spec_t spec;
+	uint8_t *end = msg + mfl;
+	uint8_t mec, len, ret;
+
+	while (msg < end) {
+		mec = *msg++;
+		if (!get_msg_spec(mec, &spec)) return UECP_ACK_UNKNOWN;
+
+		if (spec.addressed) {
+			if (end - msg < 2) return UECP_ACK_MFL;
+			if (!our_dsn(msg[0])) return UECP_ACK_DSN;
+			if (msg[1] != 0) return UECP_ACK_PSN;
+			msg += 2;
+		}
+
+		len = spec.len;
+		if (len == 0) {
+			if (msg == end) return UECP_ACK_MFL;
+			len = *msg++;
+		}
+		if (end - msg < len) return UECP_ACK_MFL;
+
+		ret = do_msg(enc, mec, msg, len, apply);
+		if (ret != UECP_ACK_OK) return ret;
+
+		msg += len;
+	}
+
+	return UECP_ACK_OK;
+}
+
+/* add a byte to a frame being sent, stuffing it if needed */
+static size_t put_stuffed(uint8_t *out, size_t pos, uint8_t byte) {
+	if (byte >= UECP_ESC) {
+		out[pos++] = UECP_ESC;
+		out[pos++] = byte - UECP_ESC;
+	} else {
+		out[pos++] = byte;
+	}
+	return pos;
+}
+
+static void send_ack(struct uecp_decoder_t *dec, uint8_t sqc, uint8_t code) {
+	uint8_t frame[8];
+	/* stuffing can double every byte except STA and STP */
+	uint8_t out[2 + sizeof(frame) * 2];
+	uint16_t crc;
+	size_t pos = 0;
+
+	if (dec->reply == NULL) return;
+
+	/* reply from site/encoder 0 with the sequence number we got */
+	frame[0] = 0;
+	frame[1] = 0;
+	frame[2] = sqc;
+	frame[3] = 2;
+	frame[4] = UECP_MEC_ACK;
+	frame[5] = code;
+	crc = crc16(frame, 6);
+	frame[6] = crc >> 8;
+	frame[7] = crc & 0xff;
+
+	out[pos++] = UECP_STA;
+	for (uint8_t i = 0; i < sizeof(frame); i++)
+		pos = put_stuffed(out, pos, frame[i]);
+	out[pos++] = UECP_STP;
+
+	dec->reply(dec->ctx, out, pos);
+}
+
+static void process_frame(struct uecp_decoder_t *dec) {
+	uint8_t *frame = dec->frame;
+	uint8_t sqc, mfl, ret;
+	uint16_t crc;
+
+	/* too short to even hold the header and the CRC */
+	if (dec->len < 6) return;
+
+	sqc = frame[2];
+	mfl = frame[3];
+
+	if (dec->len != 4 + mfl + 2) {
+		ret = UECP_ACK_MFL;
+		goto ack;
+	}
+
+	crc = frame[4 + mfl] << 8 | frame[4 + mfl + 1];
+	if (crc16(frame, 4 + mfl) != crc) {
+		ret = UECP_ACK_CRC;
+		goto ack;
+	}
+
+	/* check everything first so a bad frame changes nothing */
+	ret = do_msg_field(dec->enc, frame + 4, mfl, false);
+	if (ret != UECP_ACK_OK) goto ack;
+
+	begin_rds_batch(dec->enc);
+	do_msg_field(dec->enc, frame + 4, mfl, true);
+	end_rds_batch(dec->enc);
+
+ack:
+	/* sequence counter 0 means no acknowledgement is wanted */
+	if (sqc) send_ack(dec, sqc, ret);
+}
+
+void init_uecp_decoder(struct uecp_decoder_t *dec, struct rds_encoder_t *enc,
+	uecp_reply_t reply, void *ctx) {
+	init_crc_tables();
+	dec->enc = enc;
+	dec->len = 0;
+	dec->in_frame = false;
+	dec->escape = false;
+	dec->reply = reply;
+	dec->ctx = ctx;
+}
+
+/* Feed received bytes, complete frames are processed right away */
+void feed_uecp_decoder(struct uecp_decoder_t *dec,
+	uint8_t *data, size_t len) {
+	uint8_t byte;
+
+	for (size_t i = 0; i < len; i++) {
+		byte = data[i];
+
+		if (byte == UECP_STA) {
+			/* a new frame always starts here */
+			dec->in_frame = true;
+			dec->escape = false;
+			dec->len = 0;
+			continue;
+		}
+
+		if (!dec->in_frame) continue;
+
+		if (byte == UECP_STP) {
+			dec->in_frame = false;
+			if (!dec->escape) process_frame(dec);
+			continue;
+		}
+
+		if (dec->escape) {
+			dec->escape = false;
+			if (byte > UECP_STP - UECP_ESC) {
+				/* bad stuffing, drop the frame */
+				dec->in_frame = false;
+				continue;
+			}
+			byte += UECP_ESC;
+		} else if (byte == UECP_ESC) {
+			dec->escape = true;
+			continue;
+		}
+
+		if (dec->len == UECP_MAX_FRAME) {
+			/* longer than any valid frame */
+			dec->in_frame = false;
+			continue;
+		}
+
+		dec->frame[dec->len++] = byte;
+	}
+}
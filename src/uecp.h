@@ -0,0 +1,78 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * UECP (EBU SPB 490) decoder
+ *
+ * Frames are STA, address, sequence counter, message field length,
+ * message field, CRC and STP. Everything between STA and STP is
+ * byte stuffed so that those bytes never appear inside a frame.
+ */
+#define UECP_STA	0xfe
+#define UECP_STP	0xff
+#define UECP_ESC	0xfd
+
+/* address (2), SQC, MFL, up to 255 bytes of messages and the CRC (2) */
+#define UECP_MAX_MSG	255
+#define UECP_MAX_FRAME	(4 + UECP_MAX_MSG + 2)
+
+/* message element codes */
+#define UECP_MEC_PI		0x01
+#define UECP_MEC_PS		0x02
+#define UECP_MEC_TA_TP		0x03
+#define UECP_MEC_DI		0x04
+#define UECP_MEC_MS		0x05
+#define UECP_MEC_PTY		0x07
+#define UECP_MEC_RT		0x0a
+#define UECP_MEC_RTC		0x0d
+#define UECP_MEC_ACK		0x18
+#define UECP_MEC_CT_ON		0x19
+#define UECP_MEC_DSN_SELECT	0x1c
+#define UECP_MEC_PTYN		0x3e
+
+/* acknowledgement codes */
+#define UECP_ACK_OK		0
+#define UECP_ACK_CRC		1
+#define UECP_ACK_UNKNOWN	3
+#define UECP_ACK_DSN		4
+#define UECP_ACK_PSN		5
+#define UECP_ACK_RANGE		6
+#define UECP_ACK_MEL		7
+#define UECP_ACK_MFL		8
+
+/* special data set numbers */
+#define UECP_DSN_CURRENT	0
+#define UECP_DSN_ALL		255
+
+/* called with a complete (stuffed) response frame */
+typedef void (*uecp_reply_t)(void *ctx, uint8_t *frame, size_t len);
+
+typedef struct uecp_decoder_t {
+	uint8_t frame[UECP_MAX_FRAME];
+	uint16_t len;
+	bool in_frame;
+	bool escape;
+	struct rds_encoder_t *enc;
+	uecp_reply_t reply;
+	void *ctx;
+} uecp_decoder_t;
+
+extern void init_uecp_decoder(struct uecp_decoder_t *dec,
+	struct rds_encoder_t *enc, uecp_reply_t reply, void *ctx);
+extern void feed_uecp_decoder(struct uecp_decoder_t *dec,
+	uint8_t *data, size_t len);
@@ -0,0 +1,283 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#ifndef _WIN32
+  #include <pthread.h>
+  #include <sched.h>
+#endif
+#include <stdatomic.h>
+
+#include "work_pool.h"
+
+/*
+ * Job queues
+ *
+ * Each thread owns a range of jobs, packed as first << 8 | end in
+ * one word. The owner takes jobs from the front and thieves from the
+ * back, both with a compare and swap, so every job is run exactly
+ * once.
+ */
+#define RANGE(first, end)	((uint16_t)((first) << 8 | (end)))
+#define RANGE_FIRST(r)		((r) >> 8)
+#define RANGE_END(r)		((r) & 255)
+
+typedef struct work_thread_t {
+	struct work_pool_t *pool;
+	uint8_t id;
+} work_thread_t;
+
+struct work_pool_t {
+	uint8_t threads; /* including the caller */
+
+	/* the current batch */
+	work_fn_t fn;
+	void *ctx;
+	_Atomic uint16_t queues[MAX_WORK_THREADS];
+	atomic_uint pending;
+
+	/* wakes the workers for a new batch */
+	uint32_t batch;
+	bool quit;
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE wake;
+	HANDLE workers[MAX_WORK_THREADS];
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t workers[MAX_WORK_THREADS];
+#endif
+	struct work_thread_t args[MAX_WORK_THREADS];
+	uint8_t started;
+};
+
+/* take the next job of our own queue, -1 if there is none left */
+static int16_t pop_job(struct work_pool_t *pool, uint8_t id) {
+	uint16_t r = atomic_load(&pool->queues[id]);
+
+	while (RANGE_FIRST(r) < RANGE_END(r)) {
+		if (atomic_compare_exchange_weak(&pool->queues[id], &r,
+			RANGE(RANGE_FIRST(r) + 1, RANGE_END(r))))
+			return RANGE_FIRST(r);
+	}
+	return -1;
+}
+
+/* take the last job of another thread's queue */
+static int16_t steal_job(struct work_pool_t *pool, uint8_t id) {
+	uint16_t r;
+	uint8_t victim;
+
+	for (uint8_t i = 1; i < pool->threads; i++) {
+		victim = (id + i) % pool->threads;
+		r = atomic_load(&pool->queues[victim]);
+
+		while (RANGE_FIRST(r) < RANGE_END(r)) {
+			if (atomic_compare_exchange_weak(
+				&pool->queues[victim], &r,
+				RANGE(RANGE_FIRST(r), RANGE_END(r) - 1)))
+				return RANGE_END(r) - 1;
+		}
+	}
+	return -1;
+}
+
+/* run jobs until every queue is empty */
+static void do_jobs(struct work_pool_t *pool, uint8_t id) {
+	int16_t job;
+
+	for (;;) {
+		job = pop_job(pool, id);
+		if (job < 0) job = steal_job(pool, id);
+		if (job < 0) break;
+
+		pool->fn(pool->ctx, (uint8_t)job);
+		atomic_fetch_sub_explicit(&pool->pending, 1,
+			memory_order_release);
+	}
+}
+
+static void work_loop(struct work_thread_t *t) {
+	struct work_pool_t *pool = t->pool;
+	uint32_t seen = 0;
+	bool quit;
+
+	for (;;) {
+#ifdef _WIN32
+		EnterCriticalSection(&pool->lock);
+		while (!pool->quit && pool->batch == seen)
+			SleepConditionVariableCS(&pool->wake, &pool->lock,
+				INFINITE);
+		seen = pool->batch;
+		quit = pool->quit;
+		LeaveCriticalSection(&pool->lock);
+#else
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->quit && pool->batch == seen)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		seen = pool->batch;
+		quit = pool->quit;
+		pthread_mutex_unlock(&pool->lock);
+#endif
+		if (quit) break;
+
+		do_jobs(pool, t->id);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI work_thread(LPVOID param) {
+	work_loop(param);
+	return 0;
+}
+#else
+static void *work_thread(void *param) {
+	work_loop(param);
+	return NULL;
+}
+#endif
+
+/*
+ * Create a pool of threads - 1 workers
+ *
+ * Returns NULL on failure
+ */
+struct work_pool_t *init_work_pool(uint8_t threads) {
+	struct work_pool_t *pool;
+	struct work_thread_t *t;
+
+	if (threads == 0) threads = 1;
+	if (threads > MAX_WORK_THREADS) threads = MAX_WORK_THREADS;
+
+	pool = calloc(1, sizeof(struct work_pool_t));
+	if (pool == NULL) return NULL;
+
+	pool->threads = threads;
+	atomic_init(&pool->pending, 0);
+	for (uint8_t i = 0; i < MAX_WORK_THREADS; i++)
+		atomic_init(&pool->queues[i], 0);
+#ifdef _WIN32
+	InitializeCriticalSection(&pool->lock);
+	InitializeConditionVariable(&pool->wake);
+#else
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+#endif
+
+	for (uint8_t i = 1; i < threads; i++) {
+		t = &pool->args[i];
+		t->pool = pool;
+		t->id = i;
+#ifdef _WIN32
+		pool->workers[pool->started] = CreateThread(NULL, 0,
+			work_thread, t, 0, NULL);
+		if (pool->workers[pool->started] == NULL) {
+#else
+		if (pthread_create(&pool->workers[pool->started], NULL,
+			work_thread, t) != 0) {
+#endif
+			goto fail;
+		}
+		pool->started++;
+	}
+
+	return pool;
+
+fail:
+	exit_work_pool(pool);
+	return NULL;
+}
+
+/*
+ * Run a batch of jobs and wait for all of them
+ *
+ * Only one batch can run on a pool at a time.
+ */
+void run_work(struct work_pool_t *pool, work_fn_t fn, void *ctx,
+	uint8_t num_jobs) {
+	uint8_t first, end;
+
+	pool->fn = fn;
+	pool->ctx = ctx;
+	atomic_store(&pool->pending, num_jobs);
+
+	/* contiguous share of the jobs for every thread */
+	for (uint8_t i = 0; i < pool->threads; i++) {
+		first = num_jobs * i / pool->threads;
+		end = num_jobs * (i + 1) / pool->threads;
+		atomic_store(&pool->queues[i], RANGE(first, end));
+	}
+
+	if (pool->started) {
+#ifdef _WIN32
+		EnterCriticalSection(&pool->lock);
+		pool->batch++;
+		LeaveCriticalSection(&pool->lock);
+		WakeAllConditionVariable(&pool->wake);
+#else
+		pthread_mutex_lock(&pool->lock);
+		pool->batch++;
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+#endif
+	}
+
+	do_jobs(pool, 0);
+
+	/* the last jobs may still be running on the workers */
+	while (atomic_load_explicit(&pool->pending, memory_order_acquire)) {
+#ifdef _WIN32
+		SwitchToThread();
+#else
+		sched_yield();
+#endif
+	}
+}
+
+void exit_work_pool(struct work_pool_t *pool) {
+#ifdef _WIN32
+	EnterCriticalSection(&pool->lock);
+	pool->quit = true;
+	LeaveCriticalSection(&pool->lock);
+	WakeAllConditionVariable(&pool->wake);
+#else
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	for (uint8_t i = 0; i < pool->started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(pool->workers[i], INFINITE);
+		CloseHandle(pool->workers[i]);
+#else
+		pthread_join(pool->workers[i], NULL);
+#endif
+	}
+
+#ifdef _WIN32
+	DeleteCriticalSection(&pool->lock);
+#else
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+#endif
+	free(pool);
+}
@@ -0,0 +1,37 @@
+/*
+ * mpxgen - FM multiplex encoder with Stereo and RDS
+ * Copyright (C) 2024 MiniRDS Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fork-join work pool
+ *
+ * run_work hands out jobs 0 to num_jobs - 1, runs them on the pool
+ * and on the calling thread, and returns when all of them are done.
+ * The jobs are split between the threads up front and a thread that
+ * runs out of its own takes them from the others (work stealing), so
+ * a slow job doesn't hold up the rest.
+ */
+#define MAX_WORK_THREADS	16
+
+typedef void (*work_fn_t)(void *ctx, uint8_t job);
+
+typedef struct work_pool_t work_pool_t;
+
+extern struct work_pool_t *init_work_pool(uint8_t threads);
+extern void run_work(struct work_pool_t *pool, work_fn_t fn, void *ctx,
+	uint8_t num_jobs);
+extern void exit_work_pool(struct work_pool_t *pool);